@@ -0,0 +1,39 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Latency samples in nanoseconds
+typedef struct {
+    uint64_t* values;
+    size_t count;
+    size_t capacity;
+} bench_samples_t;
+
+int bench_samples_add(bench_samples_t* samples, uint64_t value);
+int bench_samples_merge(bench_samples_t* into, const bench_samples_t* from);
+void bench_samples_free(bench_samples_t* samples);
+
+// Sorts the samples in place; percentiles are only valid afterwards
+void bench_samples_sort(bench_samples_t* samples);
+uint64_t bench_percentile(const bench_samples_t* samples, double percentile);
+
+uint64_t bench_now(void);
+
+// Reads a whole file into a NUL-terminated malloc'd buffer
+char* bench_read_file(const char* path);
+
+// Finds the line of a previous run's output containing key and reads the
+// number that follows "field": on it. Returns -1 if either is missing.
+int bench_baseline_value(const char* baseline, const char* key, const char* field, double* out);
+
+// Writes ,"baseline_<field>":old,"change_pct":pct when the baseline has the
+// same measurement
+void bench_write_comparison(FILE* out, const char* baseline, const char* key, const char* field, double value);
+
+int bench_micro_main(int argc, char** argv);
+int bench_load_main(int argc, char** argv);
+
+#endif
@@ -0,0 +1,580 @@
+#define _GNU_SOURCE
+#include "bench.h"
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define LOAD_BUFFER_SIZE (64 * 1024)
+#define SEED_CHUNK 1000
+
+typedef enum {
+    LOAD_GET,
+    LOAD_POST,
+    LOAD_PUT,
+    LOAD_DELETE,
+    LOAD_KIND_COUNT
+} load_kind_t;
+
+static const char* const kind_names[LOAD_KIND_COUNT] = {"GET", "POST", "PUT", "DELETE"};
+
+typedef struct {
+    const char* host;
+    const char* port;
+    int threads;
+    int duration_s;
+    int seed;
+    int weights[LOAD_KIND_COUNT];
+    const char* baseline;
+} load_config_t;
+
+// One keep-alive connection. buf holds bytes read past the last response.
+typedef struct {
+    int fd;
+    char buf[LOAD_BUFFER_SIZE];
+    size_t start;
+    size_t end;
+} load_conn_t;
+
+typedef struct {
+    const load_config_t* config;
+    const struct addrinfo* address;
+    int* ids;                   // This worker's slice of the seeded todos
+    int id_count;
+    unsigned int rng;
+    bench_samples_t samples[LOAD_KIND_COUNT];
+    uint64_t errors;
+    uint64_t status_errors;     // Responses outside 2xx/3xx
+    int failed;
+} load_worker_t;
+
+static atomic_int stop = 0;
+
+static void print_usage(const char* program) {
+    fprintf(stderr,
+        "Usage: %s load [options]\n"
+        "  -H, --host HOST          Server host (default 127.0.0.1)\n"
+        "  -p, --port N             Server port (default 8080)\n"
+        "  -c, --connections N      Worker threads, one keep-alive connection each (default 4)\n"
+        "  -d, --duration SECONDS   Length of the measured run (default 10)\n"
+        "  -s, --seed N             Todos created before the run for GET/PUT/DELETE (default 10000)\n"
+        "  -m, --mix SPEC           Request mix as weights (default get=70,post=10,put=15,delete=5)\n"
+        "  -b, --baseline FILE      Compare against the output of an earlier run\n"
+        "  -h, --help               Show this help\n",
+        program);
+}
+
+static int parse_mix(const char* spec, int weights[LOAD_KIND_COUNT]) {
+    memset(weights, 0, sizeof(int) * LOAD_KIND_COUNT);
+    int total = 0;
+
+    while (*spec) {
+        const char* equals = strchr(spec, '=');
+        if (!equals) {
+            return -1;
+        }
+        int kind;
+        for (kind = 0; kind < LOAD_KIND_COUNT; kind++) {
+            if ((size_t)(equals - spec) == strlen(kind_names[kind]) &&
+                strncasecmp(spec, kind_names[kind], equals - spec) == 0) {
+                break;
+            }
+        }
+        char* end;
+        long weight = strtol(equals + 1, &end, 10);
+        if (kind == LOAD_KIND_COUNT || end == equals + 1 || weight < 0 || weight > 1000000 ||
+            (*end != ',' && *end != '\0')) {
+            return -1;
+        }
+        weights[kind] = (int)weight;
+        total += (int)weight;
+        spec = *end == ',' ? end + 1 : end;
+    }
+    return total > 0 ? 0 : -1;
+}
+
+static int conn_open(load_conn_t* conn, const struct addrinfo* address) {
+    conn->start = conn->end = 0;
+    conn->fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    if (conn->fd < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(conn->fd, address->ai_addr, address->ai_addrlen) != 0) {
+        close(conn->fd);
+        conn->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void conn_close(load_conn_t* conn) {
+    if (conn->fd >= 0) {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+}
+
+static int send_all(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return -1;
+        }
+        data += sent;
+        size -= (size_t)sent;
+    }
+    return 0;
+}
+
+// Reads more data, compacting the buffer first when it is full
+static int conn_fill(load_conn_t* conn) {
+    if (conn->end == sizeof(conn->buf)) {
+        if (conn->start == 0) {
+            return -1;
+        }
+        memmove(conn->buf, conn->buf + conn->start, conn->end - conn->start);
+        conn->end -= conn->start;
+        conn->start = 0;
+    }
+    ssize_t received;
+    do {
+        received = recv(conn->fd, conn->buf + conn->end, sizeof(conn->buf) - conn->end, 0);
+    } while (received < 0 && errno == EINTR);
+    if (received <= 0) {
+        return -1;
+    }
+    conn->end += (size_t)received;
+    return 0;
+}
+
+// Finds the end of the CRLF-terminated line at conn->start, reading as needed
+static char* conn_line(load_conn_t* conn) {
+    for (;;) {
+        char* begin = conn->buf + conn->start;
+        char* line_end = memmem(begin, conn->end - conn->start, "\r\n", 2);
+        if (line_end) {
+            return line_end;
+        }
+        if (conn_fill(conn) != 0) {
+            return NULL;
+        }
+    }
+}
+
+// Consumes exactly size body bytes; body may be NULL to discard them
+static int conn_consume(load_conn_t* conn, size_t size, char* body, size_t body_max, size_t* body_len) {
+    while (size > 0) {
+        if (conn->start == conn->end && conn_fill(conn) != 0) {
+            return -1;
+        }
+        size_t available = conn->end - conn->start;
+        size_t take = available < size ? available : size;
+        if (body && *body_len + take < body_max) {
+            memcpy(body + *body_len, conn->buf + conn->start, take);
+            *body_len += take;
+        }
+        conn->start += take;
+        size -= take;
+    }
+    return 0;
+}
+
+static int header_is(const char* line, size_t len, const char* name) {
+    size_t name_len = strlen(name);
+    return len > name_len && line[name_len] == ':' && strncasecmp(line, name, name_len) == 0;
+}
+
+// Reads one response. The first body_max - 1 bytes of the body are copied
+// into body when it is non-NULL. Returns the status code or -1.
+static int read_response(load_conn_t* conn, int* keep_alive, char* body, size_t body_max) {
+    size_t body_len = 0;
+    long long content_length = -1;
+    int chunked = 0;
+    int status = -1;
+    *keep_alive = 1;
+
+    for (int first = 1;; first = 0) {
+        char* line_end = conn_line(conn);
+        if (!line_end) {
+            return -1;
+        }
+        char* line = conn->buf + conn->start;
+        size_t len = (size_t)(line_end - line);
+        conn->start += len + 2;
+
+        if (first) {
+            if (len < 12 || strncmp(line, "HTTP/1.", 7) != 0) {
+                return -1;
+            }
+            status = atoi(line + 9);
+        } else if (len == 0) {
+            break;
+        } else if (header_is(line, len, "Content-Length")) {
+            content_length = strtoll(line + 15, NULL, 10);
+        } else if (header_is(line, len, "Transfer-Encoding")) {
+            chunked = memmem(line, len, "chunked", 7) != NULL;
+        } else if (header_is(line, len, "Connection")) {
+            *keep_alive = memmem(line, len, "close", 5) == NULL;
+        }
+    }
+
+    if (chunked) {
+        for (;;) {
+            char* line_end = conn_line(conn);
+            if (!line_end) {
+                return -1;
+            }
+            size_t size = strtoul(conn->buf + conn->start, NULL, 16);
+            conn->start = (size_t)(line_end - conn->buf) + 2;
+            if (size == 0) {
+                // No trailers are sent, so only the final CRLF remains
+                return conn_consume(conn, 2, NULL, 0, NULL) == 0 ? status : -1;
+            }
+            if (conn_consume(conn, size, body, body_max, &body_len) != 0 ||
+                conn_consume(conn, 2, NULL, 0, NULL) != 0) {
+                return -1;
+            }
+            if (body) body[body_len] = '\0';
+        }
+    }
+
+    if (content_length < 0) {
+        content_length = 0;
+    }
+    if (conn_consume(conn, (size_t)content_length, body, body_max, &body_len) != 0) {
+        return -1;
+    }
+    if (body) {
+        body[body_len] = '\0';
+    }
+    return status;
+}
+
+// Small requests go out in a single send so they are never split by Nagle
+static int send_request(load_conn_t* conn, const load_config_t* config, const char* method, const char* path,
+                        const char* body) {
+    char head[1024];
+    size_t body_len = body ? strlen(body) : 0;
+    int len = snprintf(head, sizeof(head),
+                       "%s %s HTTP/1.1\r\nHost: %s\r\n%sContent-Length: %zu\r\n\r\n",
+                       method, path, config->host, body ? "Content-Type: application/json\r\n" : "", body_len);
+    if (len < 0 || (size_t)len >= sizeof(head)) {
+        return -1;
+    }
+    if (body_len && (size_t)len + body_len <= sizeof(head)) {
+        memcpy(head + len, body, body_len);
+        return send_all(conn->fd, head, (size_t)len + body_len);
+    }
+    if (send_all(conn->fd, head, (size_t)len) != 0) {
+        return -1;
+    }
+    return body_len ? send_all(conn->fd, body, body_len) : 0;
+}
+
+// Creates the todos that GET/PUT/DELETE work on, in batches, collecting the
+// ids from the batch results
+static int seed_todos(const load_config_t* config, const struct addrinfo* address, int* ids) {
+    load_conn_t* conn = malloc(sizeof(load_conn_t));
+    size_t body_max = 64 * SEED_CHUNK;
+    char* body = malloc(body_max);
+    char* response = malloc(body_max);
+    int created = 0;
+
+    if (!conn || !body || !response || conn_open(conn, address) != 0) {
+        free(conn);
+        free(body);
+        free(response);
+        return -1;
+    }
+
+    while (created < config->seed) {
+        int count = config->seed - created < SEED_CHUNK ? config->seed - created : SEED_CHUNK;
+        size_t len = 0;
+        body[len++] = '[';
+        for (int i = 0; i < count; i++) {
+            len += (size_t)snprintf(body + len, body_max - len, "%s{\"title\":\"Load %d\",\"description\":\"Seeded\"}",
+                                    i ? "," : "", created + i);
+        }
+        body[len++] = ']';
+        body[len] = '\0';
+
+        int keep_alive;
+        if (send_request(conn, config, "POST", "/todos/batch", body) != 0 ||
+            read_response(conn, &keep_alive, response, body_max) != 200) {
+            break;
+        }
+
+        int before = created;
+        for (char* at = response; (at = strstr(at, "\"id\":")) && created < config->seed; at += 5) {
+            ids[created++] = atoi(at + 5);
+        }
+        if (created == before || !keep_alive) {
+            break;
+        }
+    }
+
+    conn_close(conn);
+    free(conn);
+    free(body);
+    free(response);
+    return created == config->seed ? 0 : -1;
+}
+
+static load_kind_t pick_kind(load_worker_t* worker) {
+    const int* weights = worker->config->weights;
+    int total = 0;
+    for (int i = 0; i < LOAD_KIND_COUNT; i++) {
+        total += weights[i];
+    }
+    int roll = rand_r(&worker->rng) % total;
+    for (int i = 0; i < LOAD_KIND_COUNT; i++) {
+        if (roll < weights[i]) {
+            return (load_kind_t)i;
+        }
+        roll -= weights[i];
+    }
+    return LOAD_GET;
+}
+
+// Closed loop: each worker keeps exactly one request outstanding. Deletes
+// shrink the worker's id slice; once it is empty, requests that need an id
+// are sent as creates.
+static void* worker_main(void* arg) {
+    load_worker_t* worker = arg;
+    load_conn_t* conn = malloc(sizeof(load_conn_t));
+    if (!conn) {
+        worker->failed = 1;
+        return NULL;
+    }
+    conn->fd = -1;
+
+    char path[64];
+    char body[256];
+    int request = 0;
+
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        if (conn->fd < 0 && conn_open(conn, worker->address) != 0) {
+            worker->failed = 1;
+            break;
+        }
+
+        load_kind_t kind = pick_kind(worker);
+        if (kind != LOAD_POST && worker->id_count == 0) {
+            kind = LOAD_POST;
+        }
+        int slot = worker->id_count ? rand_r(&worker->rng) % worker->id_count : 0;
+        int id = worker->id_count ? worker->ids[slot] : 0;
+        snprintf(path, sizeof(path), "/todos/%d", id);
+        request++;
+
+        const char* method = kind_names[kind];
+        const char* target = path;
+        const char* payload = NULL;
+        switch (kind) {
+        case LOAD_POST:
+            target = "/todos";
+            snprintf(body, sizeof(body), "{\"title\":\"Load %d\",\"description\":\"Created under load\"}", request);
+            payload = body;
+            break;
+        case LOAD_PUT:
+            snprintf(body, sizeof(body), "{\"title\":\"Load %d\",\"description\":\"Updated under load\","
+                                         "\"completed\":%s}", id, request & 1 ? "true" : "false");
+            payload = body;
+            break;
+        case LOAD_DELETE:
+            worker->ids[slot] = worker->ids[--worker->id_count];
+            break;
+        default:
+            break;
+        }
+
+        int keep_alive;
+        uint64_t started = bench_now();
+        int status = send_request(conn, worker->config, method, target, payload) == 0
+                         ? read_response(conn, &keep_alive, NULL, 0)
+                         : -1;
+        uint64_t elapsed = bench_now() - started;
+
+        if (status < 0) {
+            worker->errors++;
+            conn_close(conn);
+            continue;
+        }
+        if (status >= 400) {
+            worker->status_errors++;
+        }
+        bench_samples_add(&worker->samples[kind], elapsed);
+        if (!keep_alive) {
+            conn_close(conn);
+        }
+    }
+
+    conn_close(conn);
+    free(conn);
+    return NULL;
+}
+
+static void write_latency(FILE* out, const bench_samples_t* samples) {
+    fprintf(out, "{\"requests\":%zu,\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f}",
+            samples->count, (double)bench_percentile(samples, 50) / 1e3,
+            (double)bench_percentile(samples, 99) / 1e3, (double)bench_percentile(samples, 99.9) / 1e3,
+            samples->count ? (double)samples->values[samples->count - 1] / 1e3 : 0);
+}
+
+int bench_load_main(int argc, char** argv) {
+    load_config_t config = {"127.0.0.1", "8080", 4, 10, 10000, {70, 10, 15, 5}, NULL};
+
+    static const struct option long_options[] = {
+        {"host", required_argument, NULL, 'H'},
+        {"port", required_argument, NULL, 'p'},
+        {"connections", required_argument, NULL, 'c'},
+        {"duration", required_argument, NULL, 'd'},
+        {"seed", required_argument, NULL, 's'},
+        {"mix", required_argument, NULL, 'm'},
+        {"baseline", required_argument, NULL, 'b'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int option;
+    while ((option = getopt_long(argc, argv, "H:p:c:d:s:m:b:h", long_options, NULL)) != -1) {
+        switch (option) {
+        case 'H': config.host = optarg; break;
+        case 'p': config.port = optarg; break;
+        case 'c': config.threads = atoi(optarg); break;
+        case 'd': config.duration_s = atoi(optarg); break;
+        case 's': config.seed = atoi(optarg); break;
+        case 'm':
+            if (parse_mix(optarg, config.weights) != 0) {
+                fprintf(stderr, "Invalid mix: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'b': config.baseline = optarg; break;
+        case 'h':
+            print_usage("todo_bench");
+            return EXIT_SUCCESS;
+        default:
+            print_usage("todo_bench");
+            return EXIT_FAILURE;
+        }
+    }
+    if (config.threads <= 0 || config.duration_s <= 0 || config.seed < 0) {
+        print_usage("todo_bench");
+        return EXIT_FAILURE;
+    }
+
+    char* baseline = NULL;
+    if (config.baseline && !(baseline = bench_read_file(config.baseline))) {
+        fprintf(stderr, "Failed to read baseline %s\n", config.baseline);
+        return EXIT_FAILURE;
+    }
+
+    struct addrinfo hints = {0};
+    struct addrinfo* address = NULL;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(config.host, config.port, &hints, &address) != 0) {
+        fprintf(stderr, "Cannot resolve %s:%s\n", config.host, config.port);
+        free(baseline);
+        return EXIT_FAILURE;
+    }
+
+    int* ids = malloc(sizeof(int) * (size_t)(config.seed ? config.seed : 1));
+    load_worker_t* workers = calloc((size_t)config.threads, sizeof(load_worker_t));
+    pthread_t* threads = calloc((size_t)config.threads, sizeof(pthread_t));
+    if (!ids || !workers || !threads || seed_todos(&config, address, ids) != 0) {
+        fprintf(stderr, "Failed to seed %d todos on %s:%s\n", config.seed, config.host, config.port);
+        free(ids);
+        free(workers);
+        free(threads);
+        freeaddrinfo(address);
+        free(baseline);
+        return EXIT_FAILURE;
+    }
+
+    int started = 0;
+    for (int i = 0; i < config.threads; i++) {
+        int from = (int)((long long)config.seed * i / config.threads);
+        int to = (int)((long long)config.seed * (i + 1) / config.threads);
+        workers[i].config = &config;
+        workers[i].address = address;
+        workers[i].ids = ids + from;
+        workers[i].id_count = to - from;
+        workers[i].rng = (unsigned int)i * 2654435761u + 1;
+        if (pthread_create(&threads[i], NULL, worker_main, &workers[i]) != 0) {
+            break;
+        }
+        started++;
+    }
+
+    uint64_t began = bench_now();
+    struct timespec tick = {0, 100 * 1000 * 1000};
+    while (started == config.threads && bench_now() - began < (uint64_t)config.duration_s * 1000000000ull) {
+        nanosleep(&tick, NULL);
+    }
+    atomic_store(&stop, 1);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed_s = (double)(bench_now() - began) / 1e9;
+
+    bench_samples_t all = {0};
+    bench_samples_t by_kind[LOAD_KIND_COUNT] = {{0}};
+    uint64_t errors = 0;
+    uint64_t status_errors = 0;
+    int failed = started != config.threads;
+    for (int i = 0; i < started; i++) {
+        for (int kind = 0; kind < LOAD_KIND_COUNT; kind++) {
+            bench_samples_merge(&all, &workers[i].samples[kind]);
+            bench_samples_merge(&by_kind[kind], &workers[i].samples[kind]);
+            bench_samples_free(&workers[i].samples[kind]);
+        }
+        errors += workers[i].errors;
+        status_errors += workers[i].status_errors;
+        failed |= workers[i].failed;
+    }
+    bench_samples_sort(&all);
+
+    double throughput = (double)all.count / elapsed_s;
+    double p99 = (double)bench_percentile(&all, 99) / 1e3;
+    const char* key = "\"mode\":\"load\",";
+
+    printf("{%s\"connections\":%d,\"duration_s\":%.2f,\"throughput\":%.1f,\"errors\":%llu,"
+           "\"error_responses\":%llu,\"latency\":",
+           key, config.threads, elapsed_s, throughput, (unsigned long long)errors,
+           (unsigned long long)status_errors);
+    write_latency(stdout, &all);
+    printf(",\"by_method\":{");
+    for (int kind = 0; kind < LOAD_KIND_COUNT; kind++) {
+        bench_samples_sort(&by_kind[kind]);
+        printf("%s\"%s\":", kind ? "," : "", kind_names[kind]);
+        write_latency(stdout, &by_kind[kind]);
+        bench_samples_free(&by_kind[kind]);
+    }
+    printf("}");
+    bench_write_comparison(stdout, baseline, key, "throughput", throughput);
+    bench_write_comparison(stdout, baseline, key, "p99_us", p99);
+    printf("}\n");
+
+    bench_samples_free(&all);
+    free(ids);
+    free(workers);
+    free(threads);
+    freeaddrinfo(address);
+    free(baseline);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
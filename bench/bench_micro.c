@@ -0,0 +1,331 @@
+#include "bench.h"
+#include "../src/core/todo.h"
+#include "../src/db/database.h"
+#include "../src/http/json_writer.h"
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_ROW_COUNTS 8
+#define POPULATE_CHUNK 1000
+
+typedef struct {
+    int row_counts[MAX_ROW_COUNTS];
+    int row_count_count;
+    const char* db_path;
+    int batch_window_us;
+    uint64_t min_time_ns;
+} micro_config_t;
+
+typedef struct {
+    FILE* out;
+    const char* baseline;
+    int results;
+} micro_report_t;
+
+static void print_usage(const char* program) {
+    fprintf(stderr,
+        "Usage: %s micro [options]\n"
+        "  -n, --rows N[,N...]      Table sizes to measure (default 1000,100000,1000000)\n"
+        "  -d, --db PATH            Scratch database, recreated for each size (default todo_bench.db)\n"
+        "  -w, --batch-window US    Writer group commit window (default: the server's, 2000)\n"
+        "  -t, --min-time MS        Minimum time spent on each measurement (default 1000)\n"
+        "  -b, --baseline FILE      Compare against the output of an earlier run\n"
+        "  -h, --help               Show this help\n",
+        program);
+}
+
+static int parse_row_counts(const char* value, micro_config_t* config) {
+    config->row_count_count = 0;
+    while (*value) {
+        char* end;
+        long rows = strtol(value, &end, 10);
+        if (end == value || rows <= 0 || rows > 100000000 || config->row_count_count == MAX_ROW_COUNTS) {
+            return -1;
+        }
+        config->row_counts[config->row_count_count++] = (int)rows;
+        value = *end == ',' ? end + 1 : end;
+        if (*end != ',' && *end != '\0') {
+            return -1;
+        }
+    }
+    return config->row_count_count > 0 ? 0 : -1;
+}
+
+static void remove_database(const char* path) {
+    char name[4096];
+    unlink(path);
+    snprintf(name, sizeof(name), "%s-wal", path);
+    unlink(name);
+    snprintf(name, sizeof(name), "%s-shm", path);
+    unlink(name);
+}
+
+static int populate(int rows) {
+    todo_op_t* ops = calloc(POPULATE_CHUNK, sizeof(todo_op_t));
+    todo_op_result_t* results = calloc(POPULATE_CHUNK, sizeof(todo_op_result_t));
+    char (*titles)[32] = calloc(POPULATE_CHUNK, sizeof(*titles));
+    int rc = ops && results && titles ? 0 : -1;
+
+    for (int created = 0; rc == 0 && created < rows; created += POPULATE_CHUNK) {
+        int count = rows - created < POPULATE_CHUNK ? rows - created : POPULATE_CHUNK;
+        for (int i = 0; i < count; i++) {
+            snprintf(titles[i], sizeof(titles[i]), "Benchmark todo %d", created + i);
+            ops[i].type = TODO_OP_CREATE;
+            ops[i].title = titles[i];
+            ops[i].description = "A representative description of a few dozen characters";
+            ops[i].completed = (created + i) % 3 == 0;
+        }
+        if (todo_batch(ops, count, results) != 0) {
+            rc = -1;
+        }
+        for (int i = 0; rc == 0 && i < count; i++) {
+            if (results[i].status != TODO_OK) {
+                rc = -1;
+            }
+        }
+    }
+
+    free(ops);
+    free(results);
+    free(titles);
+    return rc;
+}
+
+static void report(micro_report_t* report, const char* name, int rows, bench_samples_t* samples,
+                   uint64_t units_per_op, const char* unit) {
+    bench_samples_sort(samples);
+
+    uint64_t total = 0;
+    for (size_t i = 0; i < samples->count; i++) {
+        total += samples->values[i];
+    }
+    double ns_per_op = samples->count ? (double)total / (double)samples->count : 0;
+
+    char key[128];
+    snprintf(key, sizeof(key), "\"name\":\"%s\",\"rows\":%d,", name, rows);
+
+    fprintf(report->out, "%s  {%s\"iterations\":%zu,\"ns_per_op\":%.1f,\"p50_ns\":%llu,\"p99_ns\":%llu,"
+                         "\"%s_per_sec\":%.1f",
+            report->results++ ? ",\n" : "", key, samples->count, ns_per_op,
+            (unsigned long long)bench_percentile(samples, 50), (unsigned long long)bench_percentile(samples, 99),
+            unit, ns_per_op > 0 ? (double)units_per_op * 1e9 / ns_per_op : 0);
+    bench_write_comparison(report->out, report->baseline, key, "ns_per_op", ns_per_op);
+    fputc('}', report->out);
+    fflush(report->out);
+}
+
+static int bench_get_todos(micro_report_t* out, const micro_config_t* config, int rows) {
+    bench_samples_t samples = {0};
+    uint64_t deadline = bench_now() + config->min_time_ns;
+    arena_t arena;
+    arena_init(&arena);
+
+    do {
+        todo_t* todos;
+        int count;
+        uint64_t started = bench_now();
+        if (db_get_todos(&todos, &count, &arena) != 0) {
+            bench_samples_free(&samples);
+            arena_destroy(&arena);
+            return -1;
+        }
+        bench_samples_add(&samples, bench_now() - started);
+        arena_reset(&arena);
+    } while (bench_now() < deadline);
+
+    report(out, "db_get_todos", rows, &samples, (uint64_t)rows, "rows");
+    bench_samples_free(&samples);
+    arena_destroy(&arena);
+    return 0;
+}
+
+static int bench_execute_query(micro_report_t* out, const micro_config_t* config, int rows) {
+    bench_samples_t samples = {0};
+    uint64_t deadline = bench_now() + config->min_time_ns;
+    unsigned int seed = 1;
+
+    do {
+        db_param_t params[2] = {DB_INT(rand_r(&seed) & 1), DB_INT(rand_r(&seed) % rows + 1)};
+        uint64_t started = bench_now();
+        if (db_execute_query("UPDATE todos SET completed = ? WHERE id = ?", params, 2, NULL) != 0) {
+            bench_samples_free(&samples);
+            return -1;
+        }
+        bench_samples_add(&samples, bench_now() - started);
+    } while (bench_now() < deadline);
+
+    report(out, "db_execute_query", rows, &samples, 1, "ops");
+    bench_samples_free(&samples);
+    return 0;
+}
+
+static int count_hit(const todo_search_hit_t* hit, void* ctx) {
+    (void)hit;
+    (*(int*)ctx)++;
+    return 0;
+}
+
+// One page of ranked hits for a term that matches a single row
+static int bench_search(micro_report_t* out, const micro_config_t* config, int rows) {
+    bench_samples_t samples = {0};
+    uint64_t deadline = bench_now() + config->min_time_ns;
+    unsigned int seed = 1;
+    char text[32];
+
+    do {
+        snprintf(text, sizeof(text), "%d", rand_r(&seed) % rows);
+        todo_search_t search = {text, 20, 0};
+        int hits = 0;
+        uint64_t started = bench_now();
+        if (db_search_todos(&search, count_hit, &hits) != 1) {
+            bench_samples_free(&samples);
+            return -1;
+        }
+        bench_samples_add(&samples, bench_now() - started);
+    } while (bench_now() < deadline);
+
+    report(out, "db_search_todos", rows, &samples, 1, "ops");
+    bench_samples_free(&samples);
+    return 0;
+}
+
+// Serializes the whole table the way GET /todos does, without the database
+static int bench_serialize(micro_report_t* out, const micro_config_t* config, int rows, int pretty) {
+    todo_t* todos;
+    int count;
+    arena_t arena;
+    arena_init(&arena);
+    if (db_get_todos(&todos, &count, &arena) != 0) {
+        arena_destroy(&arena);
+        return -1;
+    }
+
+    json_buf_t buf;
+    json_buf_init(&buf);
+    bench_samples_t samples = {0};
+    uint64_t deadline = bench_now() + config->min_time_ns;
+    int rc = 0;
+
+    do {
+        uint64_t started = bench_now();
+        json_buf_reset(&buf);
+        rc = json_buf_append(&buf, "[", 1);
+        for (int i = 0; rc == 0 && i < count; i++) {
+            if (i > 0) {
+                rc = json_buf_append(&buf, ",", 1);
+            }
+            if (rc == 0) {
+                rc = json_write_todo(&buf, &todos[i], pretty, 1);
+            }
+        }
+        if (rc == 0) {
+            rc = json_buf_append(&buf, "]", 1);
+        }
+        bench_samples_add(&samples, bench_now() - started);
+    } while (rc == 0 && bench_now() < deadline);
+
+    if (rc == 0) {
+        report(out, pretty ? "json_write_todo_pretty" : "json_write_todo", rows, &samples, (uint64_t)count, "todos");
+    }
+    bench_samples_free(&samples);
+    json_buf_free(&buf);
+    arena_destroy(&arena);
+    return rc;
+}
+
+static int run_size(micro_report_t* out, const micro_config_t* config, int rows) {
+    db_config_t db_config;
+    db_config_defaults(&db_config);
+    db_config.path = config->db_path;
+    db_config.batch_window_us = config->batch_window_us;
+
+    remove_database(config->db_path);
+    if (db_init_config(&db_config) != 0) {
+        fprintf(stderr, "Failed to open %s\n", config->db_path);
+        return -1;
+    }
+
+    int rc = populate(rows);
+    if (rc != 0) {
+        fprintf(stderr, "Failed to insert %d rows\n", rows);
+    }
+    if (rc == 0) rc = bench_get_todos(out, config, rows);
+    if (rc == 0) rc = bench_serialize(out, config, rows, 0);
+    if (rc == 0) rc = bench_serialize(out, config, rows, 1);
+    if (rc == 0) rc = bench_search(out, config, rows);
+    if (rc == 0) rc = bench_execute_query(out, config, rows);
+
+    db_cleanup();
+    remove_database(config->db_path);
+    return rc;
+}
+
+int bench_micro_main(int argc, char** argv) {
+    micro_config_t config = {
+        .row_counts = {1000, 100000, 1000000},
+        .row_count_count = 3,
+        .db_path = "todo_bench.db",
+        .batch_window_us = 2000,
+        .min_time_ns = 1000000000ull,
+    };
+    const char* baseline_path = NULL;
+
+    static const struct option long_options[] = {
+        {"rows", required_argument, NULL, 'n'},
+        {"db", required_argument, NULL, 'd'},
+        {"batch-window", required_argument, NULL, 'w'},
+        {"min-time", required_argument, NULL, 't'},
+        {"baseline", required_argument, NULL, 'b'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    int option;
+    while ((option = getopt_long(argc, argv, "n:d:w:t:b:h", long_options, NULL)) != -1) {
+        switch (option) {
+        case 'n':
+            if (parse_row_counts(optarg, &config) != 0) {
+                fprintf(stderr, "Invalid row counts: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'd':
+            config.db_path = optarg;
+            break;
+        case 'w':
+            config.batch_window_us = atoi(optarg);
+            break;
+        case 't':
+            config.min_time_ns = strtoull(optarg, NULL, 10) * 1000000ull;
+            break;
+        case 'b':
+            baseline_path = optarg;
+            break;
+        case 'h':
+            print_usage("todo_bench");
+            return EXIT_SUCCESS;
+        default:
+            print_usage("todo_bench");
+            return EXIT_FAILURE;
+        }
+    }
+
+    char* baseline = NULL;
+    if (baseline_path && !(baseline = bench_read_file(baseline_path))) {
+        fprintf(stderr, "Failed to read baseline %s\n", baseline_path);
+        return EXIT_FAILURE;
+    }
+
+    micro_report_t out = {stdout, baseline, 0};
+    int rc = 0;
+    printf("[\n");
+    for (int i = 0; rc == 0 && i < config.row_count_count; i++) {
+        rc = run_size(&out, &config, config.row_counts[i]);
+    }
+    printf("\n]\n");
+
+    free(baseline);
+    return rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
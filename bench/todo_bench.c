@@ -0,0 +1,147 @@
+#include "bench.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+int bench_samples_add(bench_samples_t* samples, uint64_t value) {
+    if (samples->count == samples->capacity) {
+        size_t capacity = samples->capacity ? samples->capacity * 2 : 4096;
+        uint64_t* values = realloc(samples->values, capacity * sizeof(uint64_t));
+        if (!values) {
+            return -1;
+        }
+        samples->values = values;
+        samples->capacity = capacity;
+    }
+    samples->values[samples->count++] = value;
+    return 0;
+}
+
+int bench_samples_merge(bench_samples_t* into, const bench_samples_t* from) {
+    for (size_t i = 0; i < from->count; i++) {
+        if (bench_samples_add(into, from->values[i]) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void bench_samples_free(bench_samples_t* samples) {
+    free(samples->values);
+    samples->values = NULL;
+    samples->count = 0;
+    samples->capacity = 0;
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+void bench_samples_sort(bench_samples_t* samples) {
+    qsort(samples->values, samples->count, sizeof(uint64_t), compare_u64);
+}
+
+// Nearest-rank percentile
+uint64_t bench_percentile(const bench_samples_t* samples, double percentile) {
+    if (samples->count == 0) {
+        return 0;
+    }
+    size_t rank = (size_t)(percentile / 100.0 * (double)samples->count + 0.999999);
+    if (rank == 0) rank = 1;
+    if (rank > samples->count) rank = samples->count;
+    return samples->values[rank - 1];
+}
+
+uint64_t bench_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+char* bench_read_file(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return NULL;
+    }
+
+    char* data = NULL;
+    size_t size = 0;
+    size_t capacity = 0;
+    size_t n;
+    do {
+        if (capacity - size < 4096) {
+            capacity = capacity ? capacity * 2 : 8192;
+            char* grown = realloc(data, capacity);
+            if (!grown) {
+                free(data);
+                fclose(file);
+                return NULL;
+            }
+            data = grown;
+        }
+        n = fread(data + size, 1, capacity - size - 1, file);
+        size += n;
+    } while (n > 0);
+
+    fclose(file);
+    data[size] = '\0';
+    return data;
+}
+
+int bench_baseline_value(const char* baseline, const char* key, const char* field, double* out) {
+    if (!baseline) {
+        return -1;
+    }
+
+    const char* line = strstr(baseline, key);
+    if (!line) {
+        return -1;
+    }
+    const char* end = strchr(line, '\n');
+
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\"%s\":", field);
+    const char* found = strstr(line, pattern);
+    if (!found || (end && found > end)) {
+        return -1;
+    }
+
+    char* parsed_end;
+    *out = strtod(found + strlen(pattern), &parsed_end);
+    return parsed_end == found + strlen(pattern) ? -1 : 0;
+}
+
+void bench_write_comparison(FILE* out, const char* baseline, const char* key, const char* field, double value) {
+    double old;
+    if (bench_baseline_value(baseline, key, field, &old) != 0 || old == 0) {
+        return;
+    }
+    fprintf(out, ",\"baseline_%s\":%.1f,\"%s_change_pct\":%.2f", field, old, field, (value - old) / old * 100.0);
+}
+
+static void print_usage(const char* program) {
+    fprintf(stderr,
+        "Usage: %s micro [options]   Database and serialization microbenchmarks\n"
+        "       %s load [options]    HTTP load against a running server\n"
+        "Run a mode with --help for its options.\n",
+        program, program);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (strcmp(argv[1], "micro") == 0) {
+        return bench_micro_main(argc - 1, argv + 1);
+    }
+    if (strcmp(argv[1], "load") == 0) {
+        return bench_load_main(argc - 1, argv + 1);
+    }
+
+    print_usage(argv[0]);
+    return strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
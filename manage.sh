@@ -8,6 +8,7 @@
 #   run         - Run the server
 #   test        - Run unit tests
 #   api-test    - Run API tests
+#   bench       - Run benchmarks (arguments go to todo_bench)
 #   help        - Display this help message
 
 set -e  # Exit on error
@@ -199,6 +200,17 @@ api_test() {
     ${SCRIPTS_DIR}/test_api.sh
 }
 
+# Function to run benchmarks, e.g. ./manage.sh bench micro --rows 1000
+bench() {
+    if [ ! -x ${BUILD_DIR}/bench/todo_bench ]; then
+        print_message "$YELLOW" "Benchmark binary not found. Building first..."
+        build
+    fi
+
+    cd ${PROJECT_DIR}
+    ${BUILD_DIR}/bench/todo_bench "$@"
+}
+
 # Display help
 help() {
     echo "Usage: ./manage.sh [command]"
@@ -208,6 +220,7 @@ help() {
     echo "  run         - Run the server"
     echo "  test        - Run unit tests"
     echo "  api-test    - Run API tests"
+    echo "  bench       - Run benchmarks (arguments go to todo_bench)"
     echo "  help        - Display this help message"
 }
 
@@ -234,6 +247,10 @@ case "$1" in
     api-test)
         api_test
         ;;
+    bench)
+        shift
+        bench "$@"
+        ;;
     help)
         help
         ;;
@@ -0,0 +1,97 @@
+#include "arena.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_CHUNK_SIZE (16 * 1024)
+#define ARENA_ALIGN 16
+
+struct arena_chunk {
+    struct arena_chunk* next;
+    size_t size;
+    size_t used;
+    _Alignas(ARENA_ALIGN) unsigned char data[];
+};
+
+void arena_init(arena_t* arena) {
+    arena->head = NULL;
+    arena->current = NULL;
+}
+
+static arena_chunk_t* arena_new_chunk(size_t min_size) {
+    size_t size = min_size > ARENA_CHUNK_SIZE ? min_size : ARENA_CHUNK_SIZE;
+    arena_chunk_t* chunk = malloc(sizeof(arena_chunk_t) + size);
+    if (!chunk) {
+        return NULL;
+    }
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+void* arena_alloc(arena_t* arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    arena_chunk_t* chunk = arena->current;
+    if (chunk && chunk->size - chunk->used >= size) {
+        void* ptr = chunk->data + chunk->used;
+        chunk->used += size;
+        return ptr;
+    }
+
+    arena_chunk_t* fresh = arena_new_chunk(size);
+    if (!fresh) {
+        return NULL;
+    }
+
+    if (chunk) {
+        chunk->next = fresh;
+    } else {
+        arena->head = fresh;
+    }
+    arena->current = fresh;
+    fresh->used = size;
+    return fresh->data;
+}
+
+char* arena_strndup(arena_t* arena, const char* str, size_t len) {
+    char* copy = arena_alloc(arena, len + 1);
+    if (copy) {
+        memcpy(copy, str, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+void arena_reset(arena_t* arena) {
+    if (!arena->head) {
+        return;
+    }
+
+    // Keep the first chunk only if it has the default size; oversized chunks
+    // from one large request should not stay pinned to a recycled arena.
+    arena_chunk_t* keep = arena->head->size == ARENA_CHUNK_SIZE ? arena->head : NULL;
+    arena_chunk_t* chunk = keep ? keep->next : arena->head;
+    while (chunk) {
+        arena_chunk_t* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+
+    arena->head = keep;
+    arena->current = keep;
+    if (keep) {
+        keep->next = NULL;
+        keep->used = 0;
+    }
+}
+
+void arena_destroy(arena_t* arena) {
+    arena_chunk_t* chunk = arena->head;
+    while (chunk) {
+        arena_chunk_t* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena_init(arena);
+}
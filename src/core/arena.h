@@ -0,0 +1,22 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+typedef struct arena_chunk arena_chunk_t;
+
+// Bump allocator for request-scoped memory. Individual allocations are never
+// freed; arena_reset releases everything at once but keeps the first chunk
+// so a recycled arena serves typical requests without calling malloc.
+typedef struct {
+    arena_chunk_t* head;
+    arena_chunk_t* current;
+} arena_t;
+
+void arena_init(arena_t* arena);
+void* arena_alloc(arena_t* arena, size_t size);
+char* arena_strndup(arena_t* arena, const char* str, size_t len);
+void arena_reset(arena_t* arena);
+void arena_destroy(arena_t* arena);
+
+#endif
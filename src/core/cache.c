@@ -0,0 +1,346 @@
+#include "cache.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_SHARD_BITS 4
+#define CACHE_SHARDS (1 << CACHE_SHARD_BITS)
+#define CACHE_MIN_BUCKETS 64
+#define CACHE_LINE 64
+
+typedef struct cache_entry {
+    struct cache_entry* hash_next;
+    struct cache_entry* prev;       // Neighbours on the clock ring
+    struct cache_entry* next;
+    atomic_int referenced;          // Set by hits, cleared as the hand passes
+    int id;
+    time_t version;
+    size_t len;
+    char data[];
+} cache_entry_t;
+
+// Hits only take the read lock; the reference bit is atomic so that CLOCK
+// needs no list manipulation on the read path.
+typedef struct {
+    _Alignas(CACHE_LINE) pthread_rwlock_t lock;
+    cache_entry_t** buckets;
+    size_t bucket_mask;
+    size_t count;
+    size_t bytes;
+    cache_entry_t* hand;
+    atomic_uint_fast64_t epoch;     // Bumped by every invalidation
+    atomic_uint_fast64_t hits;
+    atomic_uint_fast64_t misses;
+    atomic_uint_fast64_t evictions;
+    atomic_uint_fast64_t invalidations;
+} cache_shard_t;
+
+static cache_shard_t* shards = NULL;
+static size_t shard_capacity = 0;
+
+static uint32_t hash_id(int id) {
+    uint32_t hash = (uint32_t)id * 2654435761u;
+    return hash ^ (hash >> 16);
+}
+
+static cache_shard_t* shard_for(uint32_t hash) {
+    return &shards[hash & (CACHE_SHARDS - 1)];
+}
+
+static cache_entry_t** find_slot(cache_shard_t* shard, int id, uint32_t hash) {
+    cache_entry_t** slot = &shard->buckets[(hash >> CACHE_SHARD_BITS) & shard->bucket_mask];
+    while (*slot && (*slot)->id != id) {
+        slot = &(*slot)->hash_next;
+    }
+    return slot;
+}
+
+static size_t entry_charge(size_t len) {
+    return sizeof(cache_entry_t) + len;
+}
+
+// Unlinks the entry at slot from its bucket and the clock ring, and frees it
+static void remove_entry(cache_shard_t* shard, cache_entry_t** slot) {
+    cache_entry_t* entry = *slot;
+    *slot = entry->hash_next;
+
+    if (entry->next == entry) {
+        shard->hand = NULL;
+    } else {
+        entry->prev->next = entry->next;
+        entry->next->prev = entry->prev;
+        if (shard->hand == entry) {
+            shard->hand = entry->next;
+        }
+    }
+
+    shard->count--;
+    shard->bytes -= entry_charge(entry->len);
+    free(entry);
+}
+
+// Advances the hand past referenced entries, clearing their bit, and evicts
+// the first entry that has not been hit since the hand last passed it
+static void evict_one(cache_shard_t* shard) {
+    for (;;) {
+        cache_entry_t* entry = shard->hand;
+        shard->hand = entry->next;
+        if (atomic_exchange_explicit(&entry->referenced, 0, memory_order_relaxed)) {
+            continue;
+        }
+        remove_entry(shard, find_slot(shard, entry->id, hash_id(entry->id)));
+        atomic_fetch_add_explicit(&shard->evictions, 1, memory_order_relaxed);
+        return;
+    }
+}
+
+static void grow_buckets(cache_shard_t* shard) {
+    size_t count = (shard->bucket_mask + 1) * 2;
+    cache_entry_t** buckets = calloc(count, sizeof(cache_entry_t*));
+    if (!buckets) {
+        return;
+    }
+
+    for (size_t i = 0; i <= shard->bucket_mask; i++) {
+        cache_entry_t* entry = shard->buckets[i];
+        while (entry) {
+            cache_entry_t* next = entry->hash_next;
+            size_t index = (hash_id(entry->id) >> CACHE_SHARD_BITS) & (count - 1);
+            entry->hash_next = buckets[index];
+            buckets[index] = entry;
+            entry = next;
+        }
+    }
+
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->bucket_mask = count - 1;
+}
+
+int todo_cache_init(size_t capacity) {
+    if (shards || capacity == 0) {
+        return 0;
+    }
+
+    cache_shard_t* created = aligned_alloc(CACHE_LINE, sizeof(cache_shard_t) * CACHE_SHARDS);
+    if (!created) {
+        return -1;
+    }
+
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard_t* shard = &created[i];
+        memset(shard, 0, sizeof(*shard));
+        shard->buckets = calloc(CACHE_MIN_BUCKETS, sizeof(cache_entry_t*));
+        if (!shard->buckets || pthread_rwlock_init(&shard->lock, NULL) != 0) {
+            free(shard->buckets);
+            while (--i >= 0) {
+                pthread_rwlock_destroy(&created[i].lock);
+                free(created[i].buckets);
+            }
+            free(created);
+            return -1;
+        }
+        shard->bucket_mask = CACHE_MIN_BUCKETS - 1;
+        atomic_init(&shard->epoch, 0);
+        atomic_init(&shard->hits, 0);
+        atomic_init(&shard->misses, 0);
+        atomic_init(&shard->evictions, 0);
+        atomic_init(&shard->invalidations, 0);
+    }
+
+    shard_capacity = capacity / CACHE_SHARDS;
+    shards = created;
+    return 0;
+}
+
+void todo_cache_cleanup(void) {
+    if (!shards) {
+        return;
+    }
+
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard_t* shard = &shards[i];
+        while (shard->hand) {
+            remove_entry(shard, find_slot(shard, shard->hand->id, hash_id(shard->hand->id)));
+        }
+        free(shard->buckets);
+        pthread_rwlock_destroy(&shard->lock);
+    }
+
+    free(shards);
+    shards = NULL;
+    shard_capacity = 0;
+}
+
+int todo_cache_get(int id, char** data, size_t* len, time_t* version) {
+    if (!shards) {
+        return -1;
+    }
+
+    uint32_t hash = hash_id(id);
+    cache_shard_t* shard = shard_for(hash);
+    char* copy = NULL;
+
+    pthread_rwlock_rdlock(&shard->lock);
+    cache_entry_t* entry = *find_slot(shard, id, hash);
+    if (entry && (copy = malloc(entry->len ? entry->len : 1))) {
+        memcpy(copy, entry->data, entry->len);
+        *len = entry->len;
+        *version = entry->version;
+        atomic_store_explicit(&entry->referenced, 1, memory_order_relaxed);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+
+    if (!copy) {
+        atomic_fetch_add_explicit(&shard->misses, 1, memory_order_relaxed);
+        return -1;
+    }
+    atomic_fetch_add_explicit(&shard->hits, 1, memory_order_relaxed);
+    *data = copy;
+    return 0;
+}
+
+int todo_cache_version(int id, time_t* version) {
+    if (!shards) {
+        return -1;
+    }
+
+    uint32_t hash = hash_id(id);
+    cache_shard_t* shard = shard_for(hash);
+    int found = 0;
+
+    pthread_rwlock_rdlock(&shard->lock);
+    cache_entry_t* entry = *find_slot(shard, id, hash);
+    if (entry) {
+        *version = entry->version;
+        atomic_store_explicit(&entry->referenced, 1, memory_order_relaxed);
+        found = 1;
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    return found ? 0 : -1;
+}
+
+uint64_t todo_cache_begin(int id) {
+    if (!shards) {
+        return 0;
+    }
+    return atomic_load_explicit(&shard_for(hash_id(id))->epoch, memory_order_acquire);
+}
+
+void todo_cache_put(int id, uint64_t token, time_t version, const char* data, size_t len) {
+    size_t charge = entry_charge(len);
+    if (!shards || charge > shard_capacity) {
+        return;
+    }
+
+    cache_entry_t* entry = malloc(charge);
+    if (!entry) {
+        return;
+    }
+    entry->id = id;
+    entry->version = version;
+    entry->len = len;
+    atomic_init(&entry->referenced, 0);
+    memcpy(entry->data, data, len);
+
+    uint32_t hash = hash_id(id);
+    cache_shard_t* shard = shard_for(hash);
+
+    pthread_rwlock_wrlock(&shard->lock);
+
+    // The epoch is per shard, so any write to the shard since the read began
+    // drops this value; that is rare enough not to matter for hit rate
+    if (atomic_load_explicit(&shard->epoch, memory_order_relaxed) != token) {
+        pthread_rwlock_unlock(&shard->lock);
+        free(entry);
+        return;
+    }
+
+    cache_entry_t** slot = find_slot(shard, id, hash);
+    if (*slot) {
+        remove_entry(shard, slot);
+    }
+    while (shard->hand && shard->bytes + charge > shard_capacity) {
+        evict_one(shard);
+    }
+    if (shard->count >= shard->bucket_mask + 1) {
+        grow_buckets(shard);
+    }
+
+    slot = &shard->buckets[(hash >> CACHE_SHARD_BITS) & shard->bucket_mask];
+    entry->hash_next = *slot;
+    *slot = entry;
+
+    // New entries go just behind the hand, so they get a full turn before eviction
+    if (shard->hand) {
+        entry->next = shard->hand;
+        entry->prev = shard->hand->prev;
+        shard->hand->prev->next = entry;
+        shard->hand->prev = entry;
+    } else {
+        entry->next = entry;
+        entry->prev = entry;
+        shard->hand = entry;
+    }
+
+    shard->count++;
+    shard->bytes += charge;
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+void todo_cache_invalidate(int id) {
+    if (!shards) {
+        return;
+    }
+
+    uint32_t hash = hash_id(id);
+    cache_shard_t* shard = shard_for(hash);
+
+    pthread_rwlock_wrlock(&shard->lock);
+    atomic_fetch_add_explicit(&shard->epoch, 1, memory_order_release);
+    cache_entry_t** slot = find_slot(shard, id, hash);
+    if (*slot) {
+        remove_entry(shard, slot);
+        atomic_fetch_add_explicit(&shard->invalidations, 1, memory_order_relaxed);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+void todo_cache_clear(void) {
+    if (!shards) {
+        return;
+    }
+
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard_t* shard = &shards[i];
+        pthread_rwlock_wrlock(&shard->lock);
+        atomic_fetch_add_explicit(&shard->epoch, 1, memory_order_release);
+        while (shard->hand) {
+            remove_entry(shard, find_slot(shard, shard->hand->id, hash_id(shard->hand->id)));
+            atomic_fetch_add_explicit(&shard->invalidations, 1, memory_order_relaxed);
+        }
+        pthread_rwlock_unlock(&shard->lock);
+    }
+}
+
+void todo_cache_stats(todo_cache_stats_t* stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (!shards) {
+        return;
+    }
+
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard_t* shard = &shards[i];
+        stats->hits += atomic_load_explicit(&shard->hits, memory_order_relaxed);
+        stats->misses += atomic_load_explicit(&shard->misses, memory_order_relaxed);
+        stats->evictions += atomic_load_explicit(&shard->evictions, memory_order_relaxed);
+        stats->invalidations += atomic_load_explicit(&shard->invalidations, memory_order_relaxed);
+
+        pthread_rwlock_rdlock(&shard->lock);
+        stats->entries += shard->count;
+        stats->bytes += shard->bytes;
+        pthread_rwlock_unlock(&shard->lock);
+    }
+    stats->capacity = shard_capacity * CACHE_SHARDS;
+}
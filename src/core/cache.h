@@ -0,0 +1,48 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Read-through cache of serialized todos keyed by id. Entries are spread over
+// independently locked shards and evicted with the CLOCK algorithm once the
+// memory budget is reached. Until todo_cache_init is called with a non-zero
+// budget every lookup misses and every store is dropped.
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t invalidations;
+    size_t entries;
+    size_t bytes;
+    size_t capacity;
+} todo_cache_stats_t;
+
+int todo_cache_init(size_t capacity);
+void todo_cache_cleanup(void);
+
+// Copies the cached body for id into a malloc'd buffer and reports the
+// version (updated_at) it was serialized from. Returns -1 on a miss.
+int todo_cache_get(int id, char** data, size_t* len, time_t* version);
+
+// Reports the cached version of id without copying the body. Not counted
+// in hits and misses: a conditional request that goes on to read the body
+// would otherwise be counted twice.
+int todo_cache_version(int id, time_t* version);
+
+// A token to pass to todo_cache_put, taken before reading the database so a
+// value that was invalidated during the read is not stored.
+uint64_t todo_cache_begin(int id);
+void todo_cache_put(int id, uint64_t token, time_t version, const char* data, size_t len);
+
+// Drops id from the cache. Call after the change is committed.
+void todo_cache_invalidate(int id);
+
+// Drops everything, for when the changes made elsewhere are not known
+void todo_cache_clear(void);
+
+void todo_cache_stats(todo_cache_stats_t* stats);
+
+#endif
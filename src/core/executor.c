@@ -0,0 +1,189 @@
+#include "executor.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef struct {
+    executor_fn fn;
+    void* arg;
+} executor_task_t;
+
+// The owner and thieves both take from the head, so a mutex per queue is
+// enough; it is only held to copy one task in or out.
+typedef struct {
+    pthread_mutex_t lock;
+    executor_task_t* tasks;
+    size_t head;
+    size_t count;
+    size_t capacity;
+    pthread_t thread;
+} executor_worker_t;
+
+static executor_worker_t* workers = NULL;
+static int worker_count = 0;                // Queues allocated
+static int thread_count = 0;                // Of which have a running thread
+static atomic_uint next_worker = 0;
+static atomic_int pending = 0;              // Queued tasks over all workers
+static atomic_int sleeping = 0;
+static atomic_int running = 0;
+static pthread_rwlock_t state_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+
+static int push(executor_worker_t* worker, executor_fn fn, void* arg, executor_fn claimed) {
+    int rc = -1;
+    pthread_mutex_lock(&worker->lock);
+    if (worker->count < worker->capacity) {
+        if (claimed) {
+            claimed(arg);
+        }
+        executor_task_t* task = &worker->tasks[(worker->head + worker->count) % worker->capacity];
+        task->fn = fn;
+        task->arg = arg;
+        worker->count++;
+        rc = 0;
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return rc;
+}
+
+static int take(executor_worker_t* worker, executor_task_t* task) {
+    int rc = -1;
+    pthread_mutex_lock(&worker->lock);
+    if (worker->count > 0) {
+        *task = worker->tasks[worker->head];
+        worker->head = (worker->head + 1) % worker->capacity;
+        worker->count--;
+        rc = 0;
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return rc;
+}
+
+// Own queue first, then the others starting from the next worker along
+static int find_task(int self, executor_task_t* task) {
+    for (int i = 0; i < worker_count; i++) {
+        if (take(&workers[(self + i) % worker_count], task) == 0) {
+            atomic_fetch_sub(&pending, 1);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void* worker_main(void* arg) {
+    int self = (int)(intptr_t)arg;
+    executor_task_t task;
+
+    for (;;) {
+        if (find_task(self, &task) == 0) {
+            task.fn(task.arg);
+            continue;
+        }
+
+        // Announcing the sleep before the final check pairs with the
+        // submitter's increment of pending before it checks for sleepers
+        pthread_mutex_lock(&idle_lock);
+        atomic_fetch_add(&sleeping, 1);
+        while (atomic_load(&pending) <= 0 && atomic_load(&running)) {
+            pthread_cond_wait(&idle_cond, &idle_lock);
+        }
+        atomic_fetch_sub(&sleeping, 1);
+        int stop = atomic_load(&pending) <= 0 && !atomic_load(&running);
+        pthread_mutex_unlock(&idle_lock);
+        if (stop) {
+            return NULL;
+        }
+    }
+}
+
+int executor_start(int threads, int queue_capacity) {
+    if (threads <= 0 || queue_capacity < threads) {
+        return -1;
+    }
+    workers = calloc((size_t)threads, sizeof(executor_worker_t));
+    if (!workers) {
+        return -1;
+    }
+
+    size_t capacity = (size_t)(queue_capacity / threads);
+    for (worker_count = 0; worker_count < threads; worker_count++) {
+        executor_worker_t* worker = &workers[worker_count];
+        pthread_mutex_init(&worker->lock, NULL);
+        worker->capacity = capacity;
+        worker->tasks = calloc(capacity, sizeof(executor_task_t));
+    }
+
+    pthread_rwlock_wrlock(&state_lock);
+    atomic_store(&running, 1);
+    pthread_rwlock_unlock(&state_lock);
+
+    for (thread_count = 0; thread_count < threads; thread_count++) {
+        executor_worker_t* worker = &workers[thread_count];
+        if (!worker->tasks ||
+            pthread_create(&worker->thread, NULL, worker_main, (void*)(intptr_t)thread_count) != 0) {
+            break;
+        }
+    }
+    if (thread_count < threads) {
+        executor_stop();
+        return -1;
+    }
+    return 0;
+}
+
+void executor_stop(void) {
+    pthread_rwlock_wrlock(&state_lock);
+    if (!workers) {
+        pthread_rwlock_unlock(&state_lock);
+        return;
+    }
+    atomic_store(&running, 0);
+    pthread_rwlock_unlock(&state_lock);
+
+    // Nothing can be queued any more; workers finish what is there and exit
+    pthread_mutex_lock(&idle_lock);
+    pthread_cond_broadcast(&idle_cond);
+    pthread_mutex_unlock(&idle_lock);
+
+    for (int i = 0; i < thread_count; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    for (int i = 0; i < worker_count; i++) {
+        pthread_mutex_destroy(&workers[i].lock);
+        free(workers[i].tasks);
+    }
+    free(workers);
+    workers = NULL;
+    worker_count = 0;
+    thread_count = 0;
+}
+
+int executor_submit(executor_fn fn, void* arg) {
+    return executor_submit_claimed(fn, arg, NULL);
+}
+
+int executor_submit_claimed(executor_fn fn, void* arg, executor_fn claimed) {
+    pthread_rwlock_rdlock(&state_lock);
+    if (!atomic_load(&running)) {
+        pthread_rwlock_unlock(&state_lock);
+        return -1;
+    }
+
+    unsigned int start = atomic_fetch_add_explicit(&next_worker, 1, memory_order_relaxed);
+    int rc = -1;
+    for (int i = 0; rc != 0 && i < worker_count; i++) {
+        rc = push(&workers[(start + (unsigned int)i) % (unsigned int)worker_count], fn, arg, claimed);
+    }
+    if (rc == 0) {
+        atomic_fetch_add(&pending, 1);
+        if (atomic_load(&sleeping) > 0) {
+            pthread_mutex_lock(&idle_lock);
+            pthread_cond_signal(&idle_cond);
+            pthread_mutex_unlock(&idle_lock);
+        }
+    }
+    pthread_rwlock_unlock(&state_lock);
+    return rc;
+}
@@ -0,0 +1,27 @@
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+// A fixed pool of worker threads for blocking work, such as database calls
+// made on behalf of requests. Each worker has its own bounded queue; tasks
+// are spread over the queues round robin, and a worker whose queue is empty
+// steals from the others before going to sleep. Tasks run oldest first.
+
+typedef void (*executor_fn)(void* arg);
+
+// Starts threads workers, each queueing up to queue_capacity / threads tasks
+int executor_start(int threads, int queue_capacity);
+
+// Runs every task already queued, then stops the workers. Later submissions
+// are refused.
+void executor_stop(void);
+
+// Queues fn(arg). Returns -1 if every queue is full or the executor is not
+// running, in which case fn will not be called.
+int executor_submit(executor_fn fn, void* arg);
+
+// Like executor_submit, but once a slot is claimed, and before any worker
+// can run the task, calls claimed(arg) with the queue locked. Nothing is
+// called if the task is refused.
+int executor_submit_claimed(executor_fn fn, void* arg, executor_fn claimed);
+
+#endif
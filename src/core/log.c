@@ -0,0 +1,200 @@
+#include "log.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define LOG_RING_SLOTS 512
+#define LOG_MESSAGE_SIZE 240
+#define LOG_IDLE_SLEEP_NS (5 * 1000 * 1000)
+#define LOG_CACHE_LINE 64
+
+typedef struct {
+    struct timespec time;
+    int level;
+    int len;
+    char text[LOG_MESSAGE_SIZE];
+} log_record_t;
+
+// Single-producer single-consumer ring. The owning thread advances head,
+// the writer thread advances tail. A ring whose thread has exited is marked
+// closed and handed to the next thread that needs one once it is drained.
+typedef struct log_ring {
+    _Alignas(LOG_CACHE_LINE) atomic_size_t head;
+    _Alignas(LOG_CACHE_LINE) atomic_size_t tail;
+    atomic_int closed;
+    atomic_ulong dropped;
+    struct log_ring* next;
+    log_record_t slots[LOG_RING_SLOTS];
+} log_ring_t;
+
+static _Atomic(log_ring_t*) rings = NULL;
+static atomic_int running = 0;
+static atomic_int min_level = LOG_LEVEL_DEBUG;
+static pthread_t writer_thread;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local log_ring_t* thread_ring = NULL;
+
+static const char* const level_names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+static void release_ring(void* ptr) {
+    log_ring_t* ring = ptr;
+    atomic_store_explicit(&ring->closed, 1, memory_order_release);
+}
+
+static void create_ring_key(void) {
+    pthread_key_create(&ring_key, release_ring);
+}
+
+static log_ring_t* acquire_ring(void) {
+    if (thread_ring) {
+        return thread_ring;
+    }
+    pthread_once(&ring_key_once, create_ring_key);
+
+    // Reuse a drained ring left behind by an exited thread
+    for (log_ring_t* ring = atomic_load_explicit(&rings, memory_order_acquire); ring; ring = ring->next) {
+        int closed = 1;
+        if (atomic_load_explicit(&ring->head, memory_order_relaxed) ==
+                atomic_load_explicit(&ring->tail, memory_order_acquire) &&
+            atomic_compare_exchange_strong(&ring->closed, &closed, 0)) {
+            thread_ring = ring;
+            pthread_setspecific(ring_key, ring);
+            return ring;
+        }
+    }
+
+    log_ring_t* ring = aligned_alloc(LOG_CACHE_LINE, sizeof(log_ring_t));
+    if (!ring) {
+        return NULL;
+    }
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->closed, 0);
+    atomic_init(&ring->dropped, 0);
+
+    ring->next = atomic_load_explicit(&rings, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&rings, &ring->next, ring,
+                                                  memory_order_release, memory_order_relaxed)) {
+    }
+
+    thread_ring = ring;
+    pthread_setspecific(ring_key, ring);
+    return ring;
+}
+
+static void write_line(FILE* out, const struct timespec* time, int level, const char* text, int len) {
+    struct tm tm;
+    gmtime_r(&time->tv_sec, &tm);
+    fprintf(out, "%04d-%02d-%02dT%02d:%02d:%02d.%03ldZ %-5s %.*s\n",
+            tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+            time->tv_nsec / 1000000, level_names[level], len, text);
+}
+
+// Writes out everything queued in one ring. Returns the number of records.
+static int drain_ring(log_ring_t* ring, FILE* out) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    int count = 0;
+
+    for (; tail != head; tail++, count++) {
+        const log_record_t* record = &ring->slots[tail % LOG_RING_SLOTS];
+        write_line(out, &record->time, record->level, record->text, record->len);
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+    unsigned long dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+    if (dropped) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        char text[64];
+        int len = snprintf(text, sizeof(text), "log ring full, dropped %lu messages", dropped);
+        write_line(out, &now, LOG_LEVEL_WARN, text, len);
+    }
+    return count;
+}
+
+static int drain_all(FILE* out) {
+    int count = 0;
+    for (log_ring_t* ring = atomic_load_explicit(&rings, memory_order_acquire); ring; ring = ring->next) {
+        count += drain_ring(ring, out);
+    }
+    if (count) {
+        fflush(out);
+    }
+    return count;
+}
+
+static void* writer_main(void* arg) {
+    (void)arg;
+    const struct timespec idle = {0, LOG_IDLE_SLEEP_NS};
+
+    while (atomic_load_explicit(&running, memory_order_acquire)) {
+        if (drain_all(stderr) == 0) {
+            nanosleep(&idle, NULL);
+        }
+    }
+
+    // Flush what producers queued before they saw the shutdown
+    while (drain_all(stderr) > 0) {
+    }
+    return NULL;
+}
+
+int log_start(int level) {
+    atomic_store(&min_level, level);
+    if (atomic_exchange(&running, 1)) {
+        return 0;
+    }
+    if (pthread_create(&writer_thread, NULL, writer_main, NULL) != 0) {
+        atomic_store(&running, 0);
+        return -1;
+    }
+    return 0;
+}
+
+void log_stop(void) {
+    if (!atomic_exchange(&running, 0)) {
+        return;
+    }
+    pthread_join(writer_thread, NULL);
+}
+
+void log_write(int level, const char* format, ...) {
+    if (level < atomic_load_explicit(&min_level, memory_order_relaxed) || level >= LOG_LEVEL_OFF) {
+        return;
+    }
+
+    va_list args;
+    va_start(args, format);
+
+    log_ring_t* ring = atomic_load_explicit(&running, memory_order_acquire) ? acquire_ring() : NULL;
+    if (!ring) {
+        struct timespec now;
+        char text[LOG_MESSAGE_SIZE];
+        clock_gettime(CLOCK_REALTIME, &now);
+        int len = vsnprintf(text, sizeof(text), format, args);
+        write_line(stderr, &now, level, text, len < 0 ? 0 : len >= (int)sizeof(text) ? (int)sizeof(text) - 1 : len);
+        va_end(args);
+        return;
+    }
+
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == LOG_RING_SLOTS) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        va_end(args);
+        return;
+    }
+
+    log_record_t* record = &ring->slots[head % LOG_RING_SLOTS];
+    clock_gettime(CLOCK_REALTIME, &record->time);
+    record->level = level;
+    int len = vsnprintf(record->text, sizeof(record->text), format, args);
+    record->len = len < 0 ? 0 : len >= (int)sizeof(record->text) ? (int)sizeof(record->text) - 1 : len;
+    va_end(args);
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
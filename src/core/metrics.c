@@ -0,0 +1,373 @@
+#include "metrics.h"
+#include "cache.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define METRICS_BUCKETS 48          // 1us to 12.6s; slower samples only reach +Inf
+#define METRICS_BUCKET_UNIT 500     // Bucket bounds are multiples of 500ns
+
+typedef atomic_uint_fast64_t counter_t;
+
+typedef struct {
+    counter_t count;
+    counter_t sum;
+    counter_t buckets[METRICS_BUCKETS + 1];    // The last one is the overflow
+} histogram_t;
+
+static const int status_codes[] = {200, 201, 204, 304, 400, 404, 405, 412, 413, 429, 500, 503};
+#define STATUS_SLOTS ((int)(sizeof(status_codes) / sizeof(status_codes[0])) + 1)
+
+// Written only by the owning thread, read by scrapes. Like log rings, the
+// block of an exited thread is adopted by the next new thread, so its
+// counts are never lost and the list does not grow with thread churn.
+typedef struct metrics_shard {
+    counter_t requests[METRICS_ROUTE_COUNT][STATUS_SLOTS];
+    histogram_t phases[METRICS_ROUTE_COUNT][METRICS_PHASE_COUNT];
+    histogram_t db[METRICS_DB_OP_COUNT];
+    counter_t requests_started;
+    counter_t requests_finished;
+    counter_t connections_opened;
+    counter_t connections_closed;
+    atomic_int closed;
+    struct metrics_shard* next;
+} metrics_shard_t;
+
+static _Atomic(metrics_shard_t*) shards = NULL;
+static pthread_key_t shard_key;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local metrics_shard_t* thread_shard = NULL;
+static _Thread_local uint64_t thread_db_time = 0;
+
+static const struct {
+    const char* method;
+    const char* path;
+} route_labels[METRICS_ROUTE_COUNT] = {
+    {"GET", "/todos"},
+    {"GET", "/todos/:id"},
+    {"GET", "/todos/search"},
+    {"GET", "/todos/changes"},
+    {"POST", "/todos"},
+    {"POST", "/todos/batch"},
+    {"GET", "/todos/export"},
+    {"POST", "/todos/import"},
+    {"PUT", "/todos/:id"},
+    {"DELETE", "/todos/:id"},
+    {"DELETE", "/todos"},
+    {"PATCH", "/todos"},
+    {"GET", "/stats"},
+    {"GET", "/metrics"},
+    {"other", "unmatched"},
+};
+
+static const char* const phase_labels[METRICS_PHASE_COUNT] = {"parse", "queue", "db", "serialize", "send"};
+
+static const char* const db_op_labels[METRICS_DB_OP_COUNT] = {
+    "get", "get_version", "list", "page", "search", "changes", "write", "commit", "import",
+};
+
+static void release_shard(void* ptr) {
+    metrics_shard_t* shard = ptr;
+    atomic_store_explicit(&shard->closed, 1, memory_order_release);
+}
+
+static void create_shard_key(void) {
+    pthread_key_create(&shard_key, release_shard);
+}
+
+static metrics_shard_t* acquire_shard(void) {
+    if (thread_shard) {
+        return thread_shard;
+    }
+    pthread_once(&shard_key_once, create_shard_key);
+
+    metrics_shard_t* shard;
+    for (shard = atomic_load_explicit(&shards, memory_order_acquire); shard; shard = shard->next) {
+        int closed = 1;
+        if (atomic_compare_exchange_strong(&shard->closed, &closed, 0)) {
+            break;
+        }
+    }
+
+    if (!shard) {
+        shard = calloc(1, sizeof(metrics_shard_t));
+        if (!shard) {
+            return NULL;
+        }
+        shard->next = atomic_load_explicit(&shards, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&shards, &shard->next, shard,
+                                                      memory_order_release, memory_order_relaxed)) {
+        }
+    }
+
+    thread_shard = shard;
+    pthread_setspecific(shard_key, shard);
+    return shard;
+}
+
+// Single writer, so a plain load and store is enough and avoids a locked add
+static void bump(counter_t* counter, uint64_t value) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value,
+                          memory_order_relaxed);
+}
+
+static uint64_t load(counter_t* counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+// Upper bound of bucket k: 1us, 1.5us, 2us, 3us, 4us, 6us, ...
+static uint64_t bucket_bound(int k) {
+    return ((uint64_t)(2 + (k & 1)) << (k >> 1)) * METRICS_BUCKET_UNIT;
+}
+
+// Index of the first bucket whose bound is at least elapsed
+static int bucket_index(uint64_t elapsed) {
+    uint64_t units = (elapsed + METRICS_BUCKET_UNIT - 1) / METRICS_BUCKET_UNIT;
+    if (units <= 2) {
+        return 0;
+    }
+
+    // 2^e < units <= 2^(e+1); the half step between is 3 * 2^(e-1)
+    int e = 63 - __builtin_clzll(units - 1);
+    int k = units <= (3ull << (e - 1)) ? 2 * e - 1 : 2 * e;
+    return k < METRICS_BUCKETS ? k : METRICS_BUCKETS;
+}
+
+static void observe(histogram_t* histogram, uint64_t elapsed) {
+    bump(&histogram->count, 1);
+    bump(&histogram->sum, elapsed);
+    bump(&histogram->buckets[bucket_index(elapsed)], 1);
+}
+
+static int status_slot(int status) {
+    for (int i = 0; i < STATUS_SLOTS - 1; i++) {
+        if (status_codes[i] == status) {
+            return i;
+        }
+    }
+    return STATUS_SLOTS - 1;
+}
+
+uint64_t metrics_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+void metrics_record_request(metrics_route_t route, int status, const uint64_t phases[METRICS_PHASE_COUNT]) {
+    metrics_shard_t* shard = acquire_shard();
+    if (!shard || route < 0 || route >= METRICS_ROUTE_COUNT) {
+        return;
+    }
+
+    bump(&shard->requests[route][status_slot(status)], 1);
+    for (int i = 0; i < METRICS_PHASE_COUNT; i++) {
+        observe(&shard->phases[route][i], phases[i]);
+    }
+}
+
+void metrics_record_db(metrics_db_op_t op, uint64_t elapsed) {
+    metrics_shard_t* shard = acquire_shard();
+    thread_db_time += elapsed;
+    if (shard) {
+        observe(&shard->db[op], elapsed);
+    }
+}
+
+uint64_t metrics_thread_db_time(void) {
+    return thread_db_time;
+}
+
+static void bump_gauge(size_t offset) {
+    metrics_shard_t* shard = acquire_shard();
+    if (shard) {
+        bump((counter_t*)((char*)shard + offset), 1);
+    }
+}
+
+void metrics_request_started(void) {
+    bump_gauge(offsetof(metrics_shard_t, requests_started));
+}
+
+void metrics_request_finished(void) {
+    bump_gauge(offsetof(metrics_shard_t, requests_finished));
+}
+
+void metrics_connection_opened(void) {
+    bump_gauge(offsetof(metrics_shard_t, connections_opened));
+}
+
+void metrics_connection_closed(void) {
+    bump_gauge(offsetof(metrics_shard_t, connections_closed));
+}
+
+uint64_t metrics_requests_in_flight(void) {
+    uint64_t started = 0, finished = 0;
+    for (metrics_shard_t* shard = atomic_load_explicit(&shards, memory_order_acquire); shard; shard = shard->next) {
+        started += load(&shard->requests_started);
+        finished += load(&shard->requests_finished);
+    }
+    return started > finished ? started - finished : 0;
+}
+
+static void merge_histogram(histogram_t* total, histogram_t* histogram) {
+    bump(&total->count, load(&histogram->count));
+    bump(&total->sum, load(&histogram->sum));
+    for (int i = 0; i <= METRICS_BUCKETS; i++) {
+        bump(&total->buckets[i], load(&histogram->buckets[i]));
+    }
+}
+
+static void merge_shard(metrics_shard_t* total, metrics_shard_t* shard) {
+    for (int route = 0; route < METRICS_ROUTE_COUNT; route++) {
+        for (int i = 0; i < STATUS_SLOTS; i++) {
+            bump(&total->requests[route][i], load(&shard->requests[route][i]));
+        }
+        for (int phase = 0; phase < METRICS_PHASE_COUNT; phase++) {
+            merge_histogram(&total->phases[route][phase], &shard->phases[route][phase]);
+        }
+    }
+    for (int op = 0; op < METRICS_DB_OP_COUNT; op++) {
+        merge_histogram(&total->db[op], &shard->db[op]);
+    }
+    bump(&total->requests_started, load(&shard->requests_started));
+    bump(&total->requests_finished, load(&shard->requests_finished));
+    bump(&total->connections_opened, load(&shard->connections_opened));
+    bump(&total->connections_closed, load(&shard->connections_closed));
+}
+
+// Writes one histogram series. Samples are taken from separate counters
+// without a snapshot, so the +Inf bucket is reported as the bucket total to
+// keep the series consistent.
+static void write_histogram(FILE* out, const char* name, const char* labels, histogram_t* histogram) {
+    uint64_t cumulative = 0;
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        cumulative += load(&histogram->buckets[i]);
+        fprintf(out, "%s_bucket{%s,le=\"%.7g\"} %llu\n", name, labels,
+                (double)bucket_bound(i) / 1e9, (unsigned long long)cumulative);
+    }
+    cumulative += load(&histogram->buckets[METRICS_BUCKETS]);
+    fprintf(out, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, labels, (unsigned long long)cumulative);
+    fprintf(out, "%s_sum{%s} %.9f\n", name, labels, (double)load(&histogram->sum) / 1e9);
+    fprintf(out, "%s_count{%s} %llu\n", name, labels, (unsigned long long)cumulative);
+}
+
+static void write_metrics(FILE* out, metrics_shard_t* total) {
+    char labels[128];
+
+    fputs("# HELP todo_http_requests_total HTTP requests by route and status code.\n"
+          "# TYPE todo_http_requests_total counter\n", out);
+    for (int route = 0; route < METRICS_ROUTE_COUNT; route++) {
+        for (int i = 0; i < STATUS_SLOTS; i++) {
+            uint64_t count = load(&total->requests[route][i]);
+            if (count == 0) {
+                continue;
+            }
+            char code[16];
+            if (i < STATUS_SLOTS - 1) {
+                snprintf(code, sizeof(code), "%d", status_codes[i]);
+            } else {
+                snprintf(code, sizeof(code), "other");
+            }
+            fprintf(out, "todo_http_requests_total{method=\"%s\",route=\"%s\",code=\"%s\"} %llu\n",
+                    route_labels[route].method, route_labels[route].path, code, (unsigned long long)count);
+        }
+    }
+
+    fputs("# HELP todo_http_request_phase_seconds Time spent in each phase of a request.\n"
+          "# TYPE todo_http_request_phase_seconds histogram\n", out);
+    for (int route = 0; route < METRICS_ROUTE_COUNT; route++) {
+        for (int phase = 0; phase < METRICS_PHASE_COUNT; phase++) {
+            if (load(&total->phases[route][phase].count) == 0) {
+                continue;
+            }
+            snprintf(labels, sizeof(labels), "method=\"%s\",route=\"%s\",phase=\"%s\"",
+                     route_labels[route].method, route_labels[route].path, phase_labels[phase]);
+            write_histogram(out, "todo_http_request_phase_seconds", labels, &total->phases[route][phase]);
+        }
+    }
+
+    fputs("# HELP todo_db_operation_seconds Time spent in SQLite by operation.\n"
+          "# TYPE todo_db_operation_seconds histogram\n", out);
+    for (int op = 0; op < METRICS_DB_OP_COUNT; op++) {
+        if (load(&total->db[op].count) == 0) {
+            continue;
+        }
+        snprintf(labels, sizeof(labels), "op=\"%s\"", db_op_labels[op]);
+        write_histogram(out, "todo_db_operation_seconds", labels, &total->db[op]);
+    }
+
+    fprintf(out,
+            "# HELP todo_http_connections_active Open client connections.\n"
+            "# TYPE todo_http_connections_active gauge\n"
+            "todo_http_connections_active %lld\n"
+            "# HELP todo_http_requests_active Requests received but not yet completed.\n"
+            "# TYPE todo_http_requests_active gauge\n"
+            "todo_http_requests_active %lld\n",
+            (long long)(load(&total->connections_opened) - load(&total->connections_closed)),
+            (long long)(load(&total->requests_started) - load(&total->requests_finished)));
+
+    todo_cache_stats_t cache;
+    todo_cache_stats(&cache);
+    fprintf(out,
+            "# HELP todo_cache_hits_total Todo cache hits.\n"
+            "# TYPE todo_cache_hits_total counter\n"
+            "todo_cache_hits_total %llu\n"
+            "# HELP todo_cache_misses_total Todo cache misses.\n"
+            "# TYPE todo_cache_misses_total counter\n"
+            "todo_cache_misses_total %llu\n"
+            "# HELP todo_cache_evictions_total Entries evicted to stay within the budget.\n"
+            "# TYPE todo_cache_evictions_total counter\n"
+            "todo_cache_evictions_total %llu\n"
+            "# HELP todo_cache_invalidations_total Entries dropped because the todo changed.\n"
+            "# TYPE todo_cache_invalidations_total counter\n"
+            "todo_cache_invalidations_total %llu\n"
+            "# HELP todo_cache_entries Entries in the todo cache.\n"
+            "# TYPE todo_cache_entries gauge\n"
+            "todo_cache_entries %zu\n"
+            "# HELP todo_cache_bytes Memory charged to the todo cache.\n"
+            "# TYPE todo_cache_bytes gauge\n"
+            "todo_cache_bytes %zu\n"
+            "# HELP todo_cache_capacity_bytes Todo cache memory budget.\n"
+            "# TYPE todo_cache_capacity_bytes gauge\n"
+            "todo_cache_capacity_bytes %zu\n",
+            (unsigned long long)cache.hits, (unsigned long long)cache.misses,
+            (unsigned long long)cache.evictions, (unsigned long long)cache.invalidations,
+            cache.entries, cache.bytes, cache.capacity);
+}
+
+int metrics_render(char** data, size_t* size) {
+    metrics_shard_t* total = calloc(1, sizeof(metrics_shard_t));
+    if (!total) {
+        return -1;
+    }
+    for (metrics_shard_t* shard = atomic_load_explicit(&shards, memory_order_acquire); shard; shard = shard->next) {
+        merge_shard(total, shard);
+    }
+
+    char* buffer = NULL;
+    size_t length = 0;
+    FILE* out = open_memstream(&buffer, &length);
+    if (!out) {
+        free(total);
+        return -1;
+    }
+    write_metrics(out, total);
+    free(total);
+
+    if (ferror(out)) {
+        fclose(out);
+        free(buffer);
+        return -1;
+    }
+    if (fclose(out) != 0) {
+        free(buffer);
+        return -1;
+    }
+
+    *data = buffer;
+    *size = length;
+    return 0;
+}
@@ -0,0 +1,80 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Request, database and connection metrics. Every thread records into its
+// own block of counters without atomic read-modify-write or locks; a scrape
+// sums all blocks and renders them in the Prometheus text format. Durations
+// are in nanoseconds and land in log-linear histogram buckets, two per
+// power of two from 1us up.
+
+typedef enum {
+    METRICS_ROUTE_LIST_TODOS,       // GET /todos
+    METRICS_ROUTE_GET_TODO,         // GET /todos/:id
+    METRICS_ROUTE_SEARCH_TODOS,     // GET /todos/search
+    METRICS_ROUTE_CHANGES,          // GET /todos/changes
+    METRICS_ROUTE_CREATE_TODO,      // POST /todos
+    METRICS_ROUTE_BATCH_TODOS,      // POST /todos/batch
+    METRICS_ROUTE_EXPORT_TODOS,     // GET /todos/export
+    METRICS_ROUTE_IMPORT_TODOS,     // POST /todos/import
+    METRICS_ROUTE_UPDATE_TODO,      // PUT /todos/:id
+    METRICS_ROUTE_DELETE_TODO,      // DELETE /todos/:id
+    METRICS_ROUTE_DELETE_TODOS,     // DELETE /todos
+    METRICS_ROUTE_PATCH_TODOS,      // PATCH /todos
+    METRICS_ROUTE_STATS,            // GET /stats
+    METRICS_ROUTE_METRICS,          // GET /metrics
+    METRICS_ROUTE_OTHER,            // Anything unrouted
+    METRICS_ROUTE_COUNT
+} metrics_route_t;
+
+typedef enum {
+    METRICS_PHASE_PARSE,            // Headers and body received, up to dispatch
+    METRICS_PHASE_QUEUE,            // Waiting for an executor thread
+    METRICS_PHASE_DB,               // Inside database calls made by the handler
+    METRICS_PHASE_SERIALIZE,        // The rest of the handler
+    METRICS_PHASE_SEND,             // Response queued until the request completes
+    METRICS_PHASE_COUNT
+} metrics_phase_t;
+
+typedef enum {
+    METRICS_DB_GET,                 // Single todo read
+    METRICS_DB_GET_VERSION,         // updated_at lookup
+    METRICS_DB_LIST,                // Full table read
+    METRICS_DB_PAGE,                // Keyset page walk, stepping time only
+    METRICS_DB_SEARCH,              // Full-text search page, stepping time only
+    METRICS_DB_CHANGES,             // Change log read, stepping time only
+    METRICS_DB_WRITE,               // Write submitted to the writer, including queueing
+    METRICS_DB_COMMIT,              // One group commit on the writer thread
+    METRICS_DB_IMPORT,              // One bulk import transaction
+    METRICS_DB_OP_COUNT
+} metrics_db_op_t;
+
+// Monotonic clock in nanoseconds
+uint64_t metrics_now(void);
+
+void metrics_record_request(metrics_route_t route, int status, const uint64_t phases[METRICS_PHASE_COUNT]);
+
+// Records a database operation and adds its duration to the calling thread's
+// running database time
+void metrics_record_db(metrics_db_op_t op, uint64_t elapsed);
+
+// Total database time recorded by the calling thread; handlers take the
+// difference across a call to split database time from the rest
+uint64_t metrics_thread_db_time(void);
+
+void metrics_request_started(void);
+void metrics_request_finished(void);
+void metrics_connection_opened(void);
+void metrics_connection_closed(void);
+
+// Requests started and not yet completed, summed over all threads. Meant
+// for occasional polling, such as waiting for a shutdown drain.
+uint64_t metrics_requests_in_flight(void);
+
+// Renders all metrics, including the todo cache counters, as Prometheus
+// text into a malloc'd buffer
+int metrics_render(char** data, size_t* size);
+
+#endif
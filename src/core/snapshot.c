@@ -0,0 +1,299 @@
+#include "snapshot.h"
+#include "log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define RECORD_FIXED_SIZE (4 + 1 + 8 + 8 + 4 + 4)     // Everything after the length but the strings
+#define SNAPSHOT_MAGIC "TODOSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_BYTE_ORDER 0x01020304u
+#define SNAPSHOT_COPY_SIZE (64 * 1024)
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;            // SNAPSHOT_BYTE_ORDER as the writing host stores it
+    uint64_t count;
+    uint64_t records_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+} snapshot_header_t;
+
+typedef struct {
+    int64_t created_at;
+    int64_t updated_at;
+    uint64_t title_offset;          // From the start of the strings
+    uint64_t description_offset;
+    uint32_t title_len;
+    uint32_t description_len;
+    int32_t id;
+    int32_t completed;
+} snapshot_record_t;
+
+static char* put_u32(char* out, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        *out++ = (char)(value >> (8 * i));
+    }
+    return out;
+}
+
+static char* put_u64(char* out, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        *out++ = (char)(value >> (8 * i));
+    }
+    return out;
+}
+
+static uint32_t get_u32(const char* in) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) {
+        value |= (uint32_t)(unsigned char)in[i] << (8 * i);
+    }
+    return value;
+}
+
+static uint64_t get_u64(const char* in) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value |= (uint64_t)(unsigned char)in[i] << (8 * i);
+    }
+    return value;
+}
+
+size_t todo_record_size(const todo_t* todo) {
+    return 4 + RECORD_FIXED_SIZE + todo->title_len + todo->description_len + 2;
+}
+
+void todo_record_write(const todo_t* todo, char* out) {
+    out = put_u32(out, (uint32_t)(todo_record_size(todo) - 4));
+    out = put_u32(out, (uint32_t)todo->id);
+    *out++ = (char)(todo->completed != 0);
+    out = put_u64(out, (uint64_t)todo->created_at);
+    out = put_u64(out, (uint64_t)todo->updated_at);
+    out = put_u32(out, (uint32_t)todo->title_len);
+    memcpy(out, todo->title, todo->title_len);
+    out += todo->title_len;
+    *out++ = '\0';
+    out = put_u32(out, (uint32_t)todo->description_len);
+    memcpy(out, todo->description, todo->description_len);
+    out[todo->description_len] = '\0';
+}
+
+long long todo_record_read(const char* data, size_t len, todo_t* todo) {
+    if (len < 4) {
+        return 0;
+    }
+    uint64_t size = 4 + (uint64_t)get_u32(data);
+    if (size < 4 + RECORD_FIXED_SIZE + 2) {
+        return -1;
+    }
+    if (len < size) {
+        return 0;
+    }
+
+    const char* p = data + 4;
+    const char* end = data + size;
+    todo->id = (int)get_u32(p);
+    todo->completed = p[4] != 0;
+    todo->created_at = (time_t)(int64_t)get_u64(p + 5);
+    todo->updated_at = (time_t)(int64_t)get_u64(p + 13);
+    todo->title_len = get_u32(p + 21);
+    p += 25;
+    if ((size_t)(end - p) < todo->title_len + 1 + 4 || p[todo->title_len] != '\0') {
+        return -1;
+    }
+    todo->title = p;
+    p += todo->title_len + 1;
+
+    todo->description_len = get_u32(p);
+    p += 4;
+    if ((size_t)(end - p) != todo->description_len + 1 || p[todo->description_len] != '\0' || todo->id < 0) {
+        return -1;
+    }
+    todo->description = p;
+    return (long long)size;
+}
+
+// Records go to the snapshot as they are visited; strings go to a scratch
+// file that is appended once the record count, and so its offset, is known
+struct SnapshotWriter {
+    FILE* out;
+    FILE* strings;
+    uint64_t strings_size;
+    uint64_t count;
+};
+
+static int write_snapshot_record(const todo_t* todo, void* ctx) {
+    struct SnapshotWriter* writer = ctx;
+    snapshot_record_t record = {
+        .created_at = todo->created_at,
+        .updated_at = todo->updated_at,
+        .title_offset = writer->strings_size,
+        .description_offset = writer->strings_size + todo->title_len + 1,
+        .title_len = (uint32_t)todo->title_len,
+        .description_len = (uint32_t)todo->description_len,
+        .id = todo->id,
+        .completed = todo->completed != 0,
+    };
+
+    if (fwrite(&record, sizeof(record), 1, writer->out) != 1 ||
+        fwrite(todo->title, 1, todo->title_len + 1, writer->strings) != todo->title_len + 1 ||
+        fwrite(todo->description, 1, todo->description_len + 1, writer->strings) != todo->description_len + 1) {
+        return -1;
+    }
+    writer->strings_size += todo->title_len + todo->description_len + 2;
+    writer->count++;
+    return 0;
+}
+
+static int copy_file(FILE* from, FILE* to) {
+    char buf[SNAPSHOT_COPY_SIZE];
+    size_t len;
+    rewind(from);
+    while ((len = fread(buf, 1, sizeof(buf), from)) > 0) {
+        if (fwrite(buf, 1, len, to) != len) {
+            return -1;
+        }
+    }
+    return ferror(from) ? -1 : 0;
+}
+
+long long todo_snapshot_save(const char* path) {
+    char tmp_path[4096];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path)) {
+        return -1;
+    }
+
+    struct SnapshotWriter writer = {fopen(tmp_path, "wb"), tmpfile(), 0, 0};
+    snapshot_header_t header = {0};
+    int rc = writer.out && writer.strings ? 0 : -1;
+
+    // One statement over the whole table, so the snapshot is consistent
+    todo_query_t query = {0};
+    if (rc == 0 && (fwrite(&header, sizeof(header), 1, writer.out) != 1 ||
+                    todo_each(&query, write_snapshot_record, &writer) < 0 ||
+                    copy_file(writer.strings, writer.out) != 0)) {
+        rc = -1;
+    }
+
+    if (rc == 0) {
+        memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+        header.version = SNAPSHOT_VERSION;
+        header.byte_order = SNAPSHOT_BYTE_ORDER;
+        header.count = writer.count;
+        header.records_offset = sizeof(header);
+        header.strings_offset = sizeof(header) + writer.count * sizeof(snapshot_record_t);
+        header.strings_size = writer.strings_size;
+        if (fseek(writer.out, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, writer.out) != 1 ||
+            fflush(writer.out) != 0 || fsync(fileno(writer.out)) != 0) {
+            rc = -1;
+        }
+    }
+
+    if (writer.strings) {
+        fclose(writer.strings);
+    }
+    if (writer.out && fclose(writer.out) != 0) {
+        rc = -1;
+    }
+    if (rc == 0 && rename(tmp_path, path) != 0) {
+        rc = -1;
+    }
+    if (rc != 0) {
+        LOG_ERROR("Failed to write snapshot %s: %s", path, strerror(errno));
+        unlink(tmp_path);
+        return -1;
+    }
+    return (long long)writer.count;
+}
+
+struct SnapshotMap {
+    const snapshot_record_t* records;
+    const char* strings;
+    uint64_t strings_size;
+};
+
+// Offsets come from the file, so every string is checked to lie inside the
+// string area and end in its NUL
+static int snapshot_string(const struct SnapshotMap* map, uint64_t offset, uint32_t len, const char** out) {
+    if (offset >= map->strings_size || map->strings_size - offset <= len || map->strings[offset + len] != '\0') {
+        return -1;
+    }
+    *out = map->strings + offset;
+    return 0;
+}
+
+static int snapshot_row(void* ctx, long long index, todo_t* todo) {
+    const struct SnapshotMap* map = ctx;
+    const snapshot_record_t* record = &map->records[index];
+    todo->id = record->id;
+    todo->completed = record->completed != 0;
+    todo->created_at = (time_t)record->created_at;
+    todo->updated_at = (time_t)record->updated_at;
+    todo->title_len = record->title_len;
+    todo->description_len = record->description_len;
+    if (record->id <= 0 ||
+        snapshot_string(map, record->title_offset, record->title_len, &todo->title) != 0 ||
+        snapshot_string(map, record->description_offset, record->description_len, &todo->description) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static int check_header(const snapshot_header_t* header, uint64_t size) {
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != SNAPSHOT_VERSION || header->byte_order != SNAPSHOT_BYTE_ORDER) {
+        return -1;
+    }
+    if (header->records_offset < sizeof(*header) || header->records_offset % sizeof(uint64_t) != 0 ||
+        header->records_offset > size ||
+        header->count > (size - header->records_offset) / sizeof(snapshot_record_t) ||
+        header->strings_offset < header->records_offset + header->count * sizeof(snapshot_record_t) ||
+        header->strings_offset > size || header->strings_size > size - header->strings_offset) {
+        return -1;
+    }
+    return 0;
+}
+
+long long todo_snapshot_load(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOG_ERROR("Cannot open snapshot %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(snapshot_header_t)) {
+        data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) {
+        LOG_ERROR("Cannot map snapshot %s", path);
+        return -1;
+    }
+    madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+    const snapshot_header_t* header = data;
+    long long rc = -1;
+    if (check_header(header, (uint64_t)st.st_size) == 0) {
+        struct SnapshotMap map = {
+            (const snapshot_record_t*)((const char*)data + header->records_offset),
+            (const char*)data + header->strings_offset,
+            header->strings_size,
+        };
+        rc = todo_import_rows(snapshot_row, &map, (long long)header->count);
+    } else {
+        LOG_ERROR("%s is not a snapshot this build can read", path);
+    }
+
+    munmap(data, (size_t)st.st_size);
+    return rc;
+}
@@ -0,0 +1,40 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include "todo.h"
+
+// Binary todo formats for moving data in and out in bulk.
+//
+// Record stream, used by /todos/export and /todos/import: the 8 bytes of
+// TODO_RECORD_MAGIC, then one record per todo. All integers are little
+// endian:
+//
+//   u32 length of the rest of the record
+//   i32 id, u8 completed, i64 created_at, i64 updated_at
+//   u32 title length, title bytes, NUL
+//   u32 description length, description bytes, NUL
+//
+// The NULs let a reader point todos straight into the received buffer.
+
+#define TODO_RECORD_MAGIC "TODOREC1"
+#define TODO_RECORD_MAGIC_LEN 8
+
+// Bytes todo_record_write produces for todo
+size_t todo_record_size(const todo_t* todo);
+void todo_record_write(const todo_t* todo, char* out);
+
+// Decodes the record at the start of data, pointing the todo's strings into
+// it. Returns the record's size, 0 if data ends before the record does, or
+// -1 if it is malformed.
+long long todo_record_read(const char* data, size_t len, todo_t* todo);
+
+// Snapshot file: a header, an array of fixed-size records sorted by id, and
+// the NUL-terminated strings they point at, all in the host's byte order so
+// the file can be mapped and read in place. Saving replaces path atomically
+// and returns the number of todos written; loading imports the whole file in
+// one transaction and returns the number loaded. Both return -1 on error.
+long long todo_snapshot_save(const char* path);
+long long todo_snapshot_load(const char* path);
+
+#endif
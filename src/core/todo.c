@@ -1,31 +1,116 @@
 #include "todo.h"
+#include "cache.h"
 #include "../db/database.h"
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#define TODO_INSERT_SQL \
+    "INSERT INTO todos (title, description, completed, created_at, updated_at) VALUES (?, ?, 0, ?, ?)"
+// updated_at always moves forward so that (id, updated_at) identifies a version
+#define TODO_NEXT_VERSION "MAX(?, COALESCE(updated_at, 0) + 1)"
+#define TODO_UPDATE_SQL \
+    "UPDATE todos SET title = ?, description = ?, completed = ?, updated_at = " TODO_NEXT_VERSION " WHERE id = ?"
+#define TODO_PATCH_SQL \
+    "UPDATE todos SET title = COALESCE(?, title), description = COALESCE(?, description), " \
+    "completed = COALESCE(?, completed), updated_at = " TODO_NEXT_VERSION " WHERE id = ?"
+#define TODO_DELETE_SQL \
+    "DELETE FROM todos WHERE id = ?"
+#define TODO_VERSION_CHECK " AND updated_at = ?"
+
+#define TODO_MAX_OP_PARAMS 5
+
+static atomic_uint_fast64_t table_version;
+static _Atomic(todo_change_listener_t) change_listener;
+
+// Called after a write commits, whether or not it changed anything
+static void todo_changed(int id) {
+    if (id > 0) {
+        todo_cache_invalidate(id);
+    }
+    atomic_fetch_add_explicit(&table_version, 1, memory_order_release);
+
+    todo_change_listener_t listener = atomic_load_explicit(&change_listener, memory_order_acquire);
+    if (listener) {
+        listener();
+    }
+}
+
+void todo_set_change_listener(todo_change_listener_t listener) {
+    atomic_store_explicit(&change_listener, listener, memory_order_release);
+}
+
+uint64_t todo_table_version(void) {
+    return atomic_load_explicit(&table_version, memory_order_acquire);
+}
+
+// A write by another process, found by the memory store's sync
+static void foreign_change(int id) {
+    if (id == 0) {
+        todo_cache_clear();
+    }
+    todo_changed(id);
+}
+
+void todo_follow_other_writers(void) {
+    db_set_foreign_change_listener(foreign_change);
+}
+
+#define TODO_CATCH_UP_PAGE 1024
+
+static int replay_change(const todo_change_t* change, void* ctx) {
+    long long* since = ctx;
+    todo_changed(change->id);
+    *since = change->seq;
+    return 0;
+}
+
+long long todo_catch_up(long long since) {
+    long long oldest, latest;
+    if (since < 0) {
+        return -1;
+    }
+    db_sync_memstore();
+    if (todo_change_bounds(&oldest, &latest) != 0) {
+        return -1;
+    }
+    if (oldest > since + 1) {
+        todo_cache_clear();
+        todo_changed(0);
+        return latest;
+    }
+
+    int visited;
+    do {
+        visited = todo_changes(since, TODO_CATCH_UP_PAGE, replay_change, &since);
+    } while (visited == TODO_CATCH_UP_PAGE);
+    return visited < 0 ? -1 : since;
+}
+
 int todo_create(const char* title, const char* description) {
     if (!title || !description) {
         return -1;
     }
 
     time_t now = time(NULL);
-    return db_execute_query(
-        "INSERT INTO todos (title, description, completed, created_at, updated_at) "
-        "VALUES (?, ?, 0, ?, ?)",
-        "text", title,
-        "text", description,
-        "int", (long long)now,
-        "int", (long long)now
-    );
-}
-
-int todo_get(int id, todo_t* todo) {
-    if (!todo) {
+    db_param_t params[] = {
+        DB_TEXT(title),
+        DB_TEXT(description),
+        DB_INT(now),
+        DB_INT(now),
+    };
+    int rc = db_execute_query(TODO_INSERT_SQL, params, 4, NULL);
+    todo_changed(0);
+    return rc;
+}
+
+int todo_get(int id, todo_t* todo, arena_t* arena) {
+    if (!todo || !arena) {
         return -1;
     }
 
-    return db_get_todo(id, todo);
+    return db_get_todo(id, todo, arena);
 }
 
 int todo_update(int id, const char* title, const char* description, int completed) {
@@ -34,32 +119,304 @@ int todo_update(int id, const char* title, const char* description, int complete
     }
 
     time_t now = time(NULL);
-    return db_execute_query(
-        "UPDATE todos SET title = ?, description = ?, completed = ?, updated_at = ? "
-        "WHERE id = ?",
-        "text", title,
-        "text", description,
-        "int", (long long)completed,
-        "int", (long long)now,
-        "int", (long long)id
-    );
+    db_param_t params[] = {
+        DB_TEXT(title),
+        DB_TEXT(description),
+        DB_INT(completed),
+        DB_INT(now),
+        DB_INT(id),
+    };
+    int rc = db_execute_query(TODO_UPDATE_SQL, params, 5, NULL);
+    todo_changed(id);
+    return rc;
 }
 
 int todo_delete(int id) {
-    return db_execute_query(
-        "DELETE FROM todos WHERE id = ?",
-        "int", (long long)id
-    );
+    db_param_t params[] = { DB_INT(id) };
+    int rc = db_execute_query(TODO_DELETE_SQL, params, 1, NULL);
+    todo_changed(id);
+    return rc;
 }
 
-int todo_list(todo_t** todos, int* count) {
-    if (!todos || !count) {
+int todo_get_version(int id, time_t* version) {
+    if (!version) {
         return -1;
     }
+    if (todo_cache_version(id, version) == 0) {
+        return 0;
+    }
+    return db_get_todo_version(id, version);
+}
+
+// A conditional write that changed nothing either lost the race or had no row
+static todo_status_t conditional_status(int rc, const db_result_t* result, int id) {
+    time_t current;
+
+    if (rc != 0) {
+        return TODO_FAILED;
+    }
+    if (result->changes > 0) {
+        return TODO_OK;
+    }
+    return db_get_todo_version(id, &current) == 0 ? TODO_CONFLICT : TODO_NOT_FOUND;
+}
+
+todo_status_t todo_update_if(int id, const char* title, const char* description, int completed, time_t version) {
+    if (!title || !description) {
+        return TODO_INVALID;
+    }
+
+    time_t now = time(NULL);
+    db_param_t params[] = {
+        DB_TEXT(title),
+        DB_TEXT(description),
+        DB_INT(completed),
+        DB_INT(now),
+        DB_INT(id),
+        DB_INT(version),
+    };
+    db_result_t result;
+    int rc = db_execute_query(TODO_UPDATE_SQL TODO_VERSION_CHECK, params, 6, &result);
+    todo_changed(id);
+    return conditional_status(rc, &result, id);
+}
+
+todo_status_t todo_delete_if(int id, time_t version) {
+    db_param_t params[] = { DB_INT(id), DB_INT(version) };
+    db_result_t result;
+    int rc = db_execute_query(TODO_DELETE_SQL TODO_VERSION_CHECK, params, 2, &result);
+    todo_changed(id);
+    return conditional_status(rc, &result, id);
+}
 
-    return db_get_todos(todos, count);
+int todo_list(todo_t** todos, int* count, arena_t* arena) {
+    if (!todos || !count || !arena) {
+        return -1;
+    }
+
+    return db_get_todos(todos, count, arena);
+}
+
+int todo_each(const todo_query_t* query, todo_visitor_t visit, void* ctx) {
+    if (!query || !visit || query->limit < 0 || query->after_id < 0 ||
+        query->sort < TODO_SORT_ID || query->sort > TODO_SORT_UPDATED_AT ||
+        query->completed < TODO_COMPLETED_ANY || query->completed > TODO_COMPLETED_TRUE) {
+        return -1;
+    }
+
+    return db_each_todo(query, visit, ctx);
 }
 
-void todo_free_list(todo_t* todos) {
-    free(todos);
-} 
\ No newline at end of file
+int todo_changes(long long since, int limit, todo_change_visitor_t visit, void* ctx) {
+    if (since < 0 || limit <= 0 || !visit) {
+        return -1;
+    }
+
+    return db_each_change(since, limit, visit, ctx);
+}
+
+int todo_change_bounds(long long* oldest, long long* latest) {
+    if (!oldest || !latest) {
+        return -1;
+    }
+
+    return db_change_bounds(oldest, latest);
+}
+
+void todo_set_reads_nowait(int enabled) {
+    db_set_reads_nowait(enabled);
+}
+
+int todo_take_refused_read(void) {
+    return db_take_refused_read();
+}
+
+int todo_search(const todo_search_t* search, todo_search_visitor_t visit, void* ctx) {
+    if (!search || !search->text || !visit || search->limit <= 0 || search->offset < 0 ||
+        strlen(search->text) > TODO_SEARCH_MAX_TEXT) {
+        return -1;
+    }
+
+    return db_search_todos(search, visit, ctx);
+}
+
+void todo_query_advance(todo_query_t* query, const todo_t* todo) {
+    query->after_id = todo->id;
+    if (query->sort == TODO_SORT_CREATED_AT) {
+        query->after_value = todo->created_at;
+    } else if (query->sort == TODO_SORT_UPDATED_AT) {
+        query->after_value = todo->updated_at;
+    }
+}
+
+// Fills the statement and parameters for one batch op. Returns -1 if the op
+// is missing required fields.
+static int prepare_op(const todo_op_t* op, time_t now, db_op_t* db_op, db_param_t* params) {
+    switch (op->type) {
+    case TODO_OP_CREATE:
+        if (!op->title || !op->description) return -1;
+        params[0] = DB_TEXT(op->title);
+        params[1] = DB_TEXT(op->description);
+        params[2] = DB_INT(now);
+        params[3] = DB_INT(now);
+        *db_op = (db_op_t){TODO_INSERT_SQL, params, 4};
+        return 0;
+    case TODO_OP_UPDATE:
+        if (!op->title || !op->description || op->id <= 0) return -1;
+        params[0] = DB_TEXT(op->title);
+        params[1] = DB_TEXT(op->description);
+        params[2] = DB_INT(op->completed > 0);
+        params[3] = DB_INT(now);
+        params[4] = DB_INT(op->id);
+        *db_op = (db_op_t){TODO_UPDATE_SQL, params, 5};
+        return 0;
+    case TODO_OP_PATCH:
+        if (op->id <= 0) return -1;
+        params[0] = op->title ? DB_TEXT(op->title) : DB_NULL();
+        params[1] = op->description ? DB_TEXT(op->description) : DB_NULL();
+        params[2] = op->completed >= 0 ? DB_INT(op->completed > 0) : DB_NULL();
+        params[3] = DB_INT(now);
+        params[4] = DB_INT(op->id);
+        *db_op = (db_op_t){TODO_PATCH_SQL, params, 5};
+        return 0;
+    case TODO_OP_DELETE:
+        if (op->id <= 0) return -1;
+        params[0] = DB_INT(op->id);
+        *db_op = (db_op_t){TODO_DELETE_SQL, params, 1};
+        return 0;
+    case TODO_OP_NONE:
+        break;
+    }
+    return -1;
+}
+
+// Applies all ops in a single transaction. Each op succeeds or fails on its
+// own; per-op outcomes are reported in results. Returns -1 only if the batch
+// could not be submitted at all.
+int todo_batch(const todo_op_t* ops, int count, todo_op_result_t* results) {
+    if (count == 0) {
+        return 0;
+    }
+    if (!ops || !results || count < 0) {
+        return -1;
+    }
+
+    db_op_t* db_ops = malloc(sizeof(db_op_t) * count);
+    db_param_t* params = malloc(sizeof(db_param_t) * TODO_MAX_OP_PARAMS * count);
+    db_result_t* db_results = malloc(sizeof(db_result_t) * count);
+    int* slots = malloc(sizeof(int) * count);
+    if (!db_ops || !params || !db_results || !slots) {
+        free(db_ops);
+        free(params);
+        free(db_results);
+        free(slots);
+        return -1;
+    }
+
+    time_t now = time(NULL);
+    int submitted = 0;
+    for (int i = 0; i < count; i++) {
+        results[i].id = ops[i].type == TODO_OP_CREATE ? 0 : ops[i].id;
+        if (prepare_op(&ops[i], now, &db_ops[submitted], &params[submitted * TODO_MAX_OP_PARAMS]) != 0) {
+            results[i].status = TODO_INVALID;
+            slots[i] = -1;
+            continue;
+        }
+        slots[i] = submitted++;
+    }
+
+    if (submitted > 0) {
+        db_execute_batch(db_ops, submitted, db_results);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (slots[i] < 0) {
+            continue;
+        }
+        if (ops[i].type != TODO_OP_CREATE) {
+            todo_cache_invalidate(ops[i].id);
+        }
+
+        const db_result_t* result = &db_results[slots[i]];
+        if (result->status != 0) {
+            results[i].status = TODO_FAILED;
+        } else if (ops[i].type == TODO_OP_CREATE) {
+            results[i].status = TODO_OK;
+            results[i].id = (int)result->last_insert_id;
+        } else {
+            results[i].status = result->changes > 0 ? TODO_OK : TODO_NOT_FOUND;
+        }
+    }
+
+    if (submitted > 0) {
+        todo_changed(0);
+    }
+
+    free(db_ops);
+    free(params);
+    free(db_results);
+    free(slots);
+    return 0;
+}
+
+long long todo_import_rows(todo_import_row_fn row, void* ctx, long long count) {
+    if (count == 0) {
+        return 0;
+    }
+    if (!row || count < 0) {
+        return -1;
+    }
+
+    long long rc = db_import_todos(row, ctx, count);
+    if (rc > 0) {
+        todo_t todo;
+        for (long long i = 0; i < count; i++) {
+            if (row(ctx, i, &todo) == 0 && todo.id > 0) {
+                todo_cache_invalidate(todo.id);
+            }
+        }
+    }
+    todo_changed(0);
+    return rc;
+}
+
+static int array_row(void* ctx, long long index, todo_t* todo) {
+    const todo_t* todos = ctx;
+    *todo = todos[index];
+    return todo->id < 0 || !todo->title || !todo->description ? -1 : 0;
+}
+
+int todo_import(const todo_t* todos, int count) {
+    if (count > 0 && !todos) {
+        return -1;
+    }
+    return (int)todo_import_rows(array_row, (void*)todos, count);
+}
+
+todo_import_stage_t* todo_import_open(void) {
+    return db_import_stage_open();
+}
+
+int todo_import_add(todo_import_stage_t* stage, const todo_t* todos, int count) {
+    for (int i = 0; i < count; i++) {
+        todo_t todo;
+        if (array_row((void*)todos, i, &todo) != 0) {
+            return -1;
+        }
+    }
+    return db_import_stage_add(stage, todos, count);
+}
+
+// Staged ids are not kept in memory, so the whole cache goes
+long long todo_import_finish(todo_import_stage_t* stage) {
+    long long rc = db_import_stage_commit(stage);
+    if (rc > 0) {
+        todo_cache_clear();
+    }
+    todo_changed(0);
+    return rc;
+}
+
+void todo_import_close(todo_import_stage_t* stage) {
+    db_import_stage_close(stage);
+}
@@ -1,22 +1,207 @@
 #ifndef TODO_H
 #define TODO_H
 
+#include <stddef.h>
+#include <stdint.h>
 #include <time.h>
+#include "arena.h"
 
+// Strings are NUL-terminated and never truncated. They point either into an
+// arena supplied by the caller or, for visitors, into SQLite's row buffer.
 typedef struct {
     int id;
-    char title[256];
-    char description[1024];
+    const char* title;
+    size_t title_len;
+    const char* description;
+    size_t description_len;
     int completed;
     time_t created_at;
     time_t updated_at;
 } todo_t;
 
+typedef enum {
+    TODO_SORT_ID,
+    TODO_SORT_CREATED_AT,
+    TODO_SORT_UPDATED_AT
+} todo_sort_t;
+
+typedef enum {
+    TODO_COMPLETED_ANY,
+    TODO_COMPLETED_FALSE,
+    TODO_COMPLETED_TRUE
+} todo_completed_filter_t;
+
+// Filtered keyset page. Todos are ordered by the sort column with id as the
+// tie-breaker; the cursor is the last todo of the previous page. A zeroed
+// query lists everything by ascending id.
+typedef struct {
+    int after_id;                       // Cursor id, 0 = start from the beginning
+    int limit;                          // 0 = no limit
+    todo_completed_filter_t completed;
+    time_t updated_since;               // updated_at >= this, 0 = unbounded
+    time_t created_before;              // created_at < this, 0 = unbounded
+    todo_sort_t sort;
+    int descending;
+    time_t after_value;                 // Cursor's sort column value unless sorting by id
+} todo_query_t;
+
+// Called once per row; return non-zero to stop the iteration early.
+// The todo is only valid for the duration of the call.
+typedef int (*todo_visitor_t)(const todo_t* todo, void* ctx);
+
+#define TODO_SEARCH_MAX_TEXT 256
+
+// Full-text search over title and description, best match first. Every
+// whitespace-separated term must match; a term ending in * matches as a prefix.
+typedef struct {
+    const char* text;
+    int limit;                          // 1 or more
+    int offset;                         // Hits to skip from the best match
+} todo_search_t;
+
+// Snippets are the matched text with terms wrapped in TODO_SEARCH_MARK_OPEN
+// and TODO_SEARCH_MARK_CLOSE; long descriptions are cut to the best window.
+#define TODO_SEARCH_MARK_OPEN "<mark>"
+#define TODO_SEARCH_MARK_CLOSE "</mark>"
+
+typedef struct {
+    todo_t todo;
+    double rank;                        // bm25 score, lower is a better match
+    const char* title_snippet;
+    size_t title_snippet_len;
+    const char* description_snippet;
+    size_t description_snippet_len;
+} todo_search_hit_t;
+
+// Same contract as todo_visitor_t
+typedef int (*todo_search_visitor_t)(const todo_search_hit_t* hit, void* ctx);
+
+typedef enum {
+    TODO_CHANGE_CREATE = 1,
+    TODO_CHANGE_UPDATE = 2,
+    TODO_CHANGE_DELETE = 3
+} todo_change_op_t;
+
+// One entry of the change log. Sequence numbers increase with every write
+// and are never reused; the log keeps the most recent changes only.
+typedef struct {
+    long long seq;
+    todo_change_op_t op;
+    int id;
+    time_t changed_at;
+    const todo_t* todo;                 // The todo as it is now, NULL once deleted
+} todo_change_t;
+
+// Same contract as todo_visitor_t
+typedef int (*todo_change_visitor_t)(const todo_change_t* change, void* ctx);
+
+// Called after every write through this API, on the writing thread
+typedef void (*todo_change_listener_t)(void);
+
+typedef enum {
+    TODO_OP_NONE,       // Unrecognised operation, reported as invalid
+    TODO_OP_CREATE,
+    TODO_OP_UPDATE,     // Replace title, description and completed
+    TODO_OP_PATCH,      // Change only the fields that are set
+    TODO_OP_DELETE
+} todo_op_type_t;
+
+typedef struct {
+    todo_op_type_t type;
+    int id;                     // Ignored for creates
+    const char* title;          // NULL leaves the title unchanged (patch)
+    const char* description;    // NULL leaves the description unchanged (patch)
+    int completed;              // -1 leaves completion unchanged (patch)
+} todo_op_t;
+
+typedef enum {
+    TODO_FAILED = -1,
+    TODO_OK = 0,
+    TODO_NOT_FOUND = 1,
+    TODO_INVALID = 2,
+    TODO_CONFLICT = 3           // Conditional write found a different version
+} todo_status_t;
+
+typedef struct {
+    todo_status_t status;
+    int id;                     // Generated id for creates
+} todo_op_result_t;
+
 int todo_create(const char* title, const char* description);
-int todo_get(int id, todo_t* todo);
+// The todo's strings, and for todo_list the array itself, are allocated from arena
+int todo_get(int id, todo_t* todo, arena_t* arena);
 int todo_update(int id, const char* title, const char* description, int completed);
 int todo_delete(int id);
-int todo_list(todo_t** todos, int* count);
-void todo_free_list(todo_t* todos);
+int todo_list(todo_t** todos, int* count, arena_t* arena);
+int todo_each(const todo_query_t* query, todo_visitor_t visit, void* ctx);
+
+// Moves the query's cursor past todo, the last one visited
+void todo_query_advance(todo_query_t* query, const todo_t* todo);
+
+// Visits one page of search hits. Returns the number visited, or -1 on error.
+int todo_search(const todo_search_t* search, todo_search_visitor_t visit, void* ctx);
+int todo_batch(const todo_op_t* ops, int count, todo_op_result_t* results);
+
+// Fills todo with row index of an import; strings must stay valid until
+// the import returns. Rows may be read more than once and in any order.
+// Returns 0, or -1 if the row is invalid, which fails the import.
+typedef int (*todo_import_row_fn)(void* ctx, long long index, todo_t* todo);
+
+// Bulk load for restores and seeding: todos keep their ids and timestamps,
+// replacing any todo with the same id, and id 0 gets a new id. Everything
+// commits in one transaction. Returns the number loaded, or -1.
+long long todo_import_rows(todo_import_row_fn row, void* ctx, long long count);
+int todo_import(const todo_t* todos, int count);
+
+// Imports too large to hold in memory: rows are staged in a temporary file
+// as they arrive and finish loads all of them like todo_import_rows. add
+// copies the rows, so their strings may be reused once it returns.
+typedef struct todo_import_stage todo_import_stage_t;
+todo_import_stage_t* todo_import_open(void);
+int todo_import_add(todo_import_stage_t* stage, const todo_t* todos, int count);
+long long todo_import_finish(todo_import_stage_t* stage);
+void todo_import_close(todo_import_stage_t* stage);
+
+// updated_at doubles as a row version: every write moves it forward by at
+// least one, even within the same second. Reads it without the row body.
+int todo_get_version(int id, time_t* version);
+
+// Conditional writes that only apply while the todo is still at version
+todo_status_t todo_update_if(int id, const char* title, const char* description, int completed, time_t version);
+todo_status_t todo_delete_if(int id, time_t version);
+
+// Counter bumped after every write through this API
+uint64_t todo_table_version(void);
+
+// Visits changes with seq > since in order, at most limit of them. Returns
+// the number visited, or -1 on error.
+int todo_changes(long long since, int limit, todo_change_visitor_t visit, void* ctx);
+
+// The oldest retained and the latest sequence numbers, both 0 before the
+// first change. Changes after since are complete only if since >= oldest - 1.
+int todo_change_bounds(long long* oldest, long long* latest);
+
+// Applies writes that other processes made to the database file after the
+// change log reached since, as if they had gone through this API: the
+// memory store catches up, their todos leave the cache and the table
+// version moves on. If the log no
+// longer reaches back that far, the whole cache is dropped. Returns the
+// latest sequence number applied, to pass as since next time, or -1.
+long long todo_catch_up(long long since);
+
+// Has writes by other processes that the memory store picks up, on every
+// commit and while idle, leave the cache and move the table version on as
+// todo_catch_up does. Call once; without a memory store it does nothing.
+void todo_follow_other_writers(void);
+
+// For threads that must not block, such as the server's network threads:
+// while enabled, a read that would wait for a free database connection
+// fails instead, and todo_take_refused_read returns 1 until it is called.
+// The read can then be repeated on a thread that may wait.
+void todo_set_reads_nowait(int enabled);
+int todo_take_refused_read(void);
+
+// Replaces the listener; NULL removes it
+void todo_set_change_listener(todo_change_listener_t listener);
 
 #endif
\ No newline at end of file
@@ -1,148 +1,1655 @@
 #include "database.h"
+#include "memstore.h"
+#include "../core/log.h"
+#include "../core/metrics.h"
 #include <sqlite3.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <stdarg.h>
+#include <limits.h>
+#include <stdint.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
 
-static sqlite3* db = NULL;
+#define DB_MAX_READERS 64
+#define DB_BUSY_TIMEOUT_MS 5000
+#define DB_STMT_CACHE_SIZE 32
+#define DB_CHANGES_RETAINED 100000  // Change log entries kept; older ones are pruned as new ones arrive
+#define DB_IMPORT_DEFER_MIN 10000   // Smallest import that drops and rebuilds indexes
+#define DB_MEMSTORE_POLL_MS 1000    // Idle writer checks for other processes' writes this often
+
+#define DB_STRINGIFY(x) #x
+#define DB_STRING(x) DB_STRINGIFY(x)
+
+typedef struct {
+    char* sql;
+    uint32_t hash;
+    sqlite3_stmt* stmt;
+} db_stmt_entry_t;
+
+typedef struct db_conn {
+    sqlite3* handle;
+    struct db_conn* next_free;
+    db_stmt_entry_t stmts[DB_STMT_CACHE_SIZE];  // Prepared statements keyed by SQL text
+} db_conn_t;
+
+// All writes go through a single connection; reads are served by a pool of
+// read-only connections so that they run in parallel under WAL.
+static db_conn_t writer;
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static db_conn_t* readers = NULL;
+static int reader_count = 0;
+static db_conn_t* free_readers = NULL;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+
+// Threads that must not block fail a read instead of waiting for a connection
+static _Thread_local int reads_nowait = 0;
+static _Thread_local int reads_refused = 0;
+
+// Mutations are queued by request threads and applied by a single writer
+// thread, which commits them in groups to amortize the fsync per transaction.
+typedef struct db_write_job {
+    const db_op_t* ops;
+    int op_count;
+    db_result_t* results;
+    int done;
+    pthread_cond_t done_cond;
+    struct db_write_job* next;
+} db_write_job_t;
+
+static pthread_t writer_thread;
+static int writer_running = 0;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond;
+static db_write_job_t* queue_head = NULL;
+static db_write_job_t* queue_tail = NULL;
+static int queue_ops = 0;
+static int batch_max = 1;
+static long batch_window_us = 0;
+
+// Change log position the memory store reflects. Only read and written
+// under the writer lock.
+static long long memstore_seq = 0;
+static _Atomic(db_foreign_change_fn) foreign_change_listener;
+
+static int load_memstore(db_conn_t* conn);
+static void sync_memstore(db_conn_t* conn, long long own_after, long long own_last);
+static long long latest_change(db_conn_t* conn);
+
+static int is_memory_path(const char* db_path) {
+    return db_path[0] == '\0' ||
+           strcmp(db_path, ":memory:") == 0 ||
+           strstr(db_path, "mode=memory") != NULL;
+}
+
+static int default_reader_count(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) return 1;
+    return cpus > DB_MAX_READERS ? DB_MAX_READERS : (int)cpus;
+}
+
+static int open_connection(const char* db_path, int flags, db_conn_t* conn) {
+    if (sqlite3_open_v2(db_path, &conn->handle, flags | SQLITE_OPEN_NOMUTEX | SQLITE_OPEN_URI, NULL) != SQLITE_OK) {
+        LOG_ERROR("Cannot open database: %s", sqlite3_errmsg(conn->handle));
+        sqlite3_close(conn->handle);
+        conn->handle = NULL;
+        return -1;
+    }
+    sqlite3_busy_timeout(conn->handle, DB_BUSY_TIMEOUT_MS);
+    return 0;
+}
+
+static uint32_t hash_sql(const char* sql) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char* p = (const unsigned char*)sql; *p; p++) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    return hash;
+}
+
+// Returns a prepared statement for sql, compiling it only on first use per
+// connection. Callers hand it back with db_stmt_release once done stepping.
+static sqlite3_stmt* db_stmt_acquire(db_conn_t* conn, const char* sql) {
+    if (!conn) {
+        return NULL;    // A refused reader
+    }
+
+    uint32_t hash = hash_sql(sql);
+    size_t home = hash % DB_STMT_CACHE_SIZE;
+
+    for (size_t i = 0; i < DB_STMT_CACHE_SIZE; i++) {
+        db_stmt_entry_t* entry = &conn->stmts[(home + i) % DB_STMT_CACHE_SIZE];
+        if (!entry->stmt) break;
+        if (entry->hash == hash && strcmp(entry->sql, sql) == 0) {
+            return entry->stmt;
+        }
+    }
+
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v3(conn->handle, sql, -1, SQLITE_PREPARE_PERSISTENT, &stmt, NULL) != SQLITE_OK) {
+        LOG_ERROR("Failed to prepare statement: %s", sqlite3_errmsg(conn->handle));
+        return NULL;
+    }
+
+    db_stmt_entry_t* slot = NULL;
+    for (size_t i = 0; i < DB_STMT_CACHE_SIZE; i++) {
+        db_stmt_entry_t* entry = &conn->stmts[(home + i) % DB_STMT_CACHE_SIZE];
+        if (!entry->stmt) {
+            slot = entry;
+            break;
+        }
+    }
+
+    // Cache full: evict whatever lives in the home slot. Probing stops at the
+    // first empty slot, so only empty slots may break a probe chain.
+    if (!slot) {
+        slot = &conn->stmts[home];
+        sqlite3_finalize(slot->stmt);
+        free(slot->sql);
+        slot->stmt = NULL;
+    }
+
+    slot->sql = strdup(sql);
+    if (!slot->sql) {
+        sqlite3_finalize(stmt);
+        return NULL;
+    }
+    slot->hash = hash;
+    slot->stmt = stmt;
+    return stmt;
+}
+
+static void db_stmt_release(sqlite3_stmt* stmt) {
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+}
+
+static void db_stmt_cache_clear(db_conn_t* conn) {
+    for (size_t i = 0; i < DB_STMT_CACHE_SIZE; i++) {
+        if (conn->stmts[i].stmt) {
+            sqlite3_finalize(conn->stmts[i].stmt);
+            free(conn->stmts[i].sql);
+        }
+    }
+    memset(conn->stmts, 0, sizeof(conn->stmts));
+}
+
+static void close_connection(db_conn_t* conn) {
+    db_stmt_cache_clear(conn);
+    sqlite3_close(conn->handle);
+    conn->handle = NULL;
+}
+
+static int bind_params(sqlite3_stmt* stmt, const db_param_t* params, int param_count) {
+    if (sqlite3_bind_parameter_count(stmt) != param_count) {
+        LOG_ERROR("Parameter count mismatch: expected %d, got %d",
+                sqlite3_bind_parameter_count(stmt), param_count);
+        return -1;
+    }
+
+    for (int i = 0; i < param_count; i++) {
+        int rc = SQLITE_OK;
+        switch (params[i].type) {
+        case DB_PARAM_NULL:
+            rc = sqlite3_bind_null(stmt, i + 1);
+            break;
+        case DB_PARAM_INT:
+            rc = sqlite3_bind_int64(stmt, i + 1, params[i].int_value);
+            break;
+        case DB_PARAM_TEXT:
+            rc = sqlite3_bind_text(stmt, i + 1, params[i].text_value, params[i].text_length, SQLITE_STATIC);
+            break;
+        }
+        if (rc != SQLITE_OK) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static db_conn_t* db_acquire_writer(void) {
+    pthread_mutex_lock(&writer_lock);
+    return &writer;
+}
+
+static void db_release_writer(db_conn_t* conn) {
+    (void)conn;
+    pthread_mutex_unlock(&writer_lock);
+}
+
+// Returns NULL only in nowait mode, when no connection is free
+static db_conn_t* db_acquire_reader(void) {
+    // In-memory databases are private to their connection, so reads share the writer
+    if (reader_count == 0) {
+        if (!reads_nowait) {
+            return db_acquire_writer();
+        }
+        if (pthread_mutex_trylock(&writer_lock) != 0) {
+            reads_refused = 1;
+            return NULL;
+        }
+        return &writer;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    while (!free_readers) {
+        if (reads_nowait) {
+            reads_refused = 1;
+            pthread_mutex_unlock(&pool_lock);
+            return NULL;
+        }
+        pthread_cond_wait(&pool_cond, &pool_lock);
+    }
+    db_conn_t* conn = free_readers;
+    free_readers = conn->next_free;
+    pthread_mutex_unlock(&pool_lock);
+    return conn;
+}
+
+void db_set_reads_nowait(int enabled) {
+    reads_nowait = enabled;
+}
+
+int db_take_refused_read(void) {
+    int refused = reads_refused;
+    reads_refused = 0;
+    return refused;
+}
+
+static void db_release_reader(db_conn_t* conn) {
+    if (!conn) {
+        return;
+    }
+    if (conn == &writer) {
+        db_release_writer(conn);
+        return;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    conn->next_free = free_readers;
+    free_readers = conn;
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+static void execute_op(db_conn_t* conn, const db_op_t* op, db_result_t* result) {
+    result->status = -1;
+    result->last_insert_id = 0;
+    result->changes = 0;
+
+    sqlite3_stmt* stmt = db_stmt_acquire(conn, op->query);
+    if (!stmt) {
+        return;
+    }
+
+    if (bind_params(stmt, op->params, op->param_count) == 0 && sqlite3_step(stmt) == SQLITE_DONE) {
+        result->status = 0;
+        result->last_insert_id = sqlite3_last_insert_rowid(conn->handle);
+        result->changes = sqlite3_changes(conn->handle);
+    }
+
+    db_stmt_release(stmt);
+}
+
+static void fail_batch(db_write_job_t* batch) {
+    for (db_write_job_t* job = batch; job; job = job->next) {
+        for (int i = 0; i < job->op_count; i++) {
+            job->results[i].status = -1;
+        }
+    }
+}
+
+static void run_batch(db_write_job_t* batch) {
+    uint64_t started = metrics_now();
+    db_conn_t* conn = db_acquire_writer();
+    int in_transaction = sqlite3_exec(conn->handle, "BEGIN IMMEDIATE", NULL, NULL, NULL) == SQLITE_OK;
+    int lost = 0;
+
+    // Nobody else can write while the transaction holds the write lock, so
+    // the changes it logs are exactly those after own_after up to own_last
+    int track = in_transaction && memstore_enabled();
+    long long own_after = track ? latest_change(conn) : 0;
+    long long own_last = 0;
+
+    // A failing statement only undoes itself, so one bad op does not affect
+    // the rest of the batch. Errors such as SQLITE_FULL roll back the whole
+    // transaction though, which SQLite signals by returning to autocommit.
+    for (db_write_job_t* job = batch; job && !lost; job = job->next) {
+        for (int i = 0; i < job->op_count && !lost; i++) {
+            execute_op(conn, &job->ops[i], &job->results[i]);
+            if (in_transaction && job->results[i].status != 0 && sqlite3_get_autocommit(conn->handle)) {
+                lost = 1;
+            }
+        }
+    }
+
+    if (track && !lost) {
+        own_last = latest_change(conn);
+    }
+    if (in_transaction && !lost && sqlite3_exec(conn->handle, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+        LOG_ERROR("Failed to commit write batch: %s", sqlite3_errmsg(conn->handle));
+        sqlite3_exec(conn->handle, "ROLLBACK", NULL, NULL, NULL);
+        lost = 1;
+    }
+
+    if (lost) {
+        fail_batch(batch);
+    }
+
+    // Before the jobs are woken, so writers read their own writes
+    if (memstore_enabled()) {
+        if (lost || own_after < 0 || own_last < 0) {
+            own_after = own_last = 0;
+        }
+        sync_memstore(conn, own_after, own_last);
+    }
+
+    db_release_writer(conn);
+    metrics_record_db(METRICS_DB_COMMIT, metrics_now() - started);
+}
+
+static void* writer_main(void* arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&queue_lock);
+    for (;;) {
+        while (!queue_head && writer_running) {
+            if (!memstore_enabled()) {
+                pthread_cond_wait(&queue_cond, &queue_lock);
+                continue;
+            }
+
+            // Other processes writing to the file only show up in the change
+            // log, so an idle writer keeps the memory store in step with it
+            struct timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_sec += DB_MEMSTORE_POLL_MS / 1000;
+            deadline.tv_nsec += (DB_MEMSTORE_POLL_MS % 1000) * 1000000L;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+            if (pthread_cond_timedwait(&queue_cond, &queue_lock, &deadline) == ETIMEDOUT &&
+                !queue_head && writer_running) {
+                pthread_mutex_unlock(&queue_lock);
+                db_sync_memstore();
+                pthread_mutex_lock(&queue_lock);
+            }
+        }
+        if (!queue_head) {
+            break;
+        }
+
+        // Give concurrent writers a short window to join this commit
+        if (batch_window_us > 0 && writer_running && queue_ops < batch_max) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_nsec += batch_window_us * 1000;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+            while (queue_ops < batch_max && writer_running) {
+                if (pthread_cond_timedwait(&queue_cond, &queue_lock, &deadline) == ETIMEDOUT) {
+                    break;
+                }
+            }
+        }
+
+        db_write_job_t* batch = queue_head;
+        db_write_job_t* last = batch;
+        int ops = last->op_count;
+        while (last->next && ops + last->next->op_count <= batch_max) {
+            last = last->next;
+            ops += last->op_count;
+        }
+        queue_head = last->next;
+        if (!queue_head) queue_tail = NULL;
+        last->next = NULL;
+        queue_ops -= ops;
+
+        pthread_mutex_unlock(&queue_lock);
+        run_batch(batch);
+        pthread_mutex_lock(&queue_lock);
+
+        db_write_job_t* next;
+        for (db_write_job_t* job = batch; job; job = next) {
+            next = job->next;
+            job->done = 1;
+            pthread_cond_signal(&job->done_cond);
+        }
+    }
+    pthread_mutex_unlock(&queue_lock);
+
+    return NULL;
+}
+
+static int start_writer(const db_config_t* config) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&queue_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    batch_max = config->batch_max > 0 ? config->batch_max : 1;
+    batch_window_us = config->batch_window_us > 0 ? config->batch_window_us : 0;
+    writer_running = 1;
+
+    if (pthread_create(&writer_thread, NULL, writer_main, NULL) != 0) {
+        writer_running = 0;
+        pthread_cond_destroy(&queue_cond);
+        return -1;
+    }
+    return 0;
+}
+
+static void stop_writer(void) {
+    pthread_mutex_lock(&queue_lock);
+    if (!writer_running) {
+        pthread_mutex_unlock(&queue_lock);
+        return;
+    }
+    writer_running = 0;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+
+    // The writer drains queued jobs before exiting
+    pthread_join(writer_thread, NULL);
+    pthread_cond_destroy(&queue_cond);
+}
+
+// Secondary indexes and full-text triggers, shared by their migrations and
+// by imports that rebuild them
+#define DB_LIST_INDEXES_SQL \
+    "CREATE INDEX IF NOT EXISTS todos_completed_updated ON todos(completed, updated_at);" \
+    "CREATE INDEX IF NOT EXISTS todos_updated ON todos(updated_at);" \
+    "CREATE INDEX IF NOT EXISTS todos_created ON todos(created_at);"
+#define DB_FTS_TRIGGERS_SQL \
+    "CREATE TRIGGER IF NOT EXISTS todos_fts_insert AFTER INSERT ON todos BEGIN " \
+    "INSERT INTO todos_fts(rowid, title, description) VALUES (new.id, new.title, new.description); END;" \
+    "CREATE TRIGGER IF NOT EXISTS todos_fts_delete AFTER DELETE ON todos BEGIN " \
+    "INSERT INTO todos_fts(todos_fts, rowid, title, description) " \
+    "VALUES ('delete', old.id, old.title, old.description); END;" \
+    "CREATE TRIGGER IF NOT EXISTS todos_fts_update AFTER UPDATE OF title, description ON todos BEGIN " \
+    "INSERT INTO todos_fts(todos_fts, rowid, title, description) " \
+    "VALUES ('delete', old.id, old.title, old.description);" \
+    "INSERT INTO todos_fts(rowid, title, description) VALUES (new.id, new.title, new.description); END;"
+
+// Schema changes in order. PRAGMA user_version records how many have been
+// applied; append new steps, never edit released ones.
+static const char* const migrations[] = {
+    "CREATE TABLE IF NOT EXISTS todos ("
+    "id INTEGER PRIMARY KEY AUTOINCREMENT,"
+    "title TEXT NOT NULL,"
+    "description TEXT,"
+    "completed INTEGER DEFAULT 0,"
+    "created_at INTEGER,"
+    "updated_at INTEGER"
+    ")",
+
+    // Filtered and sorted lists; the rowid is the implicit last column
+    DB_LIST_INDEXES_SQL,
+
+    // Full-text index over the todos table itself (external content), kept in
+    // step by triggers. Only title and description changes touch the index.
+    "CREATE VIRTUAL TABLE IF NOT EXISTS todos_fts USING fts5("
+    "title, description, content='todos', content_rowid='id', tokenize='unicode61 remove_diacritics 2');"
+    DB_FTS_TRIGGERS_SQL
+    // Title matches weigh four times as much as description matches
+    "INSERT INTO todos_fts(todos_fts, rank) VALUES ('rank', 'bm25(4.0, 1.0)');"
+    "INSERT INTO todos_fts(todos_fts) VALUES ('rebuild');",
+
+    // Change log behind /todos/changes. Triggers record writes in the same
+    // transaction, so every committed change gets a sequence number.
+    "CREATE TABLE IF NOT EXISTS todo_changes ("
+    "seq INTEGER PRIMARY KEY AUTOINCREMENT,"
+    "todo_id INTEGER NOT NULL,"
+    "op INTEGER NOT NULL,"
+    "changed_at INTEGER NOT NULL"
+    ");"
+    "CREATE TRIGGER IF NOT EXISTS todo_changes_insert AFTER INSERT ON todos BEGIN "
+    "INSERT INTO todo_changes(todo_id, op, changed_at) VALUES (new.id, 1, COALESCE(new.updated_at, 0)); END;"
+    "CREATE TRIGGER IF NOT EXISTS todo_changes_update AFTER UPDATE ON todos BEGIN "
+    "INSERT INTO todo_changes(todo_id, op, changed_at) VALUES (new.id, 2, COALESCE(new.updated_at, 0)); END;"
+    "CREATE TRIGGER IF NOT EXISTS todo_changes_delete AFTER DELETE ON todos BEGIN "
+    "INSERT INTO todo_changes(todo_id, op, changed_at) VALUES (old.id, 3, CAST(strftime('%s', 'now') AS INTEGER)); END;"
+    "CREATE TRIGGER IF NOT EXISTS todo_changes_prune AFTER INSERT ON todo_changes BEGIN "
+    "DELETE FROM todo_changes WHERE seq <= new.seq - " DB_STRING(DB_CHANGES_RETAINED) "; END;",
+};
+
+static int migrate(db_conn_t* conn) {
+    int version = 0;
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(conn->handle, "PRAGMA user_version", -1, &stmt, NULL) != SQLITE_OK) {
+        LOG_ERROR("Failed to read schema version: %s", sqlite3_errmsg(conn->handle));
+        return -1;
+    }
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        version = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+
+    int count = (int)(sizeof(migrations) / sizeof(migrations[0]));
+    if (version > count) {
+        LOG_ERROR("Database schema version %d is newer than this build (%d)", version, count);
+        return -1;
+    }
+
+    int from = version;
+    for (; version < count; version++) {
+        char set_version[64];
+        snprintf(set_version, sizeof(set_version), "PRAGMA user_version = %d", version + 1);
+
+        char* err_msg = NULL;
+        if (sqlite3_exec(conn->handle, "BEGIN IMMEDIATE", NULL, NULL, &err_msg) != SQLITE_OK ||
+            sqlite3_exec(conn->handle, migrations[version], NULL, NULL, &err_msg) != SQLITE_OK ||
+            sqlite3_exec(conn->handle, set_version, NULL, NULL, &err_msg) != SQLITE_OK ||
+            sqlite3_exec(conn->handle, "COMMIT", NULL, NULL, &err_msg) != SQLITE_OK) {
+            LOG_ERROR("Schema migration %d failed: %s", version + 1, err_msg ? err_msg : "unknown error");
+            sqlite3_free(err_msg);
+            sqlite3_exec(conn->handle, "ROLLBACK", NULL, NULL, NULL);
+            return -1;
+        }
+    }
+
+    if (from > 0 && from < count) {
+        LOG_INFO("Migrated database schema from version %d to %d", from, count);
+    }
+    return 0;
+}
+
+void db_config_defaults(db_config_t* config) {
+    config->path = "todo.db";
+    config->reader_count = 0;
+    config->batch_max = 512;
+    config->batch_window_us = 2000;
+    config->memory_primary = 0;
+}
 
 int db_init(const char* db_path) {
-    if (sqlite3_open(db_path, &db) != SQLITE_OK) {
-        fprintf(stderr, "Cannot open database: %s\n", sqlite3_errmsg(db));
+    db_config_t config;
+    db_config_defaults(&config);
+    config.path = db_path;
+    return db_init_config(&config);
+}
+
+int db_init_config(const db_config_t* config) {
+    if (!sqlite3_threadsafe()) {
+        LOG_ERROR("SQLite was built without thread support");
         return -1;
     }
 
-    const char* create_table_sql = 
-        "CREATE TABLE IF NOT EXISTS todos ("
-        "id INTEGER PRIMARY KEY AUTOINCREMENT,"
-        "title TEXT NOT NULL,"
-        "description TEXT,"
-        "completed INTEGER DEFAULT 0,"
-        "created_at INTEGER,"
-        "updated_at INTEGER"
-        ")";
+    if (open_connection(config->path, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, &writer) != 0) {
+        return -1;
+    }
+
+    const char* setup_sql =
+        "PRAGMA journal_mode=WAL;"
+        "PRAGMA synchronous=NORMAL;";
 
     char* err_msg = NULL;
-    if (sqlite3_exec(db, create_table_sql, NULL, NULL, &err_msg) != SQLITE_OK) {
-        fprintf(stderr, "SQL error: %s\n", err_msg);
+    if (sqlite3_exec(writer.handle, setup_sql, NULL, NULL, &err_msg) != SQLITE_OK) {
+        LOG_ERROR("SQL error: %s", err_msg);
         sqlite3_free(err_msg);
+        db_cleanup();
+        return -1;
+    }
+
+    if (migrate(&writer) != 0) {
+        db_cleanup();
+        return -1;
+    }
+
+    if (config->memory_primary && load_memstore(&writer) != 0) {
+        db_cleanup();
+        return -1;
+    }
+
+    if (start_writer(config) != 0) {
+        db_cleanup();
+        return -1;
+    }
+
+    if (is_memory_path(config->path)) {
+        return 0;
+    }
+
+    int count = config->reader_count > 0 ? config->reader_count : default_reader_count();
+    if (count > DB_MAX_READERS) count = DB_MAX_READERS;
+
+    readers = calloc((size_t)count, sizeof(db_conn_t));
+    if (!readers) {
+        db_cleanup();
         return -1;
     }
 
+    for (int i = 0; i < count; i++) {
+        if (open_connection(config->path, SQLITE_OPEN_READONLY, &readers[i]) != 0) {
+            db_cleanup();
+            return -1;
+        }
+        readers[i].next_free = free_readers;
+        free_readers = &readers[i];
+        reader_count++;
+    }
+
     return 0;
 }
 
 void db_cleanup(void) {
-    if (db) {
-        sqlite3_close(db);
-        db = NULL;
+    stop_writer();
+
+    memstore_cleanup();
+    memstore_seq = 0;
+
+    for (int i = 0; i < reader_count; i++) {
+        close_connection(&readers[i]);
+    }
+    free(readers);
+    readers = NULL;
+    reader_count = 0;
+    free_readers = NULL;
+
+    if (writer.handle) {
+        close_connection(&writer);
     }
 }
 
-int db_execute_query(const char* query, ...) {
-    sqlite3_stmt* stmt;
-    int rc = sqlite3_prepare_v2(db, query, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare statement: %s\n", sqlite3_errmsg(db));
+int db_execute_batch(const db_op_t* ops, int op_count, db_result_t* results) {
+    if (op_count <= 0) {
+        return 0;
+    }
+
+    uint64_t started = metrics_now();
+    db_write_job_t job = {ops, op_count, results, 0, PTHREAD_COND_INITIALIZER, NULL};
+
+    pthread_mutex_lock(&queue_lock);
+    if (!writer_running) {
+        pthread_mutex_unlock(&queue_lock);
+        return -1;
+    }
+
+    if (queue_tail) {
+        queue_tail->next = &job;
+    } else {
+        queue_head = &job;
+    }
+    queue_tail = &job;
+    queue_ops += op_count;
+    pthread_cond_signal(&queue_cond);
+
+    while (!job.done) {
+        pthread_cond_wait(&job.done_cond, &queue_lock);
+    }
+    pthread_mutex_unlock(&queue_lock);
+    pthread_cond_destroy(&job.done_cond);
+    metrics_record_db(METRICS_DB_WRITE, metrics_now() - started);
+
+    for (int i = 0; i < op_count; i++) {
+        if (results[i].status != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int db_execute_query(const char* query, const db_param_t* params, int param_count, db_result_t* result) {
+    db_op_t op = {query, params, param_count};
+    db_result_t local;
+
+    int rc = db_execute_batch(&op, 1, &local);
+    if (result) {
+        *result = local;
+    }
+    return rc;
+}
+
+#define DB_IMPORT_CONFLICT \
+    "ON CONFLICT(id) DO UPDATE SET title = excluded.title, description = excluded.description, " \
+    "completed = excluded.completed, created_at = excluded.created_at, updated_at = excluded.updated_at"
+#define DB_IMPORT_SQL \
+    "INSERT INTO todos (id, title, description, completed, created_at, updated_at) VALUES (?, ?, ?, ?, ?, ?) " \
+    DB_IMPORT_CONFLICT
+// WHERE true keeps SQLite from reading ON CONFLICT as a join constraint;
+// rowid order lets the last of several rows with one id win, as it does
+// when rows are upserted one at a time
+#define DB_IMPORT_STAGED_SQL \
+    "INSERT INTO todos (id, title, description, completed, created_at, updated_at) " \
+    "SELECT id, title, description, completed, created_at, updated_at FROM import_stage.rows " \
+    "WHERE true ORDER BY rowid " \
+    DB_IMPORT_CONFLICT
+
+// Binds an import row to the six parameters of an insert
+static void bind_import_row(sqlite3_stmt* stmt, const todo_t* todo) {
+    if (todo->id > 0) {
+        sqlite3_bind_int(stmt, 1, todo->id);
+    } else {
+        sqlite3_bind_null(stmt, 1);
+    }
+    sqlite3_bind_text(stmt, 2, todo->title, (int)todo->title_len, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, todo->description, (int)todo->description_len, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 4, todo->completed != 0);
+    sqlite3_bind_int64(stmt, 5, todo->created_at);
+    sqlite3_bind_int64(stmt, 6, todo->updated_at);
+}
+
+static int import_rows(db_conn_t* conn, todo_import_row_fn row, void* ctx, long long count) {
+    sqlite3_stmt* stmt = db_stmt_acquire(conn, DB_IMPORT_SQL);
+    if (!stmt) {
         return -1;
     }
 
-    va_list args;
-    va_start(args, query);
-    
-    int param_count = sqlite3_bind_parameter_count(stmt);
-    for (int i = 1; i <= param_count; i++) {
-        const char* param_type = va_arg(args, const char*);
-        if (strcmp(param_type, "text") == 0) {
-            const char* text_val = va_arg(args, const char*);
-            sqlite3_bind_text(stmt, i, text_val, -1, SQLITE_STATIC);
-        } else if (strcmp(param_type, "int") == 0) {
-            long long int_val = va_arg(args, long long);
-            sqlite3_bind_int64(stmt, i, int_val);
+    todo_t row_todo;
+    const todo_t* todo = &row_todo;
+    for (long long i = 0; i < count; i++) {
+        if (row(ctx, i, &row_todo) != 0) {
+            LOG_ERROR("Import row %lld is invalid", i);
+            db_stmt_release(stmt);
+            return -1;
+        }
+        bind_import_row(stmt, todo);
+        int rc = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+        if (rc != SQLITE_DONE) {
+            LOG_ERROR("Import failed at row %lld: %s", i, sqlite3_errmsg(conn->handle));
+            db_stmt_release(stmt);
+            return -1;
         }
     }
 
-    va_end(args);
+    db_stmt_release(stmt);
+    return 0;
+}
+
+// Building an index once over sorted data beats updating it row by row, so
+// an import at least as large as the table drops the secondary indexes and
+// the full-text triggers and rebuilds both after loading
+static int import_defers_indexes(db_conn_t* conn, long long count) {
+    if (count < DB_IMPORT_DEFER_MIN) {
+        return 0;
+    }
+    sqlite3_stmt* stmt = db_stmt_acquire(conn, "SELECT COUNT(*) FROM todos");
+    if (!stmt) {
+        return 0;
+    }
+    int defer = sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int64(stmt, 0) <= count;
+    db_stmt_release(stmt);
+    return defer;
+}
 
-    rc = sqlite3_step(stmt);
+// Where an import's rows come from: a row callback, or the rows table of a
+// staging file
+struct ImportSource {
+    todo_import_row_fn row;
+    void* ctx;
+    const char* stage_path;
+    long long count;
+};
+
+static int load_import(db_conn_t* conn, const struct ImportSource* source, char** err_msg) {
+    if (!source->stage_path) {
+        return import_rows(conn, source->row, source->ctx, source->count);
+    }
+    return sqlite3_exec(conn->handle, DB_IMPORT_STAGED_SQL, NULL, NULL, err_msg) == SQLITE_OK ? 0 : -1;
+}
+
+static int attach_stage(db_conn_t* conn, const char* path) {
+    sqlite3_stmt* stmt = NULL;
+    if (sqlite3_prepare_v2(conn->handle, "ATTACH DATABASE ? AS import_stage", -1, &stmt, NULL) != SQLITE_OK) {
+        return -1;
+    }
+    sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+    int rc = sqlite3_step(stmt);
     sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        LOG_ERROR("Failed to attach import staging file: %s", sqlite3_errmsg(conn->handle));
+        return -1;
+    }
+    return 0;
+}
+
+// Loads todos in one transaction on the writer connection, bypassing the
+// write queue: group commits wait until the import is done
+static long long apply_import(const struct ImportSource* source) {
+    static const char* const drop_sql =
+        "DROP INDEX IF EXISTS todos_completed_updated;"
+        "DROP INDEX IF EXISTS todos_updated;"
+        "DROP INDEX IF EXISTS todos_created;"
+        "DROP TRIGGER IF EXISTS todos_fts_insert;"
+        "DROP TRIGGER IF EXISTS todos_fts_delete;"
+        "DROP TRIGGER IF EXISTS todos_fts_update;";
+    static const char* const rebuild_sql =
+        DB_LIST_INDEXES_SQL
+        DB_FTS_TRIGGERS_SQL
+        "INSERT INTO todos_fts(todos_fts) VALUES ('rebuild');";
+
+    long long count = source->count;
+    if (count <= 0) {
+        return 0;
+    }
 
-    return (rc == SQLITE_DONE) ? 0 : -1;
+    uint64_t started = metrics_now();
+    db_conn_t* conn = db_acquire_writer();
+    // ATTACH is not allowed inside a transaction
+    if (!conn->handle || (source->stage_path && attach_stage(conn, source->stage_path) != 0)) {
+        db_release_writer(conn);
+        return -1;
+    }
+    if (sqlite3_exec(conn->handle, "BEGIN IMMEDIATE", NULL, NULL, NULL) != SQLITE_OK) {
+        if (source->stage_path) {
+            sqlite3_exec(conn->handle, "DETACH DATABASE import_stage", NULL, NULL, NULL);
+        }
+        db_release_writer(conn);
+        return -1;
+    }
+
+    int defer = import_defers_indexes(conn, count);
+    int track = memstore_enabled();
+    long long own_after = track ? latest_change(conn) : 0;
+    long long own_last = 0;
+    int rc = 0;
+    char* err_msg = NULL;
+    if (defer && sqlite3_exec(conn->handle, drop_sql, NULL, NULL, &err_msg) != SQLITE_OK) {
+        rc = -1;
+    }
+    if (rc == 0) {
+        rc = load_import(conn, source, &err_msg);
+    }
+    if (rc == 0 && defer && sqlite3_exec(conn->handle, rebuild_sql, NULL, NULL, &err_msg) != SQLITE_OK) {
+        rc = -1;
+    }
+    if (rc == 0 && track) {
+        own_last = latest_change(conn);
+    }
+    if (rc == 0 && sqlite3_exec(conn->handle, "COMMIT", NULL, NULL, &err_msg) != SQLITE_OK) {
+        rc = -1;
+    }
+    if (rc != 0) {
+        if (err_msg) {
+            LOG_ERROR("Import failed: %s", err_msg);
+            sqlite3_free(err_msg);
+        }
+        sqlite3_exec(conn->handle, "ROLLBACK", NULL, NULL, NULL);
+    }
+    if (source->stage_path) {
+        sqlite3_exec(conn->handle, "DETACH DATABASE import_stage", NULL, NULL, NULL);
+    }
+
+    if (memstore_enabled()) {
+        if (rc != 0 || own_after < 0 || own_last < 0) {
+            own_after = own_last = 0;
+        }
+        sync_memstore(conn, own_after, own_last);
+    }
+    db_release_writer(conn);
+    metrics_record_db(METRICS_DB_IMPORT, metrics_now() - started);
+    return rc == 0 ? count : -1;
+}
+
+long long db_import_todos(todo_import_row_fn row, void* ctx, long long count) {
+    struct ImportSource source = {row, ctx, NULL, count};
+    return apply_import(&source);
 }
 
-int db_get_todo(int id, todo_t* todo) {
+struct todo_import_stage {
+    sqlite3* handle;
+    sqlite3_stmt* insert;
+    long long count;
+    char path[PATH_MAX];
+};
+
+// The staging file is private and thrown away after the import, so it is
+// written without a journal or syncs, in one transaction held open until
+// the rows are applied
+todo_import_stage_t* db_import_stage_open(void) {
+    static const char* const setup_sql =
+        "PRAGMA journal_mode = OFF;"
+        "PRAGMA synchronous = OFF;"
+        "BEGIN;"
+        "CREATE TABLE rows (id INTEGER, title TEXT NOT NULL, description TEXT NOT NULL, "
+        "completed INTEGER NOT NULL, created_at INTEGER NOT NULL, updated_at INTEGER NOT NULL);";
+
+    todo_import_stage_t* stage = calloc(1, sizeof(todo_import_stage_t));
+    if (!stage) {
+        return NULL;
+    }
+    const char* dir = getenv("TMPDIR");
+    if (!dir || !*dir) {
+        dir = "/tmp";
+    }
+    int len = snprintf(stage->path, sizeof(stage->path), "%s/todo-import-XXXXXX", dir);
+    int fd = len > 0 && (size_t)len < sizeof(stage->path) ? mkstemp(stage->path) : -1;
+    if (fd < 0) {
+        LOG_ERROR("Failed to create import staging file in %s: %s", dir, strerror(errno));
+        free(stage);
+        return NULL;
+    }
+    close(fd);
+
+    if (sqlite3_open(stage->path, &stage->handle) != SQLITE_OK ||
+        sqlite3_exec(stage->handle, setup_sql, NULL, NULL, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(stage->handle,
+                           "INSERT INTO rows (id, title, description, completed, created_at, updated_at) "
+                           "VALUES (?, ?, ?, ?, ?, ?)", -1, &stage->insert, NULL) != SQLITE_OK) {
+        LOG_ERROR("Failed to set up import staging file: %s", sqlite3_errmsg(stage->handle));
+        db_import_stage_close(stage);
+        return NULL;
+    }
+    return stage;
+}
+
+int db_import_stage_add(todo_import_stage_t* stage, const todo_t* todos, int count) {
+    if (!stage->insert) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        bind_import_row(stage->insert, &todos[i]);
+        int rc = sqlite3_step(stage->insert);
+        sqlite3_reset(stage->insert);
+        if (rc != SQLITE_DONE) {
+            LOG_ERROR("Failed to stage import row: %s", sqlite3_errmsg(stage->handle));
+            return -1;
+        }
+    }
+    stage->count += count;
+    return 0;
+}
+
+long long db_import_stage_commit(todo_import_stage_t* stage) {
+    if (!stage->insert) {
+        return -1;
+    }
+    sqlite3_finalize(stage->insert);
+    stage->insert = NULL;
+    if (sqlite3_exec(stage->handle, "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+        LOG_ERROR("Failed to stage import: %s", sqlite3_errmsg(stage->handle));
+        return -1;
+    }
+    sqlite3_close(stage->handle);
+    stage->handle = NULL;
+
+    struct ImportSource source = {NULL, NULL, stage->path, stage->count};
+    return apply_import(&source);
+}
+
+void db_import_stage_close(todo_import_stage_t* stage) {
+    if (!stage) {
+        return;
+    }
+    sqlite3_finalize(stage->insert);
+    sqlite3_close(stage->handle);
+    unlink(stage->path);
+    free(stage);
+}
+
+static const char* column_text(sqlite3_stmt* stmt, int column, size_t* len) {
+    const unsigned char* text = sqlite3_column_text(stmt, column);
+    *len = text ? (size_t)sqlite3_column_bytes(stmt, column) : 0;
+    return text ? (const char*)text : "";
+}
+
+// Points the todo's strings at the statement's row buffer, which is only
+// valid until the statement is stepped, reset or released
+static void read_todo_row(sqlite3_stmt* stmt, todo_t* todo) {
+    todo->id = sqlite3_column_int(stmt, 0);
+    todo->title = column_text(stmt, 1, &todo->title_len);
+    todo->description = column_text(stmt, 2, &todo->description_len);
+    todo->completed = sqlite3_column_int(stmt, 3);
+    todo->created_at = sqlite3_column_int64(stmt, 4);
+    todo->updated_at = sqlite3_column_int64(stmt, 5);
+}
+
+// Ids of every record in the memory store, ascending
+struct StoreIds {
+    int* ids;
+    size_t count;
+    size_t capacity;
+};
+
+static int collect_store_id(const todo_t* todo, void* ctx) {
+    struct StoreIds* store = ctx;
+    if (store->count == store->capacity) {
+        size_t capacity = store->capacity ? store->capacity * 2 : 1024;
+        int* ids = realloc(store->ids, capacity * sizeof(int));
+        if (!ids) return -1;
+        store->ids = ids;
+        store->capacity = capacity;
+    }
+    store->ids[store->count++] = todo->id;
+    return 0;
+}
+
+// Makes the store match the whole table, for when the change log no longer
+// reaches back to the last change applied. Rows are put over their records
+// and records whose row is gone are removed, merging the two by id.
+static int reload_memstore(db_conn_t* conn) {
+    struct StoreIds store = {0};
+    todo_query_t query = {0};
+    if (memstore_each(&query, collect_store_id, &store) < 0) {
+        free(store.ids);
+        return -1;
+    }
+
+    sqlite3_stmt* stmt = db_stmt_acquire(conn, "SELECT * FROM todos ORDER BY id");
+    int rc = stmt ? SQLITE_ROW : SQLITE_ERROR;
+    size_t next = 0;
+    todo_t todo;
+    while (rc == SQLITE_ROW && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        read_todo_row(stmt, &todo);
+        while (next < store.count && store.ids[next] < todo.id) {
+            memstore_remove(store.ids[next++]);
+        }
+        if (next < store.count && store.ids[next] == todo.id) {
+            next++;
+        }
+        if (memstore_put(&todo) != 0) {
+            rc = SQLITE_NOMEM;
+        }
+    }
+    while (rc == SQLITE_DONE && next < store.count) {
+        memstore_remove(store.ids[next++]);
+    }
+
+    if (stmt) {
+        db_stmt_release(stmt);
+    }
+    free(store.ids);
+    return rc == SQLITE_DONE ? 0 : -1;
+}
+
+// The latest change log sequence, or -1 if it cannot be read
+static long long latest_change(db_conn_t* conn) {
+    sqlite3_stmt* stmt = db_stmt_acquire(conn, "SELECT COALESCE(MAX(seq), 0) FROM todo_changes");
+    if (!stmt) {
+        return -1;
+    }
+    long long seq = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : -1;
+    db_stmt_release(stmt);
+    return seq;
+}
+
+static void report_foreign_change(int id) {
+    db_foreign_change_fn listener = atomic_load_explicit(&foreign_change_listener, memory_order_acquire);
+    if (listener) {
+        listener(id);
+    }
+}
+
+void db_set_foreign_change_listener(db_foreign_change_fn listener) {
+    atomic_store_explicit(&foreign_change_listener, listener, memory_order_release);
+}
+
+// Copies the committed state of every row the change log shows changed
+// since memstore_seq into the store. The log records writes made by every
+// connection and process, so this also picks up writes that did not go
+// through this process; those are reported to the foreign change listener.
+// Changes after own_after up to own_last are the writer's own and are not.
+// It reads in one transaction so the rows and the new position agree. If
+// the store cannot be updated it is switched off for good and reads go
+// back to SQLite, which is always up to date.
+static void sync_memstore(db_conn_t* conn, long long own_after, long long own_last) {
+    static const char* const changed_sql =
+        "SELECT todos.*, changed.todo_id, changed.foreign_write FROM "
+        "(SELECT todo_id, MAX(seq <= ? OR seq > ?) AS foreign_write FROM todo_changes "
+        "WHERE seq > ? GROUP BY todo_id) AS changed "
+        "LEFT JOIN todos ON todos.id = changed.todo_id";
+
+    if (sqlite3_exec(conn->handle, "BEGIN", NULL, NULL, NULL) != SQLITE_OK) {
+        memstore_disable();
+        return;
+    }
+
+    long long oldest = 0, latest = 0;
+    int failed = 0;
+    sqlite3_stmt* stmt = db_stmt_acquire(conn, "SELECT COALESCE((SELECT MIN(seq) FROM todo_changes), 0), "
+                                               "COALESCE((SELECT MAX(seq) FROM todo_changes), 0)");
+    if (stmt && sqlite3_step(stmt) == SQLITE_ROW) {
+        oldest = sqlite3_column_int64(stmt, 0);
+        latest = sqlite3_column_int64(stmt, 1);
+    } else {
+        failed = 1;
+    }
+    if (stmt) {
+        db_stmt_release(stmt);
+    }
+
+    if (!failed && latest > memstore_seq) {
+        if (oldest > memstore_seq + 1) {
+            LOG_WARN("Change log pruned past the memory store, reloading it");
+            failed = reload_memstore(conn) != 0;
+            if (!failed) {
+                report_foreign_change(0);
+            }
+        } else if ((stmt = db_stmt_acquire(conn, changed_sql))) {
+            sqlite3_bind_int64(stmt, 1, own_after);
+            sqlite3_bind_int64(stmt, 2, own_last);
+            sqlite3_bind_int64(stmt, 3, memstore_seq);
+            int rc = SQLITE_DONE;
+            while (!failed && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                int id = sqlite3_column_int(stmt, 6);
+                if (sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+                    todo_t todo;
+                    read_todo_row(stmt, &todo);
+                    failed = memstore_put(&todo) != 0;
+                } else {
+                    memstore_remove(id);
+                }
+                if (!failed && sqlite3_column_int(stmt, 7)) {
+                    report_foreign_change(id);
+                }
+            }
+            failed = failed || rc != SQLITE_DONE;
+            db_stmt_release(stmt);
+        } else {
+            failed = 1;
+        }
+    }
+    sqlite3_exec(conn->handle, "COMMIT", NULL, NULL, NULL);
+
+    if (failed) {
+        LOG_ERROR("Memory store out of step with the database, serving reads from SQLite");
+        memstore_disable();
+        return;
+    }
+    memstore_seq = latest;
+    memstore_reclaim();
+}
+
+void db_sync_memstore(void) {
+    db_conn_t* conn = db_acquire_writer();
+    if (conn->handle && memstore_enabled()) {
+        sync_memstore(conn, 0, 0);
+    }
+    db_release_writer(conn);
+}
+
+// Loads the table and notes the change log position in one read
+// transaction, so later syncs start exactly after what was loaded
+static int load_memstore(db_conn_t* conn) {
+    uint64_t started = metrics_now();
+    if (memstore_init() != 0 || sqlite3_exec(conn->handle, "BEGIN", NULL, NULL, NULL) != SQLITE_OK) {
+        memstore_cleanup();
+        return -1;
+    }
+
+    sqlite3_stmt* stmt = db_stmt_acquire(conn, "SELECT COALESCE(MAX(seq), 0) FROM todo_changes");
+    int rc = stmt ? sqlite3_step(stmt) : SQLITE_ERROR;
+    if (rc == SQLITE_ROW) {
+        memstore_seq = sqlite3_column_int64(stmt, 0);
+    }
+    if (stmt) {
+        db_stmt_release(stmt);
+    }
+    stmt = rc == SQLITE_ROW ? db_stmt_acquire(conn, "SELECT * FROM todos") : NULL;
+    if (!stmt) {
+        sqlite3_exec(conn->handle, "COMMIT", NULL, NULL, NULL);
+        memstore_cleanup();
+        return -1;
+    }
+
+    int loaded = 0;
+    todo_t todo;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        read_todo_row(stmt, &todo);
+        if (memstore_put(&todo) != 0) {
+            break;
+        }
+        loaded++;
+    }
+    db_stmt_release(stmt);
+    sqlite3_exec(conn->handle, "COMMIT", NULL, NULL, NULL);
+
+    if (rc != SQLITE_DONE) {
+        LOG_ERROR("Failed to load todos into memory");
+        memstore_cleanup();
+        return -1;
+    }
+
+    LOG_INFO("Loaded %d todos into memory in %llu ms", loaded,
+             (unsigned long long)((metrics_now() - started) / 1000000));
+    return 0;
+}
+
+// Reads the current row and copies its strings into arena
+static int copy_todo_row(sqlite3_stmt* stmt, todo_t* todo, arena_t* arena) {
+    read_todo_row(stmt, todo);
+    todo->title = arena_strndup(arena, todo->title, todo->title_len);
+    todo->description = arena_strndup(arena, todo->description, todo->description_len);
+    return todo->title && todo->description ? 0 : -1;
+}
+
+int db_get_todo(int id, todo_t* todo, arena_t* arena) {
     const char* query = "SELECT * FROM todos WHERE id = ?";
-    sqlite3_stmt* stmt;
+    uint64_t started = metrics_now();
+    if (memstore_enabled()) {
+        int rc = memstore_get(id, todo, arena);
+        if (rc != MEMSTORE_UNAVAILABLE) {
+            metrics_record_db(METRICS_DB_GET, metrics_now() - started);
+            return rc;
+        }
+    }
+
+    db_conn_t* conn = db_acquire_reader();
+    sqlite3_stmt* stmt = db_stmt_acquire(conn, query);
 
-    if (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) != SQLITE_OK) {
+    if (!stmt) {
+        db_release_reader(conn);
         return -1;
     }
 
     sqlite3_bind_int(stmt, 1, id);
 
+    int rc = -1;
     if (sqlite3_step(stmt) == SQLITE_ROW) {
-        todo->id = sqlite3_column_int(stmt, 0);
-        const unsigned char* title = sqlite3_column_text(stmt, 1);
-        const unsigned char* desc = sqlite3_column_text(stmt, 2);
-        if (title) strncpy(todo->title, (const char*)title, sizeof(todo->title) - 1);
-        if (desc) strncpy(todo->description, (const char*)desc, sizeof(todo->description) - 1);
-        todo->completed = sqlite3_column_int(stmt, 3);
-        todo->created_at = sqlite3_column_int64(stmt, 4);
-        todo->updated_at = sqlite3_column_int64(stmt, 5);
-        sqlite3_finalize(stmt);
-        return 0;
+        rc = copy_todo_row(stmt, todo, arena);
     }
 
-    sqlite3_finalize(stmt);
-    return -1;
+    db_stmt_release(stmt);
+    db_release_reader(conn);
+    metrics_record_db(METRICS_DB_GET, metrics_now() - started);
+    return rc;
 }
 
-int db_get_todos(todo_t** todos, int* count) {
-    const char* query = "SELECT COUNT(*) FROM todos";
-    sqlite3_stmt* stmt;
+int db_get_todo_version(int id, time_t* updated_at) {
+    uint64_t started = metrics_now();
+    if (memstore_enabled()) {
+        int rc = memstore_get_version(id, updated_at);
+        if (rc != MEMSTORE_UNAVAILABLE) {
+            metrics_record_db(METRICS_DB_GET_VERSION, metrics_now() - started);
+            return rc;
+        }
+    }
+
+    db_conn_t* conn = db_acquire_reader();
+    sqlite3_stmt* stmt = db_stmt_acquire(conn, "SELECT updated_at FROM todos WHERE id = ?");
+
+    if (!stmt) {
+        db_release_reader(conn);
+        return -1;
+    }
+
+    sqlite3_bind_int(stmt, 1, id);
+
+    int rc = -1;
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        *updated_at = (time_t)sqlite3_column_int64(stmt, 0);
+        rc = 0;
+    }
+
+    db_stmt_release(stmt);
+    db_release_reader(conn);
+    metrics_record_db(METRICS_DB_GET_VERSION, metrics_now() - started);
+    return rc;
+}
+
+static int load_todos(db_conn_t* conn, todo_t** todos, int* count, arena_t* arena) {
+    sqlite3_stmt* stmt = db_stmt_acquire(conn, "SELECT COUNT(*) FROM todos");
 
-    if (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) != SQLITE_OK) {
+    if (!stmt) {
         return -1;
     }
 
     if (sqlite3_step(stmt) != SQLITE_ROW) {
-        sqlite3_finalize(stmt);
+        db_stmt_release(stmt);
         return -1;
     }
 
     *count = sqlite3_column_int(stmt, 0);
-    sqlite3_finalize(stmt);
+    db_stmt_release(stmt);
 
     if (*count == 0) {
         *todos = NULL;
         return 0;
     }
 
-    *todos = malloc(sizeof(todo_t) * *count);
+    *todos = arena_alloc(arena, sizeof(todo_t) * *count);
     if (!*todos) {
         return -1;
     }
 
-    query = "SELECT * FROM todos";
-    if (sqlite3_prepare_v2(db, query, -1, &stmt, NULL) != SQLITE_OK) {
-        free(*todos);
+    stmt = db_stmt_acquire(conn, "SELECT * FROM todos");
+    if (!stmt) {
         return -1;
     }
 
     int i = 0;
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
-        todo_t* todo = &(*todos)[i++];
-        todo->id = sqlite3_column_int(stmt, 0);
-        const unsigned char* title = sqlite3_column_text(stmt, 1);
-        const unsigned char* desc = sqlite3_column_text(stmt, 2);
-        if (title) strncpy(todo->title, (const char*)title, sizeof(todo->title) - 1);
-        if (desc) strncpy(todo->description, (const char*)desc, sizeof(todo->description) - 1);
-        todo->completed = sqlite3_column_int(stmt, 3);
-        todo->created_at = sqlite3_column_int64(stmt, 4);
-        todo->updated_at = sqlite3_column_int64(stmt, 5);
+    int rc = 0;
+    while (rc == 0 && i < *count && sqlite3_step(stmt) == SQLITE_ROW) {
+        rc = copy_todo_row(stmt, &(*todos)[i++], arena);
     }
+    *count = i;
 
-    sqlite3_finalize(stmt);
-    return 0;
-} 
\ No newline at end of file
+    db_stmt_release(stmt);
+    return rc;
+}
+
+int db_get_todos(todo_t** todos, int* count, arena_t* arena) {
+    uint64_t started = metrics_now();
+    if (memstore_enabled()) {
+        int rc = memstore_list(todos, count, arena);
+        if (rc != MEMSTORE_UNAVAILABLE) {
+            metrics_record_db(METRICS_DB_LIST, metrics_now() - started);
+            return rc;
+        }
+    }
+
+    db_conn_t* conn = db_acquire_reader();
+
+    // COUNT and SELECT must see the same snapshot or the count can go stale
+    if (!conn || sqlite3_exec(conn->handle, "BEGIN", NULL, NULL, NULL) != SQLITE_OK) {
+        db_release_reader(conn);
+        return -1;
+    }
+
+    int rc = load_todos(conn, todos, count, arena);
+
+    sqlite3_exec(conn->handle, "COMMIT", NULL, NULL, NULL);
+    db_release_reader(conn);
+    metrics_record_db(METRICS_DB_LIST, metrics_now() - started);
+    return rc;
+}
+
+#define SQL_BUILDER_MAX_PARAMS 8
+
+// Assembles a statement from fixed SQL fragments; values only ever enter it
+// as bound parameters. Running out of space marks the builder failed.
+typedef struct {
+    char sql[512];
+    size_t len;
+    int conditions;
+    int failed;
+    db_param_t params[SQL_BUILDER_MAX_PARAMS];
+    int param_count;
+} sql_builder_t;
+
+static void sql_append(sql_builder_t* builder, const char* fragment) {
+    size_t len = strlen(fragment);
+    if (builder->len + len >= sizeof(builder->sql)) {
+        builder->failed = 1;
+        return;
+    }
+    memcpy(builder->sql + builder->len, fragment, len + 1);
+    builder->len += len;
+}
+
+static void sql_bind(sql_builder_t* builder, db_param_t param) {
+    if (builder->param_count == SQL_BUILDER_MAX_PARAMS) {
+        builder->failed = 1;
+        return;
+    }
+    builder->params[builder->param_count++] = param;
+}
+
+// Adds a condition joined with AND. Its placeholders are bound in order from
+// the following sql_bind calls.
+static void sql_where(sql_builder_t* builder, const char* condition) {
+    sql_append(builder, builder->conditions++ ? " AND " : " WHERE ");
+    sql_append(builder, condition);
+}
+
+static void build_list_query(sql_builder_t* builder, const todo_query_t* query) {
+    static const char* const sort_columns[] = {"id", "created_at", "updated_at"};
+    const char* column = sort_columns[query->sort];
+    int desc = query->descending;
+
+    sql_append(builder, "SELECT * FROM todos");
+
+    if (query->completed != TODO_COMPLETED_ANY) {
+        sql_where(builder, "completed = ?");
+        sql_bind(builder, DB_INT(query->completed == TODO_COMPLETED_TRUE));
+    }
+    if (query->updated_since > 0) {
+        sql_where(builder, "updated_at >= ?");
+        sql_bind(builder, DB_INT(query->updated_since));
+    }
+    if (query->created_before > 0) {
+        sql_where(builder, "created_at < ?");
+        sql_bind(builder, DB_INT(query->created_before));
+    }
+
+    if (query->after_id > 0) {
+        if (query->sort == TODO_SORT_ID) {
+            sql_where(builder, desc ? "id < ?" : "id > ?");
+        } else {
+            // Row values let SQLite seek the (column, rowid) index directly
+            char condition[64];
+            snprintf(condition, sizeof(condition), "(%s, id) %s (?, ?)", column, desc ? "<" : ">");
+            sql_where(builder, condition);
+            sql_bind(builder, DB_INT(query->after_value));
+        }
+        sql_bind(builder, DB_INT(query->after_id));
+    }
+
+    sql_append(builder, " ORDER BY ");
+    if (query->sort != TODO_SORT_ID) {
+        sql_append(builder, column);
+        sql_append(builder, desc ? " DESC, " : ", ");
+    }
+    sql_append(builder, desc ? "id DESC LIMIT ?" : "id LIMIT ?");
+    sql_bind(builder, DB_INT(query->limit > 0 ? query->limit : -1));
+}
+
+// Walks one keyset page without materializing it. Returns the number of rows
+// visited or -1 on error.
+int db_each_todo(const todo_query_t* query, todo_visitor_t visit, void* ctx) {
+    // Pages by created_at or updated_at keep using their SQLite indexes
+    if (memstore_enabled() && query->sort == TODO_SORT_ID) {
+        uint64_t started = metrics_now();
+        int rc = memstore_each(query, visit, ctx);
+        if (rc != MEMSTORE_UNAVAILABLE) {
+            metrics_record_db(METRICS_DB_PAGE, metrics_now() - started);
+            return rc;
+        }
+    }
+
+    sql_builder_t builder = {0};
+    build_list_query(&builder, query);
+    if (builder.failed) {
+        return -1;
+    }
+
+    uint64_t started = metrics_now();
+    db_conn_t* conn = db_acquire_reader();
+    sqlite3_stmt* stmt = db_stmt_acquire(conn, builder.sql);
+
+    if (!stmt) {
+        db_release_reader(conn);
+        return -1;
+    }
+
+    if (bind_params(stmt, builder.params, builder.param_count) != 0) {
+        db_stmt_release(stmt);
+        db_release_reader(conn);
+        return -1;
+    }
+
+    // Time spent in the visitor is the caller's, not the database's
+    uint64_t visiting = 0;
+    int visited = 0;
+    int rc;
+    todo_t todo;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        read_todo_row(stmt, &todo);
+        visited++;
+        uint64_t visit_started = metrics_now();
+        int stop = visit(&todo, ctx);
+        visiting += metrics_now() - visit_started;
+        if (stop != 0) {
+            rc = SQLITE_DONE;
+            break;
+        }
+    }
+
+    db_stmt_release(stmt);
+    db_release_reader(conn);
+    metrics_record_db(METRICS_DB_PAGE, metrics_now() - started - visiting);
+    return rc == SQLITE_DONE ? visited : -1;
+}
+
+int db_each_change(long long since, int limit, todo_change_visitor_t visit, void* ctx) {
+    static const char* const sql =
+        "SELECT todos.*, todo_changes.seq, todo_changes.op, todo_changes.todo_id, todo_changes.changed_at "
+        "FROM todo_changes LEFT JOIN todos ON todos.id = todo_changes.todo_id "
+        "WHERE todo_changes.seq > ? ORDER BY todo_changes.seq LIMIT ?";
+
+    uint64_t started = metrics_now();
+    db_conn_t* conn = db_acquire_reader();
+    sqlite3_stmt* stmt = db_stmt_acquire(conn, sql);
+
+    if (!stmt) {
+        db_release_reader(conn);
+        return -1;
+    }
+
+    sqlite3_bind_int64(stmt, 1, since);
+    sqlite3_bind_int(stmt, 2, limit);
+
+    uint64_t visiting = 0;
+    int visited = 0;
+    int rc;
+    todo_t todo;
+    todo_change_t change;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        change.seq = sqlite3_column_int64(stmt, 6);
+        change.op = (todo_change_op_t)sqlite3_column_int(stmt, 7);
+        change.id = sqlite3_column_int(stmt, 8);
+        change.changed_at = (time_t)sqlite3_column_int64(stmt, 9);
+        change.todo = NULL;
+        if (sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+            read_todo_row(stmt, &todo);
+            change.todo = &todo;
+        }
+        visited++;
+        uint64_t visit_started = metrics_now();
+        int stop = visit(&change, ctx);
+        visiting += metrics_now() - visit_started;
+        if (stop != 0) {
+            rc = SQLITE_DONE;
+            break;
+        }
+    }
+
+    db_stmt_release(stmt);
+    db_release_reader(conn);
+    metrics_record_db(METRICS_DB_CHANGES, metrics_now() - started - visiting);
+    return rc == SQLITE_DONE ? visited : -1;
+}
+
+int db_change_bounds(long long* oldest, long long* latest) {
+    db_conn_t* conn = db_acquire_reader();
+    // Separate subqueries so each is a single seek on the primary key
+    sqlite3_stmt* stmt = db_stmt_acquire(conn, "SELECT COALESCE((SELECT MIN(seq) FROM todo_changes), 0), "
+                                               "COALESCE((SELECT MAX(seq) FROM todo_changes), 0)");
+
+    if (!stmt) {
+        db_release_reader(conn);
+        return -1;
+    }
+
+    int rc = -1;
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        *oldest = sqlite3_column_int64(stmt, 0);
+        *latest = sqlite3_column_int64(stmt, 1);
+        rc = 0;
+    }
+
+    db_stmt_release(stmt);
+    db_release_reader(conn);
+    return rc;
+}
+
+#define SEARCH_MATCH_SIZE (TODO_SEARCH_MAX_TEXT * 2 + 8)
+
+// Turns free text into an FTS5 query of quoted terms, so punctuation and
+// operators in the input are searched for rather than parsed. A trailing *
+// keeps its prefix meaning. Returns the number of terms written.
+static int build_match_expression(const char* text, char* out, size_t size) {
+    size_t len = 0;
+    int terms = 0;
+
+    while (*text) {
+        while (*text == ' ' || *text == '\t' || *text == '\n' || *text == '\r') text++;
+        const char* start = text;
+        while (*text && *text != ' ' && *text != '\t' && *text != '\n' && *text != '\r') text++;
+
+        const char* end = text;
+        int prefix = end > start && end[-1] == '*';
+        if (prefix) end--;
+        if (end == start) continue;
+
+        // Worst case per term is every byte doubled, plus quotes, star and space
+        if (len + (size_t)(end - start) * 2 + 4 >= size) return -1;
+        if (terms > 0) out[len++] = ' ';
+        out[len++] = '"';
+        for (const char* p = start; p < end; p++) {
+            if (*p == '"') out[len++] = '"';
+            out[len++] = *p;
+        }
+        out[len++] = '"';
+        if (prefix) out[len++] = '*';
+        terms++;
+    }
+
+    out[len] = '\0';
+    return terms;
+}
+
+int db_search_todos(const todo_search_t* search, todo_search_visitor_t visit, void* ctx) {
+    static const char* const sql =
+        "SELECT todos.*, todos_fts.rank, "
+        "highlight(todos_fts, 0, '" TODO_SEARCH_MARK_OPEN "', '" TODO_SEARCH_MARK_CLOSE "'), "
+        "snippet(todos_fts, 1, '" TODO_SEARCH_MARK_OPEN "', '" TODO_SEARCH_MARK_CLOSE "', '...', 24) "
+        "FROM todos_fts JOIN todos ON todos.id = todos_fts.rowid "
+        "WHERE todos_fts MATCH ? ORDER BY todos_fts.rank LIMIT ? OFFSET ?";
+
+    char match[SEARCH_MATCH_SIZE];
+    int terms = build_match_expression(search->text, match, sizeof(match));
+    if (terms <= 0) {
+        return terms;   // Nothing to search for matches nothing
+    }
+
+    uint64_t started = metrics_now();
+    db_conn_t* conn = db_acquire_reader();
+    sqlite3_stmt* stmt = db_stmt_acquire(conn, sql);
+
+    if (!stmt) {
+        db_release_reader(conn);
+        return -1;
+    }
+
+    db_param_t params[] = {DB_TEXT(match), DB_INT(search->limit), DB_INT(search->offset)};
+    if (bind_params(stmt, params, 3) != 0) {
+        db_stmt_release(stmt);
+        db_release_reader(conn);
+        return -1;
+    }
+
+    uint64_t visiting = 0;
+    int visited = 0;
+    int rc;
+    todo_search_hit_t hit;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        read_todo_row(stmt, &hit.todo);
+        hit.rank = sqlite3_column_double(stmt, 6);
+        hit.title_snippet = column_text(stmt, 7, &hit.title_snippet_len);
+        hit.description_snippet = column_text(stmt, 8, &hit.description_snippet_len);
+        visited++;
+        uint64_t visit_started = metrics_now();
+        int stop = visit(&hit, ctx);
+        visiting += metrics_now() - visit_started;
+        if (stop != 0) {
+            rc = SQLITE_DONE;
+            break;
+        }
+    }
+
+    if (rc != SQLITE_DONE) {
+        LOG_ERROR("Search failed: %s", sqlite3_errmsg(conn->handle));
+    }
+    db_stmt_release(stmt);
+    db_release_reader(conn);
+    metrics_record_db(METRICS_DB_SEARCH, metrics_now() - started - visiting);
+    return rc == SQLITE_DONE ? visited : -1;
+}
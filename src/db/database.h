@@ -3,11 +3,82 @@
 
 #include "../core/todo.h"
 
+typedef struct {
+    const char* path;
+    int reader_count;       // Read-only pooled connections, 0 = one per CPU
+    int batch_max;          // Maximum mutations committed in one transaction
+    int batch_window_us;    // How long the writer waits for a batch to fill, 0 = no wait
+    int memory_primary;     // Serve reads from an in-memory copy of the todos table
+} db_config_t;
 
+typedef enum {
+    DB_PARAM_NULL,
+    DB_PARAM_INT,
+    DB_PARAM_TEXT
+} db_param_type_t;
+
+// A typed statement parameter. Text is bound without copying, so it must stay
+// valid until the call that receives it returns.
+typedef struct {
+    db_param_type_t type;
+    long long int_value;
+    const char* text_value;
+    int text_length;    // -1 = NUL-terminated
+} db_param_t;
+
+#define DB_NULL() ((db_param_t){ .type = DB_PARAM_NULL })
+#define DB_INT(v) ((db_param_t){ .type = DB_PARAM_INT, .int_value = (long long)(v) })
+#define DB_TEXT(s) ((db_param_t){ .type = DB_PARAM_TEXT, .text_value = (s), .text_length = -1 })
+#define DB_TEXT_LEN(s, n) ((db_param_t){ .type = DB_PARAM_TEXT, .text_value = (s), .text_length = (int)(n) })
+
+typedef struct {
+    int status;         // 0 on success, -1 on failure
+    long long last_insert_id;
+    int changes;
+} db_result_t;
+
+// A single mutation for the write pipeline
+typedef struct {
+    const char* query;
+    const db_param_t* params;
+    int param_count;
+} db_op_t;
+
+void db_config_defaults(db_config_t* config);
 int db_init(const char* db_path);
+int db_init_config(const db_config_t* config);
 void db_cleanup(void);
-int db_execute_query(const char* query, ...);
-int db_get_todo(int id, todo_t* todo);
-int db_get_todos(todo_t** todos, int* count);
+int db_execute_query(const char* query, const db_param_t* params, int param_count, db_result_t* result);
+int db_execute_batch(const db_op_t* ops, int op_count, db_result_t* results);
+int db_get_todo(int id, todo_t* todo, arena_t* arena);
+// Reads only updated_at, which versions the row. Returns -1 if there is no such todo.
+int db_get_todo_version(int id, time_t* updated_at);
+int db_get_todos(todo_t** todos, int* count, arena_t* arena);
+int db_each_todo(const todo_query_t* query, todo_visitor_t visit, void* ctx);
+int db_each_change(long long since, int limit, todo_change_visitor_t visit, void* ctx);
+int db_change_bounds(long long* oldest, long long* latest);
+// Upserts count rows keeping their ids and timestamps; id 0 inserts a new
+// row. All rows commit together or none do. Returns count, or -1.
+long long db_import_todos(todo_import_row_fn row, void* ctx, long long count);
+// Staged imports: rows are copied into a private temporary file as they
+// arrive, and commit applies all of them in one transaction, returning the
+// number of rows or -1. close discards the file, committed or not.
+todo_import_stage_t* db_import_stage_open(void);
+int db_import_stage_add(todo_import_stage_t* stage, const todo_t* todos, int count);
+long long db_import_stage_commit(todo_import_stage_t* stage);
+void db_import_stage_close(todo_import_stage_t* stage);
+// Applies every change in the change log that the memory store has not seen,
+// including writes made by other processes. A no-op without a memory store.
+void db_sync_memstore(void);
+// Called with the id of each todo the memory store finds changed by another
+// process, on the syncing thread with the writer lock held. id 0 means the
+// store was reloaded and any todo may have changed.
+typedef void (*db_foreign_change_fn)(int id);
+void db_set_foreign_change_listener(db_foreign_change_fn listener);
+// Per thread: reads fail rather than wait for a free connection
+void db_set_reads_nowait(int enabled);
+// Whether a read failed that way since the last call; clears the flag
+int db_take_refused_read(void);
+int db_search_todos(const todo_search_t* search, todo_search_visitor_t visit, void* ctx);
 
 #endif 
\ No newline at end of file
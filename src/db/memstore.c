@@ -0,0 +1,402 @@
+#include "memstore.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Ids are positive ints: 11 + 10 + 10 bits
+#define MEMSTORE_LEAF_BITS 10
+#define MEMSTORE_MID_BITS 10
+#define MEMSTORE_TOP_BITS 11
+#define MEMSTORE_LEAF_SIZE (1 << MEMSTORE_LEAF_BITS)
+#define MEMSTORE_MID_SIZE (1 << MEMSTORE_MID_BITS)
+#define MEMSTORE_TOP_SIZE (1 << MEMSTORE_TOP_BITS)
+#define MEMSTORE_LEAF_SHIFT MEMSTORE_LEAF_BITS
+#define MEMSTORE_TOP_SHIFT (MEMSTORE_LEAF_BITS + MEMSTORE_MID_BITS)
+#define MEMSTORE_CACHE_LINE 64
+
+// One version of a row. The title and description follow the header in the
+// same allocation, so a record is never modified once published.
+typedef struct memstore_record {
+    todo_t todo;
+    struct memstore_record* next_retired;
+    uint64_t retired_epoch;
+    char text[];
+} memstore_record_t;
+
+typedef struct {
+    _Atomic(memstore_record_t*) slots[MEMSTORE_LEAF_SIZE];
+} memstore_leaf_t;
+
+typedef struct {
+    _Atomic(memstore_leaf_t*) leaves[MEMSTORE_MID_SIZE];
+} memstore_mid_t;
+
+// Announces the epoch a thread started reading in, 0 while it is not.
+// Readers of exited threads are released and reused like log rings.
+typedef struct memstore_reader {
+    _Alignas(MEMSTORE_CACHE_LINE) atomic_uint_fast64_t epoch;
+    atomic_int closed;
+    int depth;                          // Owner only; nested reads keep the outer epoch
+    struct memstore_reader* next;
+} memstore_reader_t;
+
+static _Atomic(memstore_mid_t*) top[MEMSTORE_TOP_SIZE];
+static atomic_int enabled = 0;
+static atomic_size_t record_count = 0;
+static atomic_uint_fast64_t global_epoch = 1;
+static memstore_record_t* retired = NULL;       // Writer only
+
+static _Atomic(memstore_reader_t*) readers = NULL;
+static pthread_key_t reader_key;
+static pthread_once_t reader_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local memstore_reader_t* thread_reader = NULL;
+
+static void release_reader(void* ptr) {
+    memstore_reader_t* reader = ptr;
+    atomic_store_explicit(&reader->closed, 1, memory_order_release);
+}
+
+static void create_reader_key(void) {
+    pthread_key_create(&reader_key, release_reader);
+}
+
+static memstore_reader_t* acquire_reader(void) {
+    if (thread_reader) {
+        return thread_reader;
+    }
+    pthread_once(&reader_key_once, create_reader_key);
+
+    for (memstore_reader_t* reader = atomic_load_explicit(&readers, memory_order_acquire); reader;
+         reader = reader->next) {
+        int closed = 1;
+        if (atomic_compare_exchange_strong(&reader->closed, &closed, 0)) {
+            thread_reader = reader;
+            pthread_setspecific(reader_key, reader);
+            return reader;
+        }
+    }
+
+    memstore_reader_t* reader = aligned_alloc(MEMSTORE_CACHE_LINE, sizeof(memstore_reader_t));
+    if (!reader) {
+        return NULL;
+    }
+    atomic_init(&reader->epoch, 0);
+    atomic_init(&reader->closed, 0);
+    reader->depth = 0;
+
+    reader->next = atomic_load_explicit(&readers, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&readers, &reader->next, reader,
+                                                  memory_order_release, memory_order_relaxed)) {
+    }
+
+    thread_reader = reader;
+    pthread_setspecific(reader_key, reader);
+    return reader;
+}
+
+// The fence orders the announcement before every load of the index, which
+// pairs with the writer unlinking a record before it scans the readers
+static memstore_reader_t* read_begin(void) {
+    memstore_reader_t* reader = acquire_reader();
+    if (reader && reader->depth++ == 0) {
+        atomic_store_explicit(&reader->epoch, atomic_load(&global_epoch), memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+    }
+    return reader;
+}
+
+static void read_end(memstore_reader_t* reader) {
+    if (--reader->depth == 0) {
+        atomic_store_explicit(&reader->epoch, 0, memory_order_release);
+    }
+}
+
+static memstore_record_t* lookup(int id) {
+    if (id <= 0) {
+        return NULL;
+    }
+    memstore_mid_t* mid = atomic_load_explicit(&top[id >> MEMSTORE_TOP_SHIFT], memory_order_acquire);
+    if (!mid) {
+        return NULL;
+    }
+    memstore_leaf_t* leaf = atomic_load_explicit(&mid->leaves[(id >> MEMSTORE_LEAF_SHIFT) & (MEMSTORE_MID_SIZE - 1)],
+                                                 memory_order_acquire);
+    if (!leaf) {
+        return NULL;
+    }
+    return atomic_load_explicit(&leaf->slots[id & (MEMSTORE_LEAF_SIZE - 1)], memory_order_acquire);
+}
+
+// Finds the first record at *id or beyond it in the direction of step,
+// skipping whole subtrees that were never allocated
+static memstore_record_t* seek(long long* id, int step) {
+    while (*id >= 1 && *id <= INT_MAX) {
+        long long top_index = *id >> MEMSTORE_TOP_SHIFT;
+        memstore_mid_t* mid = atomic_load_explicit(&top[top_index], memory_order_acquire);
+        if (!mid) {
+            *id = step > 0 ? (top_index + 1) << MEMSTORE_TOP_SHIFT : (top_index << MEMSTORE_TOP_SHIFT) - 1;
+            continue;
+        }
+        long long leaf_index = *id >> MEMSTORE_LEAF_SHIFT;
+        memstore_leaf_t* leaf = atomic_load_explicit(&mid->leaves[leaf_index & (MEMSTORE_MID_SIZE - 1)],
+                                                     memory_order_acquire);
+        if (!leaf) {
+            *id = step > 0 ? (leaf_index + 1) << MEMSTORE_LEAF_SHIFT : (leaf_index << MEMSTORE_LEAF_SHIFT) - 1;
+            continue;
+        }
+        memstore_record_t* record = atomic_load_explicit(&leaf->slots[*id & (MEMSTORE_LEAF_SIZE - 1)],
+                                                         memory_order_acquire);
+        if (record) {
+            return record;
+        }
+        *id += step;
+    }
+    return NULL;
+}
+
+static _Atomic(memstore_record_t*)* writable_slot(int id) {
+    _Atomic(memstore_mid_t*)* mid_slot = &top[id >> MEMSTORE_TOP_SHIFT];
+    memstore_mid_t* mid = atomic_load_explicit(mid_slot, memory_order_relaxed);
+    if (!mid) {
+        mid = calloc(1, sizeof(memstore_mid_t));
+        if (!mid) {
+            return NULL;
+        }
+        atomic_store_explicit(mid_slot, mid, memory_order_release);
+    }
+
+    _Atomic(memstore_leaf_t*)* leaf_slot = &mid->leaves[(id >> MEMSTORE_LEAF_SHIFT) & (MEMSTORE_MID_SIZE - 1)];
+    memstore_leaf_t* leaf = atomic_load_explicit(leaf_slot, memory_order_relaxed);
+    if (!leaf) {
+        leaf = calloc(1, sizeof(memstore_leaf_t));
+        if (!leaf) {
+            return NULL;
+        }
+        atomic_store_explicit(leaf_slot, leaf, memory_order_release);
+    }
+    return &leaf->slots[id & (MEMSTORE_LEAF_SIZE - 1)];
+}
+
+static void retire(memstore_record_t* record) {
+    record->retired_epoch = atomic_load_explicit(&global_epoch, memory_order_relaxed);
+    record->next_retired = retired;
+    retired = record;
+}
+
+int memstore_init(void) {
+    atomic_store(&global_epoch, 1);
+    atomic_store(&record_count, 0);
+    atomic_store(&enabled, 1);
+    return 0;
+}
+
+void memstore_cleanup(void) {
+    atomic_store(&enabled, 0);
+    for (int t = 0; t < MEMSTORE_TOP_SIZE; t++) {
+        memstore_mid_t* mid = atomic_load(&top[t]);
+        if (!mid) {
+            continue;
+        }
+        for (int m = 0; m < MEMSTORE_MID_SIZE; m++) {
+            memstore_leaf_t* leaf = atomic_load(&mid->leaves[m]);
+            if (!leaf) {
+                continue;
+            }
+            for (int i = 0; i < MEMSTORE_LEAF_SIZE; i++) {
+                free(atomic_load(&leaf->slots[i]));
+            }
+            free(leaf);
+        }
+        free(mid);
+        atomic_store(&top[t], NULL);
+    }
+
+    while (retired) {
+        memstore_record_t* next = retired->next_retired;
+        free(retired);
+        retired = next;
+    }
+    atomic_store(&record_count, 0);
+}
+
+int memstore_enabled(void) {
+    return atomic_load_explicit(&enabled, memory_order_acquire);
+}
+
+void memstore_disable(void) {
+    atomic_store(&enabled, 0);
+}
+
+int memstore_put(const todo_t* todo) {
+    if (todo->id <= 0) {
+        return -1;
+    }
+
+    memstore_record_t* record = malloc(sizeof(memstore_record_t) + todo->title_len + todo->description_len + 2);
+    _Atomic(memstore_record_t*)* slot = record ? writable_slot(todo->id) : NULL;
+    if (!slot) {
+        free(record);
+        return -1;
+    }
+
+    char* title = record->text;
+    char* description = title + todo->title_len + 1;
+    memcpy(title, todo->title, todo->title_len);
+    title[todo->title_len] = '\0';
+    memcpy(description, todo->description, todo->description_len);
+    description[todo->description_len] = '\0';
+    record->todo = *todo;
+    record->todo.title = title;
+    record->todo.description = description;
+
+    memstore_record_t* old = atomic_exchange(slot, record);
+    if (old) {
+        retire(old);
+    } else {
+        atomic_fetch_add_explicit(&record_count, 1, memory_order_relaxed);
+    }
+    return 0;
+}
+
+void memstore_remove(int id) {
+    if (id <= 0 || !lookup(id)) {
+        return;
+    }
+    memstore_record_t* old = atomic_exchange(writable_slot(id), NULL);
+    if (old) {
+        retire(old);
+        atomic_fetch_sub_explicit(&record_count, 1, memory_order_relaxed);
+    }
+}
+
+// A record retired in epoch E was unlinked before the epoch moved past E,
+// so only readers that announced E or earlier can still hold it
+void memstore_reclaim(void) {
+    if (!retired) {
+        return;
+    }
+
+    uint64_t oldest = atomic_fetch_add(&global_epoch, 1) + 1;
+    for (memstore_reader_t* reader = atomic_load_explicit(&readers, memory_order_acquire); reader;
+         reader = reader->next) {
+        uint64_t epoch = atomic_load(&reader->epoch);
+        if (epoch && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+
+    memstore_record_t** link = &retired;
+    while (*link) {
+        memstore_record_t* record = *link;
+        if (record->retired_epoch < oldest) {
+            *link = record->next_retired;
+            free(record);
+        } else {
+            link = &record->next_retired;
+        }
+    }
+}
+
+static int copy_todo(const todo_t* from, todo_t* todo, arena_t* arena) {
+    *todo = *from;
+    todo->title = arena_strndup(arena, from->title, from->title_len);
+    todo->description = arena_strndup(arena, from->description, from->description_len);
+    return todo->title && todo->description ? 0 : -1;
+}
+
+int memstore_get(int id, todo_t* todo, arena_t* arena) {
+    memstore_reader_t* reader = read_begin();
+    if (!reader) {
+        return MEMSTORE_UNAVAILABLE;
+    }
+    memstore_record_t* record = lookup(id);
+    int rc = record ? copy_todo(&record->todo, todo, arena) : -1;
+    read_end(reader);
+    return rc;
+}
+
+int memstore_get_version(int id, time_t* updated_at) {
+    memstore_reader_t* reader = read_begin();
+    if (!reader) {
+        return MEMSTORE_UNAVAILABLE;
+    }
+    memstore_record_t* record = lookup(id);
+    if (record) {
+        *updated_at = record->todo.updated_at;
+    }
+    read_end(reader);
+    return record ? 0 : -1;
+}
+
+int memstore_list(todo_t** todos, int* count, arena_t* arena) {
+    memstore_reader_t* reader = read_begin();
+    if (!reader) {
+        return MEMSTORE_UNAVAILABLE;
+    }
+
+    // Rows created during the walk may not fit; they are left out
+    size_t capacity = atomic_load_explicit(&record_count, memory_order_relaxed);
+    *todos = NULL;
+    *count = 0;
+    if (capacity > 0) {
+        *todos = arena_alloc(arena, sizeof(todo_t) * capacity);
+        if (!*todos) {
+            read_end(reader);
+            return -1;
+        }
+    }
+
+    int rc = 0;
+    long long id = 1;
+    memstore_record_t* record;
+    while (rc == 0 && (size_t)*count < capacity && (record = seek(&id, 1)) != NULL) {
+        rc = copy_todo(&record->todo, &(*todos)[(*count)++], arena);
+        id++;
+    }
+    read_end(reader);
+    return rc;
+}
+
+static int matches(const todo_query_t* query, const todo_t* todo) {
+    if (query->completed != TODO_COMPLETED_ANY &&
+        (todo->completed != 0) != (query->completed == TODO_COMPLETED_TRUE)) {
+        return 0;
+    }
+    if (query->updated_since > 0 && todo->updated_at < query->updated_since) {
+        return 0;
+    }
+    if (query->created_before > 0 && todo->created_at >= query->created_before) {
+        return 0;
+    }
+    return 1;
+}
+
+int memstore_each(const todo_query_t* query, todo_visitor_t visit, void* ctx) {
+    if (query->sort != TODO_SORT_ID) {
+        return MEMSTORE_UNAVAILABLE;
+    }
+    memstore_reader_t* reader = read_begin();
+    if (!reader) {
+        return MEMSTORE_UNAVAILABLE;
+    }
+
+    int step = query->descending ? -1 : 1;
+    long long id = query->after_id > 0 ? (long long)query->after_id + step : (step > 0 ? 1 : INT_MAX);
+    int visited = 0;
+    memstore_record_t* record;
+    while ((query->limit == 0 || visited < query->limit) && (record = seek(&id, step)) != NULL) {
+        id += step;
+        if (!matches(query, &record->todo)) {
+            continue;
+        }
+        visited++;
+        if (visit(&record->todo, ctx) != 0) {
+            break;
+        }
+    }
+    read_end(reader);
+    return visited;
+}
@@ -0,0 +1,52 @@
+#ifndef MEMSTORE_H
+#define MEMSTORE_H
+
+#include <stddef.h>
+#include "../core/todo.h"
+
+// In-process copy of the todos table for the memory-primary mode. Rows are
+// immutable records indexed by id in a three-level radix table, so a lookup
+// is three dependent loads and an id-ordered scan walks the leaves in order.
+// Only the database writer thread changes the store; readers take no locks
+// and records they may still see are freed by epoch-based reclamation.
+//
+// The store assumes this process owns the database. The writer applies
+// rows from the change log, so writes by other processes arrive only when
+// it next syncs, after a local write or within DB_MEMSTORE_POLL_MS.
+//
+// Readers see every committed row change, but not the rows of one group
+// commit all at once: a scan running while a batch is applied may see some
+// of its rows and not others.
+
+// Returned by readers that could not register with the store; the caller
+// should read from SQLite instead
+#define MEMSTORE_UNAVAILABLE (-2)
+
+int memstore_init(void);
+void memstore_cleanup(void);
+int memstore_enabled(void);
+
+// Stops serving reads without freeing anything a reader may hold; the
+// memory is released by memstore_cleanup
+void memstore_disable(void);
+
+// Writer thread only. Put copies the todo, replacing any record with its id.
+int memstore_put(const todo_t* todo);
+void memstore_remove(int id);
+
+// Writer thread only: frees replaced records no reader can still see
+void memstore_reclaim(void);
+
+// Copies the todo's strings into arena. Returns -1 if there is no such todo.
+int memstore_get(int id, todo_t* todo, arena_t* arena);
+int memstore_get_version(int id, time_t* updated_at);
+
+// Every todo by ascending id, allocated from arena
+int memstore_list(todo_t** todos, int* count, arena_t* arena);
+
+// Walks one keyset page ordered by id; the todo points into the store for
+// the duration of the visit. Returns the number visited. Queries sorted by
+// another column return MEMSTORE_UNAVAILABLE.
+int memstore_each(const todo_query_t* query, todo_visitor_t visit, void* ctx);
+
+#endif
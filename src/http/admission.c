@@ -0,0 +1,197 @@
+#include "admission.h"
+#include <netinet/in.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ADMISSION_CLIENT_SLOTS 16384        // Power of two
+#define ADMISSION_CLIENT_PROBES 4
+#define ADMISSION_DELAY_WEIGHT 8            // Each sample moves the average by 1/8 of the difference
+#define NS_PER_SECOND 1000000000ull
+
+typedef struct {
+    uint64_t interval;              // Nanoseconds per token, 0 = unlimited
+    uint64_t tolerance;             // interval * burst
+} bucket_rate_t;
+
+typedef struct {
+    atomic_uint_fast64_t key;       // 0 = free
+    atomic_uint_fast64_t tat;
+} client_slot_t;
+
+static bucket_rate_t global_rate;
+static bucket_rate_t client_rate;
+static atomic_uint_fast64_t global_tat = 0;
+static client_slot_t* clients = NULL;
+static unsigned int max_in_flight[ADMISSION_CLASS_COUNT];
+static atomic_uint in_flight[ADMISSION_CLASS_COUNT];
+static uint64_t shed_delay = 0;
+static atomic_uint_fast64_t queue_delay = 0;
+static atomic_uint_fast64_t queue_delay_at = 0;
+
+void admission_config_defaults(admission_config_t* config) {
+    memset(config, 0, sizeof(*config));
+    config->burst = 100;
+    config->client_burst = 20;
+}
+
+static bucket_rate_t make_rate(double rate, unsigned int burst) {
+    bucket_rate_t bucket = {0, 0};
+    if (rate > 0) {
+        bucket.interval = (uint64_t)((double)NS_PER_SECOND / rate);
+        if (bucket.interval == 0) bucket.interval = 1;
+        bucket.tolerance = bucket.interval * (burst > 0 ? burst : 1);
+    }
+    return bucket;
+}
+
+int admission_init(const admission_config_t* config) {
+    global_rate = make_rate(config->rate, config->burst);
+    client_rate = make_rate(config->client_rate, config->client_burst);
+    atomic_store(&global_tat, 0);
+    if (client_rate.interval) {
+        clients = calloc(ADMISSION_CLIENT_SLOTS, sizeof(client_slot_t));
+        if (!clients) {
+            return -1;
+        }
+    }
+    for (int i = 0; i < ADMISSION_CLASS_COUNT; i++) {
+        max_in_flight[i] = config->max_in_flight[i];
+        atomic_store(&in_flight[i], 0);
+    }
+    shed_delay = (uint64_t)config->shed_delay_ms * 1000000ull;
+    atomic_store(&queue_delay, 0);
+    atomic_store(&queue_delay_at, 0);
+    return 0;
+}
+
+void admission_cleanup(void) {
+    free(clients);
+    clients = NULL;
+    global_rate.interval = 0;
+    client_rate.interval = 0;
+    shed_delay = 0;
+    for (int i = 0; i < ADMISSION_CLASS_COUNT; i++) {
+        max_in_flight[i] = 0;
+    }
+}
+
+uint64_t admission_client_key(const struct sockaddr* addr) {
+    const unsigned char* bytes = NULL;
+    size_t len = 0;
+    if (addr && addr->sa_family == AF_INET) {
+        bytes = (const unsigned char*)&((const struct sockaddr_in*)addr)->sin_addr;
+        len = sizeof(struct in_addr);
+    } else if (addr && addr->sa_family == AF_INET6) {
+        bytes = (const unsigned char*)&((const struct sockaddr_in6*)addr)->sin6_addr;
+        len = sizeof(struct in6_addr);
+    }
+
+    // FNV-1a; 0 marks a free slot, so it is never returned
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash ? hash : 1;
+}
+
+// GCRA: the bucket is full once now reaches tat, and each token pushes tat
+// one interval further. A request conforms while tat stays within
+// tolerance of now.
+static int take_token(atomic_uint_fast64_t* tat, const bucket_rate_t* rate, uint64_t now, uint64_t* wait) {
+    uint64_t old = atomic_load_explicit(tat, memory_order_relaxed);
+    for (;;) {
+        uint64_t next = (old > now ? old : now) + rate->interval;
+        if (next - now > rate->tolerance) {
+            *wait = next - rate->tolerance - now;
+            return -1;
+        }
+        if (atomic_compare_exchange_weak_explicit(tat, &old, next, memory_order_relaxed, memory_order_relaxed)) {
+            return 0;
+        }
+    }
+}
+
+// A few slots are probed from the hashed one. A slot whose bucket has
+// refilled is as good as free and may be taken over; if none is, the
+// client shares the first one, which only makes its limit stricter.
+static client_slot_t* client_slot(uint64_t key, uint64_t now) {
+    size_t index = (size_t)key & (ADMISSION_CLIENT_SLOTS - 1);
+    for (int i = 0; i < ADMISSION_CLIENT_PROBES; i++) {
+        client_slot_t* slot = &clients[(index + (size_t)i) & (ADMISSION_CLIENT_SLOTS - 1)];
+        uint64_t current = atomic_load_explicit(&slot->key, memory_order_relaxed);
+        if (current == key) {
+            return slot;
+        }
+        if (current == 0 || atomic_load_explicit(&slot->tat, memory_order_relaxed) <= now) {
+            if (atomic_compare_exchange_strong_explicit(&slot->key, &current, key,
+                                                        memory_order_relaxed, memory_order_relaxed) ||
+                current == key) {
+                return slot;
+            }
+        }
+    }
+    return &clients[index];
+}
+
+static unsigned int seconds_until(uint64_t wait) {
+    return (unsigned int)((wait + NS_PER_SECOND - 1) / NS_PER_SECOND);
+}
+
+int admission_check_rate(uint64_t client, uint64_t now, unsigned int* retry_after) {
+    uint64_t wait;
+    if (clients && client_rate.interval &&
+        take_token(&client_slot(client, now)->tat, &client_rate, now, &wait) != 0) {
+        *retry_after = seconds_until(wait);
+        return 429;
+    }
+    if (global_rate.interval && take_token(&global_tat, &global_rate, now, &wait) != 0) {
+        *retry_after = seconds_until(wait);
+        return 503;
+    }
+    return 0;
+}
+
+// Shedding stops admitting the requests that produce delay samples, so an
+// average nobody has updated for a while no longer counts
+static int shedding(uint64_t now) {
+    if (!shed_delay || atomic_load_explicit(&queue_delay, memory_order_relaxed) <= shed_delay) {
+        return 0;
+    }
+    uint64_t at = atomic_load_explicit(&queue_delay_at, memory_order_relaxed);
+    return now < at + 2 * shed_delay;
+}
+
+int admission_acquire(admission_class_t admission_class, uint64_t now, unsigned int* retry_after) {
+    if (admission_class == ADMISSION_UNLIMITED) {
+        return 0;
+    }
+    if (admission_class != ADMISSION_READ && shedding(now)) {
+        *retry_after = 1;
+        return 503;
+    }
+
+    unsigned int limit = max_in_flight[admission_class];
+    unsigned int previous = atomic_fetch_add_explicit(&in_flight[admission_class], 1, memory_order_relaxed);
+    if (limit && previous >= limit) {
+        atomic_fetch_sub_explicit(&in_flight[admission_class], 1, memory_order_relaxed);
+        *retry_after = 1;
+        return 503;
+    }
+    return 0;
+}
+
+void admission_release(admission_class_t admission_class) {
+    if (admission_class != ADMISSION_UNLIMITED) {
+        atomic_fetch_sub_explicit(&in_flight[admission_class], 1, memory_order_relaxed);
+    }
+}
+
+// Concurrent updates may overwrite each other; the average only needs to
+// follow the trend
+void admission_record_queue_delay(uint64_t delay, uint64_t now) {
+    int64_t average = (int64_t)atomic_load_explicit(&queue_delay, memory_order_relaxed);
+    average += ((int64_t)delay - average) / ADMISSION_DELAY_WEIGHT;
+    atomic_store_explicit(&queue_delay, (uint64_t)average, memory_order_relaxed);
+    atomic_store_explicit(&queue_delay_at, now, memory_order_relaxed);
+}
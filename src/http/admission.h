@@ -0,0 +1,59 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Decides whether a request is served before any work is done for it.
+// Rate limits are token buckets, kept as a single atomic "theoretical
+// arrival time" each (GCRA), so checking one is a load and a CAS. Per
+// client buckets live in a fixed table indexed by a hash of the address.
+
+typedef enum {
+    ADMISSION_READ,                 // Single todos, stats and metrics
+    ADMISSION_LIST,                 // List and search queries
+    ADMISSION_WRITE,                // Everything that commits
+    ADMISSION_CLASS_COUNT,
+    ADMISSION_UNLIMITED = ADMISSION_CLASS_COUNT     // Long-lived change feed subscriptions
+} admission_class_t;
+
+typedef struct {
+    double rate;                    // Requests per second over all clients, 0 = unlimited
+    unsigned int burst;             // Requests allowed at once after an idle period
+    double client_rate;             // Requests per second from one address, 0 = unlimited
+    unsigned int client_burst;
+    unsigned int max_in_flight[ADMISSION_CLASS_COUNT];  // 0 = unlimited
+    unsigned int shed_delay_ms;     // Shed list and write requests while the executor
+                                    // queue delay averages more than this, 0 = never
+} admission_config_t;
+
+void admission_config_defaults(admission_config_t* config);
+int admission_init(const admission_config_t* config);
+void admission_cleanup(void);
+
+// Hashes a client address to a bucket key; the port is ignored
+uint64_t admission_client_key(const struct sockaddr* addr);
+
+// Takes a token from the global and the client's bucket. Returns 0, or the
+// status to answer with: 429 when the client is over its rate, 503 when the
+// server is. retry_after is set to whole seconds until a token is due.
+int admission_check_rate(uint64_t client, uint64_t now, unsigned int* retry_after);
+
+// Claims an in-flight slot for the class unless it is full or being shed.
+// Returns 0 or 503; on 0 the caller must call admission_release later.
+int admission_acquire(admission_class_t admission_class, uint64_t now, unsigned int* retry_after);
+void admission_release(admission_class_t admission_class);
+
+// Feeds the time an admitted request waited for an executor thread into
+// the delay average that shedding is based on
+void admission_record_queue_delay(uint64_t delay, uint64_t now);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,436 @@
+#include "change_feed.h"
+#include "../core/log.h"
+#include "../core/metrics.h"
+#include "../core/todo.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define FEED_BATCH 256                              // Changes read per query
+#define FEED_TICK_MS 1000                           // Longest wait, which bounds poll timeout overshoot
+#define FEED_HEARTBEAT_NS (15 * 1000000000ull)      // Comment line sent to idle event streams
+#define FEED_MAX_PENDING (4 * 1024 * 1024)          // Event streams further behind are dropped
+#define FEED_RETRY_MS 3000                          // EventSource reconnect delay
+
+// Subscribers are owned by their response: the stream frees them once
+// libmicrohttpd is done with it. Everything but out of a poll is guarded by
+// feed_lock.
+typedef struct feed_subscriber {
+    int events;                 // Server-Sent Events, otherwise a long poll
+    long long since;            // Last change delivered, or asked after for a poll
+    int limit;                  // Poll page size
+    int pretty;
+    uint64_t deadline;          // metrics_now() at which a poll answers empty
+    int ready;                  // Poll has changes or timed out; its reader writes the page
+    int finished;               // Nothing more will be added to out
+    json_buf_t out;
+    size_t sent;
+    int parked;                 // Suspended through the waker, waiting for resume
+    int has_waker;
+    response_waker_t waker;
+    pthread_cond_t wake;        // Used instead of the waker when there is none
+    struct feed_subscriber* prev;
+    struct feed_subscriber* next;
+} feed_subscriber_t;
+
+// One query's worth of events, formatted once for every subscriber
+typedef struct {
+    json_buf_t text;
+    long long seqs[FEED_BATCH];
+    size_t offsets[FEED_BATCH];
+    int count;
+} feed_batch_t;
+
+static pthread_mutex_t feed_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t feed_cond;
+static pthread_t feed_thread;
+static int feed_running = 0;
+static int feed_pending = 0;
+static feed_subscriber_t* subscribers = NULL;
+static atomic_int subscriber_count;
+
+static void feed_notify(void) {
+    // Writes are frequent and subscribers rare; skip the lock when nobody listens
+    if (atomic_load_explicit(&subscriber_count, memory_order_acquire) == 0) {
+        return;
+    }
+    pthread_mutex_lock(&feed_lock);
+    feed_pending = 1;
+    pthread_cond_signal(&feed_cond);
+    pthread_mutex_unlock(&feed_lock);
+}
+
+// Called with feed_lock held
+static void wake_subscriber(feed_subscriber_t* sub) {
+    if (sub->parked) {
+        sub->parked = 0;
+        sub->waker.resume(sub->waker.ctx);
+    } else {
+        pthread_cond_signal(&sub->wake);
+    }
+}
+
+static int append_event(const todo_change_t* change, void* ctx) {
+    static const char* const names[] = {"change", "create", "update", "delete"};
+    feed_batch_t* batch = ctx;
+    int op = change->op >= TODO_CHANGE_CREATE && change->op <= TODO_CHANGE_DELETE ? (int)change->op : 0;
+
+    batch->seqs[batch->count] = change->seq;
+    batch->offsets[batch->count] = batch->text.len;
+    // Compact JSON escapes newlines, so the object fits on one data line
+    if (json_buf_printf(&batch->text, "id: %lld\nevent: %s\ndata: ", change->seq, names[op]) != 0 ||
+        json_write_change(&batch->text, change, 0, 0) != 0 ||
+        json_buf_append(&batch->text, "\n\n", 2) != 0) {
+        return -1;
+    }
+    batch->count++;
+    return 0;
+}
+
+// Catches every event stream up to latest, reading each change once however
+// many subscribers need it
+static void deliver_events(long long latest, feed_batch_t* batch) {
+    for (;;) {
+        long long from = -1;
+        pthread_mutex_lock(&feed_lock);
+        for (feed_subscriber_t* sub = subscribers; sub; sub = sub->next) {
+            if (sub->events && !sub->finished && sub->since < latest && (from < 0 || sub->since < from)) {
+                from = sub->since;
+            }
+        }
+        pthread_mutex_unlock(&feed_lock);
+        if (from < 0) {
+            return;
+        }
+
+        json_buf_reset(&batch->text);
+        batch->count = 0;
+        if (todo_changes(from, FEED_BATCH, append_event, batch) < 0) {
+            LOG_ERROR("Failed to read changes after %lld", from);
+            return;
+        }
+        if (batch->count == 0) {
+            return;     // latest is not visible to this reader yet; the next tick retries
+        }
+
+        long long last = batch->seqs[batch->count - 1];
+        pthread_mutex_lock(&feed_lock);
+        for (feed_subscriber_t* sub = subscribers; sub; sub = sub->next) {
+            // Subscribers behind from joined meanwhile and are served by the next round
+            if (!sub->events || sub->finished || sub->since < from || sub->since >= last) {
+                continue;
+            }
+            int first = 0;
+            while (batch->seqs[first] <= sub->since) first++;
+
+            size_t offset = batch->offsets[first];
+            if (sub->out.len - sub->sent + batch->text.len - offset > FEED_MAX_PENDING) {
+                LOG_WARN("Dropping change stream subscriber %lld changes behind", latest - sub->since);
+                sub->finished = 1;
+            } else if (json_buf_append(&sub->out, batch->text.data + offset, batch->text.len - offset) != 0) {
+                sub->finished = 1;
+            } else {
+                sub->since = last;
+            }
+            wake_subscriber(sub);
+        }
+        pthread_mutex_unlock(&feed_lock);
+
+        if (batch->count < FEED_BATCH) {
+            return;
+        }
+    }
+}
+
+// Answers polls that have something to say; their readers build the page
+static void deliver_polls(long long latest, uint64_t now) {
+    pthread_mutex_lock(&feed_lock);
+    for (feed_subscriber_t* sub = subscribers; sub; sub = sub->next) {
+        if (!sub->events && !sub->ready && (latest > sub->since || now >= sub->deadline)) {
+            sub->ready = 1;
+            wake_subscriber(sub);
+        }
+    }
+    pthread_mutex_unlock(&feed_lock);
+}
+
+static void send_heartbeats(void) {
+    static const char heartbeat[] = ": keep-alive\n\n";
+
+    pthread_mutex_lock(&feed_lock);
+    for (feed_subscriber_t* sub = subscribers; sub; sub = sub->next) {
+        if (sub->events && !sub->finished && sub->sent == sub->out.len) {
+            if (json_buf_append(&sub->out, heartbeat, sizeof(heartbeat) - 1) != 0) {
+                sub->finished = 1;
+            }
+            wake_subscriber(sub);
+        }
+    }
+    pthread_mutex_unlock(&feed_lock);
+}
+
+static void* feed_main(void* arg) {
+    (void)arg;
+    feed_batch_t* batch = calloc(1, sizeof(feed_batch_t));
+    if (!batch) {
+        LOG_ERROR("Change feed out of memory");
+        return NULL;
+    }
+    json_buf_init(&batch->text);
+    uint64_t last_heartbeat = metrics_now();
+
+    pthread_mutex_lock(&feed_lock);
+    while (feed_running) {
+        if (!feed_pending) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_sec += FEED_TICK_MS / 1000;
+            deadline.tv_nsec += (FEED_TICK_MS % 1000) * 1000000L;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+            while (!feed_pending && feed_running) {
+                if (pthread_cond_timedwait(&feed_cond, &feed_lock, &deadline) == ETIMEDOUT) {
+                    break;
+                }
+            }
+        }
+        feed_pending = 0;
+        int idle = subscribers == NULL;
+        pthread_mutex_unlock(&feed_lock);
+
+        long long oldest, latest;
+        if (!idle && todo_change_bounds(&oldest, &latest) == 0) {
+            deliver_events(latest, batch);
+            deliver_polls(latest, metrics_now());
+        }
+        if (metrics_now() - last_heartbeat >= FEED_HEARTBEAT_NS) {
+            last_heartbeat = metrics_now();
+            send_heartbeats();
+        }
+
+        pthread_mutex_lock(&feed_lock);
+    }
+    pthread_mutex_unlock(&feed_lock);
+
+    json_buf_free(&batch->text);
+    free(batch);
+    return NULL;
+}
+
+int change_feed_start(void) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&feed_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    feed_running = 1;
+    if (pthread_create(&feed_thread, NULL, feed_main, NULL) != 0) {
+        feed_running = 0;
+        pthread_cond_destroy(&feed_cond);
+        return -1;
+    }
+    todo_set_change_listener(feed_notify);
+    return 0;
+}
+
+void change_feed_stop(void) {
+    pthread_mutex_lock(&feed_lock);
+    if (!feed_running) {
+        pthread_mutex_unlock(&feed_lock);
+        return;
+    }
+    feed_running = 0;
+    // Polls still answer, with whatever is there; event streams just end
+    for (feed_subscriber_t* sub = subscribers; sub; sub = sub->next) {
+        if (sub->events) {
+            sub->finished = 1;
+        } else {
+            sub->ready = 1;
+        }
+        wake_subscriber(sub);
+    }
+    pthread_cond_signal(&feed_cond);
+    pthread_mutex_unlock(&feed_lock);
+
+    todo_set_change_listener(NULL);
+    pthread_join(feed_thread, NULL);
+    pthread_cond_destroy(&feed_cond);
+}
+
+struct ChangePage {
+    json_buf_t* body;
+    int pretty;
+    int rows;
+    long long last_seq;
+};
+
+static int append_change(const todo_change_t* change, void* ctx) {
+    struct ChangePage* page = ctx;
+
+    if (page->rows > 0 && json_buf_append(page->body, ",", 1) != 0) {
+        return -1;
+    }
+    if (page->pretty && json_buf_append(page->body, "\n    ", 5) != 0) {
+        return -1;
+    }
+    if (json_write_change(page->body, change, page->pretty, 2) != 0) {
+        return -1;
+    }
+
+    page->rows++;
+    page->last_seq = change->seq;
+    return 0;
+}
+
+int change_feed_write_page(json_buf_t* buf, long long since, int limit, int pretty) {
+    struct ChangePage page = {buf, pretty, 0, since};
+
+    if (json_buf_append(buf, pretty ? "{\n  \"changes\": [" : "{\"changes\":[", pretty ? 15 : 12) != 0 ||
+        todo_changes(since, limit, append_change, &page) < 0) {
+        return -1;
+    }
+    if (pretty) {
+        return json_buf_printf(buf, "%s],\n  \"last_seq\": %lld\n}", page.rows ? "\n  " : "", page.last_seq);
+    }
+    return json_buf_printf(buf, "],\"last_seq\":%lld}", page.last_seq);
+}
+
+static ssize_t read_subscription(void* state, uint64_t pos, char* buf, size_t max) {
+    feed_subscriber_t* sub = state;
+    (void)pos;
+
+    pthread_mutex_lock(&feed_lock);
+    for (;;) {
+        if (sub->sent < sub->out.len) {
+            size_t n = sub->out.len - sub->sent;
+            if (n > max) n = max;
+            memcpy(buf, sub->out.data + sub->sent, n);
+            sub->sent += n;
+            if (sub->sent == sub->out.len) {
+                json_buf_reset(&sub->out);
+                sub->sent = 0;
+            }
+            pthread_mutex_unlock(&feed_lock);
+            return (ssize_t)n;
+        }
+        if (sub->finished) {
+            pthread_mutex_unlock(&feed_lock);
+            return RESPONSE_STREAM_END;
+        }
+        if (sub->ready) {
+            // Only this reader touches a poll's buffer, so the query runs unlocked
+            sub->finished = 1;
+            pthread_mutex_unlock(&feed_lock);
+            int rc = change_feed_write_page(&sub->out, sub->since, sub->limit, sub->pretty);
+            pthread_mutex_lock(&feed_lock);
+            if (rc != 0) {
+                sub->finished = 0;      // A read refused a connection is repeated
+                pthread_mutex_unlock(&feed_lock);
+                return RESPONSE_STREAM_ERROR;
+            }
+            continue;
+        }
+        if (sub->has_waker) {
+            sub->parked = 1;
+            sub->waker.suspend(sub->waker.ctx);
+            pthread_mutex_unlock(&feed_lock);
+            return 0;
+        }
+        pthread_cond_wait(&sub->wake, &feed_lock);
+    }
+}
+
+static void set_subscription_waker(void* state, const response_waker_t* waker) {
+    feed_subscriber_t* sub = state;
+    pthread_mutex_lock(&feed_lock);
+    sub->waker = *waker;
+    sub->has_waker = 1;
+    pthread_mutex_unlock(&feed_lock);
+}
+
+static void free_subscription(void* state) {
+    feed_subscriber_t* sub = state;
+
+    pthread_mutex_lock(&feed_lock);
+    if (sub->prev) {
+        sub->prev->next = sub->next;
+    } else {
+        subscribers = sub->next;
+    }
+    if (sub->next) {
+        sub->next->prev = sub->prev;
+    }
+    atomic_fetch_sub_explicit(&subscriber_count, 1, memory_order_release);
+    pthread_mutex_unlock(&feed_lock);
+
+    json_buf_free(&sub->out);
+    pthread_cond_destroy(&sub->wake);
+    free(sub);
+}
+
+static int subscribe(feed_subscriber_t* sub, struct ResponseData* response) {
+    pthread_mutex_lock(&feed_lock);
+    if (!feed_running) {
+        pthread_mutex_unlock(&feed_lock);
+        json_buf_free(&sub->out);
+        free(sub);
+        return -1;
+    }
+    pthread_cond_init(&sub->wake, NULL);
+    sub->next = subscribers;
+    if (subscribers) {
+        subscribers->prev = sub;
+    }
+    subscribers = sub;
+    atomic_fetch_add_explicit(&subscriber_count, 1, memory_order_release);
+    // The fan-out thread checks for changes that landed before the subscription
+    feed_pending = 1;
+    pthread_cond_signal(&feed_cond);
+    pthread_mutex_unlock(&feed_lock);
+
+    response->stream = read_subscription;
+    response->stream_free = free_subscription;
+    response->stream_state = sub;
+    response->stream_set_waker = set_subscription_waker;
+    return 0;
+}
+
+int change_feed_subscribe_events(long long since, struct ResponseData* response) {
+    feed_subscriber_t* sub = calloc(1, sizeof(feed_subscriber_t));
+    if (!sub) {
+        return -1;
+    }
+    sub->events = 1;
+    sub->since = since;
+    json_buf_init(&sub->out);
+    // Something to send straight away, so the client sees the headers
+    if (json_buf_printf(&sub->out, "retry: %d\n\n", FEED_RETRY_MS) != 0) {
+        json_buf_free(&sub->out);
+        free(sub);
+        return -1;
+    }
+    if (subscribe(sub, response) != 0) {
+        return -1;
+    }
+    response->content_type = "text/event-stream";
+    response_add_header(response, "Cache-Control", "no-cache");
+    return 0;
+}
+
+int change_feed_subscribe_poll(long long since, int limit, int timeout_s, int pretty,
+                               struct ResponseData* response) {
+    feed_subscriber_t* sub = calloc(1, sizeof(feed_subscriber_t));
+    if (!sub) {
+        return -1;
+    }
+    sub->since = since;
+    sub->limit = limit;
+    sub->pretty = pretty;
+    sub->deadline = metrics_now() + (uint64_t)timeout_s * 1000000000ull;
+    json_buf_init(&sub->out);
+    return subscribe(sub, response);
+}
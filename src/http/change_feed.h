@@ -0,0 +1,34 @@
+#ifndef CHANGE_FEED_H
+#define CHANGE_FEED_H
+
+#include "handlers.h"
+#include "json_writer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Starts the thread that fans changes out to /todos/changes subscribers
+int change_feed_start(void);
+
+// Ends every subscription and stops the thread. Must run before the HTTP
+// daemon stops, so that parked connections are resumed and can close.
+void change_feed_stop(void);
+
+// Writes {"changes":[...],"last_seq":N} with up to limit changes after since
+int change_feed_write_page(json_buf_t* buf, long long since, int limit, int pretty);
+
+// Turns response into an endless text/event-stream with one event per
+// change after since. Returns -1 if the feed is not running.
+int change_feed_subscribe_events(long long since, struct ResponseData* response);
+
+// Turns response into a long poll that answers with the changes after since
+// as soon as there are any, or with an empty page after timeout_s seconds
+int change_feed_subscribe_poll(long long since, int limit, int timeout_s, int pretty,
+                               struct ResponseData* response);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
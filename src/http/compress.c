@@ -0,0 +1,434 @@
+#include "compress.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+#ifdef TODO_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define COMPRESS_ZLIB_LEVEL 6
+#define COMPRESS_ZSTD_LEVEL 3
+#define COMPRESS_OUTPUT_STEP (16 * 1024)    // Output space added per compressor call
+#define COMPRESS_INPUT_BLOCK (32 * 1024)    // Read from the wrapped stream at a time
+#define COMPRESS_CACHE_SLOTS 64
+
+static const char* const encoding_names[CONTENT_ENCODING_COUNT] = {NULL, "gzip", "deflate", "zstd"};
+
+content_encoding_t compress_negotiate(const char* accept_encoding) {
+    double q[CONTENT_ENCODING_COUNT] = {-1, -1, -1, -1};
+    double any = -1;
+    const char* p = accept_encoding;
+
+    while (p && *p) {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        const char* token = p;
+        while (*p && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+        size_t len = (size_t)(p - token);
+        if (len == 0) {
+            break;
+        }
+
+        double value = 1;
+        while (*p && *p != ',') {
+            if (*p == ';') {
+                const char* param = p + 1;
+                while (*param == ' ' || *param == '\t') param++;
+                if ((param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+                    value = strtod(param + 2, NULL);
+                }
+            }
+            p++;
+        }
+
+        if (len == 1 && *token == '*') {
+            any = value;
+        } else if ((len == 4 && strncasecmp(token, "gzip", 4) == 0) ||
+                   (len == 6 && strncasecmp(token, "x-gzip", 6) == 0)) {
+            q[CONTENT_ENCODING_GZIP] = value;
+        } else if (len == 7 && strncasecmp(token, "deflate", 7) == 0) {
+            q[CONTENT_ENCODING_DEFLATE] = value;
+        } else if (len == 4 && strncasecmp(token, "zstd", 4) == 0) {
+            q[CONTENT_ENCODING_ZSTD] = value;
+        }
+    }
+
+    static const content_encoding_t preference[] = {
+#ifdef TODO_HAVE_ZSTD
+        CONTENT_ENCODING_ZSTD,
+#endif
+        CONTENT_ENCODING_GZIP,
+        CONTENT_ENCODING_DEFLATE,
+    };
+    content_encoding_t best = CONTENT_ENCODING_IDENTITY;
+    double best_q = 0;
+    for (size_t i = 0; i < sizeof(preference) / sizeof(preference[0]); i++) {
+        double value = q[preference[i]] >= 0 ? q[preference[i]] : any;
+        if (value > best_q) {
+            best = preference[i];
+            best_q = value;
+        }
+    }
+    return best;
+}
+
+const char* compress_encoding_name(content_encoding_t encoding) {
+    return encoding >= 0 && encoding < CONTENT_ENCODING_COUNT ? encoding_names[encoding] : NULL;
+}
+
+struct compress_stream {
+    content_encoding_t encoding;
+    z_stream zlib;
+#ifdef TODO_HAVE_ZSTD
+    ZSTD_CCtx* zstd;
+#endif
+};
+
+compress_stream_t* compress_stream_new(content_encoding_t encoding) {
+    compress_stream_t* stream = calloc(1, sizeof(compress_stream_t));
+    if (!stream) {
+        return NULL;
+    }
+    stream->encoding = encoding;
+
+    int rc = -1;
+    if (encoding == CONTENT_ENCODING_GZIP || encoding == CONTENT_ENCODING_DEFLATE) {
+        // 16 added to the window bits selects the gzip wrapper instead of zlib's
+        int window_bits = encoding == CONTENT_ENCODING_GZIP ? 15 + 16 : 15;
+        rc = deflateInit2(&stream->zlib, COMPRESS_ZLIB_LEVEL, Z_DEFLATED, window_bits, 8,
+                          Z_DEFAULT_STRATEGY) == Z_OK ? 0 : -1;
+#ifdef TODO_HAVE_ZSTD
+    } else if (encoding == CONTENT_ENCODING_ZSTD) {
+        stream->zstd = ZSTD_createCCtx();
+        rc = stream->zstd && !ZSTD_isError(ZSTD_CCtx_setParameter(stream->zstd, ZSTD_c_compressionLevel,
+                                                                  COMPRESS_ZSTD_LEVEL)) ? 0 : -1;
+        if (rc != 0) {
+            ZSTD_freeCCtx(stream->zstd);
+        }
+#endif
+    }
+
+    if (rc != 0) {
+        free(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+static int write_zlib(compress_stream_t* stream, const char* data, size_t len, int finish, json_buf_t* out) {
+    stream->zlib.next_in = (Bytef*)(uintptr_t)data;
+    stream->zlib.avail_in = (uInt)len;
+
+    int rc;
+    do {
+        if (json_buf_reserve(out, COMPRESS_OUTPUT_STEP) != 0) {
+            return -1;
+        }
+        stream->zlib.next_out = (Bytef*)(out->data + out->len);
+        stream->zlib.avail_out = COMPRESS_OUTPUT_STEP;
+        rc = deflate(&stream->zlib, finish ? Z_FINISH : Z_NO_FLUSH);
+        if (rc == Z_STREAM_ERROR) {
+            return -1;
+        }
+        out->len += COMPRESS_OUTPUT_STEP - stream->zlib.avail_out;
+    } while (stream->zlib.avail_out == 0 || (finish && rc != Z_STREAM_END));
+    return 0;
+}
+
+#ifdef TODO_HAVE_ZSTD
+static int write_zstd(compress_stream_t* stream, const char* data, size_t len, int finish, json_buf_t* out) {
+    ZSTD_inBuffer input = {data, len, 0};
+    size_t remaining;
+
+    do {
+        if (json_buf_reserve(out, COMPRESS_OUTPUT_STEP) != 0) {
+            return -1;
+        }
+        ZSTD_outBuffer output = {out->data + out->len, COMPRESS_OUTPUT_STEP, 0};
+        remaining = ZSTD_compressStream2(stream->zstd, &output, &input, finish ? ZSTD_e_end : ZSTD_e_continue);
+        if (ZSTD_isError(remaining)) {
+            return -1;
+        }
+        out->len += output.pos;
+    } while (finish ? remaining != 0 : input.pos < input.size);
+    return 0;
+}
+#endif
+
+int compress_stream_write(compress_stream_t* stream, const char* data, size_t len, int finish, json_buf_t* out) {
+#ifdef TODO_HAVE_ZSTD
+    if (stream->encoding == CONTENT_ENCODING_ZSTD) {
+        return write_zstd(stream, data, len, finish, out);
+    }
+#endif
+    return write_zlib(stream, data, len, finish, out);
+}
+
+void compress_stream_free(compress_stream_t* stream) {
+    if (!stream) {
+        return;
+    }
+#ifdef TODO_HAVE_ZSTD
+    if (stream->encoding == CONTENT_ENCODING_ZSTD) {
+        ZSTD_freeCCtx(stream->zstd);
+        free(stream);
+        return;
+    }
+#endif
+    deflateEnd(&stream->zlib);
+    free(stream);
+}
+
+int compress_buffer(content_encoding_t encoding, const char* data, size_t len, char** out, size_t* out_len) {
+    compress_stream_t* stream = compress_stream_new(encoding);
+    if (!stream) {
+        return -1;
+    }
+
+    json_buf_t buf;
+    json_buf_init(&buf);
+    int rc = compress_stream_write(stream, data, len, 1, &buf);
+    compress_stream_free(stream);
+    if (rc != 0) {
+        json_buf_free(&buf);
+        return -1;
+    }
+
+    *out = buf.data;
+    *out_len = buf.len;
+    return 0;
+}
+
+// A stream whose output is compressed block by block. The wrapped stream is
+// read into in, and its compressed form is drained from out.
+struct CompressedStream {
+    response_stream_fn inner;
+    void* inner_state;
+    void (*inner_free)(void* state);
+    uint64_t inner_pos;
+    compress_stream_t* compressor;
+    content_encoding_t encoding;
+    char in[COMPRESS_INPUT_BLOCK];
+    json_buf_t out;
+    size_t sent;
+    int finished;
+    char* cache_key;            // Non-NULL while the output is still being captured
+    json_buf_t capture;
+};
+
+static size_t cache_entry_limit(void);
+
+static void stop_capture(struct CompressedStream* stream) {
+    free(stream->cache_key);
+    stream->cache_key = NULL;
+    json_buf_free(&stream->capture);
+}
+
+static ssize_t read_compressed(void* state, uint64_t pos, char* buf, size_t max) {
+    struct CompressedStream* stream = state;
+    (void)pos;
+
+    while (stream->sent == stream->out.len) {
+        if (stream->finished) {
+            return RESPONSE_STREAM_END;
+        }
+        json_buf_reset(&stream->out);
+        stream->sent = 0;
+
+        ssize_t n = stream->inner(stream->inner_state, stream->inner_pos, stream->in, sizeof(stream->in));
+        if (n == RESPONSE_STREAM_END) {
+            stream->finished = 1;
+            n = 0;
+        } else if (n < 0) {
+            return RESPONSE_STREAM_ERROR;
+        } else if (n == 0) {
+            return 0;
+        }
+        stream->inner_pos += (uint64_t)n;
+
+        if (compress_stream_write(stream->compressor, stream->in, (size_t)n, stream->finished, &stream->out) != 0) {
+            return RESPONSE_STREAM_ERROR;
+        }
+
+        if (stream->cache_key) {
+            if (stream->capture.len + stream->out.len > cache_entry_limit() ||
+                json_buf_append(&stream->capture, stream->out.data, stream->out.len) != 0) {
+                stop_capture(stream);
+            } else if (stream->finished) {
+                compress_cache_put(stream->cache_key, stream->encoding, stream->capture.data, stream->capture.len);
+                stop_capture(stream);
+            }
+        }
+    }
+
+    size_t n = stream->out.len - stream->sent;
+    if (n > max) n = max;
+    memcpy(buf, stream->out.data + stream->sent, n);
+    stream->sent += n;
+    return (ssize_t)n;
+}
+
+static void free_compressed(void* state) {
+    struct CompressedStream* stream = state;
+    if (stream->inner_free) {
+        stream->inner_free(stream->inner_state);
+    }
+    compress_stream_free(stream->compressor);
+    json_buf_free(&stream->out);
+    stop_capture(stream);
+    free(stream);
+}
+
+int compress_wrap_stream(struct ResponseData* response, content_encoding_t encoding, const char* cache_key) {
+    struct CompressedStream* stream = calloc(1, sizeof(struct CompressedStream));
+    if (!stream) {
+        return -1;
+    }
+    stream->compressor = compress_stream_new(encoding);
+    if (!stream->compressor) {
+        free(stream);
+        return -1;
+    }
+    stream->encoding = encoding;
+    json_buf_init(&stream->out);
+    json_buf_init(&stream->capture);
+    if (cache_key && cache_entry_limit() > 0) {
+        stream->cache_key = strdup(cache_key);
+    }
+
+    stream->inner = response->stream;
+    stream->inner_state = response->stream_state;
+    stream->inner_free = response->stream_free;
+    response->stream = read_compressed;
+    response->stream_state = stream;
+    response->stream_free = free_compressed;
+    return 0;
+}
+
+// Least recently used entries go first once the budget is reached. The
+// cache holds a few large bodies, so a linear scan is cheaper than hashing.
+typedef struct {
+    char* key;
+    content_encoding_t encoding;
+    char* data;
+    size_t len;
+    uint64_t last_used;
+} compress_cache_entry_t;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static compress_cache_entry_t cache_entries[COMPRESS_CACHE_SLOTS];
+static size_t cache_capacity = 0;
+static size_t cache_bytes = 0;
+static uint64_t cache_clock = 0;
+
+// No single body may take more than a quarter of the budget
+static size_t cache_entry_limit(void) {
+    pthread_mutex_lock(&cache_lock);
+    size_t limit = cache_capacity / 4;
+    pthread_mutex_unlock(&cache_lock);
+    return limit;
+}
+
+static void drop_entry(compress_cache_entry_t* entry) {
+    cache_bytes -= entry->len;
+    free(entry->key);
+    free(entry->data);
+    memset(entry, 0, sizeof(*entry));
+}
+
+int compress_cache_init(size_t capacity) {
+    pthread_mutex_lock(&cache_lock);
+    cache_capacity = capacity;
+    pthread_mutex_unlock(&cache_lock);
+    return 0;
+}
+
+void compress_cache_cleanup(void) {
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < COMPRESS_CACHE_SLOTS; i++) {
+        if (cache_entries[i].key) {
+            drop_entry(&cache_entries[i]);
+        }
+    }
+    cache_capacity = 0;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+int compress_cache_get(const char* key, content_encoding_t encoding, char** data, size_t* len) {
+    int rc = -1;
+
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < COMPRESS_CACHE_SLOTS; i++) {
+        compress_cache_entry_t* entry = &cache_entries[i];
+        if (entry->key && entry->encoding == encoding && strcmp(entry->key, key) == 0) {
+            *data = malloc(entry->len);
+            if (*data) {
+                memcpy(*data, entry->data, entry->len);
+                *len = entry->len;
+                entry->last_used = ++cache_clock;
+                rc = 0;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return rc;
+}
+
+void compress_cache_put(const char* key, content_encoding_t encoding, const char* data, size_t len) {
+    if (len > cache_entry_limit()) {
+        return;
+    }
+
+    char* key_copy = strdup(key);
+    char* data_copy = malloc(len ? len : 1);
+    if (!key_copy || !data_copy) {
+        free(key_copy);
+        free(data_copy);
+        return;
+    }
+    memcpy(data_copy, data, len);
+
+    pthread_mutex_lock(&cache_lock);
+    if (len > cache_capacity / 4) {
+        pthread_mutex_unlock(&cache_lock);
+        free(key_copy);
+        free(data_copy);
+        return;
+    }
+
+    for (int i = 0; i < COMPRESS_CACHE_SLOTS; i++) {
+        compress_cache_entry_t* entry = &cache_entries[i];
+        if (entry->key && entry->encoding == encoding && strcmp(entry->key, key) == 0) {
+            drop_entry(entry);
+        }
+    }
+
+    compress_cache_entry_t* slot;
+    for (;;) {
+        slot = NULL;
+        compress_cache_entry_t* oldest = NULL;
+        for (int i = 0; i < COMPRESS_CACHE_SLOTS; i++) {
+            compress_cache_entry_t* entry = &cache_entries[i];
+            if (!entry->key) {
+                slot = slot ? slot : entry;
+            } else if (!oldest || entry->last_used < oldest->last_used) {
+                oldest = entry;
+            }
+        }
+        if (slot && cache_bytes + len <= cache_capacity) {
+            break;
+        }
+        drop_entry(oldest);
+    }
+
+    slot->key = key_copy;
+    slot->encoding = encoding;
+    slot->data = data_copy;
+    slot->len = len;
+    slot->last_used = ++cache_clock;
+    cache_bytes += len;
+    pthread_mutex_unlock(&cache_lock);
+}
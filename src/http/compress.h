@@ -0,0 +1,60 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include "handlers.h"
+#include "json_writer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    CONTENT_ENCODING_IDENTITY,
+    CONTENT_ENCODING_GZIP,
+    CONTENT_ENCODING_DEFLATE,
+    CONTENT_ENCODING_ZSTD,              // Only offered when built with zstd
+    CONTENT_ENCODING_COUNT
+} content_encoding_t;
+
+// Picks the coding the client prefers from an Accept-Encoding value, NULL
+// included. Among equal q-values zstd beats gzip beats deflate.
+content_encoding_t compress_negotiate(const char* accept_encoding);
+
+// The Content-Encoding token, NULL for identity
+const char* compress_encoding_name(content_encoding_t encoding);
+
+// Compresses data into a malloc'd buffer
+int compress_buffer(content_encoding_t encoding, const char* data, size_t len, char** out, size_t* out_len);
+
+typedef struct compress_stream compress_stream_t;
+
+compress_stream_t* compress_stream_new(content_encoding_t encoding);
+
+// Compresses data and appends whatever output is ready to out. finish ends
+// the stream; nothing may be written after it.
+int compress_stream_write(compress_stream_t* stream, const char* data, size_t len, int finish, json_buf_t* out);
+
+void compress_stream_free(compress_stream_t* stream);
+
+// Replaces response's stream with one that compresses it on the fly. With a
+// cache_key the whole output is also stored in the compressed body cache
+// once the stream ends, if it fits.
+int compress_wrap_stream(struct ResponseData* response, content_encoding_t encoding, const char* cache_key);
+
+// Compressed bodies of large responses, keyed by representation: the key
+// must change whenever the uncompressed body would, e.g. by including its
+// ETag. Until compress_cache_init is called with a non-zero budget every
+// lookup misses and every store is dropped.
+int compress_cache_init(size_t capacity);
+void compress_cache_cleanup(void);
+
+// Copies the cached body into a malloc'd buffer. Returns -1 on a miss.
+int compress_cache_get(const char* key, content_encoding_t encoding, char** data, size_t* len);
+void compress_cache_put(const char* key, content_encoding_t encoding, const char* data, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
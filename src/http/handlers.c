@@ -1,193 +1,1148 @@
 #include "handlers.h"
 #include "../core/todo.h"
+#include "../core/cache.h"
+#include "../core/metrics.h"
+#include "../core/snapshot.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <jansson.h>
-#include <curl/curl.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "json_writer.h"
+#include "json_reader.h"
+#include "change_feed.h"
 
-struct MemoryStruct {
-    char* memory;
-    size_t size;
-};
+#define LIST_PAGE_SIZE 256
+#define ETAG_SIZE 64
+#define BATCH_MAX_ITEMS 10000
+#define BATCH_INITIAL_CAPACITY 64
+#define IMPORT_BATCH_ROWS 256
+
+// Parse failures for bulk bodies
+#define BATCH_INVALID (-1)
+#define BATCH_TOO_LARGE (-2)
+
+void response_add_header(struct ResponseData* response, const char* name, const char* format, ...) {
+    if (response->header_count >= RESPONSE_MAX_HEADERS) {
+        return;
+    }
+
+    struct ResponseHeader* header = &response->headers[response->header_count++];
+    header->name = name;
+
+    va_list args;
+    va_start(args, format);
+    vsnprintf(header->value, sizeof(header->value), format, args);
+    va_end(args);
+}
+
+// Strong validators. A todo's is its id and version (updated_at); a list's is
+// the table version counter behind a per-process nonce, so tags never match
+// across restarts. Pretty output is a separate representation with its own tag.
+static uint64_t etag_nonce;
+static pthread_once_t etag_nonce_once = PTHREAD_ONCE_INIT;
+
+static void init_etag_nonce(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    etag_nonce = ((uint64_t)now.tv_sec << 32) ^ (uint64_t)now.tv_nsec ^ ((uint64_t)getpid() << 16);
+}
 
-static size_t write_callback(void* contents, size_t size, size_t nmemb, void* userp) {
-    size_t realsize = size * nmemb;
-    struct MemoryStruct* mem = (struct MemoryStruct*)userp;
+static void todo_etag(char* out, size_t size, int id, time_t version, int pretty) {
+    snprintf(out, size, "\"%d-%lld%s\"", id, (long long)version, pretty ? "-p" : "");
+}
+
+static void list_etag(char* out, size_t size, uint64_t version, int pretty) {
+    pthread_once(&etag_nonce_once, init_etag_nonce);
+    snprintf(out, size, "\"L%llx-%llu%s\"", (unsigned long long)etag_nonce,
+             (unsigned long long)version, pretty ? "-p" : "");
+}
+
+// Returns 1 if an If-None-Match or If-Match header value is "*" or lists tag.
+// The comparison is weak, so W/ prefixes are ignored: a compressed response
+// carries the weak form of the tag its version would otherwise have.
+static int etag_list_contains(const char* header, const char* tag) {
+    size_t tag_len = strlen(tag);
+    const char* p = header;
+
+    for (;;) {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        if (*p == '\0') return 0;
+        if (*p == '*') return 1;
+
+        if (strncmp(p, "W/", 2) == 0) p += 2;
+        if (*p != '"') return 0;
+        const char* end = strchr(p + 1, '"');
+        if (!end) return 0;
+
+        if ((size_t)(end + 1 - p) == tag_len && memcmp(p, tag, tag_len) == 0) {
+            return 1;
+        }
+        p = end + 1;
+    }
+}
 
-    char* ptr = realloc(mem->memory, mem->size + realsize + 1);
-    if (!ptr) {
+static void set_not_modified(struct ResponseData* response, const char* etag) {
+    response->status = 304;
+    response_add_header(response, "ETag", "%s", etag);
+}
+
+static void set_precondition_failed(struct ResponseData* response) {
+    response->status = 412;
+    response->data = strdup("{\"error\": \"Precondition failed\"}");
+    response->size = strlen(response->data);
+}
+
+// Resolves If-Match to the version a conditional write must still find.
+// Returns -1 if the precondition already fails.
+static int match_version(int id, const char* if_match, time_t* version) {
+    char etag[ETAG_SIZE];
+
+    if (todo_get_version(id, version) != 0) {
+        return -1;
+    }
+    todo_etag(etag, sizeof(etag), id, *version, 0);
+    if (etag_list_contains(if_match, etag)) {
         return 0;
     }
+    todo_etag(etag, sizeof(etag), id, *version, 1);
+    return etag_list_contains(if_match, etag) ? 0 : -1;
+}
+
+// Rows are written into one buffer per page; the array brackets and
+// separators depend on whether the output is pretty-printed.
+struct TodoPage {
+    json_buf_t* body;
+    int pretty;
+    int rows;           // Rows written so far, across refills of body
+    todo_query_t next;  // Continues after the last row written
+};
 
-    mem->memory = ptr;
-    memcpy(&(mem->memory[mem->size]), contents, realsize);
-    mem->size += realsize;
-    mem->memory[mem->size] = 0;
+static int append_todo(const todo_t* todo, void* ctx) {
+    struct TodoPage* page = ctx;
 
-    return realsize;
+    if (page->rows > 0 && json_buf_append(page->body, ",", 1) != 0) {
+        return -1;
+    }
+    if (page->pretty && json_buf_append(page->body, "\n  ", 3) != 0) {
+        return -1;
+    }
+    if (json_write_todo(page->body, todo, page->pretty, 1) != 0) {
+        return -1;
+    }
+
+    page->rows++;
+    todo_query_advance(&page->next, todo);
+    return 0;
 }
 
-void handle_list_todos(CURL* curl, struct ResponseData* response) {
-    (void)curl; 
-    todo_t* todos = NULL;
-    int count = 0;
+static int close_todo_array(struct TodoPage* page) {
+    if (page->pretty && page->rows > 0) {
+        return json_buf_append(page->body, "\n]", 2);
+    }
+    return json_buf_append(page->body, "]", 1);
+}
 
-    if (todo_list(&todos, &count) == 0) {
-        json_t* root = json_array();
-        
-        for (int i = 0; i < count; i++) {
-            json_t* todo = json_object();
-            json_object_set_new(todo, "id", json_integer(todos[i].id));
-            json_object_set_new(todo, "title", json_string(todos[i].title));
-            json_object_set_new(todo, "description", json_string(todos[i].description));
-            json_object_set_new(todo, "completed", json_boolean(todos[i].completed));
-            json_object_set_new(todo, "created_at", json_integer(todos[i].created_at));
-            json_object_set_new(todo, "updated_at", json_integer(todos[i].updated_at));
-            json_array_append_new(root, todo);
-        }
-
-        response->data = json_dumps(root, JSON_INDENT(2));
-        response->size = strlen(response->data);
+// Streams the whole table as one JSON array, fetching LIST_PAGE_SIZE rows at
+// a time so memory stays bounded and no database connection is held while
+// the client is slow to read.
+struct ListStream {
+    json_buf_t body;
+    struct TodoPage page;
+    size_t sent;
+    int started;
+    int finished;
+};
 
-        json_decref(root);
-        todo_free_list(todos);
+static int fill_list_stream(struct ListStream* stream) {
+    json_buf_reset(&stream->body);
+    stream->sent = 0;
+
+    // Nothing is kept until the page is read, so a failed fill can be repeated
+    if (!stream->started && json_buf_append(&stream->body, "[", 1) != 0) {
+        return -1;
+    }
+
+    todo_query_t query = stream->page.next;
+    query.limit = LIST_PAGE_SIZE;
+    int visited = todo_each(&query, append_todo, &stream->page);
+    if (visited < 0) {
+        json_buf_reset(&stream->body);
+        return -1;
+    }
+    stream->started = 1;
+
+    if (visited < LIST_PAGE_SIZE) {
+        stream->finished = 1;
+        return close_todo_array(&stream->page);
+    }
+    return 0;
+}
+
+static ssize_t read_list_stream(void* state, uint64_t pos, char* buf, size_t max) {
+    (void)pos;
+    struct ListStream* stream = state;
+
+    while (stream->sent == stream->body.len) {
+        if (stream->finished) {
+            return RESPONSE_STREAM_END;
+        }
+        if (fill_list_stream(stream) != 0) {
+            return RESPONSE_STREAM_ERROR;
+        }
+    }
+
+    size_t len = stream->body.len - stream->sent;
+    if (len > max) len = max;
+    memcpy(buf, stream->body.data + stream->sent, len);
+    stream->sent += len;
+    return (ssize_t)len;
+}
+
+static void free_list_stream(void* state) {
+    struct ListStream* stream = state;
+    json_buf_free(&stream->body);
+    free(stream);
+}
+
+// Writes the query string that fetches the page after query's cursor
+static void format_next_link(char* out, size_t size, const todo_query_t* query) {
+    static const char* const sort_names[] = {"id", "created_at", "updated_at"};
+    int len = snprintf(out, size, "/todos?limit=%d&after_id=%d", query->limit, query->after_id);
+
+    if (query->sort != TODO_SORT_ID) {
+        len += snprintf(out + len, size - (size_t)len, "&after_value=%lld&sort=%s",
+                        (long long)query->after_value, sort_names[query->sort]);
+    }
+    if (query->descending) {
+        len += snprintf(out + len, size - (size_t)len, "&order=desc");
+    }
+    if (query->completed != TODO_COMPLETED_ANY) {
+        len += snprintf(out + len, size - (size_t)len, "&completed=%s",
+                        query->completed == TODO_COMPLETED_TRUE ? "true" : "false");
+    }
+    if (query->updated_since > 0) {
+        len += snprintf(out + len, size - (size_t)len, "&updated_since=%lld", (long long)query->updated_since);
+    }
+    if (query->created_before > 0) {
+        snprintf(out + len, size - (size_t)len, "&created_before=%lld", (long long)query->created_before);
+    }
+}
+
+void handle_list_todos(const struct RequestContext* request, const todo_query_t* query) {
+    struct ResponseData* response = request->response;
+    int pretty = request->pretty;
+    const char* if_none_match = request->if_none_match;
+    char etag[ETAG_SIZE];
+
+    // Read the version before the rows: a write racing the query then only
+    // makes the tag older than the data, which costs a refetch, not staleness
+    list_etag(etag, sizeof(etag), todo_table_version(), pretty);
+    if (if_none_match && etag_list_contains(if_none_match, etag)) {
+        set_not_modified(response, etag);
+        return;
+    }
+    response_add_header(response, "ETag", "%s", etag);
+
+    if (query->limit == 0) {
+        struct ListStream* stream = calloc(1, sizeof(struct ListStream));
+        if (stream) {
+            json_buf_init(&stream->body);
+            stream->page.body = &stream->body;
+            stream->page.pretty = pretty;
+            stream->page.next = *query;
+            response->stream = read_list_stream;
+            response->stream_free = free_list_stream;
+            response->stream_state = stream;
+            return;
+        }
     } else {
-        response->data = strdup("{\"error\": \"Failed to list todos\"}");
+        struct TodoPage page = {json_thread_buf(), pretty, 0, *query};
+        if (json_buf_append(page.body, "[", 1) == 0 &&
+            todo_each(query, append_todo, &page) >= 0 &&
+            close_todo_array(&page) == 0) {
+            // A full page means there may be more; point the client at it
+            if (page.rows == query->limit) {
+                char next[RESPONSE_HEADER_VALUE_SIZE - 16];
+                format_next_link(next, sizeof(next), &page.next);
+                response_add_header(response, "Link", "<%s>; rel=\"next\"", next);
+            }
+            response->data = page.body->data;
+            response->size = page.body->len;
+            response->borrowed = 1;
+            return;
+        }
+    }
+
+    response->status = 500;
+    response->data = strdup("{\"error\": \"Failed to list todos\"}");
+    response->size = strlen(response->data);
+}
+
+static int append_search_hit(const todo_search_hit_t* hit, void* ctx) {
+    struct TodoPage* page = ctx;
+
+    if (page->rows > 0 && json_buf_append(page->body, ",", 1) != 0) {
+        return -1;
+    }
+    if (page->pretty && json_buf_append(page->body, "\n  ", 3) != 0) {
+        return -1;
+    }
+    if (json_write_search_hit(page->body, hit, page->pretty, 1) != 0) {
+        return -1;
+    }
+
+    page->rows++;
+    return 0;
+}
+
+// Percent-encodes everything but RFC 3986 unreserved characters
+static int url_encode(char* out, size_t size, const char* text) {
+    static const char hex[] = "0123456789ABCDEF";
+    size_t len = 0;
+
+    for (const unsigned char* p = (const unsigned char*)text; *p; p++) {
+        if (len + 4 > size) {
+            return -1;
+        }
+        if ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9') ||
+            *p == '-' || *p == '.' || *p == '_' || *p == '~') {
+            out[len++] = (char)*p;
+        } else {
+            out[len++] = '%';
+            out[len++] = hex[*p >> 4];
+            out[len++] = hex[*p & 0x0F];
+        }
+    }
+    out[len] = '\0';
+    return 0;
+}
+
+void handle_search_todos(const struct RequestContext* request, const todo_search_t* search) {
+    struct ResponseData* response = request->response;
+    int pretty = request->pretty;
+    struct TodoPage page = {json_thread_buf(), pretty, 0, {0}};
+
+    if (json_buf_append(page.body, "[", 1) == 0 &&
+        todo_search(search, append_search_hit, &page) >= 0 &&
+        close_todo_array(&page) == 0) {
+        char text[TODO_SEARCH_MAX_TEXT * 3 + 1];
+        if (page.rows == search->limit && url_encode(text, sizeof(text), search->text) == 0) {
+            response_add_header(response, "Link", "</todos/search?q=%s&limit=%d&offset=%d>; rel=\"next\"",
+                                text, search->limit, search->offset + search->limit);
+        }
+        response->data = page.body->data;
+        response->size = page.body->len;
+        response->borrowed = 1;
+        return;
+    }
+
+    response->status = 500;
+    response->data = strdup("{\"error\": \"Failed to search todos\"}");
+    response->size = strlen(response->data);
+}
+
+void handle_list_changes(const struct RequestContext* request, long long since, int limit, int wait, int events) {
+    struct ResponseData* response = request->response;
+    int pretty = request->pretty;
+    long long oldest, latest;
+
+    if (todo_change_bounds(&oldest, &latest) != 0) {
+        response->status = 500;
+        response->data = strdup("{\"error\": \"Failed to read changes\"}");
         response->size = strlen(response->data);
+        return;
+    }
+
+    // Pruned changes can't be replayed; the client has to reload the list
+    if (since >= 0 && since < oldest - 1) {
+        response->status = 410;
+        response->data = strdup("{\"error\": \"Changes since that sequence are no longer retained\"}");
+        response->size = strlen(response->data);
+        return;
+    }
+
+    // Without a since, polls and streams alike start from now
+    if (since < 0) {
+        since = latest;
     }
+
+    if (events) {
+        if (change_feed_subscribe_events(since, response) == 0) {
+            return;
+        }
+    } else {
+        if (wait == 0 || latest > since) {
+            json_buf_t* body = json_thread_buf();
+            if (change_feed_write_page(body, since, limit, pretty) == 0) {
+                response->data = body->data;
+                response->size = body->len;
+                response->borrowed = 1;
+                return;
+            }
+            response->status = 500;
+            response->data = strdup("{\"error\": \"Failed to read changes\"}");
+            response->size = strlen(response->data);
+            return;
+        }
+        if (change_feed_subscribe_poll(since, limit, wait, pretty, response) == 0) {
+            return;
+        }
+    }
+
+    response->status = 503;
+    response->data = strdup("{\"error\": \"Change feed unavailable\"}");
+    response->size = strlen(response->data);
 }
 
-void handle_get_todo(CURL* curl, int id, struct ResponseData* response) {
-    (void)curl; 
+void handle_get_todo(const struct RequestContext* request) {
+    struct ResponseData* response = request->response;
+    int id = request->id;
+    int pretty = request->pretty;
     todo_t todo;
-    if (todo_get(id, &todo) == 0) {
-        json_t* root = json_object();
-        json_object_set_new(root, "id", json_integer(todo.id));
-        json_object_set_new(root, "title", json_string(todo.title));
-        json_object_set_new(root, "description", json_string(todo.description));
-        json_object_set_new(root, "completed", json_boolean(todo.completed));
-        json_object_set_new(root, "created_at", json_integer(todo.created_at));
-        json_object_set_new(root, "updated_at", json_integer(todo.updated_at));
-
-        response->data = json_dumps(root, JSON_INDENT(2));
-        response->size = strlen(response->data);
+    time_t version;
+    char etag[ETAG_SIZE];
+    json_buf_t* body = json_thread_buf();
+
+    // Revalidation only needs the version, which the cache or the primary key lookup provides
+    if (request->if_none_match && todo_get_version(id, &version) == 0) {
+        todo_etag(etag, sizeof(etag), id, version, pretty);
+        if (etag_list_contains(request->if_none_match, etag)) {
+            set_not_modified(response, etag);
+            return;
+        }
+    }
 
-        json_decref(root);
+    // Only the compact form is cached; pretty output is a debugging aid
+    if (!pretty && todo_cache_get(id, &response->data, &response->size, &version) == 0) {
+        todo_etag(etag, sizeof(etag), id, version, 0);
+        response_add_header(response, "ETag", "%s", etag);
+        return;
+    }
+
+    uint64_t token = todo_cache_begin(id);
+    if (todo_get(id, &todo, request->arena) == 0 && json_write_todo(body, &todo, pretty, 0) == 0) {
+        if (!pretty) {
+            todo_cache_put(id, token, todo.updated_at, body->data, body->len);
+        }
+        todo_etag(etag, sizeof(etag), id, todo.updated_at, pretty);
+        response_add_header(response, "ETag", "%s", etag);
+        response->data = body->data;
+        response->size = body->len;
+        response->borrowed = 1;
     } else {
         response->data = strdup("{\"error\": \"Todo not found\"}");
         response->size = strlen(response->data);
     }
 }
 
-void handle_create_todo(CURL* curl, const char* post_data, size_t post_size, struct ResponseData* response) {
-    (void)curl;
-    
-    printf("DEBUG: handle_create_todo received %zu bytes of post data\n", post_size);
-    if (post_data) {
-        printf("DEBUG: post_data = '%.*s'\n", (int)post_size, post_data);
-    } else {
-        printf("DEBUG: post_data is NULL\n");
+void handle_stats(const struct RequestContext* request) {
+    struct ResponseData* response = request->response;
+    todo_cache_stats_t cache;
+    todo_cache_stats(&cache);
+
+    json_buf_t* body = json_thread_buf();
+    if (json_buf_printf(body,
+                        "{\"cache\":{\"hits\":%llu,\"misses\":%llu,\"evictions\":%llu,"
+                        "\"invalidations\":%llu,\"entries\":%zu,\"bytes\":%zu,\"capacity\":%zu}}",
+                        (unsigned long long)cache.hits, (unsigned long long)cache.misses,
+                        (unsigned long long)cache.evictions, (unsigned long long)cache.invalidations,
+                        cache.entries, cache.bytes, cache.capacity) != 0) {
+        response->status = 500;
+        response->data = strdup("{\"error\": \"Failed to read stats\"}");
+        response->size = strlen(response->data);
+        return;
     }
 
-    if (post_data && post_size > 0) {
-        json_error_t error;
-        json_t* root = json_loadb(post_data, post_size, 0, &error);
-        
-        if (root && json_is_object(root)) {
-            printf("DEBUG: Successfully parsed JSON\n");
-            const char* title = json_string_value(json_object_get(root, "title"));
-            const char* description = json_string_value(json_object_get(root, "description"));
+    response->data = body->data;
+    response->size = body->len;
+    response->borrowed = 1;
+}
 
-            printf("DEBUG: title = %s, description = %s\n", 
-                   title ? title : "NULL", 
-                   description ? description : "NULL");
+void handle_metrics(const struct RequestContext* request) {
+    struct ResponseData* response = request->response;
 
-            if (title && description) {
-                if (todo_create(title, description) == 0) {
-                    printf("DEBUG: Todo created successfully\n");
+    if (metrics_render(&response->data, &response->size) != 0) {
+        response->status = 500;
+        response->data = strdup("{\"error\": \"Failed to read metrics\"}");
+        response->size = strlen(response->data);
+        return;
+    }
+    response->content_type = "text/plain; version=0.0.4; charset=utf-8";
+}
+
+// Parses a request body holding a single todo object. The body is unescaped
+// in place, so the returned strings point into it.
+static int parse_todo_body(char* body, size_t size, todo_input_t* input) {
+    json_reader_t reader;
+    json_reader_init(&reader, body, size);
+    if (json_read_todo(&reader, input) != 0 || json_reader_finish(&reader) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+void handle_create_todo(const struct RequestContext* request) {
+    struct ResponseData* response = request->response;
+    char* body = request->body;
+    size_t body_size = request->body_size;
+
+    if (body && body_size > 0) {
+        todo_input_t input;
+
+        if (parse_todo_body(body, body_size, &input) == 0) {
+            if (input.title && input.description) {
+                if (todo_create(input.title, input.description) == 0) {
                     response->data = strdup("{\"status\": \"Todo created successfully\"}");
                 } else {
-                    printf("DEBUG: Failed to create todo\n");
                     response->data = strdup("{\"error\": \"Failed to create todo\"}");
                 }
             } else {
-                printf("DEBUG: Invalid request data\n");
                 response->data = strdup("{\"error\": \"Invalid request data\"}");
             }
-
-            json_decref(root);
         } else {
-            printf("DEBUG: Invalid JSON data. Error: %s\n", error.text);
             response->data = strdup("{\"error\": \"Invalid JSON data\"}");
         }
     } else {
-        printf("DEBUG: No data received\n");
         response->data = strdup("{\"error\": \"No data received\"}");
     }
 
     response->size = strlen(response->data);
 }
 
-void handle_update_todo(CURL* curl, int id, const char* post_data, size_t post_size, struct ResponseData* response) {
-    (void)curl;
-    
-    printf("DEBUG: handle_update_todo received %zu bytes of post data\n", post_size);
-    if (post_data) {
-        printf("DEBUG: post_data = '%.*s'\n", (int)post_size, post_data);
-    } else {
-        printf("DEBUG: post_data is NULL\n");
-    }
-
-    if (post_data && post_size > 0) {
-        json_error_t error;
-        json_t* root = json_loadb(post_data, post_size, 0, &error);
-        
-        if (root && json_is_object(root)) {
-            printf("DEBUG: Successfully parsed JSON\n");
-            const char* title = json_string_value(json_object_get(root, "title"));
-            const char* description = json_string_value(json_object_get(root, "description"));
-            json_t* completed_json = json_object_get(root, "completed");
-            int completed = completed_json ? json_boolean_value(completed_json) : 0;
-
-            printf("DEBUG: title = %s, description = %s, completed = %d\n", 
-                   title ? title : "NULL", 
-                   description ? description : "NULL",
-                   completed);
-
-            if (title && description) {
-                if (todo_update(id, title, description, completed) == 0) {
-                    printf("DEBUG: Todo updated successfully\n");
+void handle_update_todo(const struct RequestContext* request) {
+    struct ResponseData* response = request->response;
+    int id = request->id;
+    const char* if_match = request->if_match;
+    char* body = request->body;
+    size_t body_size = request->body_size;
+
+    if (body && body_size > 0) {
+        todo_input_t input;
+
+        if (parse_todo_body(body, body_size, &input) == 0) {
+            if (input.title && input.description && if_match) {
+                time_t version;
+                todo_status_t status = TODO_CONFLICT;
+                if (match_version(id, if_match, &version) == 0) {
+                    status = todo_update_if(id, input.title, input.description, input.completed, version);
+                }
+                if (status == TODO_CONFLICT || status == TODO_NOT_FOUND) {
+                    set_precondition_failed(response);
+                    return;
+                }
+                response->data = strdup(status == TODO_OK ? "{\"status\": \"Todo updated successfully\"}"
+                                                          : "{\"error\": \"Failed to update todo\"}");
+            } else if (input.title && input.description) {
+                if (todo_update(id, input.title, input.description, input.completed) == 0) {
                     response->data = strdup("{\"status\": \"Todo updated successfully\"}");
                 } else {
-                    printf("DEBUG: Failed to update todo\n");
                     response->data = strdup("{\"error\": \"Failed to update todo\"}");
                 }
             } else {
-                printf("DEBUG: Invalid request data\n");
                 response->data = strdup("{\"error\": \"Invalid request data\"}");
             }
-
-            json_decref(root);
         } else {
-            printf("DEBUG: Invalid JSON data. Error: %s\n", error.text);
             response->data = strdup("{\"error\": \"Invalid JSON data\"}");
         }
     } else {
-        printf("DEBUG: No data received\n");
         response->data = strdup("{\"error\": \"No data received\"}");
     }
 
     response->size = strlen(response->data);
 }
 
-void handle_delete_todo(CURL* curl, int id, struct ResponseData* response) {
-    (void)curl;
-    
+void handle_delete_todo(const struct RequestContext* request) {
+    struct ResponseData* response = request->response;
+    int id = request->id;
+    const char* if_match = request->if_match;
+
+    if (if_match) {
+        time_t version;
+        todo_status_t status = TODO_CONFLICT;
+        if (match_version(id, if_match, &version) == 0) {
+            status = todo_delete_if(id, version);
+        }
+        if (status == TODO_CONFLICT || status == TODO_NOT_FOUND) {
+            set_precondition_failed(response);
+            return;
+        }
+        response->data = strdup(status == TODO_OK ? "{\"status\": \"Todo deleted successfully\"}"
+                                                  : "{\"error\": \"Failed to delete todo\"}");
+        response->size = strlen(response->data);
+        return;
+    }
+
     if (todo_delete(id) == 0) {
         response->data = strdup("{\"status\": \"Todo deleted successfully\"}");
     } else {
         response->data = strdup("{\"error\": \"Failed to delete todo\"}");
     }
     response->size = strlen(response->data);
-} 
\ No newline at end of file
+}
+
+static void set_error(struct ResponseData* response, int status, const char* json) {
+    response->status = status;
+    response->data = strdup(json);
+    response->size = strlen(response->data);
+}
+
+static void set_batch_error(struct ResponseData* response, int rc) {
+    if (rc == BATCH_TOO_LARGE) {
+        set_error(response, 413, "{\"error\": \"Too many items in batch\"}");
+    } else {
+        set_error(response, 400, "{\"error\": \"Invalid JSON data\"}");
+    }
+}
+
+static todo_op_type_t parse_op_type(const char* op) {
+    if (!op || strcmp(op, "create") == 0) return TODO_OP_CREATE;
+    if (strcmp(op, "update") == 0) return TODO_OP_UPDATE;
+    if (strcmp(op, "patch") == 0) return TODO_OP_PATCH;
+    if (strcmp(op, "delete") == 0) return TODO_OP_DELETE;
+    return TODO_OP_NONE;
+}
+
+static void input_to_op(const todo_input_t* input, todo_op_t* op) {
+    op->type = parse_op_type(input->op);
+    op->id = input->has_id ? input->id : 0;
+    op->title = input->title;
+    op->description = input->description;
+    if (op->type == TODO_OP_PATCH) {
+        op->completed = input->has_completed ? input->completed : -1;
+    } else {
+        op->completed = input->completed;
+    }
+}
+
+// Parses every item of a batch body into an arena-allocated op array.
+// Returns the number of ops, or BATCH_INVALID / BATCH_TOO_LARGE.
+static int parse_batch(char* body, size_t size, int ndjson, arena_t* arena, todo_op_t** out) {
+    json_reader_t reader;
+    todo_op_t* ops = NULL;
+    int count = 0;
+    int capacity = 0;
+
+    json_reader_init(&reader, body, size);
+    if (!ndjson && json_array_begin(&reader) != 0) {
+        return BATCH_INVALID;
+    }
+
+    for (;;) {
+        if (ndjson) {
+            if (json_reader_finish(&reader) == 0) break;
+        } else {
+            int rc = json_array_next(&reader, count);
+            if (rc < 0) return BATCH_INVALID;
+            if (rc == 0) break;
+        }
+
+        if (count == BATCH_MAX_ITEMS) {
+            return BATCH_TOO_LARGE;
+        }
+        if (count == capacity) {
+            // Arena memory is never freed individually; doubling keeps the waste bounded
+            int grown = capacity ? capacity * 2 : BATCH_INITIAL_CAPACITY;
+            todo_op_t* larger = arena_alloc(arena, sizeof(todo_op_t) * (size_t)grown);
+            if (!larger) return BATCH_INVALID;
+            if (count > 0) memcpy(larger, ops, sizeof(todo_op_t) * (size_t)count);
+            ops = larger;
+            capacity = grown;
+        }
+
+        todo_input_t input;
+        if (json_read_todo(&reader, &input) != 0) {
+            return BATCH_INVALID;
+        }
+        input_to_op(&input, &ops[count++]);
+    }
+
+    if (!ndjson && json_reader_finish(&reader) != 0) {
+        return BATCH_INVALID;
+    }
+
+    *out = ops;
+    return count;
+}
+
+static const char* op_status_name(todo_op_type_t type, todo_status_t status) {
+    switch (status) {
+    case TODO_OK:
+        if (type == TODO_OP_CREATE) return "created";
+        if (type == TODO_OP_DELETE) return "deleted";
+        return "updated";
+    case TODO_NOT_FOUND:
+        return "not_found";
+    case TODO_INVALID:
+        return "invalid";
+    case TODO_CONFLICT:
+        return "conflict";
+    case TODO_FAILED:
+        break;
+    }
+    return "failed";
+}
+
+// Runs the ops in one transaction and answers with one result per op, in
+// request order: [{"index":0,"status":"created","id":12}, ...]
+static void run_batch(const todo_op_t* ops, int count, arena_t* arena, struct ResponseData* response) {
+    todo_op_result_t* results = arena_alloc(arena, sizeof(todo_op_result_t) * (size_t)(count > 0 ? count : 1));
+    if (!results || todo_batch(ops, count, results) != 0) {
+        set_error(response, 500, "{\"error\": \"Failed to apply batch\"}");
+        return;
+    }
+
+    json_buf_t* body = json_thread_buf();
+    int rc = json_buf_append(body, "[", 1);
+    for (int i = 0; i < count && rc == 0; i++) {
+        rc = json_buf_printf(body, "%s{\"index\":%d,\"status\":\"%s\"", i > 0 ? "," : "", i,
+                             op_status_name(ops[i].type, results[i].status));
+        if (rc == 0 && results[i].id > 0) {
+            rc = json_buf_printf(body, ",\"id\":%d", results[i].id);
+        }
+        if (rc == 0) {
+            rc = json_buf_append(body, "}", 1);
+        }
+    }
+    if (rc != 0 || json_buf_append(body, "]", 1) != 0) {
+        set_error(response, 500, "{\"error\": \"Failed to apply batch\"}");
+        return;
+    }
+
+    response->data = body->data;
+    response->size = body->len;
+    response->borrowed = 1;
+}
+
+void handle_batch_todos(const struct RequestContext* request, int ndjson) {
+    struct ResponseData* response = request->response;
+    char* body = request->body;
+    size_t body_size = request->body_size;
+    arena_t* arena = request->arena;
+
+    if (!body || body_size == 0) {
+        set_error(response, 400, "{\"error\": \"No data received\"}");
+        return;
+    }
+
+    todo_op_t* ops = NULL;
+    int count = parse_batch(body, body_size, ndjson, arena, &ops);
+    if (count < 0) {
+        set_batch_error(response, count);
+        return;
+    }
+    run_batch(ops, count, arena, response);
+}
+
+// Parses a comma-separated list of positive ids such as "1,2,3"
+static int parse_id_list(const char* value, arena_t* arena, int** out) {
+    int capacity = 1;
+    for (const char* p = value; *p; p++) {
+        if (*p == ',') capacity++;
+    }
+    if (capacity > BATCH_MAX_ITEMS) {
+        return BATCH_TOO_LARGE;
+    }
+
+    int* ids = arena_alloc(arena, sizeof(int) * (size_t)capacity);
+    if (!ids) {
+        return BATCH_INVALID;
+    }
+
+    int count = 0;
+    const char* p = value;
+    for (;;) {
+        char* end;
+        errno = 0;
+        long id = strtol(p, &end, 10);
+        if (end == p || errno != 0 || id <= 0 || id > INT_MAX || (*end != ',' && *end != '\0')) {
+            return BATCH_INVALID;
+        }
+        ids[count++] = (int)id;
+        if (*end == '\0') break;
+        p = end + 1;
+    }
+
+    *out = ids;
+    return count;
+}
+
+// Reads the "ids" array recorded while parsing a bulk body
+static int read_body_ids(todo_input_t* input, arena_t* arena, int** out) {
+    if (!input->has_ids) {
+        return BATCH_INVALID;
+    }
+
+    // Integers are not rewritten by the reader, so the array can be walked twice
+    json_reader_t ids = input->ids;
+    int count = json_read_ids(&ids, NULL, INT_MAX);
+    if (count < 0) {
+        return BATCH_INVALID;
+    }
+    if (count > BATCH_MAX_ITEMS) {
+        return BATCH_TOO_LARGE;
+    }
+
+    int* values = arena_alloc(arena, sizeof(int) * (size_t)(count > 0 ? count : 1));
+    if (!values) {
+        return BATCH_INVALID;
+    }
+    ids = input->ids;
+    json_read_ids(&ids, values, count);
+
+    *out = values;
+    return count;
+}
+
+// Expands a list of ids into one op per id, each a copy of shared
+static todo_op_t* ops_for_ids(const todo_op_t* shared, const int* ids, int count, arena_t* arena) {
+    todo_op_t* ops = arena_alloc(arena, sizeof(todo_op_t) * (size_t)(count > 0 ? count : 1));
+    if (!ops) {
+        return NULL;
+    }
+    for (int i = 0; i < count; i++) {
+        ops[i] = *shared;
+        ops[i].id = ids[i];
+    }
+    return ops;
+}
+
+void handle_delete_todos(const struct RequestContext* request, const char* ids_arg) {
+    struct ResponseData* response = request->response;
+    char* body = request->body;
+    size_t body_size = request->body_size;
+    arena_t* arena = request->arena;
+    int* ids = NULL;
+    int count;
+
+    if (ids_arg) {
+        count = parse_id_list(ids_arg, arena, &ids);
+        if (count == BATCH_INVALID) {
+            set_error(response, 400, "{\"error\": \"Invalid ids\"}");
+            return;
+        }
+    } else if (body && body_size > 0) {
+        todo_input_t input;
+        count = parse_todo_body(body, body_size, &input) == 0 ? read_body_ids(&input, arena, &ids) : BATCH_INVALID;
+    } else {
+        set_error(response, 400, "{\"error\": \"No ids given\"}");
+        return;
+    }
+    if (count < 0) {
+        set_batch_error(response, count);
+        return;
+    }
+
+    todo_op_t shared = {TODO_OP_DELETE, 0, NULL, NULL, 0};
+    todo_op_t* ops = ops_for_ids(&shared, ids, count, arena);
+    if (!ops) {
+        set_error(response, 500, "{\"error\": \"Failed to apply batch\"}");
+        return;
+    }
+    run_batch(ops, count, arena, response);
+}
+
+void handle_patch_todos(const struct RequestContext* request) {
+    struct ResponseData* response = request->response;
+    char* body = request->body;
+    size_t body_size = request->body_size;
+    arena_t* arena = request->arena;
+
+    if (!body || body_size == 0) {
+        set_error(response, 400, "{\"error\": \"No data received\"}");
+        return;
+    }
+
+    todo_input_t input;
+    int* ids = NULL;
+    int count = parse_todo_body(body, body_size, &input) == 0 ? read_body_ids(&input, arena, &ids) : BATCH_INVALID;
+    if (count < 0) {
+        set_batch_error(response, count);
+        return;
+    }
+
+    todo_op_t shared = {TODO_OP_PATCH, 0, input.title, input.description,
+                        input.has_completed ? input.completed : -1};
+    todo_op_t* ops = ops_for_ids(&shared, ids, count, arena);
+    if (!ops) {
+        set_error(response, 500, "{\"error\": \"Failed to apply batch\"}");
+        return;
+    }
+    run_batch(ops, count, arena, response);
+}
+
+// Streams every todo by ascending id, one page at a time like ListStream,
+// either as NDJSON lines or as binary records after TODO_RECORD_MAGIC
+struct ExportStream {
+    json_buf_t body;
+    todo_query_t next;
+    size_t sent;
+    int binary;
+    int started;
+    int finished;
+};
+
+static int append_export_row(const todo_t* todo, void* ctx) {
+    struct ExportStream* stream = ctx;
+
+    if (stream->binary) {
+        size_t size = todo_record_size(todo);
+        if (json_buf_reserve(&stream->body, size) != 0) return -1;
+        todo_record_write(todo, stream->body.data + stream->body.len);
+        stream->body.len += size;
+    } else if (json_write_todo(&stream->body, todo, 0, 0) != 0 || json_buf_append(&stream->body, "\n", 1) != 0) {
+        return -1;
+    }
+
+    todo_query_advance(&stream->next, todo);
+    return 0;
+}
+
+static ssize_t read_export_stream(void* state, uint64_t pos, char* buf, size_t max) {
+    (void)pos;
+    struct ExportStream* stream = state;
+
+    while (stream->sent == stream->body.len) {
+        if (stream->finished) {
+            return RESPONSE_STREAM_END;
+        }
+        json_buf_reset(&stream->body);
+        stream->sent = 0;
+        if (!stream->started && stream->binary &&
+            json_buf_append(&stream->body, TODO_RECORD_MAGIC, TODO_RECORD_MAGIC_LEN) != 0) {
+            return RESPONSE_STREAM_ERROR;
+        }
+
+        // As with lists, a page that failed to read can be read again
+        todo_query_t query = stream->next;
+        query.limit = LIST_PAGE_SIZE;
+        int visited = todo_each(&query, append_export_row, stream);
+        if (visited < 0) {
+            json_buf_reset(&stream->body);
+            return RESPONSE_STREAM_ERROR;
+        }
+        stream->started = 1;
+        stream->finished = visited < LIST_PAGE_SIZE;
+    }
+
+    size_t len = stream->body.len - stream->sent;
+    if (len > max) len = max;
+    memcpy(buf, stream->body.data + stream->sent, len);
+    stream->sent += len;
+    return (ssize_t)len;
+}
+
+static void free_export_stream(void* state) {
+    struct ExportStream* stream = state;
+    json_buf_free(&stream->body);
+    free(stream);
+}
+
+void handle_export_todos(const struct RequestContext* request, int binary) {
+    struct ResponseData* response = request->response;
+    struct ExportStream* stream = calloc(1, sizeof(struct ExportStream));
+    if (!stream) {
+        set_error(response, 500, "{\"error\": \"Failed to export todos\"}");
+        return;
+    }
+
+    json_buf_init(&stream->body);
+    stream->binary = binary;
+    response->content_type = binary ? "application/octet-stream" : "application/x-ndjson";
+    response->stream = read_export_stream;
+    response->stream_free = free_export_stream;
+    response->stream_state = stream;
+}
+
+// An import body parsed as it arrives. Complete lines or records are staged
+// in batches, and only an unfinished one is carried into the next chunk.
+struct ImportUpload {
+    int binary;
+    int started;                // Binary: the magic has been checked
+    int status;                 // First error as an HTTP status, 0 while none
+    char* carry;
+    size_t carry_len;
+    size_t carry_capacity;      // The longest line or record accepted
+    todo_import_stage_t* stage;
+    todo_t batch[IMPORT_BATCH_ROWS];
+    int batch_count;
+    long long count;
+    time_t now;
+};
+
+// Batched rows point into the carry, so they are staged before it moves
+static int flush_import_batch(struct ImportUpload* upload) {
+    if (upload->batch_count > 0 && todo_import_add(upload->stage, upload->batch, upload->batch_count) != 0) {
+        upload->status = 500;
+        return -1;
+    }
+    upload->count += upload->batch_count;
+    upload->batch_count = 0;
+    return 0;
+}
+
+static todo_t* next_import_row(struct ImportUpload* upload) {
+    if (upload->batch_count == IMPORT_BATCH_ROWS && flush_import_batch(upload) != 0) {
+        return NULL;
+    }
+    return &upload->batch[upload->batch_count++];
+}
+
+// Parses the complete lines at the start of data, or all of it when final.
+// Returns the bytes used, or -1.
+static long long parse_import_lines(struct ImportUpload* upload, char* data, size_t len, int final) {
+    size_t end = len;
+    if (!final) {
+        while (end > 0 && data[end - 1] != '\n') end--;
+    }
+
+    json_reader_t reader;
+    json_reader_init(&reader, data, end);
+    while (json_reader_finish(&reader) != 0) {
+        todo_input_t input;
+        if (json_read_todo(&reader, &input) != 0 || !input.title || (input.has_id && input.id < 0)) {
+            upload->status = 400;
+            return -1;
+        }
+
+        todo_t* todo = next_import_row(upload);
+        if (!todo) return -1;
+        todo->id = input.has_id ? input.id : 0;
+        todo->title = input.title;
+        todo->title_len = strlen(input.title);
+        todo->description = input.description ? input.description : "";
+        todo->description_len = strlen(todo->description);
+        todo->completed = input.completed;
+        todo->created_at = input.has_created_at ? (time_t)input.created_at : upload->now;
+        todo->updated_at = input.has_updated_at ? (time_t)input.updated_at : todo->created_at;
+    }
+    return (long long)end;
+}
+
+// Records are decoded in place; their strings point into data
+static long long parse_import_records(struct ImportUpload* upload, char* data, size_t len, int final) {
+    size_t pos = 0;
+    if (!upload->started) {
+        if (len < TODO_RECORD_MAGIC_LEN && !final) {
+            return 0;
+        }
+        if (len < TODO_RECORD_MAGIC_LEN || memcmp(data, TODO_RECORD_MAGIC, TODO_RECORD_MAGIC_LEN) != 0) {
+            upload->status = 400;
+            return -1;
+        }
+        pos = TODO_RECORD_MAGIC_LEN;
+        upload->started = 1;
+    }
+
+    while (pos < len) {
+        todo_t record;
+        long long used = todo_record_read(data + pos, len - pos, &record);
+        if (used < 0 || (used == 0 && final)) {
+            upload->status = 400;
+            return -1;
+        }
+        if (used == 0) {
+            break;
+        }
+
+        todo_t* todo = next_import_row(upload);
+        if (!todo) return -1;
+        *todo = record;
+        pos += (size_t)used;
+    }
+    return (long long)pos;
+}
+
+// Stages everything complete in the carry and keeps the rest
+static int consume_import(struct ImportUpload* upload, int final) {
+    long long used = upload->binary ? parse_import_records(upload, upload->carry, upload->carry_len, final)
+                                    : parse_import_lines(upload, upload->carry, upload->carry_len, final);
+    if (used < 0 || flush_import_batch(upload) != 0) {
+        return -1;
+    }
+    upload->carry_len -= (size_t)used;
+    memmove(upload->carry, upload->carry + used, upload->carry_len);
+    return 0;
+}
+
+struct ImportUpload* import_upload_open(int binary, size_t max_record) {
+    struct ImportUpload* upload = calloc(1, sizeof(struct ImportUpload));
+    if (!upload) {
+        return NULL;
+    }
+    upload->binary = binary;
+    upload->carry_capacity = max_record;
+    upload->carry = malloc(max_record);
+    upload->stage = upload->carry ? todo_import_open() : NULL;
+    if (!upload->stage) {
+        import_upload_free(upload);
+        return NULL;
+    }
+    upload->now = time(NULL);
+    return upload;
+}
+
+int import_upload_write(struct ImportUpload* upload, const char* data, size_t size) {
+    while (upload->status == 0 && size > 0) {
+        size_t room = upload->carry_capacity - upload->carry_len;
+        if (room == 0) {
+            upload->status = 413;
+            break;
+        }
+        size_t take = size < room ? size : room;
+        memcpy(upload->carry + upload->carry_len, data, take);
+        upload->carry_len += take;
+        data += take;
+        size -= take;
+        consume_import(upload, 0);
+    }
+    return upload->status;
+}
+
+void import_upload_free(struct ImportUpload* upload) {
+    if (!upload) {
+        return;
+    }
+    todo_import_close(upload->stage);
+    free(upload->carry);
+    free(upload);
+}
+
+void handle_import_todos(const struct RequestContext* request, struct ImportUpload* upload) {
+    struct ResponseData* response = request->response;
+
+    if (!upload) {
+        set_error(response, 400, "{\"error\": \"No data received\"}");
+        return;
+    }
+
+    if (upload->status == 0) {
+        consume_import(upload, 1);
+    }
+    if (upload->status == 413) {
+        set_error(response, 413, "{\"error\": \"Import line or record too large\"}");
+        return;
+    }
+    if (upload->status == 400) {
+        set_error(response, 400,
+                  upload->binary ? "{\"error\": \"Invalid import data\"}" : "{\"error\": \"Invalid JSON data\"}");
+        return;
+    }
+    if (upload->status != 0 || todo_import_finish(upload->stage) != upload->count) {
+        set_error(response, 500, "{\"error\": \"Failed to import todos\"}");
+        return;
+    }
+
+    json_buf_t* out = json_thread_buf();
+    if (json_buf_printf(out, "{\"imported\": %lld}", upload->count) != 0) {
+        set_error(response, 500, "{\"error\": \"Failed to import todos\"}");
+        return;
+    }
+    response->data = out->data;
+    response->size = out->len;
+    response->borrowed = 1;
+}
@@ -1,32 +1,135 @@
 #ifndef HANDLERS_H
 #define HANDLERS_H
 
-#include <curl/curl.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "../core/arena.h"
+#include "../core/todo.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#define RESPONSE_MAX_HEADERS 8
+#define RESPONSE_HEADER_VALUE_SIZE 1024    // Fits a search Link with the longest query
+#define RESPONSE_STREAM_END ((ssize_t)-1)
+#define RESPONSE_STREAM_ERROR ((ssize_t)-2)
+
+// Pulls the next part of a streamed body into buf; same contract as a
+// libmicrohttpd content reader.
+typedef ssize_t (*response_stream_fn)(void* state, uint64_t pos, char* buf, size_t max);
+
+// Lets a stream with nothing to send yet park its connection instead of
+// holding a thread. The stream calls suspend from inside its read callback
+// and then returns 0; resume may be called from any thread once it has data.
+typedef struct {
+    void (*suspend)(void* ctx);
+    void (*resume)(void* ctx);
+    void* ctx;
+} response_waker_t;
+
+struct ResponseHeader {
+    const char* name;
+    char value[RESPONSE_HEADER_VALUE_SIZE];
+};
+
 struct ResponseData {
     char* data;
     size_t size;
+    int borrowed;                       // data is a per-thread buffer: copy, don't free
+    int status;                         // 0 = 200 OK; 304 sends no body
+    const char* content_type;           // NULL = application/json
+    response_stream_fn stream;          // Set instead of data for chunked bodies
+    void (*stream_free)(void* state);
+    void* stream_state;
+    // Set by streams that wait for data; without a waker they block in read
+    void (*stream_set_waker)(void* state, const response_waker_t* waker);
+    struct ResponseHeader headers[RESPONSE_MAX_HEADERS];
+    int header_count;
 };
 
-// Handler for GET /todos
-void handle_list_todos(CURL* curl, struct ResponseData* response);
+void response_add_header(struct ResponseData* response, const char* name, const char* format, ...);
+
+// What a handler sees of its request. The server parses the route and the
+// headers handlers care about before dispatch; the handler fills in response.
+struct RequestContext {
+    int id;                             // :id route parameter, 0 on collection routes
+    int pretty;                         // ?pretty=1 selects indented JSON
+    const char* if_none_match;          // Conditional headers, NULL when absent
+    const char* if_match;
+    char* body;                         // Writable and NUL-terminated; NULL without a body
+    size_t body_size;
+    arena_t* arena;                     // Released when the request completes
+    struct ResponseData* response;
+};
+
+// Handler for GET /todos. A query without a limit streams every matching todo.
+void handle_list_todos(const struct RequestContext* request, const todo_query_t* query);
+
+// Handler for GET /todos/search: one page of ranked hits with highlighted
+// snippets, and a Link to the next page when this one is full
+void handle_search_todos(const struct RequestContext* request, const todo_search_t* search);
+
+// Handler for GET /todos/changes. since < 0 means the argument was absent.
+// With events set the response is a Server-Sent Events stream; otherwise it
+// is one page of changes, held open for up to wait seconds if there are none.
+void handle_list_changes(const struct RequestContext* request, long long since, int limit, int wait, int events);
+
+// Handler for GET /todos/:id. Compact responses are served from and stored
+// in the todo cache; a todo read from the database is copied into the arena.
+void handle_get_todo(const struct RequestContext* request);
+
+// Handler for GET /stats: cache counters
+void handle_stats(const struct RequestContext* request);
+
+// Handler for GET /metrics: request, database and cache metrics in the
+// Prometheus text format
+void handle_metrics(const struct RequestContext* request);
+
+// Handler for POST /todos. The body is parsed in place.
+void handle_create_todo(const struct RequestContext* request);
+
+// Handler for PUT /todos/:id. With an If-Match header the update only
+// applies to the version the client last saw.
+void handle_update_todo(const struct RequestContext* request);
+
+// Handler for DELETE /todos/:id, conditional like handle_update_todo
+void handle_delete_todo(const struct RequestContext* request);
+
+// Handler for POST /todos/batch. The body is a JSON array of operations, or
+// one operation object per line when ndjson is set. All operations are
+// applied in a single transaction; item arrays are allocated from the arena.
+void handle_batch_todos(const struct RequestContext* request, int ndjson);
+
+// Handler for DELETE /todos. Ids come from the comma-separated ids query
+// argument, or from an "ids" array in the body.
+void handle_delete_todos(const struct RequestContext* request, const char* ids);
 
-// Handler for GET /todos/:id
-void handle_get_todo(CURL* curl, int id, struct ResponseData* response);
+// Handler for PATCH /todos. The body's "ids" array selects the todos and its
+// other fields are applied to each of them.
+void handle_patch_todos(const struct RequestContext* request);
 
-// Handler for POST /todos
-void handle_create_todo(CURL* curl, const char* post_data, size_t post_size, struct ResponseData* response);
+// Handler for GET /todos/export: every todo by ascending id as NDJSON, one
+// object per line, or with binary set as the record stream of snapshot.h.
+// Pages are read as the client drains the response, so writes made during a
+// long export may or may not appear in it.
+void handle_export_todos(const struct RequestContext* request, int binary);
 
-// Handler for PUT /todos/:id
-void handle_update_todo(CURL* curl, int id, const char* post_data, size_t post_size, struct ResponseData* response);
+// The body of POST /todos/import, parsed and staged as it is uploaded so
+// that no more than one line or record, at most max_record bytes, is held
+// in memory. write returns 0, or the HTTP status of the first error, after
+// which the rest of the body is ignored.
+struct ImportUpload;
+struct ImportUpload* import_upload_open(int binary, size_t max_record);
+int import_upload_write(struct ImportUpload* upload, const char* data, size_t size);
+void import_upload_free(struct ImportUpload* upload);
 
-// Handler for DELETE /todos/:id
-void handle_delete_todo(CURL* curl, int id, struct ResponseData* response);
+// Handler for POST /todos/import, given the upload of the whole body or NULL
+// when there was none. The body is what the export produces in the same
+// format; todos keep their ids and timestamps and all of them are loaded in
+// one transaction. NDJSON lines need only a title.
+void handle_import_todos(const struct RequestContext* request, struct ImportUpload* upload);
 
 #ifdef __cplusplus
 }
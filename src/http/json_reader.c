@@ -0,0 +1,401 @@
+#include "json_reader.h"
+#include "json_writer.h"
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+
+#define JSON_MAX_DEPTH 32
+
+void json_reader_init(json_reader_t* reader, char* data, size_t len) {
+    reader->pos = data;
+    reader->end = data + len;
+}
+
+static void skip_whitespace(json_reader_t* reader) {
+    while (reader->pos < reader->end &&
+           (*reader->pos == ' ' || *reader->pos == '\t' || *reader->pos == '\n' || *reader->pos == '\r')) {
+        reader->pos++;
+    }
+}
+
+static int expect(json_reader_t* reader, char c) {
+    skip_whitespace(reader);
+    if (reader->pos < reader->end && *reader->pos == c) {
+        reader->pos++;
+        return 0;
+    }
+    return -1;
+}
+
+static int peek(json_reader_t* reader) {
+    skip_whitespace(reader);
+    return reader->pos < reader->end ? (unsigned char)*reader->pos : -1;
+}
+
+static int read_hex4(const char* p, uint32_t* out) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = p[i];
+        value <<= 4;
+        if (c >= '0' && c <= '9') value |= (uint32_t)(c - '0');
+        else if (c >= 'a' && c <= 'f') value |= (uint32_t)(c - 'a' + 10);
+        else if (c >= 'A' && c <= 'F') value |= (uint32_t)(c - 'A' + 10);
+        else return -1;
+    }
+    *out = value;
+    return 0;
+}
+
+static char* encode_utf8(char* out, uint32_t cp) {
+    if (cp < 0x80) {
+        *out++ = (char)cp;
+    } else if (cp < 0x800) {
+        *out++ = (char)(0xC0 | (cp >> 6));
+        *out++ = (char)(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        *out++ = (char)(0xE0 | (cp >> 12));
+        *out++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+        *out++ = (char)(0x80 | (cp & 0x3F));
+    } else {
+        *out++ = (char)(0xF0 | (cp >> 18));
+        *out++ = (char)(0x80 | ((cp >> 12) & 0x3F));
+        *out++ = (char)(0x80 | ((cp >> 6) & 0x3F));
+        *out++ = (char)(0x80 | (cp & 0x3F));
+    }
+    return out;
+}
+
+// Parses a string at the cursor, unescaping it in place. The decoded form is
+// never longer than the source, so it is NUL-terminated where it ends.
+static int read_string(json_reader_t* reader, char** out) {
+    if (expect(reader, '"') != 0) {
+        return -1;
+    }
+
+    char* start = reader->pos;
+    char* dst = start;
+    char* src = start;
+    char* end = reader->end;
+
+    while (src < end) {
+        unsigned char c = (unsigned char)*src;
+
+        if (c == '"') {
+            *dst = '\0';
+            reader->pos = src + 1;
+            *out = start;
+            return 0;
+        }
+
+        if (c < 0x20) {
+            return -1;
+        }
+
+        if (c >= 0x80) {
+            size_t n = json_utf8_sequence_length((const unsigned char*)src, (size_t)(end - src));
+            if (!n) return -1;
+            memmove(dst, src, n);
+            dst += n;
+            src += n;
+            continue;
+        }
+
+        if (c != '\\') {
+            *dst++ = *src++;
+            continue;
+        }
+
+        if (end - src < 2) return -1;
+        switch (src[1]) {
+        case '"': *dst++ = '"'; break;
+        case '\\': *dst++ = '\\'; break;
+        case '/': *dst++ = '/'; break;
+        case 'b': *dst++ = '\b'; break;
+        case 'f': *dst++ = '\f'; break;
+        case 'n': *dst++ = '\n'; break;
+        case 'r': *dst++ = '\r'; break;
+        case 't': *dst++ = '\t'; break;
+        case 'u': {
+            uint32_t cp;
+            if (end - src < 6 || read_hex4(src + 2, &cp) != 0) return -1;
+            src += 6;
+            if (cp >= 0xD800 && cp <= 0xDBFF) {
+                uint32_t low;
+                if (end - src < 6 || src[0] != '\\' || src[1] != 'u' ||
+                    read_hex4(src + 2, &low) != 0 || low < 0xDC00 || low > 0xDFFF) {
+                    return -1;
+                }
+                src += 6;
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+            } else if (cp >= 0xDC00 && cp <= 0xDFFF) {
+                return -1;
+            }
+            // Strings are handed around as C strings, so NUL cannot be represented
+            if (cp == 0) return -1;
+            dst = encode_utf8(dst, cp);
+            continue;
+        }
+        default:
+            return -1;
+        }
+        src += 2;
+    }
+
+    return -1;
+}
+
+static int read_literal(json_reader_t* reader, const char* literal) {
+    size_t len = strlen(literal);
+    if ((size_t)(reader->end - reader->pos) < len || memcmp(reader->pos, literal, len) != 0) {
+        return -1;
+    }
+    reader->pos += len;
+    return 0;
+}
+
+static int is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static int skip_number(json_reader_t* reader) {
+    char* p = reader->pos;
+    char* end = reader->end;
+
+    if (p < end && *p == '-') p++;
+    if (p >= end || !is_digit(*p)) return -1;
+    if (*p == '0') {
+        p++;
+    } else {
+        while (p < end && is_digit(*p)) p++;
+    }
+    if (p < end && *p == '.') {
+        p++;
+        if (p >= end || !is_digit(*p)) return -1;
+        while (p < end && is_digit(*p)) p++;
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        if (p < end && (*p == '+' || *p == '-')) p++;
+        if (p >= end || !is_digit(*p)) return -1;
+        while (p < end && is_digit(*p)) p++;
+    }
+
+    reader->pos = p;
+    return 0;
+}
+
+static int skip_value(json_reader_t* reader, int depth);
+
+static int skip_container(json_reader_t* reader, char close, int depth) {
+    if (depth >= JSON_MAX_DEPTH) {
+        return -1;
+    }
+
+    reader->pos++;
+    if (peek(reader) == close) {
+        reader->pos++;
+        return 0;
+    }
+
+    for (;;) {
+        if (close == '}') {
+            char* key;
+            if (read_string(reader, &key) != 0 || expect(reader, ':') != 0) return -1;
+        }
+        if (skip_value(reader, depth + 1) != 0) return -1;
+
+        int c = peek(reader);
+        if (c != close && c != ',') return -1;
+        reader->pos++;
+        if (c == close) return 0;
+    }
+}
+
+static int skip_value(json_reader_t* reader, int depth) {
+    char* ignored;
+
+    switch (peek(reader)) {
+    case '"': return read_string(reader, &ignored);
+    case '{': return skip_container(reader, '}', depth);
+    case '[': return skip_container(reader, ']', depth);
+    case 't': return read_literal(reader, "true");
+    case 'f': return read_literal(reader, "false");
+    case 'n': return read_literal(reader, "null");
+    default: return skip_number(reader);
+    }
+}
+
+// Reads a string value, or skips a value of any other type leaving *out NULL
+static int read_optional_string(json_reader_t* reader, const char** out) {
+    char* value = NULL;
+    *out = NULL;
+
+    if (peek(reader) != '"') {
+        return skip_value(reader, 1);
+    }
+    if (read_string(reader, &value) != 0) {
+        return -1;
+    }
+    *out = value;
+    return 0;
+}
+
+static int read_boolean(json_reader_t* reader, int* value, int* present) {
+    int c = peek(reader);
+    *present = 0;
+
+    if (c == 't' || c == 'f') {
+        *value = c == 't';
+        *present = 1;
+        return read_literal(reader, c == 't' ? "true" : "false");
+    }
+    return skip_value(reader, 1);
+}
+
+// Reads a JSON integer no larger in magnitude than max; fractions and
+// exponents are rejected
+static int read_integer(json_reader_t* reader, long long max, long long* out) {
+    int negative = 0;
+    long long value = 0;
+
+    skip_whitespace(reader);
+    char* p = reader->pos;
+    if (p < reader->end && *p == '-') {
+        negative = 1;
+        p++;
+    }
+    if (p >= reader->end || !is_digit(*p) || (*p == '0' && p + 1 < reader->end && is_digit(p[1]))) {
+        return -1;
+    }
+    while (p < reader->end && is_digit(*p)) {
+        int digit = *p++ - '0';
+        if (value > (max - digit) / 10) return -1;
+        value = value * 10 + digit;
+    }
+    if (p < reader->end && (*p == '.' || *p == 'e' || *p == 'E')) {
+        return -1;
+    }
+
+    reader->pos = p;
+    *out = negative ? -value : value;
+    return 0;
+}
+
+static int read_int(json_reader_t* reader, int* out) {
+    long long value;
+    if (read_integer(reader, INT_MAX, &value) != 0) {
+        return -1;
+    }
+    *out = (int)value;
+    return 0;
+}
+
+// Records the extent of an array value so it can be walked later
+static int read_array_span(json_reader_t* reader, json_reader_t* span) {
+    if (peek(reader) != '[') {
+        return -1;
+    }
+    span->pos = reader->pos;
+    if (skip_value(reader, 1) != 0) {
+        return -1;
+    }
+    span->end = reader->pos;
+    return 0;
+}
+
+int json_read_todo(json_reader_t* reader, todo_input_t* input) {
+    memset(input, 0, sizeof(*input));
+
+    if (expect(reader, '{') != 0) {
+        return -1;
+    }
+    if (peek(reader) == '}') {
+        reader->pos++;
+        return 0;
+    }
+
+    for (;;) {
+        char* key;
+        if (read_string(reader, &key) != 0 || expect(reader, ':') != 0) {
+            return -1;
+        }
+
+        int rc;
+        if (strcmp(key, "title") == 0) {
+            rc = read_optional_string(reader, &input->title);
+        } else if (strcmp(key, "description") == 0) {
+            rc = read_optional_string(reader, &input->description);
+        } else if (strcmp(key, "completed") == 0) {
+            rc = read_boolean(reader, &input->completed, &input->has_completed);
+        } else if (strcmp(key, "op") == 0) {
+            rc = read_optional_string(reader, &input->op);
+        } else if (strcmp(key, "id") == 0) {
+            rc = read_int(reader, &input->id);
+            input->has_id = rc == 0;
+        } else if (strcmp(key, "created_at") == 0) {
+            rc = read_integer(reader, LLONG_MAX, &input->created_at);
+            input->has_created_at = rc == 0;
+        } else if (strcmp(key, "updated_at") == 0) {
+            rc = read_integer(reader, LLONG_MAX, &input->updated_at);
+            input->has_updated_at = rc == 0;
+        } else if (strcmp(key, "ids") == 0) {
+            rc = read_array_span(reader, &input->ids);
+            input->has_ids = rc == 0;
+        } else {
+            rc = skip_value(reader, 1);
+        }
+        if (rc != 0) {
+            return -1;
+        }
+
+        int c = peek(reader);
+        if (c != '}' && c != ',') return -1;
+        reader->pos++;
+        if (c == '}') return 0;
+    }
+}
+
+int json_array_begin(json_reader_t* reader) {
+    return expect(reader, '[');
+}
+
+int json_array_next(json_reader_t* reader, int index) {
+    int c = peek(reader);
+    if (c == ']') {
+        reader->pos++;
+        return 0;
+    }
+    if (index > 0) {
+        if (c != ',') return -1;
+        reader->pos++;
+    }
+    return 1;
+}
+
+int json_read_ids(json_reader_t* reader, int* out, int max) {
+    int count = 0;
+
+    if (json_array_begin(reader) != 0) {
+        return -1;
+    }
+    for (;;) {
+        int rc = json_array_next(reader, count);
+        if (rc <= 0) {
+            return rc == 0 ? count : -1;
+        }
+
+        int id;
+        if (count >= max || read_int(reader, &id) != 0 || id <= 0) {
+            return -1;
+        }
+        if (out) {
+            out[count] = id;
+        }
+        count++;
+    }
+}
+
+int json_reader_finish(json_reader_t* reader) {
+    skip_whitespace(reader);
+    return reader->pos == reader->end ? 0 : -1;
+}
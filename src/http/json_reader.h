@@ -0,0 +1,51 @@
+#ifndef JSON_READER_H
+#define JSON_READER_H
+
+#include <stddef.h>
+
+// Cursor over a mutable JSON document. Parsing never allocates.
+typedef struct {
+    char* pos;
+    char* end;
+} json_reader_t;
+
+// Fields of a todo request body. Strings point into the parsed buffer, which
+// is unescaped in place and NUL-terminated; fields with another JSON type
+// are left NULL.
+typedef struct {
+    const char* title;
+    const char* description;
+    int completed;
+    int has_completed;
+    const char* op;         // Bulk requests: "create", "update", "patch" or "delete"
+    int id;
+    int has_id;
+    long long created_at;   // Imports: timestamps to keep
+    int has_created_at;
+    long long updated_at;
+    int has_updated_at;
+    json_reader_t ids;      // Bulk requests: cursor over the "ids" array
+    int has_ids;
+} todo_input_t;
+
+void json_reader_init(json_reader_t* reader, char* data, size_t len);
+
+// Reads one JSON object, extracting the known todo fields and skipping the rest
+int json_read_todo(json_reader_t* reader, todo_input_t* input);
+
+// Consumes the opening bracket of an array
+int json_array_begin(json_reader_t* reader);
+
+// Moves to element index of an array. Returns 1 if an element follows, 0
+// after consuming the closing bracket, -1 on malformed input.
+int json_array_next(json_reader_t* reader, int index);
+
+// Reads an array of positive integer ids. With out NULL the ids are only
+// counted. Returns the number of ids, or -1 if there are more than max or
+// the array is malformed.
+int json_read_ids(json_reader_t* reader, int* out, int max);
+
+// Succeeds if only whitespace is left
+int json_reader_finish(json_reader_t* reader);
+
+#endif
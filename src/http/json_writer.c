@@ -0,0 +1,337 @@
+#include "json_writer.h"
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#define JSON_BUF_MIN_CAPACITY 4096
+
+void json_buf_init(json_buf_t* buf) {
+    buf->data = NULL;
+    buf->len = 0;
+    buf->cap = 0;
+}
+
+void json_buf_reset(json_buf_t* buf) {
+    buf->len = 0;
+}
+
+void json_buf_free(json_buf_t* buf) {
+    free(buf->data);
+    json_buf_init(buf);
+}
+
+int json_buf_reserve(json_buf_t* buf, size_t extra) {
+    if (buf->len + extra <= buf->cap) {
+        return 0;
+    }
+
+    size_t cap = buf->cap ? buf->cap : JSON_BUF_MIN_CAPACITY;
+    while (cap < buf->len + extra) {
+        cap *= 2;
+    }
+
+    char* data = realloc(buf->data, cap);
+    if (!data) {
+        return -1;
+    }
+    buf->data = data;
+    buf->cap = cap;
+    return 0;
+}
+
+int json_buf_append(json_buf_t* buf, const char* data, size_t len) {
+    if (json_buf_reserve(buf, len) != 0) {
+        return -1;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return 0;
+}
+
+int json_buf_printf(json_buf_t* buf, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int needed = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    if (needed < 0 || json_buf_reserve(buf, (size_t)needed + 1) != 0) {
+        return -1;
+    }
+
+    va_start(args, format);
+    vsnprintf(buf->data + buf->len, (size_t)needed + 1, format, args);
+    va_end(args);
+    buf->len += (size_t)needed;
+    return 0;
+}
+
+json_buf_t* json_thread_buf(void) {
+    static _Thread_local json_buf_t buf;
+    json_buf_reset(&buf);
+    return &buf;
+}
+
+// Bytes that cannot be copied verbatim: control characters, quote,
+// backslash, and anything non-ASCII (which takes the UTF-8 validating path).
+static int needs_escape(unsigned char c) {
+    return c < 0x20 || c == '"' || c == '\\' || c >= 0x80;
+}
+
+// Returns the offset of the first byte in s that needs escaping, or len.
+static size_t scan_plain(const unsigned char* s, size_t len) {
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i space = _mm_set1_epi8(0x20);
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+        // Signed compare: bytes >= 0x80 are negative, so one test catches
+        // both control characters and non-ASCII
+        __m128i special = _mm_or_si128(_mm_cmplt_epi8(v, space),
+                                       _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                                                    _mm_cmpeq_epi8(v, backslash)));
+        int mask = _mm_movemask_epi8(special);
+        if (mask) {
+            return i + (size_t)__builtin_ctz((unsigned int)mask);
+        }
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    const uint8x16_t quote = vdupq_n_u8('"');
+    const uint8x16_t backslash = vdupq_n_u8('\\');
+    const uint8x16_t space = vdupq_n_u8(0x20);
+    const uint8x16_t high = vdupq_n_u8(0x80);
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t v = vld1q_u8(s + i);
+        uint8x16_t special = vorrq_u8(vorrq_u8(vcltq_u8(v, space), vcgeq_u8(v, high)),
+                                      vorrq_u8(vceqq_u8(v, quote), vceqq_u8(v, backslash)));
+        if (vmaxvq_u8(special)) {
+            break;
+        }
+    }
+#endif
+
+    for (; i < len; i++) {
+        if (needs_escape(s[i])) {
+            return i;
+        }
+    }
+    return len;
+}
+
+size_t json_utf8_sequence_length(const unsigned char* s, size_t len) {
+    unsigned char c = s[0];
+    size_t n;
+    uint32_t cp;
+
+    if (c >= 0xC2 && c <= 0xDF) {
+        n = 2;
+        cp = c & 0x1F;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+        n = 3;
+        cp = c & 0x0F;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        n = 4;
+        cp = c & 0x07;
+    } else {
+        return 0;
+    }
+
+    if (n > len) {
+        return 0;
+    }
+    for (size_t i = 1; i < n; i++) {
+        if ((s[i] & 0xC0) != 0x80) {
+            return 0;
+        }
+        cp = (cp << 6) | (s[i] & 0x3F);
+    }
+
+    // Reject overlong forms, surrogates and code points past U+10FFFF
+    if ((n == 3 && cp < 0x800) || (n == 4 && (cp < 0x10000 || cp > 0x10FFFF)) ||
+        (cp >= 0xD800 && cp <= 0xDFFF)) {
+        return 0;
+    }
+    return n;
+}
+
+int json_write_string(json_buf_t* buf, const char* str, size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char* s = (const unsigned char*)str;
+
+    // Worst case is six bytes per input byte (\u00XX)
+    if (json_buf_reserve(buf, len * 6 + 2) != 0) {
+        return -1;
+    }
+
+    char* out = buf->data + buf->len;
+    *out++ = '"';
+
+    size_t i = 0;
+    while (i < len) {
+        size_t plain = scan_plain(s + i, len - i);
+        memcpy(out, s + i, plain);
+        out += plain;
+        i += plain;
+        if (i == len) {
+            break;
+        }
+
+        unsigned char c = s[i];
+        if (c >= 0x80) {
+            size_t n = json_utf8_sequence_length(s + i, len - i);
+            if (n) {
+                memcpy(out, s + i, n);
+                out += n;
+                i += n;
+            } else {
+                memcpy(out, "\\ufffd", 6);
+                out += 6;
+                i++;
+            }
+            continue;
+        }
+
+        *out++ = '\\';
+        switch (c) {
+        case '"': *out++ = '"'; break;
+        case '\\': *out++ = '\\'; break;
+        case '\b': *out++ = 'b'; break;
+        case '\f': *out++ = 'f'; break;
+        case '\n': *out++ = 'n'; break;
+        case '\r': *out++ = 'r'; break;
+        case '\t': *out++ = 't'; break;
+        default:
+            *out++ = 'u';
+            *out++ = '0';
+            *out++ = '0';
+            *out++ = hex[c >> 4];
+            *out++ = hex[c & 0x0F];
+            break;
+        }
+        i++;
+    }
+
+    *out++ = '"';
+    buf->len = (size_t)(out - buf->data);
+    return 0;
+}
+
+static int json_write_int(json_buf_t* buf, long long value) {
+    char digits[24];
+    char* end = digits + sizeof(digits);
+    char* p = end;
+    unsigned long long magnitude = value < 0 ? 0ULL - (unsigned long long)value : (unsigned long long)value;
+
+    do {
+        *--p = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude);
+    if (value < 0) {
+        *--p = '-';
+    }
+    return json_buf_append(buf, p, (size_t)(end - p));
+}
+
+static int json_write_key(json_buf_t* buf, const char* key, int first, int pretty, int depth) {
+    if (!first && json_buf_append(buf, ",", 1) != 0) {
+        return -1;
+    }
+    if (pretty) {
+        if (json_buf_append(buf, "\n", 1) != 0) return -1;
+        for (int i = 0; i <= depth; i++) {
+            if (json_buf_append(buf, "  ", 2) != 0) return -1;
+        }
+    }
+    if (json_write_string(buf, key, strlen(key)) != 0) {
+        return -1;
+    }
+    return pretty ? json_buf_append(buf, ": ", 2) : json_buf_append(buf, ":", 1);
+}
+
+static int json_write_text_field(json_buf_t* buf, const char* key, const char* value, size_t len, int pretty,
+                                 int depth) {
+    if (json_write_key(buf, key, 0, pretty, depth) != 0) {
+        return -1;
+    }
+    return value ? json_write_string(buf, value, len) : json_buf_append(buf, "null", 4);
+}
+
+static int json_write_int_field(json_buf_t* buf, const char* key, long long value, int pretty, int depth) {
+    if (json_write_key(buf, key, 0, pretty, depth) != 0) {
+        return -1;
+    }
+    return json_write_int(buf, value);
+}
+
+// Writes the opening brace and the todo's fields, leaving the object open
+static int json_write_todo_fields(json_buf_t* buf, const todo_t* todo, int pretty, int depth) {
+    if (json_buf_append(buf, "{", 1) != 0 ||
+        json_write_key(buf, "id", 1, pretty, depth) != 0 ||
+        json_write_int(buf, todo->id) != 0 ||
+        json_write_text_field(buf, "title", todo->title, todo->title_len, pretty, depth) != 0 ||
+        json_write_text_field(buf, "description", todo->description, todo->description_len, pretty, depth) != 0 ||
+        json_write_key(buf, "completed", 0, pretty, depth) != 0 ||
+        (todo->completed ? json_buf_append(buf, "true", 4) : json_buf_append(buf, "false", 5)) != 0 ||
+        json_write_int_field(buf, "created_at", todo->created_at, pretty, depth) != 0 ||
+        json_write_int_field(buf, "updated_at", todo->updated_at, pretty, depth) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static int json_close_object(json_buf_t* buf, int pretty, int depth) {
+    if (pretty) {
+        if (json_buf_append(buf, "\n", 1) != 0) return -1;
+        for (int i = 0; i < depth; i++) {
+            if (json_buf_append(buf, "  ", 2) != 0) return -1;
+        }
+    }
+    return json_buf_append(buf, "}", 1);
+}
+
+int json_write_todo(json_buf_t* buf, const todo_t* todo, int pretty, int depth) {
+    if (json_write_todo_fields(buf, todo, pretty, depth) != 0) {
+        return -1;
+    }
+    return json_close_object(buf, pretty, depth);
+}
+
+int json_write_change(json_buf_t* buf, const todo_change_t* change, int pretty, int depth) {
+    static const char* const ops[] = {"unknown", "create", "update", "delete"};
+    const char* op = change->op >= TODO_CHANGE_CREATE && change->op <= TODO_CHANGE_DELETE ? ops[change->op] : ops[0];
+
+    if (json_buf_append(buf, "{", 1) != 0 ||
+        json_write_key(buf, "seq", 1, pretty, depth) != 0 ||
+        json_write_int(buf, change->seq) != 0 ||
+        json_write_text_field(buf, "op", op, strlen(op), pretty, depth) != 0 ||
+        json_write_int_field(buf, "id", change->id, pretty, depth) != 0 ||
+        json_write_int_field(buf, "changed_at", change->changed_at, pretty, depth) != 0 ||
+        json_write_key(buf, "todo", 0, pretty, depth) != 0) {
+        return -1;
+    }
+    int rc = change->todo ? json_write_todo(buf, change->todo, pretty, depth + 1) : json_buf_append(buf, "null", 4);
+    return rc != 0 ? -1 : json_close_object(buf, pretty, depth);
+}
+
+int json_write_search_hit(json_buf_t* buf, const todo_search_hit_t* hit, int pretty, int depth) {
+    if (json_write_todo_fields(buf, &hit->todo, pretty, depth) != 0 ||
+        json_write_key(buf, "rank", 0, pretty, depth) != 0 ||
+        json_buf_printf(buf, "%.6g", hit->rank) != 0 ||
+        json_write_text_field(buf, "title_snippet", hit->title_snippet, hit->title_snippet_len,
+                              pretty, depth) != 0 ||
+        json_write_text_field(buf, "description_snippet", hit->description_snippet,
+                              hit->description_snippet_len, pretty, depth) != 0) {
+        return -1;
+    }
+    return json_close_object(buf, pretty, depth);
+}
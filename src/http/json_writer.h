@@ -0,0 +1,42 @@
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <stddef.h>
+#include "../core/todo.h"
+
+// Growable output buffer. Reset keeps the allocation so the buffer can be
+// reused across responses without touching the allocator.
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+} json_buf_t;
+
+void json_buf_init(json_buf_t* buf);
+void json_buf_reset(json_buf_t* buf);
+void json_buf_free(json_buf_t* buf);
+int json_buf_append(json_buf_t* buf, const char* data, size_t len);
+// Makes room for extra bytes after len, for callers that write in place
+int json_buf_reserve(json_buf_t* buf, size_t extra);
+int json_buf_printf(json_buf_t* buf, const char* format, ...);
+
+// Per-thread scratch buffer, reset on every call
+json_buf_t* json_thread_buf(void);
+
+// Length of the well-formed UTF-8 sequence starting at s, or 0 if invalid
+size_t json_utf8_sequence_length(const unsigned char* s, size_t len);
+
+// Writes a quoted JSON string. Invalid UTF-8 is replaced with U+FFFD.
+int json_write_string(json_buf_t* buf, const char* str, size_t len);
+
+// Writes a todo object. Compact unless pretty is set, in which case the
+// output is indented by two spaces per level starting at depth.
+int json_write_todo(json_buf_t* buf, const todo_t* todo, int pretty, int depth);
+
+// Writes a change log entry with the todo's current state nested under "todo"
+int json_write_change(json_buf_t* buf, const todo_change_t* change, int pretty, int depth);
+
+// Writes a todo object followed by its rank and highlighted snippets
+int json_write_search_hit(json_buf_t* buf, const todo_search_hit_t* hit, int pretty, int depth);
+
+#endif
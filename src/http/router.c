@@ -0,0 +1,211 @@
+#include "router.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#define ROUTER_MAX_NODES 32
+
+static const struct {
+    http_method_t method;
+    const char* pattern;            // Segments are literals or :name for a positive integer id
+    metrics_route_t route;
+} routes[] = {
+    {HTTP_METHOD_GET, "/todos", METRICS_ROUTE_LIST_TODOS},
+    {HTTP_METHOD_POST, "/todos", METRICS_ROUTE_CREATE_TODO},
+    {HTTP_METHOD_DELETE, "/todos", METRICS_ROUTE_DELETE_TODOS},
+    {HTTP_METHOD_PATCH, "/todos", METRICS_ROUTE_PATCH_TODOS},
+    {HTTP_METHOD_GET, "/todos/search", METRICS_ROUTE_SEARCH_TODOS},
+    {HTTP_METHOD_GET, "/todos/changes", METRICS_ROUTE_CHANGES},
+    {HTTP_METHOD_POST, "/todos/batch", METRICS_ROUTE_BATCH_TODOS},
+    {HTTP_METHOD_GET, "/todos/export", METRICS_ROUTE_EXPORT_TODOS},
+    {HTTP_METHOD_POST, "/todos/import", METRICS_ROUTE_IMPORT_TODOS},
+    {HTTP_METHOD_GET, "/todos/:id", METRICS_ROUTE_GET_TODO},
+    {HTTP_METHOD_PUT, "/todos/:id", METRICS_ROUTE_UPDATE_TODO},
+    {HTTP_METHOD_DELETE, "/todos/:id", METRICS_ROUTE_DELETE_TODO},
+    {HTTP_METHOD_GET, "/stats", METRICS_ROUTE_STATS},
+    {HTTP_METHOD_GET, "/metrics", METRICS_ROUTE_METRICS},
+};
+
+static const char* const method_names[HTTP_METHOD_COUNT] = {"GET", "POST", "PUT", "DELETE", "PATCH"};
+
+// One node per path segment. Literal children are tried before the
+// parameter child, so /todos/search never reaches /todos/:id.
+struct RouteNode {
+    const char* segment;            // Points into the pattern; NULL for the root and parameters
+    size_t segment_len;
+    int first_child;                // Literal children, -1 for none
+    int next_sibling;
+    int param_child;
+    metrics_route_t routes[HTTP_METHOD_COUNT];  // METRICS_ROUTE_OTHER where the method has no route
+};
+
+static struct RouteNode nodes[ROUTER_MAX_NODES];
+static int node_count = 0;
+static pthread_once_t trie_once = PTHREAD_ONCE_INIT;
+
+static int add_node(const char* segment, size_t segment_len) {
+    if (node_count == ROUTER_MAX_NODES) {
+        return -1;
+    }
+    struct RouteNode* node = &nodes[node_count];
+    node->segment = segment;
+    node->segment_len = segment_len;
+    node->first_child = -1;
+    node->next_sibling = -1;
+    node->param_child = -1;
+    for (int i = 0; i < HTTP_METHOD_COUNT; i++) {
+        node->routes[i] = METRICS_ROUTE_OTHER;
+    }
+    return node_count++;
+}
+
+static int find_literal(int parent, const char* segment, size_t len) {
+    for (int child = nodes[parent].first_child; child >= 0; child = nodes[child].next_sibling) {
+        if (nodes[child].segment_len == len && memcmp(nodes[child].segment, segment, len) == 0) {
+            return child;
+        }
+    }
+    return -1;
+}
+
+static void build_trie(void) {
+    int root = add_node(NULL, 0);
+
+    for (size_t i = 0; i < sizeof(routes) / sizeof(routes[0]); i++) {
+        int node = root;
+        const char* p = routes[i].pattern + 1;
+        for (;;) {
+            const char* end = strchr(p, '/');
+            size_t len = end ? (size_t)(end - p) : strlen(p);
+            int child;
+            if (*p == ':') {
+                child = nodes[node].param_child;
+                if (child < 0) {
+                    child = nodes[node].param_child = add_node(NULL, 0);
+                }
+            } else {
+                child = find_literal(node, p, len);
+                if (child < 0 && (child = add_node(p, len)) >= 0) {
+                    nodes[child].next_sibling = nodes[node].first_child;
+                    nodes[node].first_child = child;
+                }
+            }
+            if (child < 0) {
+                // The table outgrew ROUTER_MAX_NODES; the route stays unreachable
+                break;
+            }
+            node = child;
+            if (!end) {
+                nodes[node].routes[routes[i].method] = routes[i].route;
+                break;
+            }
+            p = end + 1;
+        }
+    }
+}
+
+// Ids are positive decimal integers that fit an int, nothing else
+static int parse_id(const char* s, size_t len, int* out) {
+    long long value = 0;
+    if (len == 0 || len > 10) {
+        return -1;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] < '0' || s[i] > '9') {
+            return -1;
+        }
+        value = value * 10 + (s[i] - '0');
+    }
+    if (value < 1 || value > INT_MAX) {
+        return -1;
+    }
+    *out = (int)value;
+    return 0;
+}
+
+http_method_t http_method_parse(const char* method) {
+    for (int i = 0; i < HTTP_METHOD_COUNT; i++) {
+        if (strcmp(method, method_names[i]) == 0) {
+            return (http_method_t)i;
+        }
+    }
+    return HTTP_METHOD_UNKNOWN;
+}
+
+const char* http_method_name(http_method_t method) {
+    return method >= 0 && method < HTTP_METHOD_COUNT ? method_names[method] : "UNKNOWN";
+}
+
+int router_match(http_method_t method, const char* path, route_match_t* match) {
+    pthread_once(&trie_once, build_trie);
+
+    memset(match, 0, sizeof(*match));
+    match->route = METRICS_ROUTE_OTHER;
+    match->status = 404;
+    if (path[0] != '/') {
+        return -1;
+    }
+
+    int node = 0;
+    int bad_param = 0;
+    const char* p = path + 1;
+    for (;;) {
+        const char* end = strchr(p, '/');
+        size_t len = end ? (size_t)(end - p) : strlen(p);
+        int child = find_literal(node, p, len);
+        if (child < 0 && len > 0 && nodes[node].param_child >= 0) {
+            child = nodes[node].param_child;
+            int value;
+            if (parse_id(p, len, &value) != 0) {
+                bad_param = 1;
+            } else if (match->param_count < ROUTER_MAX_PARAMS) {
+                match->params[match->param_count++] = value;
+            }
+        }
+        if (child < 0) {
+            return -1;
+        }
+        node = child;
+        if (!end) {
+            break;
+        }
+        p = end + 1;
+    }
+
+    for (int i = 0; i < HTTP_METHOD_COUNT; i++) {
+        if (nodes[node].routes[i] != METRICS_ROUTE_OTHER) {
+            match->allowed |= 1u << i;
+        }
+    }
+    if (match->allowed == 0) {
+        return -1;
+    }
+    if (method == HTTP_METHOD_UNKNOWN || nodes[node].routes[method] == METRICS_ROUTE_OTHER) {
+        match->status = 405;
+        return -1;
+    }
+    if (bad_param) {
+        match->status = 400;
+        return -1;
+    }
+
+    match->route = nodes[node].routes[method];
+    match->status = 0;
+    match->allowed = 0;
+    return 0;
+}
+
+void router_format_allow(unsigned int allowed, char* out, size_t size) {
+    size_t len = 0;
+    out[0] = '\0';
+    for (int i = 0; i < HTTP_METHOD_COUNT && len < size; i++) {
+        if (allowed & (1u << i)) {
+            int written = snprintf(out + len, size - len, "%s%s", len ? ", " : "", method_names[i]);
+            if (written < 0) {
+                break;
+            }
+            len += (size_t)written;
+        }
+    }
+}
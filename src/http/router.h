@@ -0,0 +1,46 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <stddef.h>
+#include "../core/metrics.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ROUTER_MAX_PARAMS 2
+
+typedef enum {
+    HTTP_METHOD_GET,
+    HTTP_METHOD_POST,
+    HTTP_METHOD_PUT,
+    HTTP_METHOD_DELETE,
+    HTTP_METHOD_PATCH,
+    HTTP_METHOD_COUNT,
+    HTTP_METHOD_UNKNOWN = HTTP_METHOD_COUNT
+} http_method_t;
+
+http_method_t http_method_parse(const char* method);
+const char* http_method_name(http_method_t method);
+
+typedef struct {
+    metrics_route_t route;          // METRICS_ROUTE_OTHER unless status is 0
+    int status;                     // 0 on a match, else 400, 404 or 405
+    int params[ROUTER_MAX_PARAMS];  // :id parameters in path order
+    int param_count;
+    unsigned int allowed;           // On 405, a bit per http_method_t the path accepts
+} route_match_t;
+
+// Matches a request path against the route table. A path that exists with
+// a parameter that does not parse is 400, a path that exists only for other
+// methods is 405, and anything else unknown is 404. Returns 0 on a match.
+int router_match(http_method_t method, const char* path, route_match_t* match);
+
+// Writes the Allow header value for a 405, e.g. "GET, DELETE"
+void router_format_allow(unsigned int allowed, char* out, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
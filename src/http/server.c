@@ -1,181 +1,1194 @@
 #include "server.h"
 #include "handlers.h"
+#include "change_feed.h"
+#include "compress.h"
+#include "router.h"
+#include "admission.h"
+#include "../core/executor.h"
+#include "../core/arena.h"
+#include "../core/log.h"
+#include "../core/metrics.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <curl/curl.h>
+#include <strings.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <microhttpd.h>
 
 static struct MHD_Daemon* http_daemon = NULL;
 
-#define MAX_POST_DATA_SIZE 16384  // 16KB max
+#define MAX_LIST_LIMIT 1000
+#define MAX_SEARCH_LIMIT 100
+#define DEFAULT_SEARCH_LIMIT 20
+#define MAX_SEARCH_OFFSET 10000
+#define DEFAULT_CHANGES_LIMIT 100
+#define MAX_CHANGES_WAIT 60
+#define STREAM_BLOCK_SIZE (32 * 1024)
+#define CONNECTION_INFO_CACHE_SIZE 64
+#define DRAIN_POLL_US 10000
 
+// Older libmicrohttpd releases only know the RFC 7231 name
+#ifndef MHD_HTTP_CONTENT_TOO_LARGE
+#define MHD_HTTP_CONTENT_TOO_LARGE MHD_HTTP_PAYLOAD_TOO_LARGE
+#endif
+
+static size_t max_body_size = 0;
+static size_t max_import_size = 0;
+static size_t compress_min_size = 0;
+static int suspend_allowed = 0;    // Streams may park connections instead of blocking a thread
+static int quiesced = 0;           // The listening socket has been released
+static int executor_enabled = 0;   // Slow routes run on the executor while their connection is suspended
+
+// Per-request state. Instances are recycled through a per-thread free list
+// together with their arena, and the body buffer is only allocated once a
+// request actually uploads data.
 struct ConnectionInfo {
-    char* post_data;
-    size_t post_data_size;
-    int post_data_processed;
+    arena_t arena;
+    char* body;
+    size_t body_size;
+    size_t body_capacity;
+    int body_too_large;
+    struct ImportUpload* import;        // POST /todos/import bodies are parsed as they arrive
+    route_match_t match;
+    int status;                         // Set once a response is queued
+    struct MHD_Connection* connection;  // For handlers running on the executor
+    const char* method;
+    const char* url;
+    struct MHD_Response* response;      // Built by build_response, queued by the connection's thread
+    unsigned int response_status;
+    int response_built;
+    int admitted;                       // Holds an in-flight slot of admission_class
+    admission_class_t admission_class;
+    uint64_t started;
+    uint64_t parsed;
+    uint64_t queued;
+    uint64_t phases[METRICS_PHASE_COUNT];
+    struct ConnectionInfo* next_free;
 };
 
-static void free_connection_info(struct ConnectionInfo* con_info) {
+struct ConnectionInfoCache {
+    struct ConnectionInfo* head;
+    int count;
+};
+
+static pthread_key_t connection_info_key;
+static pthread_once_t connection_info_once = PTHREAD_ONCE_INIT;
+
+static void destroy_connection_info_cache(void* ptr) {
+    struct ConnectionInfoCache* cache = ptr;
+    while (cache->head) {
+        struct ConnectionInfo* con_info = cache->head;
+        cache->head = con_info->next_free;
+        arena_destroy(&con_info->arena);
+        free(con_info);
+    }
+    free(cache);
+}
+
+static void create_connection_info_key(void) {
+    pthread_key_create(&connection_info_key, destroy_connection_info_cache);
+}
+
+static struct ConnectionInfoCache* connection_info_cache(void) {
+    pthread_once(&connection_info_once, create_connection_info_key);
+    struct ConnectionInfoCache* cache = pthread_getspecific(connection_info_key);
+    if (!cache) {
+        cache = calloc(1, sizeof(struct ConnectionInfoCache));
+        if (cache) {
+            pthread_setspecific(connection_info_key, cache);
+        }
+    }
+    return cache;
+}
+
+static struct ConnectionInfo* acquire_connection_info(void) {
+    struct ConnectionInfoCache* cache = connection_info_cache();
+    if (cache && cache->head) {
+        struct ConnectionInfo* con_info = cache->head;
+        cache->head = con_info->next_free;
+        cache->count--;
+        return con_info;
+    }
+
+    struct ConnectionInfo* con_info = calloc(1, sizeof(struct ConnectionInfo));
     if (con_info) {
-        if (con_info->post_data) {
-            free(con_info->post_data);
+        arena_init(&con_info->arena);
+    }
+    return con_info;
+}
+
+static void release_connection_info(struct ConnectionInfo* con_info) {
+    struct ConnectionInfoCache* cache = connection_info_cache();
+
+    arena_reset(&con_info->arena);
+    con_info->body = NULL;
+    con_info->body_size = 0;
+    con_info->body_capacity = 0;
+    con_info->body_too_large = 0;
+    import_upload_free(con_info->import);
+    con_info->import = NULL;
+    con_info->status = 0;
+    con_info->response_built = 0;
+    con_info->admitted = 0;
+
+    if (cache && cache->count < CONNECTION_INFO_CACHE_SIZE) {
+        con_info->next_free = cache->head;
+        cache->head = con_info;
+        cache->count++;
+        return;
+    }
+
+    arena_destroy(&con_info->arena);
+    free(con_info);
+}
+
+static int method_has_body(const char* method) {
+    return strcmp(method, "POST") == 0 || strcmp(method, "PUT") == 0 ||
+           strcmp(method, "PATCH") == 0 || strcmp(method, "DELETE") == 0;
+}
+
+// Appends upload data to the body, keeping it NUL-terminated
+static int append_body(struct ConnectionInfo* con_info, const char* data, size_t size) {
+    if (size > max_body_size - con_info->body_size) {
+        return -1;
+    }
+
+    size_t needed = con_info->body_size + size + 1;
+    if (needed > con_info->body_capacity) {
+        size_t capacity = con_info->body_capacity ? con_info->body_capacity * 2 : 1024;
+        while (capacity < needed) {
+            capacity *= 2;
         }
-        free(con_info);
+        if (capacity > max_body_size + 1) {
+            capacity = max_body_size + 1;
+        }
+
+        char* body = arena_alloc(&con_info->arena, capacity);
+        if (!body) {
+            return -1;
+        }
+        if (con_info->body_size) {
+            memcpy(body, con_info->body, con_info->body_size);
+        }
+        con_info->body = body;
+        con_info->body_capacity = capacity;
     }
+
+    memcpy(con_info->body + con_info->body_size, data, size);
+    con_info->body_size += size;
+    con_info->body[con_info->body_size] = '\0';
+    return 0;
 }
 
-static enum MHD_Result handle_request(void* cls,
-                        struct MHD_Connection* connection,
-                        const char* url,
-                        const char* method,
-                        const char* version,
-                        const char* upload_data,
-                        size_t* upload_data_size,
-                        void** con_cls) {
-    (void)cls;
-    (void)version;
+// Import bodies are counted but not kept: whatever they hold, other than an
+// unfinished line or record, is already staged
+static int append_import(struct ConnectionInfo* con_info, const char* data, size_t size) {
+    if (size > max_import_size - con_info->body_size) {
+        return -1;
+    }
+    con_info->body_size += size;
+    import_upload_write(con_info->import, data, size);
+    return 0;
+}
+
+// Queues a constant JSON body, with one extra header when header is set
+static enum MHD_Result queue_static_json(struct MHD_Connection* connection, unsigned int status, const char* json,
+                                         const char* header, const char* value) {
+    struct MHD_Response* response = MHD_create_response_from_buffer(strlen(json), (void*)json,
+                                                                    MHD_RESPMEM_PERSISTENT);
+    if (!response) {
+        return MHD_NO;
+    }
+    MHD_add_response_header(response, "Content-Type", "application/json");
+    if (header) {
+        MHD_add_response_header(response, header, value);
+    }
+    enum MHD_Result ret = MHD_queue_response(connection, status, response);
+    MHD_destroy_response(response);
+    return ret;
+}
+
+static const char* const body_too_large_json = "{\"error\": \"Request body too large\"}";
+static const char* const executor_full_json = "{\"error\": \"Server busy\"}";
+static const char* const rate_limited_json = "{\"error\": \"Too many requests\"}";
 
-    printf("DEBUG: Request [%s] %s\n", method, url);
-    printf("DEBUG: upload_data_size = %zu\n", upload_data_size ? *upload_data_size : 0);
+static void record_rejection(struct ConnectionInfo* con_info, unsigned int status) {
+    con_info->status = (int)status;
+    con_info->queued = metrics_now();
+    con_info->phases[METRICS_PHASE_PARSE] = con_info->queued - con_info->started;
+}
+
+static enum MHD_Result queue_rejection(struct ConnectionInfo* con_info, struct MHD_Connection* connection) {
+    enum MHD_Result ret = queue_static_json(connection, MHD_HTTP_CONTENT_TOO_LARGE, body_too_large_json, NULL, NULL);
+    if (ret == MHD_YES) {
+        record_rejection(con_info, MHD_HTTP_CONTENT_TOO_LARGE);
+    }
+    return ret;
+}
+
+// Answers a request admission control turned away: 429 for a client over
+// its rate, 503 when the server is, both with the seconds to wait
+static enum MHD_Result queue_overload(struct ConnectionInfo* con_info, struct MHD_Connection* connection,
+                                      int status, unsigned int retry_after) {
+    char seconds[16];
+    snprintf(seconds, sizeof(seconds), "%u", retry_after > 0 ? retry_after : 1);
+    const char* json = status == MHD_HTTP_TOO_MANY_REQUESTS ? rate_limited_json : executor_full_json;
+    enum MHD_Result ret = queue_static_json(connection, (unsigned int)status, json,
+                                            MHD_HTTP_HEADER_RETRY_AFTER, seconds);
+    if (ret == MHD_YES) {
+        record_rejection(con_info, (unsigned int)status);
+    }
+    return ret;
+}
+
+// Answers a request the router could not match: 400, 404, or 405 with the
+// methods the path does accept
+static enum MHD_Result queue_route_error(struct ConnectionInfo* con_info, struct MHD_Connection* connection) {
+    const char* json;
+    switch (con_info->match.status) {
+    case MHD_HTTP_BAD_REQUEST:
+        json = "{\"error\": \"Invalid id\"}";
+        break;
+    case MHD_HTTP_METHOD_NOT_ALLOWED:
+        json = "{\"error\": \"Method not allowed\"}";
+        break;
+    default:
+        json = "{\"error\": \"Not found\"}";
+        break;
+    }
+
+    char allow[64];
+    router_format_allow(con_info->match.allowed, allow, sizeof(allow));
+    unsigned int status = (unsigned int)con_info->match.status;
+    int with_allow = status == MHD_HTTP_METHOD_NOT_ALLOWED;
+    enum MHD_Result ret = queue_static_json(connection, status, json,
+                                            with_allow ? MHD_HTTP_HEADER_ALLOW : NULL, allow);
+    if (ret == MHD_YES) {
+        record_rejection(con_info, status);
+    }
+    return ret;
+}
+
+static void request_completed(void* cls,
+                              struct MHD_Connection* connection,
+                              void** con_cls,
+                              enum MHD_RequestTerminationCode toe) {
+    (void)cls;
+    (void)connection;
+    (void)toe;
 
     struct ConnectionInfo* con_info = *con_cls;
+    if (con_info) {
+        // Streamed bodies read the database while sending, so for them the
+        // send phase includes database time
+        if (con_info->status) {
+            con_info->phases[METRICS_PHASE_SEND] = metrics_now() - con_info->queued;
+            metrics_record_request(con_info->match.route, con_info->status, con_info->phases);
+        }
+        if (con_info->admitted) {
+            admission_release(con_info->admission_class);
+        }
+        metrics_request_finished();
+        release_connection_info(con_info);
+        *con_cls = NULL;
+    }
+}
 
-    if (con_info == NULL) {
-        printf("DEBUG: First call - initializing connection info\n");
-        con_info = calloc(1, sizeof(struct ConnectionInfo));
-        if (!con_info) return MHD_NO;
-        
-        con_info->post_data = malloc(MAX_POST_DATA_SIZE);
-        if (!con_info->post_data) {
-            free(con_info);
-            return MHD_NO;
-        }
-        con_info->post_data[0] = '\0';
-        con_info->post_data_size = 0;
-        con_info->post_data_processed = 0;
-        
-        *con_cls = con_info;
-        return MHD_YES;
+// Change feed subscriptions are long-lived and mostly parked, so they are
+// rate limited but never count against a class's in-flight slots
+static admission_class_t admission_class_of(metrics_route_t route) {
+    switch (route) {
+    case METRICS_ROUTE_LIST_TODOS:
+    case METRICS_ROUTE_SEARCH_TODOS:
+    case METRICS_ROUTE_EXPORT_TODOS:
+        return ADMISSION_LIST;
+    case METRICS_ROUTE_CREATE_TODO:
+    case METRICS_ROUTE_BATCH_TODOS:
+    case METRICS_ROUTE_IMPORT_TODOS:
+    case METRICS_ROUTE_UPDATE_TODO:
+    case METRICS_ROUTE_DELETE_TODO:
+    case METRICS_ROUTE_DELETE_TODOS:
+    case METRICS_ROUTE_PATCH_TODOS:
+        return ADMISSION_WRITE;
+    case METRICS_ROUTE_CHANGES:
+        return ADMISSION_UNLIMITED;
+    default:
+        return ADMISSION_READ;
+    }
+}
+
+static uint64_t client_key(struct MHD_Connection* connection) {
+    const union MHD_ConnectionInfo* info = MHD_get_connection_info(connection, MHD_CONNECTION_INFO_CLIENT_ADDRESS);
+    return admission_client_key(info ? info->client_addr : NULL);
+}
+
+static void connection_notify(void* cls,
+                              struct MHD_Connection* connection,
+                              void** socket_context,
+                              enum MHD_ConnectionNotificationCode toe) {
+    (void)cls;
+    (void)connection;
+    (void)socket_context;
+
+    if (toe == MHD_CONNECTION_NOTIFY_STARTED) {
+        metrics_connection_opened();
+    } else if (toe == MHD_CONNECTION_NOTIFY_CLOSED) {
+        metrics_connection_closed();
+    }
+}
+
+// Reads an optional integer query argument. Returns -1 if it is present but
+// malformed or out of range, leaving *out untouched when it is absent.
+static int query_int_arg(struct MHD_Connection* connection, const char* name, int min, int max, int* out) {
+    const char* value = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, name);
+    if (!value) {
+        return 0;
+    }
+
+    char* end;
+    errno = 0;
+    long parsed = strtol(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || errno != 0 || parsed < min || parsed > max) {
+        return -1;
+    }
+    *out = (int)parsed;
+    return 0;
+}
+
+static int query_time_arg(struct MHD_Connection* connection, const char* name, long long min, time_t* out) {
+    const char* value = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, name);
+    if (!value) {
+        return 0;
+    }
+
+    char* end;
+    errno = 0;
+    long long parsed = strtoll(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || errno != 0 || parsed < min) {
+        return -1;
+    }
+    *out = (time_t)parsed;
+    return 0;
+}
+
+// Matches an optional query argument against names; *out is the index of
+// the match. Returns -1 if the argument is present but not in the list.
+static int query_enum_arg(struct MHD_Connection* connection, const char* name, const char* const* names,
+                          int count, int* out) {
+    const char* value = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, name);
+    if (!value) {
+        return 0;
+    }
+    for (int i = 0; i < count; i++) {
+        if (strcmp(value, names[i]) == 0) {
+            *out = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Reads the GET /todos paging, filter and sort arguments
+static int parse_list_query(struct MHD_Connection* connection, todo_query_t* query) {
+    static const char* const sorts[] = {"id", "created_at", "updated_at"};
+    static const char* const orders[] = {"asc", "desc"};
+    static const char* const completed[] = {"false", "true", "0", "1"};
+    int sort = TODO_SORT_ID;
+    int filter = -1;
+
+    memset(query, 0, sizeof(*query));
+    if (query_int_arg(connection, "limit", 1, MAX_LIST_LIMIT, &query->limit) != 0 ||
+        query_int_arg(connection, "after_id", 0, INT_MAX, &query->after_id) != 0 ||
+        query_time_arg(connection, "after_value", LLONG_MIN, &query->after_value) != 0 ||
+        query_time_arg(connection, "updated_since", 0, &query->updated_since) != 0 ||
+        query_time_arg(connection, "created_before", 1, &query->created_before) != 0 ||
+        query_enum_arg(connection, "sort", sorts, 3, &sort) != 0 ||
+        query_enum_arg(connection, "order", orders, 2, &query->descending) != 0 ||
+        query_enum_arg(connection, "completed", completed, 4, &filter) != 0) {
+        return -1;
+    }
+
+    query->sort = (todo_sort_t)sort;
+    if (filter >= 0) {
+        query->completed = filter % 2 ? TODO_COMPLETED_TRUE : TODO_COMPLETED_FALSE;
+    }
+
+    // Paging through a timestamp order needs the cursor's value as well as its id
+    if (query->sort != TODO_SORT_ID && query->after_id > 0 &&
+        !MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "after_value")) {
+        return -1;
+    }
+    return 0;
+}
+
+// Reads the GET /todos/search arguments; q is required
+static int parse_search(struct MHD_Connection* connection, todo_search_t* search) {
+    search->text = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "q");
+    search->limit = DEFAULT_SEARCH_LIMIT;
+    search->offset = 0;
+
+    if (!search->text || search->text[0] == '\0' || strlen(search->text) > TODO_SEARCH_MAX_TEXT) {
+        return -1;
+    }
+    return query_int_arg(connection, "limit", 1, MAX_SEARCH_LIMIT, &search->limit) == 0 &&
+           query_int_arg(connection, "offset", 0, MAX_SEARCH_OFFSET, &search->offset) == 0 ? 0 : -1;
+}
+
+// Reads the GET /todos/changes arguments. An EventSource reconnecting sends
+// the last id it saw as Last-Event-ID, which takes the place of since.
+static int parse_changes(struct MHD_Connection* connection, long long* since, int* limit, int* wait) {
+    const char* value = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "Last-Event-ID");
+    if (!value) {
+        value = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "since");
     }
 
-    if ((strcmp(method, "POST") == 0 || strcmp(method, "PUT") == 0) && *upload_data_size != 0) {
-        printf("DEBUG: Received %zu bytes of POST/PUT data\n", *upload_data_size);
-        if (upload_data) {
-            printf("DEBUG: Data: '%.*s'\n", (int)*upload_data_size, upload_data);
+    *since = -1;
+    *limit = DEFAULT_CHANGES_LIMIT;
+    *wait = 0;
+    if (value) {
+        char* end;
+        errno = 0;
+        *since = strtoll(value, &end, 10);
+        if (*value == '\0' || *end != '\0' || errno != 0 || *since < 0) {
+            return -1;
         }
-        
-        if (con_info->post_data_size + *upload_data_size <= MAX_POST_DATA_SIZE) {
-            memcpy(con_info->post_data + con_info->post_data_size, upload_data, *upload_data_size);
-            con_info->post_data_size += *upload_data_size;
-            con_info->post_data[con_info->post_data_size] = '\0';  // Null-terminate
-            
-            printf("DEBUG: Total accumulated data: %zu bytes\n", con_info->post_data_size);
-            *upload_data_size = 0;
-            return MHD_YES;
+    }
+    return query_int_arg(connection, "limit", 1, MAX_LIST_LIMIT, limit) == 0 &&
+           query_int_arg(connection, "wait", 0, MAX_CHANGES_WAIT, wait) == 0 ? 0 : -1;
+}
+
+static int accepts_event_stream(struct MHD_Connection* connection) {
+    const char* accept = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_ACCEPT);
+    return accept && strstr(accept, "text/event-stream") != NULL;
+}
+
+static void suspend_connection(void* ctx) {
+    MHD_suspend_connection(ctx);
+}
+
+static void resume_connection(void* ctx) {
+    MHD_resume_connection(ctx);
+}
+
+static int query_flag_arg(struct MHD_Connection* connection, const char* name) {
+    const char* value = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, name);
+    return value && (strcmp(value, "1") == 0 || strcmp(value, "true") == 0);
+}
+
+// Batch bodies may be sent as newline-delimited JSON instead of an array
+static int is_ndjson(struct MHD_Connection* connection) {
+    const char* type = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_CONTENT_TYPE);
+    return type && (strncmp(type, "application/x-ndjson", 20) == 0 ||
+                    strncmp(type, "application/ndjson", 18) == 0);
+}
+
+// Exports are NDJSON unless ?format=binary or an Accept of
+// application/octet-stream asks for records; imports follow Content-Type
+static int wants_binary_export(struct MHD_Connection* connection) {
+    const char* format = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "format");
+    const char* accept = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_ACCEPT);
+    if (format) {
+        return strcmp(format, "binary") == 0;
+    }
+    return accept && strstr(accept, "application/octet-stream") != NULL;
+}
+
+static int is_octet_stream(struct MHD_Connection* connection) {
+    const char* type = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_CONTENT_TYPE);
+    return type && strncmp(type, "application/octet-stream", 24) == 0;
+}
+
+static struct ResponseHeader* find_response_header(struct ResponseData* response, const char* name) {
+    for (int i = 0; i < response->header_count; i++) {
+        if (strcasecmp(response->headers[i].name, name) == 0) {
+            return &response->headers[i];
         }
+    }
+    return NULL;
+}
+
+struct CacheKey {
+    char* data;
+    size_t size;
+    size_t len;
+    int args;
+};
+
+static enum MHD_Result append_cache_key_arg(void* cls, enum MHD_ValueKind kind, const char* key, const char* value) {
+    struct CacheKey* cache_key = cls;
+    (void)kind;
+
+    int written = snprintf(cache_key->data + cache_key->len, cache_key->size - cache_key->len, "%c%s=%s",
+                           cache_key->args++ ? '&' : '?', key, value ? value : "");
+    if (written < 0 || (size_t)written >= cache_key->size - cache_key->len) {
+        cache_key->len = cache_key->size;
         return MHD_NO;
     }
+    cache_key->len += (size_t)written;
+    return MHD_YES;
+}
 
-    if ((strcmp(method, "POST") == 0 || strcmp(method, "PUT") == 0) && !con_info->post_data_processed) {
-        printf("DEBUG: Finished receiving data - setting processed flag\n");
-        con_info->post_data_processed = 1;
-        return MHD_YES;
+// A representation is identified by its ETag together with the URL and
+// query, since some tags (list versions) are shared between queries
+static int format_cache_key(struct MHD_Connection* connection, const char* url, const char* etag,
+                            char* buf, size_t size) {
+    int written = snprintf(buf, size, "%s %s", etag, url);
+    if (written < 0 || (size_t)written >= size) {
+        return -1;
+    }
+    struct CacheKey cache_key = {buf, size, (size_t)written, 0};
+    MHD_get_connection_values(connection, MHD_GET_ARGUMENT_KIND, append_cache_key_arg, &cache_key);
+    return cache_key.len < size ? 0 : -1;
+}
+
+// Compresses the body when the client accepts a coding we support. Streams
+// that wait for data are left alone: a compressor would hold back their
+// events until it had a block's worth.
+static void compress_response(struct MHD_Connection* connection, const char* method, const char* url,
+                              struct ResponseData* response_data) {
+    if (compress_min_size == 0 || response_data->status == MHD_HTTP_NOT_MODIFIED ||
+        response_data->stream_set_waker || response_data->header_count + 2 > RESPONSE_MAX_HEADERS ||
+        (!response_data->stream && response_data->size < compress_min_size)) {
+        return;
+    }
+
+    response_add_header(response_data, "Vary", "Accept-Encoding");
+    content_encoding_t encoding = compress_negotiate(
+        MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_ACCEPT_ENCODING));
+    if (encoding == CONTENT_ENCODING_IDENTITY) {
+        return;
+    }
+
+    struct ResponseHeader* etag = find_response_header(response_data, "ETag");
+    char key[2048];
+    int cacheable = etag && strcmp(method, "GET") == 0 &&
+                    format_cache_key(connection, url, etag->value, key, sizeof(key)) == 0;
+
+    char* data;
+    size_t size;
+    if (cacheable && compress_cache_get(key, encoding, &data, &size) == 0) {
+        if (response_data->stream) {
+            if (response_data->stream_free) {
+                response_data->stream_free(response_data->stream_state);
+            }
+            response_data->stream = NULL;
+            response_data->stream_free = NULL;
+            response_data->stream_state = NULL;
+        } else if (!response_data->borrowed) {
+            free(response_data->data);
+        }
+        response_data->data = data;
+        response_data->size = size;
+        response_data->borrowed = 0;
+    } else if (response_data->stream) {
+        if (compress_wrap_stream(response_data, encoding, cacheable ? key : NULL) != 0) {
+            return;
+        }
+    } else {
+        if (compress_buffer(encoding, response_data->data, response_data->size, &data, &size) != 0) {
+            return;
+        }
+        if (cacheable) {
+            compress_cache_put(key, encoding, data, size);
+        }
+        if (!response_data->borrowed) {
+            free(response_data->data);
+        }
+        response_data->data = data;
+        response_data->size = size;
+        response_data->borrowed = 0;
+    }
+
+    response_add_header(response_data, "Content-Encoding", "%s", compress_encoding_name(encoding));
+    // The bytes differ from the identity body, so the tag can only be weak
+    if (etag && strncmp(etag->value, "W/", 2) != 0 && strlen(etag->value) + 3 <= sizeof(etag->value)) {
+        memmove(etag->value + 2, etag->value, strlen(etag->value) + 1);
+        memcpy(etag->value, "W/", 2);
+    }
+}
+
+// With an executor, stream reads run on the network thread in nowait mode.
+// A read refused a database connection is repeated on the executor while
+// the connection is suspended, and its bytes are sent once it resumes.
+struct DeferredStream {
+    response_stream_fn inner;
+    void* inner_state;
+    void (*inner_free)(void* state);
+    struct MHD_Connection* connection;
+    uint64_t pos;                       // Arguments of the read being repeated
+    size_t max;
+    char* pending;                      // What the repeated read returned
+    size_t pending_capacity;
+    ssize_t pending_len;
+    size_t pending_sent;
+    int has_pending;
+};
+
+static void suspend_deferred_read(void* arg) {
+    struct DeferredStream* stream = arg;
+    MHD_suspend_connection(stream->connection);
+}
+
+static void run_deferred_read(void* arg) {
+    struct DeferredStream* stream = arg;
+    stream->pending_len = stream->inner(stream->inner_state, stream->pos, stream->pending, stream->max);
+    stream->pending_sent = 0;
+    stream->has_pending = 1;
+    MHD_resume_connection(stream->connection);
+}
+
+static ssize_t read_deferred(void* state, uint64_t pos, char* buf, size_t max) {
+    struct DeferredStream* stream = state;
+
+    if (stream->has_pending) {
+        if (stream->pending_len < 0) {
+            return stream->pending_len;
+        }
+        size_t len = (size_t)stream->pending_len - stream->pending_sent;
+        if (len > max) len = max;
+        memcpy(buf, stream->pending + stream->pending_sent, len);
+        stream->pending_sent += len;
+        stream->has_pending = stream->pending_sent < (size_t)stream->pending_len;
+        return (ssize_t)len;
+    }
+
+    todo_set_reads_nowait(1);
+    ssize_t n = stream->inner(stream->inner_state, pos, buf, max);
+    todo_set_reads_nowait(0);
+    if (!todo_take_refused_read() || n != RESPONSE_STREAM_ERROR) {
+        return n;
+    }
+
+    if (stream->pending_capacity < max) {
+        char* grown = realloc(stream->pending, max);
+        if (!grown) {
+            return RESPONSE_STREAM_ERROR;
+        }
+        stream->pending = grown;
+        stream->pending_capacity = max;
+    }
+    stream->pos = pos;
+    stream->max = max;
+    if (executor_submit_claimed(run_deferred_read, stream, suspend_deferred_read) != 0) {
+        return RESPONSE_STREAM_ERROR;
     }
+    return 0;
+}
 
-    printf("DEBUG: Processing request with %zu bytes of data\n", con_info->post_data_size);
-    if (con_info->post_data_size > 0) {
-        printf("DEBUG: Data: '%.*s'\n", (int)con_info->post_data_size, con_info->post_data);
+static void free_deferred(void* state) {
+    struct DeferredStream* stream = state;
+    if (stream->inner_free) {
+        stream->inner_free(stream->inner_state);
     }
+    free(stream->pending);
+    free(stream);
+}
 
-    struct ResponseData response_data = {NULL, 0};
-    CURL* curl = curl_easy_init();
+static int defer_stream(struct MHD_Connection* connection, struct ResponseData* response_data) {
+    struct DeferredStream* stream = calloc(1, sizeof(struct DeferredStream));
+    if (!stream) {
+        return -1;
+    }
+    stream->inner = response_data->stream;
+    stream->inner_state = response_data->stream_state;
+    stream->inner_free = response_data->stream_free;
+    stream->connection = connection;
+    response_data->stream = read_deferred;
+    response_data->stream_state = stream;
+    response_data->stream_free = free_deferred;
+    return 0;
+}
+
+static struct MHD_Response* create_response(struct MHD_Connection* connection,
+                                            struct ResponseData* response_data) {
     struct MHD_Response* response;
-    enum MHD_Result ret;
-    int http_status = MHD_HTTP_OK;
 
-    if (strcmp(method, "GET") == 0) {
-        if (strcmp(url, "/todos") == 0) {
-            handle_list_todos(curl, &response_data);
-        } else if (strncmp(url, "/todos/", 7) == 0) {
-            int id = atoi(url + 7);
-            handle_get_todo(curl, id, &response_data);
-        } else {
-            http_status = MHD_HTTP_NOT_FOUND;
-            response_data.data = strdup("{\"error\": \"Not found\"}");
-            response_data.size = strlen(response_data.data);
+    if (response_data->stream) {
+        if (response_data->stream_set_waker && suspend_allowed) {
+            response_waker_t waker = {suspend_connection, resume_connection, connection};
+            response_data->stream_set_waker(response_data->stream_state, &waker);
+        }
+        if (executor_enabled && defer_stream(connection, response_data) != 0) {
+            if (response_data->stream_free) {
+                response_data->stream_free(response_data->stream_state);
+            }
+            return NULL;
+        }
+        response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN,
+                                                     STREAM_BLOCK_SIZE,
+                                                     response_data->stream,
+                                                     response_data->stream_state,
+                                                     response_data->stream_free);
+        if (!response && response_data->stream_free) {
+            response_data->stream_free(response_data->stream_state);
+        }
+    } else {
+        response = MHD_create_response_from_buffer(response_data->size,
+                                                   response_data->data,
+                                                   response_data->borrowed ? MHD_RESPMEM_MUST_COPY
+                                                                           : MHD_RESPMEM_MUST_FREE);
+        if (!response && !response_data->borrowed) {
+            free(response_data->data);
         }
-    } else if (strcmp(method, "POST") == 0) {
-        if (strcmp(url, "/todos") == 0) {
-            printf("DEBUG: Calling handle_create_todo with %zu bytes\n", con_info->post_data_size);
-            handle_create_todo(curl, con_info->post_data, con_info->post_data_size, &response_data);
+    }
+
+    if (!response) {
+        return NULL;
+    }
+
+    MHD_add_response_header(response, "Content-Type",
+                            response_data->content_type ? response_data->content_type : "application/json");
+    for (int i = 0; i < response_data->header_count; i++) {
+        MHD_add_response_header(response, response_data->headers[i].name, response_data->headers[i].value);
+    }
+    return response;
+}
+
+// Routes that can wait on SQLite: list and search queries, and writes that
+// wait for a group commit. Single gets, mostly cache hits, and the counters
+// stay on the network thread, so they never queue behind slow work.
+static int runs_on_executor(metrics_route_t route) {
+    switch (route) {
+    case METRICS_ROUTE_LIST_TODOS:
+    case METRICS_ROUTE_SEARCH_TODOS:
+    case METRICS_ROUTE_CREATE_TODO:
+    case METRICS_ROUTE_BATCH_TODOS:
+    case METRICS_ROUTE_IMPORT_TODOS:
+    case METRICS_ROUTE_UPDATE_TODO:
+    case METRICS_ROUTE_DELETE_TODO:
+    case METRICS_ROUTE_DELETE_TODOS:
+    case METRICS_ROUTE_PATCH_TODOS:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Runs the handler for a routed request and builds its response, on the
+// connection's own thread or on an executor thread while it is suspended
+static void build_response(struct ConnectionInfo* con_info) {
+    struct MHD_Connection* connection = con_info->connection;
+    uint64_t dispatched = metrics_now();
+    uint64_t db_before = metrics_thread_db_time();
+    con_info->phases[METRICS_PHASE_QUEUE] = dispatched - con_info->parsed;
+    if (runs_on_executor(con_info->match.route)) {
+        admission_record_queue_delay(con_info->phases[METRICS_PHASE_QUEUE], dispatched);
+    }
+
+    struct ResponseData response_data = {0};
+    int http_status = MHD_HTTP_OK;
+
+    struct RequestContext request = {
+        .id = con_info->match.params[0],
+        .pretty = query_flag_arg(connection, "pretty"),
+        .if_none_match = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_IF_NONE_MATCH),
+        .if_match = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_IF_MATCH),
+        .body = con_info->body,
+        .body_size = con_info->body_size,
+        .arena = &con_info->arena,
+        .response = &response_data,
+    };
+
+    switch (con_info->match.route) {
+    case METRICS_ROUTE_LIST_TODOS: {
+        todo_query_t query;
+        if (parse_list_query(connection, &query) == 0) {
+            handle_list_todos(&request, &query);
         } else {
-            http_status = MHD_HTTP_NOT_FOUND;
-            response_data.data = strdup("{\"error\": \"Not found\"}");
+            http_status = MHD_HTTP_BAD_REQUEST;
+            response_data.data = strdup("{\"error\": \"Invalid list query\"}");
             response_data.size = strlen(response_data.data);
         }
-    } else if (strcmp(method, "PUT") == 0) {
-        if (strncmp(url, "/todos/", 7) == 0) {
-            int id = atoi(url + 7);
-            printf("DEBUG: Calling handle_update_todo with %zu bytes\n", con_info->post_data_size);
-            handle_update_todo(curl, id, con_info->post_data, con_info->post_data_size, &response_data);
+        break;
+    }
+    case METRICS_ROUTE_CHANGES: {
+        long long since;
+        int limit, wait;
+        if (parse_changes(connection, &since, &limit, &wait) == 0) {
+            handle_list_changes(&request, since, limit, wait, accepts_event_stream(connection));
         } else {
-            http_status = MHD_HTTP_NOT_FOUND;
-            response_data.data = strdup("{\"error\": \"Not found\"}");
+            http_status = MHD_HTTP_BAD_REQUEST;
+            response_data.data = strdup("{\"error\": \"Invalid since, limit or wait\"}");
             response_data.size = strlen(response_data.data);
         }
-    } else if (strcmp(method, "DELETE") == 0) {
-        if (strncmp(url, "/todos/", 7) == 0) {
-            int id = atoi(url + 7);
-            handle_delete_todo(curl, id, &response_data);
+        break;
+    }
+    case METRICS_ROUTE_SEARCH_TODOS: {
+        todo_search_t search;
+        if (parse_search(connection, &search) == 0) {
+            handle_search_todos(&request, &search);
         } else {
-            http_status = MHD_HTTP_NOT_FOUND;
-            response_data.data = strdup("{\"error\": \"Not found\"}");
+            http_status = MHD_HTTP_BAD_REQUEST;
+            response_data.data = strdup("{\"error\": \"Invalid search query\"}");
             response_data.size = strlen(response_data.data);
         }
-    } else {
-        http_status = MHD_HTTP_METHOD_NOT_ALLOWED;
-        response_data.data = strdup("{\"error\": \"Method not allowed\"}");
-        response_data.size = strlen(response_data.data);
+        break;
+    }
+    case METRICS_ROUTE_GET_TODO:
+        handle_get_todo(&request);
+        break;
+    case METRICS_ROUTE_STATS:
+        handle_stats(&request);
+        break;
+    case METRICS_ROUTE_METRICS:
+        handle_metrics(&request);
+        break;
+    case METRICS_ROUTE_CREATE_TODO:
+        handle_create_todo(&request);
+        break;
+    case METRICS_ROUTE_BATCH_TODOS:
+        handle_batch_todos(&request, is_ndjson(connection));
+        break;
+    case METRICS_ROUTE_EXPORT_TODOS:
+        handle_export_todos(&request, wants_binary_export(connection));
+        break;
+    case METRICS_ROUTE_IMPORT_TODOS:
+        handle_import_todos(&request, con_info->import);
+        break;
+    case METRICS_ROUTE_UPDATE_TODO:
+        handle_update_todo(&request);
+        break;
+    case METRICS_ROUTE_DELETE_TODOS: {
+        const char* ids = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "ids");
+        handle_delete_todos(&request, ids);
+        break;
+    }
+    case METRICS_ROUTE_DELETE_TODO:
+        handle_delete_todo(&request);
+        break;
+    case METRICS_ROUTE_PATCH_TODOS:
+        handle_patch_todos(&request);
+        break;
+    default:
+        // Unmatched requests are answered before their body is read
+        break;
     }
 
-    if (!response_data.data) {
+    if (!response_data.data && !response_data.stream && response_data.status != MHD_HTTP_NOT_MODIFIED) {
         response_data.data = strdup("{\"status\": \"OK\"}");
         response_data.size = strlen(response_data.data);
     }
 
-    response = MHD_create_response_from_buffer(response_data.size,
-                                             response_data.data,
-                                             MHD_RESPMEM_MUST_FREE);
-    MHD_add_response_header(response, "Content-Type", "application/json");
+    if (response_data.status) {
+        http_status = response_data.status;
+    }
 
-    ret = MHD_queue_response(connection, http_status, response);
-    MHD_destroy_response(response);
-    curl_easy_cleanup(curl);
+    compress_response(connection, con_info->method, con_info->url, &response_data);
+    con_info->response = create_response(connection, &response_data);
+    con_info->response_status = (unsigned int)http_status;
+    con_info->response_built = 1;
+
+    uint64_t handled = metrics_now();
+    uint64_t db_time = metrics_thread_db_time() - db_before;
+    con_info->phases[METRICS_PHASE_DB] = db_time;
+    con_info->phases[METRICS_PHASE_SERIALIZE] = handled - dispatched > db_time ? handled - dispatched - db_time : 0;
 
-    free_connection_info(con_info);
-    *con_cls = NULL;
+}
+
+static void suspend_for_executor(void* arg) {
+    struct ConnectionInfo* con_info = arg;
+    MHD_suspend_connection(con_info->connection);
+}
+
+static void run_on_executor(void* arg) {
+    struct ConnectionInfo* con_info = arg;
+    build_response(con_info);
+    MHD_resume_connection(con_info->connection);
+}
+
+// Suspended once a queue slot is claimed, before a worker can take the task
+// and resume it; a refused request was never suspended
+static enum MHD_Result submit_to_executor(struct ConnectionInfo* con_info, struct MHD_Connection* connection) {
+    if (executor_submit_claimed(run_on_executor, con_info, suspend_for_executor) == 0) {
+        return MHD_YES;
+    }
+    return queue_overload(con_info, connection, MHD_HTTP_SERVICE_UNAVAILABLE, 1);
+}
+
+static enum MHD_Result queue_built_response(struct ConnectionInfo* con_info, struct MHD_Connection* connection) {
+    struct MHD_Response* response = con_info->response;
+    con_info->response = NULL;
+    if (!response) {
+        return MHD_NO;
+    }
 
+    enum MHD_Result ret = MHD_queue_response(connection, con_info->response_status, response);
+    MHD_destroy_response(response);
+    if (ret == MHD_YES) {
+        con_info->status = (int)con_info->response_status;
+        con_info->queued = metrics_now();
+    }
     return ret;
 }
 
-int http_server_init(int port) {
-    http_daemon = MHD_start_daemon(MHD_USE_THREAD_PER_CONNECTION,
-                            port,
+static enum MHD_Result handle_request(void* cls,
+                        struct MHD_Connection* connection,
+                        const char* url,
+                        const char* method,
+                        const char* version,
+                        const char* upload_data,
+                        size_t* upload_data_size,
+                        void** con_cls) {
+    (void)cls;
+    (void)version;
+
+    struct ConnectionInfo* con_info = *con_cls;
+
+    if (con_info == NULL) {
+        con_info = acquire_connection_info();
+        if (!con_info) return MHD_NO;
+        *con_cls = con_info;
+        con_info->started = metrics_now();
+        memset(con_info->phases, 0, sizeof(con_info->phases));
+        metrics_request_started();
+
+        // Admission runs before anything else, so a rejected request costs
+        // neither a body read nor any database work
+        unsigned int retry_after = 0;
+        con_info->match.route = METRICS_ROUTE_OTHER;
+        int status = admission_check_rate(client_key(connection), con_info->started, &retry_after);
+        if (status) {
+            return queue_overload(con_info, connection, status, retry_after);
+        }
+
+        if (router_match(http_method_parse(method), url, &con_info->match) != 0) {
+            return queue_route_error(con_info, connection);
+        }
+
+        con_info->admission_class = admission_class_of(con_info->match.route);
+        status = admission_acquire(con_info->admission_class, con_info->started, &retry_after);
+        if (status) {
+            return queue_overload(con_info, connection, status, retry_after);
+        }
+        con_info->admitted = 1;
+
+        // Reject oversized uploads before reading them when the client says up front
+        if (method_has_body(method)) {
+            const char* length = MHD_lookup_connection_value(connection, MHD_HEADER_KIND,
+                                                             MHD_HTTP_HEADER_CONTENT_LENGTH);
+            size_t limit = con_info->match.route == METRICS_ROUTE_IMPORT_TODOS ? max_import_size : max_body_size;
+            if (length && strtoull(length, NULL, 10) > limit) {
+                return queue_rejection(con_info, connection);
+            }
+        }
+        return MHD_YES;
+    }
+
+    if (method_has_body(method) && *upload_data_size != 0) {
+        int import = con_info->match.route == METRICS_ROUTE_IMPORT_TODOS;
+        if (import && !con_info->import) {
+            // A line or record is held whole, so each is limited like a body
+            con_info->import = import_upload_open(is_octet_stream(connection), max_body_size);
+            if (!con_info->import) return MHD_NO;
+        }
+        // Chunked uploads have no length up front; drain the rest and answer 413 at the end
+        if (!con_info->body_too_large &&
+            (import ? append_import(con_info, upload_data, *upload_data_size)
+                    : append_body(con_info, upload_data, *upload_data_size)) != 0) {
+            con_info->body_too_large = 1;
+        }
+        *upload_data_size = 0;
+        return MHD_YES;
+    }
+
+    if (con_info->body_too_large) {
+        return queue_rejection(con_info, connection);
+    }
+
+    // Resumed after an executor thread built the response
+    if (con_info->response_built) {
+        return queue_built_response(con_info, connection);
+    }
+
+    LOG_DEBUG("%s %s (%zu byte body)", method, url, con_info->body_size);
+
+    con_info->connection = connection;
+    con_info->method = method;
+    con_info->url = url;
+    con_info->parsed = metrics_now();
+    con_info->phases[METRICS_PHASE_PARSE] = con_info->parsed - con_info->started;
+
+    if (!executor_enabled) {
+        build_response(con_info);
+        return queue_built_response(con_info, connection);
+    }
+    if (runs_on_executor(con_info->match.route)) {
+        return submit_to_executor(con_info, connection);
+    }
+
+    // The other routes run here, but the network thread never waits for a
+    // database connection: when none is free, as on a cache miss while slow
+    // queries hold the pool, the read is refused and the request is handed
+    // to the executor. These routes only read, so running again is safe.
+    todo_set_reads_nowait(1);
+    build_response(con_info);
+    todo_set_reads_nowait(0);
+    if (todo_take_refused_read()) {
+        if (con_info->response) {
+            MHD_destroy_response(con_info->response);
+            con_info->response = NULL;
+        }
+        con_info->response_built = 0;
+        return submit_to_executor(con_info, connection);
+    }
+    return queue_built_response(con_info, connection);
+}
+
+static unsigned int default_thread_pool_size(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (unsigned int)cpus : 1;
+}
+
+void http_server_config_defaults(server_config_t* config) {
+    config->port = 8080;
+    config->mode = SERVER_MODE_EPOLL_POOL;
+    config->thread_pool_size = 0;
+    config->connection_limit = 10000;
+    config->connection_timeout = 60;
+    config->max_body_size = 1024 * 1024;
+    config->max_import_size = 1024 * 1024 * 1024;
+    config->compress_min_size = 1024;
+    config->compress_cache_size = 16 * 1024 * 1024;
+    config->listen_fd = -1;
+    config->executor_threads = default_thread_pool_size();
+    config->executor_queue = 1024;
+    admission_config_defaults(&config->admission);
+}
+
+int http_server_init(const server_config_t* config) {
+    max_body_size = config->max_body_size;
+    max_import_size = config->max_import_size;
+    compress_min_size = config->compress_min_size;
+
+    // An inherited socket replaces binding the port; otherwise the list ends here
+    struct MHD_OptionItem listen_options[] = {
+        {config->listen_fd >= 0 ? MHD_OPTION_LISTEN_SOCKET : MHD_OPTION_END, config->listen_fd, NULL},
+        {MHD_OPTION_END, 0, NULL},
+    };
+
+    if (admission_init(&config->admission) != 0) {
+        return -1;
+    }
+    if (compress_cache_init(config->compress_cache_size) != 0) {
+        admission_cleanup();
+        return -1;
+    }
+    if (change_feed_start() != 0) {
+        compress_cache_cleanup();
+        admission_cleanup();
+        return -1;
+    }
+
+    if (config->mode == SERVER_MODE_THREAD_PER_CONNECTION) {
+        // Each connection has its own thread, so waiting streams simply block in it
+        suspend_allowed = 0;
+        http_daemon = MHD_start_daemon(MHD_USE_THREAD_PER_CONNECTION | MHD_USE_INTERNAL_POLLING_THREAD | MHD_USE_ITC,
+                                (uint16_t)config->port,
+                                NULL,
+                                NULL,
+                                (MHD_AccessHandlerCallback)&handle_request,
+                                NULL,
+                                MHD_OPTION_CONNECTION_LIMIT, config->connection_limit,
+                                MHD_OPTION_CONNECTION_TIMEOUT, config->connection_timeout,
+                                MHD_OPTION_NOTIFY_COMPLETED, &request_completed, NULL,
+                                MHD_OPTION_NOTIFY_CONNECTION, &connection_notify, NULL,
+                                MHD_OPTION_ARRAY, listen_options,
+                                MHD_OPTION_END);
+        if (!http_daemon) {
+            change_feed_stop();
+            compress_cache_cleanup();
+            admission_cleanup();
+        }
+        return http_daemon ? 0 : -1;
+    }
+
+    // A fixed pool of epoll event loops: connection count no longer drives thread count
+    unsigned int threads = config->thread_pool_size ? config->thread_pool_size : default_thread_pool_size();
+    suspend_allowed = 1;
+
+    // Database work gets its own threads, sized apart from the event loops
+    if (config->executor_threads > 0) {
+        if (executor_start((int)config->executor_threads, (int)config->executor_queue) != 0) {
+            change_feed_stop();
+            compress_cache_cleanup();
+            admission_cleanup();
+            return -1;
+        }
+        executor_enabled = 1;
+    }
+    http_daemon = MHD_start_daemon(MHD_USE_EPOLL_INTERNAL_THREAD | MHD_ALLOW_SUSPEND_RESUME | MHD_USE_ERROR_LOG,
+                            (uint16_t)config->port,
                             NULL,
                             NULL,
                             (MHD_AccessHandlerCallback)&handle_request,
                             NULL,
+                            MHD_OPTION_THREAD_POOL_SIZE, threads,
+                            MHD_OPTION_CONNECTION_LIMIT, config->connection_limit,
+                            MHD_OPTION_CONNECTION_TIMEOUT, config->connection_timeout,
+                            MHD_OPTION_NOTIFY_COMPLETED, &request_completed, NULL,
+                            MHD_OPTION_NOTIFY_CONNECTION, &connection_notify, NULL,
+                            MHD_OPTION_ARRAY, listen_options,
                             MHD_OPTION_END);
+    if (!http_daemon) {
+        executor_stop();
+        executor_enabled = 0;
+        change_feed_stop();
+        compress_cache_cleanup();
+        admission_cleanup();
+    }
     return http_daemon ? 0 : -1;
 }
 
-void http_server_process(void) {
+int http_server_listen_fd(void) {
+    if (!http_daemon || quiesced) {
+        return -1;
+    }
+    const union MHD_DaemonInfo* info = MHD_get_daemon_info(http_daemon, MHD_DAEMON_INFO_LISTEN_FD);
+    return info ? info->listen_fd : -1;
+}
+
+int http_server_drain(unsigned int timeout_ms) {
+    if (!http_daemon) {
+        return 0;
+    }
+
+    // Connections already accepted keep being served; a replacement process
+    // holding its own copy of the socket takes the new ones
+    if (!quiesced) {
+        MHD_socket fd = MHD_quiesce_daemon(http_daemon);
+        if (fd != MHD_INVALID_SOCKET) {
+            close(fd);
+        }
+        quiesced = 1;
+    }
+
+    // Long polls answer and event streams end, or they would hold the drain open
+    change_feed_stop();
+
+    uint64_t deadline = metrics_now() + (uint64_t)timeout_ms * 1000000ull;
+    while (metrics_requests_in_flight() > 0) {
+        if (metrics_now() >= deadline) {
+            return -1;
+        }
+        usleep(DRAIN_POLL_US);
+    }
+    return 0;
 }
 
 void http_server_cleanup(void) {
+    // Parked change feed connections and those waiting on the executor have
+    // to be resumed before the daemon stops
+    change_feed_stop();
+    executor_stop();
+    executor_enabled = 0;
     if (http_daemon) {
         MHD_stop_daemon(http_daemon);
         http_daemon = NULL;
     }
-} 
\ No newline at end of file
+    quiesced = 0;
+    compress_cache_cleanup();
+    admission_cleanup();
+}
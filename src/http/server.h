@@ -1,8 +1,42 @@
 #ifndef SERVER_H
 #define SERVER_H
 
-int http_server_init(int port);
-void http_server_process(void);
+#include <stddef.h>
+#include "admission.h"
+
+typedef enum {
+    SERVER_MODE_THREAD_PER_CONNECTION,
+    SERVER_MODE_EPOLL_POOL
+} server_mode_t;
+
+typedef struct {
+    int port;
+    server_mode_t mode;
+    unsigned int thread_pool_size;    // Worker threads in epoll mode, 0 = one per CPU
+    unsigned int connection_limit;    // Maximum concurrent connections
+    unsigned int connection_timeout;  // Idle connection timeout in seconds, 0 = none
+    size_t max_body_size;             // Larger request bodies are rejected with 413
+    size_t max_import_size;           // Likewise for POST /todos/import, which is not buffered
+    size_t compress_min_size;         // Smaller bodies are sent uncompressed, 0 = never compress
+    size_t compress_cache_size;       // Memory for compressed bodies of cacheable responses
+    int listen_fd;                    // Inherited listening socket, -1 = bind port
+    unsigned int executor_threads;    // Threads for database-bound routes in epoll mode, 0 = run them inline
+    unsigned int executor_queue;      // Requests waiting for those threads before 503s
+    admission_config_t admission;     // Rate limits, in-flight caps and load shedding
+} server_config_t;
+
+void http_server_config_defaults(server_config_t* config);
+int http_server_init(const server_config_t* config);
+
+// The listening socket, to hand over to a replacement process; -1 once
+// the server has stopped accepting
+int http_server_listen_fd(void);
+
+// Stops accepting connections, ends change feed subscriptions and waits up
+// to timeout_ms for requests in flight to complete. Returns -1 if some are
+// still running at the deadline.
+int http_server_drain(unsigned int timeout_ms);
+
 void http_server_cleanup(void);
 
-#endif 
\ No newline at end of file
+#endif
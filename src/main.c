@@ -1,40 +1,564 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include <signal.h>
+#include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
 #include "http/server.h"
 #include "db/database.h"
+#include "core/cache.h"
+#include "core/snapshot.h"
+#include "core/log.h"
 
-static volatile int keep_running = 1;
+#define READY_TIMEOUT_MS 30000     // How long a replacement process may take to start
 
-static void handle_signal(int signum) {
-    (void)signum;
-    keep_running = 0;
+extern char** environ;
+
+typedef struct {
+    server_config_t server;
+    db_config_t db;
+    size_t cache_size;
+    int log_level;
+    unsigned int drain_timeout;
+    const char* load_snapshot;      // One-shot modes: run against the database and exit
+    const char* save_snapshot;
+} app_config_t;
+
+static void print_usage(const char* program) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -p, --port N             Listening port (env TODO_PORT, default 8080)\n"
+        "  -m, --mode MODE          Server mode: epoll or thread (env TODO_SERVER_MODE, default epoll)\n"
+        "  -t, --threads N          Worker threads in epoll mode (env TODO_THREADS, default: CPU count)\n"
+        "  -c, --max-connections N  Connection limit (env TODO_MAX_CONNECTIONS, default 10000)\n"
+        "  -T, --timeout SECONDS    Idle connection timeout (env TODO_CONNECTION_TIMEOUT, default 60)\n"
+        "  -M, --max-body BYTES     Largest accepted request body (env TODO_MAX_BODY_SIZE, default 1048576)\n"
+        "  -X, --max-import BYTES   Largest accepted import body (env TODO_MAX_IMPORT_SIZE, default 1073741824)\n"
+        "  -d, --db PATH            SQLite database file (env TODO_DB_PATH, default todo.db)\n"
+        "  -s, --store STORE        Where reads are served from: sqlite or memory (env TODO_STORE, default sqlite)\n"
+        "  -r, --db-readers N       Pooled read connections (env TODO_DB_READERS, default: CPU count)\n"
+        "  -b, --batch-size N       Writes per group commit (env TODO_DB_BATCH_SIZE, default 512)\n"
+        "  -w, --batch-window US    Group commit window in microseconds (env TODO_DB_BATCH_WINDOW_US, default 2000)\n"
+        "  -C, --cache-size BYTES   Memory for cached todo responses, 0 disables (env TODO_CACHE_SIZE, default 67108864)\n"
+        "  -z, --compress-min BYTES Smallest response body worth compressing, 0 disables (env TODO_COMPRESS_MIN_SIZE, default 1024)\n"
+        "  -Z, --compress-cache BYTES  Memory for compressed response bodies, 0 disables (env TODO_COMPRESS_CACHE_SIZE, default 16777216)\n"
+        "  -e, --executor-threads N Threads for database-bound requests in epoll mode, 0 runs them inline (env TODO_EXECUTOR_THREADS, default: CPU count)\n"
+        "  -q, --executor-queue N   Requests waiting for an executor thread before 503s (env TODO_EXECUTOR_QUEUE, default 1024)\n"
+        "  -R, --rate-limit N[:BURST]  Requests per second over all clients, 0 = unlimited (env TODO_RATE_LIMIT, default 0:100)\n"
+        "  -I, --client-rate-limit N[:BURST]  Requests per second from one address (env TODO_CLIENT_RATE_LIMIT, default 0:20)\n"
+        "  -F, --max-in-flight R,L,W  Concurrent reads, lists and writes, 0 = unlimited (env TODO_MAX_IN_FLIGHT, default 0,0,0)\n"
+        "  -S, --shed-delay MS      Shed lists and writes while executor queueing averages more, 0 = never (env TODO_SHED_DELAY_MS, default 0)\n"
+        "  -D, --drain-timeout SECONDS  Wait for requests in flight on shutdown (env TODO_DRAIN_TIMEOUT, default 30)\n"
+        "  -L, --log-level LEVEL    debug, info, warn or error (env TODO_LOG_LEVEL, default info)\n"
+        "  -i, --load-snapshot FILE Import a snapshot file into the database and exit\n"
+        "  -o, --save-snapshot FILE Write the database to a snapshot file and exit; after -i if both are given\n"
+        "  -h, --help               Show this help\n",
+        program);
+}
+
+static const char* const log_level_names[] = {"debug", "info", "warn", "error"};
+
+static int parse_uint(const char* value, unsigned int* out) {
+    char* end;
+    unsigned long parsed = strtoul(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || parsed > 0xFFFFFFFFUL) {
+        return -1;
+    }
+    *out = (unsigned int)parsed;
+    return 0;
+}
+
+// "N" or "N:BURST"; the burst keeps its default when omitted
+static int parse_rate(const char* value, double* rate, unsigned int* burst) {
+    char number[32];
+    const char* colon = strchr(value, ':');
+    size_t len = colon ? (size_t)(colon - value) : strlen(value);
+    unsigned int parsed;
+    if (len >= sizeof(number)) {
+        return -1;
+    }
+    memcpy(number, value, len);
+    number[len] = '\0';
+    if (parse_uint(number, &parsed) != 0) {
+        return -1;
+    }
+    if (colon && (parse_uint(colon + 1, burst) != 0 || *burst == 0)) {
+        return -1;
+    }
+    *rate = parsed;
+    return 0;
+}
+
+// "READS,LISTS,WRITES"
+static int parse_in_flight(const char* value, unsigned int* limits) {
+    char copy[64];
+    if (strlen(value) >= sizeof(copy)) {
+        return -1;
+    }
+    strcpy(copy, value);
+
+    char* save = NULL;
+    char* field = strtok_r(copy, ",", &save);
+    for (int i = 0; i < ADMISSION_CLASS_COUNT; i++) {
+        if (!field || parse_uint(field, &limits[i]) != 0) {
+            return -1;
+        }
+        field = strtok_r(NULL, ",", &save);
+    }
+    return field ? -1 : 0;
+}
+
+static int apply_option(app_config_t* config, char option, const char* value) {
+    unsigned int number;
+
+    switch (option) {
+    case 'p':
+        if (parse_uint(value, &number) != 0 || number == 0 || number > 65535) return -1;
+        config->server.port = (int)number;
+        return 0;
+    case 'm':
+        if (strcmp(value, "epoll") == 0) {
+            config->server.mode = SERVER_MODE_EPOLL_POOL;
+        } else if (strcmp(value, "thread") == 0) {
+            config->server.mode = SERVER_MODE_THREAD_PER_CONNECTION;
+        } else {
+            return -1;
+        }
+        return 0;
+    case 't':
+        return parse_uint(value, &config->server.thread_pool_size);
+    case 'c':
+        return parse_uint(value, &config->server.connection_limit);
+    case 'T':
+        return parse_uint(value, &config->server.connection_timeout);
+    case 'M':
+        if (parse_uint(value, &number) != 0) return -1;
+        config->server.max_body_size = number;
+        return 0;
+    case 'X':
+        if (parse_uint(value, &number) != 0) return -1;
+        config->server.max_import_size = number;
+        return 0;
+    case 'd':
+        if (*value == '\0') return -1;
+        config->db.path = value;
+        return 0;
+    case 's':
+        if (strcmp(value, "sqlite") == 0) {
+            config->db.memory_primary = 0;
+        } else if (strcmp(value, "memory") == 0) {
+            config->db.memory_primary = 1;
+        } else {
+            return -1;
+        }
+        return 0;
+    case 'r':
+    case 'b':
+    case 'w':
+        if (parse_uint(value, &number) != 0 || number > 0x7FFFFFFF) return -1;
+        if (option == 'r') config->db.reader_count = (int)number;
+        if (option == 'b') config->db.batch_max = (int)number;
+        if (option == 'w') config->db.batch_window_us = (int)number;
+        return 0;
+    case 'C':
+        if (parse_uint(value, &number) != 0) return -1;
+        config->cache_size = number;
+        return 0;
+    case 'z':
+    case 'Z':
+        if (parse_uint(value, &number) != 0) return -1;
+        if (option == 'z') config->server.compress_min_size = number;
+        if (option == 'Z') config->server.compress_cache_size = number;
+        return 0;
+    case 'e':
+    case 'q':
+        if (parse_uint(value, &number) != 0 || number > 0x7FFFFFFF) return -1;
+        if (option == 'e') config->server.executor_threads = number;
+        if (option == 'q') config->server.executor_queue = number;
+        return 0;
+    case 'R':
+        return parse_rate(value, &config->server.admission.rate, &config->server.admission.burst);
+    case 'I':
+        return parse_rate(value, &config->server.admission.client_rate, &config->server.admission.client_burst);
+    case 'F':
+        return parse_in_flight(value, config->server.admission.max_in_flight);
+    case 'S':
+        return parse_uint(value, &config->server.admission.shed_delay_ms);
+    case 'D':
+        return parse_uint(value, &config->drain_timeout);
+    case 'L':
+        for (int level = LOG_LEVEL_DEBUG; level <= LOG_LEVEL_ERROR; level++) {
+            if (strcasecmp(value, log_level_names[level]) == 0) {
+                config->log_level = level;
+                return 0;
+            }
+        }
+        return -1;
+    case 'i':
+    case 'o':
+        if (*value == '\0') return -1;
+        if (option == 'i') config->load_snapshot = value;
+        if (option == 'o') config->save_snapshot = value;
+        return 0;
+    default:
+        return -1;
+    }
 }
 
-int main(void) {
-    signal(SIGINT, handle_signal);
-    signal(SIGTERM, handle_signal);
+// Returns 1 when usage was asked for and printed, -1 on invalid options
+static int load_config(app_config_t* config, int argc, char** argv) {
+    static const struct {
+        const char* name;
+        char option;
+    } env_options[] = {
+        {"TODO_PORT", 'p'},
+        {"TODO_SERVER_MODE", 'm'},
+        {"TODO_THREADS", 't'},
+        {"TODO_MAX_CONNECTIONS", 'c'},
+        {"TODO_CONNECTION_TIMEOUT", 'T'},
+        {"TODO_MAX_BODY_SIZE", 'M'},
+        {"TODO_MAX_IMPORT_SIZE", 'X'},
+        {"TODO_DB_PATH", 'd'},
+        {"TODO_STORE", 's'},
+        {"TODO_DB_READERS", 'r'},
+        {"TODO_DB_BATCH_SIZE", 'b'},
+        {"TODO_DB_BATCH_WINDOW_US", 'w'},
+        {"TODO_CACHE_SIZE", 'C'},
+        {"TODO_COMPRESS_MIN_SIZE", 'z'},
+        {"TODO_COMPRESS_CACHE_SIZE", 'Z'},
+        {"TODO_EXECUTOR_THREADS", 'e'},
+        {"TODO_EXECUTOR_QUEUE", 'q'},
+        {"TODO_RATE_LIMIT", 'R'},
+        {"TODO_CLIENT_RATE_LIMIT", 'I'},
+        {"TODO_MAX_IN_FLIGHT", 'F'},
+        {"TODO_SHED_DELAY_MS", 'S'},
+        {"TODO_DRAIN_TIMEOUT", 'D'},
+        {"TODO_LOG_LEVEL", 'L'},
+    };
+    static const struct option long_options[] = {
+        {"port", required_argument, NULL, 'p'},
+        {"mode", required_argument, NULL, 'm'},
+        {"threads", required_argument, NULL, 't'},
+        {"max-connections", required_argument, NULL, 'c'},
+        {"timeout", required_argument, NULL, 'T'},
+        {"max-body", required_argument, NULL, 'M'},
+        {"max-import", required_argument, NULL, 'X'},
+        {"db", required_argument, NULL, 'd'},
+        {"store", required_argument, NULL, 's'},
+        {"db-readers", required_argument, NULL, 'r'},
+        {"batch-size", required_argument, NULL, 'b'},
+        {"batch-window", required_argument, NULL, 'w'},
+        {"cache-size", required_argument, NULL, 'C'},
+        {"compress-min", required_argument, NULL, 'z'},
+        {"compress-cache", required_argument, NULL, 'Z'},
+        {"executor-threads", required_argument, NULL, 'e'},
+        {"executor-queue", required_argument, NULL, 'q'},
+        {"rate-limit", required_argument, NULL, 'R'},
+        {"client-rate-limit", required_argument, NULL, 'I'},
+        {"max-in-flight", required_argument, NULL, 'F'},
+        {"shed-delay", required_argument, NULL, 'S'},
+        {"drain-timeout", required_argument, NULL, 'D'},
+        {"log-level", required_argument, NULL, 'L'},
+        {"load-snapshot", required_argument, NULL, 'i'},
+        {"save-snapshot", required_argument, NULL, 'o'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    http_server_config_defaults(&config->server);
+    db_config_defaults(&config->db);
+    config->cache_size = 64 * 1024 * 1024;
+    config->log_level = LOG_LEVEL_INFO;
+    config->drain_timeout = 30;
+
+    // Environment first so that command line flags take precedence
+    for (size_t i = 0; i < sizeof(env_options) / sizeof(env_options[0]); i++) {
+        const char* value = getenv(env_options[i].name);
+        if (value && apply_option(config, env_options[i].option, value) != 0) {
+            fprintf(stderr, "Invalid value for %s: %s\n", env_options[i].name, value);
+            return -1;
+        }
+    }
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "p:m:t:c:T:M:X:d:s:r:b:w:C:z:Z:e:q:R:I:F:S:D:L:i:o:h", long_options, NULL)) != -1) {
+        if (opt == 'h' || opt == '?') {
+            print_usage(argv[0]);
+            return opt == 'h' ? 1 : -1;
+        }
+        if (apply_option(config, (char)opt, optarg) != 0) {
+            fprintf(stderr, "Invalid value for -%c: %s\n", opt, optarg);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Loads and/or saves a snapshot instead of serving
+static int run_snapshot(const app_config_t* config) {
+    if (config->load_snapshot) {
+        long long count = todo_snapshot_load(config->load_snapshot);
+        if (count < 0) {
+            LOG_ERROR("Failed to load snapshot %s", config->load_snapshot);
+            return EXIT_FAILURE;
+        }
+        LOG_INFO("Loaded %lld todos from %s", count, config->load_snapshot);
+    }
+    if (config->save_snapshot) {
+        long long count = todo_snapshot_save(config->save_snapshot);
+        if (count < 0) {
+            LOG_ERROR("Failed to save snapshot %s", config->save_snapshot);
+            return EXIT_FAILURE;
+        }
+        LOG_INFO("Saved %lld todos to %s", count, config->save_snapshot);
+    }
+    return EXIT_SUCCESS;
+}
+
+// A process started by a restart inherits the listening socket, a pipe on
+// which it reports that it is ready to take over, and the read end of a pipe
+// that reaches end of file once the old process has exited
+static int inherited_fd(const char* name) {
+    const char* value = getenv(name);
+    unsigned int fd;
+    if (!value || parse_uint(value, &fd) != 0 || fd > 0x7FFFFFFF) {
+        return -1;
+    }
+    unsetenv(name);
+    return (int)fd;
+}
+
+static void report_ready(void) {
+    int fd = inherited_fd("TODO_READY_FD");
+    if (fd >= 0) {
+        ssize_t written = write(fd, "1", 1);
+        (void)written;
+        close(fd);
+    }
+}
+
+// Starts a new copy of this program on the same listening socket and waits
+// for it to report ready. Returns 0 once it has; this process should then
+// drain and exit. The write end of the exit pipe stays open in this process
+// only, so the kernel closes it when the process exits, however that is.
+// Everything the child needs is prepared before fork, as only
+// async-signal-safe calls are allowed between fork and exec.
+static int start_replacement(char** argv, int listen_fd) {
+    if (listen_fd < 0) {
+        return -1;
+    }
 
-    if (db_init("todo.db") != 0) {
-        fprintf(stderr, "Failed to initialize database\n");
+    size_t env_count = 0;
+    while (environ[env_count]) env_count++;
+    char** env = calloc(env_count + 4, sizeof(char*));
+    char listen_var[32], ready_var[32], exited_var[32];
+    int ready[2];
+    int exited[2];
+    if (!env || pipe2(ready, O_CLOEXEC) != 0) {
+        free(env);
+        return -1;
+    }
+    if (pipe2(exited, O_CLOEXEC) != 0) {
+        close(ready[0]);
+        close(ready[1]);
+        free(env);
+        return -1;
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < env_count; i++) {
+        if (strncmp(environ[i], "TODO_LISTEN_FD=", 15) != 0 && strncmp(environ[i], "TODO_READY_FD=", 14) != 0 &&
+            strncmp(environ[i], "TODO_EXITED_FD=", 15) != 0) {
+            env[n++] = environ[i];
+        }
+    }
+    snprintf(listen_var, sizeof(listen_var), "TODO_LISTEN_FD=%d", listen_fd);
+    snprintf(ready_var, sizeof(ready_var), "TODO_READY_FD=%d", ready[1]);
+    snprintf(exited_var, sizeof(exited_var), "TODO_EXITED_FD=%d", exited[0]);
+    env[n++] = listen_var;
+    env[n++] = ready_var;
+    env[n++] = exited_var;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // These descriptors have to survive exec; everything else is close-on-exec
+        fcntl(listen_fd, F_SETFD, 0);
+        fcntl(ready[1], F_SETFD, 0);
+        fcntl(exited[0], F_SETFD, 0);
+        execve("/proc/self/exe", argv, env);
+        _exit(127);
+    }
+    free(env);
+    close(ready[1]);
+    close(exited[0]);
+    if (pid < 0) {
+        close(ready[0]);
+        close(exited[1]);
+        return -1;
+    }
+
+    struct pollfd ready_poll = {ready[0], POLLIN, 0};
+    char byte;
+    int rc = poll(&ready_poll, 1, READY_TIMEOUT_MS) == 1 && read(ready[0], &byte, 1) == 1 ? 0 : -1;
+    close(ready[0]);
+    if (rc != 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        close(exited[1]);
+    }
+    return rc;
+}
+
+// Until the process this one replaced has exited, it may still commit
+// writes that this process's caches have not seen. Once it is gone they are
+// replayed from the change log, starting where the log stood at startup.
+static void catch_up_after_handoff(int* exited_fd, long long since) {
+    close(*exited_fd);
+    *exited_fd = -1;
+    long long latest = todo_catch_up(since);
+    if (latest < 0) {
+        LOG_ERROR("Failed to replay writes made by the previous process");
+        return;
+    }
+    LOG_INFO("Previous process exited, replayed changes %lld to %lld", since + 1, latest);
+}
+
+// Sleeps until a signal arrives, catching up once the previous process has
+// exited if there is one
+static int wait_for_signal(int signal_fd, int* exited_fd, long long handoff_seq) {
+    struct signalfd_siginfo info;
+    for (;;) {
+        struct pollfd fds[2] = {{signal_fd, POLLIN, 0}, {*exited_fd, POLLIN, 0}};
+        if (poll(fds, *exited_fd >= 0 ? 2 : 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (*exited_fd >= 0 && fds[1].revents) {
+            catch_up_after_handoff(exited_fd, handoff_seq);
+        }
+        if (!fds[0].revents) {
+            continue;
+        }
+
+        ssize_t n = read(signal_fd, &info, sizeof(info));
+        if (n == (ssize_t)sizeof(info)) {
+            return (int)info.ssi_signo;
+        }
+        if (n < 0 && errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    app_config_t config;
+    int config_rc = load_config(&config, argc, argv);
+    if (config_rc != 0) {
+        return config_rc > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    config.server.listen_fd = inherited_fd("TODO_LISTEN_FD");
+    int exited_fd = inherited_fd("TODO_EXITED_FD");
+    if (exited_fd >= 0) {
+        fcntl(exited_fd, F_SETFD, FD_CLOEXEC);
+    }
+
+    // Signals are read from a descriptor by this thread. They are blocked
+    // before any other thread starts, so every thread inherits the mask.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR2);
+    int signal_fd = -1;
+    if (sigprocmask(SIG_BLOCK, &signals, NULL) != 0 ||
+        (signal_fd = signalfd(-1, &signals, SFD_CLOEXEC)) < 0) {
+        fprintf(stderr, "Failed to set up signal handling\n");
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    if (log_start(config.log_level) != 0) {
+        fprintf(stderr, "Failed to start log writer\n");
+        return EXIT_FAILURE;
+    }
+
+    if (db_init_config(&config.db) != 0) {
+        LOG_ERROR("Failed to initialize database");
+        log_stop();
         return EXIT_FAILURE;
     }
 
-    if (http_server_init(8080) != 0) {
-        fprintf(stderr, "Failed to initialize HTTP server\n");
+    if (todo_cache_init(config.cache_size) != 0) {
+        LOG_ERROR("Failed to initialize cache");
         db_cleanup();
+        log_stop();
         return EXIT_FAILURE;
     }
+    todo_follow_other_writers();
 
-    printf("Todo REST API server running on port 8080...\n");
+    if (config.load_snapshot || config.save_snapshot) {
+        int rc = run_snapshot(&config);
+        todo_cache_cleanup();
+        db_cleanup();
+        log_stop();
+        return rc;
+    }
 
-    while (keep_running) {
-        http_server_process();
+    // Writes the previous process commits from here on are replayed once it exits
+    long long handoff_seq = 0;
+    long long oldest_seq;
+    if (exited_fd >= 0 && todo_change_bounds(&oldest_seq, &handoff_seq) != 0) {
+        LOG_WARN("Cannot read the change log, writes by the previous process may be served stale");
+        close(exited_fd);
+        exited_fd = -1;
     }
 
+    if (http_server_init(&config.server) != 0) {
+        LOG_ERROR("Failed to initialize HTTP server");
+        todo_cache_cleanup();
+        db_cleanup();
+        log_stop();
+        return EXIT_FAILURE;
+    }
+
+    LOG_INFO("Todo REST API server running on port %d", config.server.port);
+    report_ready();
+
+    // SIGUSR2 hands the socket to a new process, e.g. after a deploy
+    for (;;) {
+        int signo = wait_for_signal(signal_fd, &exited_fd, handoff_seq);
+        if (signo != SIGUSR2) {
+            break;
+        }
+        LOG_INFO("Starting replacement process");
+        if (start_replacement(argv, http_server_listen_fd()) == 0) {
+            LOG_INFO("Replacement process is serving, draining this one");
+            break;
+        }
+        LOG_ERROR("Replacement process failed to start, still serving");
+    }
+
+    if (http_server_drain(config.drain_timeout * 1000) != 0) {
+        LOG_WARN("Drain timed out after %u s with requests in flight", config.drain_timeout);
+    }
     http_server_cleanup();
+    todo_cache_cleanup();
+    // Completes every queued write before closing the database
     db_cleanup();
-    printf("\nServer shutdown complete\n");
+    LOG_INFO("Server shutdown complete");
+    log_stop();
+    close(signal_fd);
+    if (exited_fd >= 0) {
+        close(exited_fd);
+    }
 
     return EXIT_SUCCESS;
-} 
\ No newline at end of file
+}
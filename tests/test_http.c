@@ -0,0 +1,636 @@
+#include "../src/http/json_writer.h"
+#include "../src/http/json_reader.h"
+#include "../src/http/change_feed.h"
+#include "../src/http/compress.h"
+#include "../src/http/router.h"
+#include "../src/http/admission.h"
+#include "../src/http/handlers.h"
+#include "../src/db/database.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <netinet/in.h>
+
+static void assert_json(const json_buf_t* buf, const char* expected) {
+    if (buf->len != strlen(expected) || memcmp(buf->data, expected, buf->len) != 0) {
+        fprintf(stderr, "expected: %s\ngot:      %.*s\n", expected, (int)buf->len, buf->data);
+        assert(0);
+    }
+}
+
+void test_json_escape(void) {
+    json_buf_t buf;
+    json_buf_init(&buf);
+
+    const char* plain = "a plain ascii string that is longer than one vector";
+    assert(json_write_string(&buf, plain, strlen(plain)) == 0);
+    assert_json(&buf, "\"a plain ascii string that is longer than one vector\"");
+
+    // Escapes at every offset within and across 16-byte blocks
+    json_buf_reset(&buf);
+    const char* special = "0123456789abcde\"quote\\slash\n\t\r\b\f\x01 end";
+    assert(json_write_string(&buf, special, strlen(special)) == 0);
+    assert_json(&buf, "\"0123456789abcde\\\"quote\\\\slash\\n\\t\\r\\b\\f\\u0001 end\"");
+
+    // Valid UTF-8 passes through; invalid bytes become U+FFFD
+    json_buf_reset(&buf);
+    const char* utf8 = "caf\xc3\xa9 \xe2\x9c\x93 \xf0\x9f\x98\x80 bad\xff\xc0\xaf end";
+    assert(json_write_string(&buf, utf8, strlen(utf8)) == 0);
+    assert_json(&buf, "\"caf\xc3\xa9 \xe2\x9c\x93 \xf0\x9f\x98\x80 bad\\ufffd\\ufffd\\ufffd end\"");
+
+    json_buf_free(&buf);
+}
+
+void test_json_todo(void) {
+    todo_t todo;
+    memset(&todo, 0, sizeof(todo));
+    todo.id = 7;
+    todo.title = "Buy \"milk\"";
+    todo.title_len = strlen(todo.title);
+    todo.description = "2%";
+    todo.description_len = strlen(todo.description);
+    todo.completed = 1;
+    todo.created_at = 1700000000;
+    todo.updated_at = -1;
+
+    json_buf_t* buf = json_thread_buf();
+    assert(json_write_todo(buf, &todo, 0, 0) == 0);
+    assert_json(buf, "{\"id\":7,\"title\":\"Buy \\\"milk\\\"\",\"description\":\"2%\","
+                     "\"completed\":true,\"created_at\":1700000000,\"updated_at\":-1}");
+
+    buf = json_thread_buf();
+    assert(json_write_todo(buf, &todo, 1, 0) == 0);
+    assert_json(buf, "{\n  \"id\": 7,\n  \"title\": \"Buy \\\"milk\\\"\",\n  \"description\": \"2%\",\n"
+                     "  \"completed\": true,\n  \"created_at\": 1700000000,\n  \"updated_at\": -1\n}");
+}
+
+void test_json_search_hit(void) {
+    todo_search_hit_t hit;
+    memset(&hit, 0, sizeof(hit));
+    hit.todo.id = 3;
+    hit.todo.title = "Buy milk";
+    hit.todo.title_len = strlen(hit.todo.title);
+    hit.todo.description = "";
+    hit.rank = -1.5;
+    hit.title_snippet = "Buy <mark>milk</mark>";
+    hit.title_snippet_len = strlen(hit.title_snippet);
+    hit.description_snippet = "";
+
+    json_buf_t* buf = json_thread_buf();
+    assert(json_write_search_hit(buf, &hit, 0, 0) == 0);
+    assert_json(buf, "{\"id\":3,\"title\":\"Buy milk\",\"description\":\"\",\"completed\":false,"
+                     "\"created_at\":0,\"updated_at\":0,\"rank\":-1.5,"
+                     "\"title_snippet\":\"Buy <mark>milk</mark>\",\"description_snippet\":\"\"}");
+}
+
+static int parse_todo(const char* json, todo_input_t* input, char* storage, size_t size) {
+    size_t len = strlen(json);
+    assert(len < size);
+    memcpy(storage, json, len + 1);
+
+    json_reader_t reader;
+    json_reader_init(&reader, storage, len);
+    if (json_read_todo(&reader, input) != 0) {
+        return -1;
+    }
+    return json_reader_finish(&reader);
+}
+
+void test_json_read_todo(void) {
+    char storage[512];
+    todo_input_t input;
+
+    assert(parse_todo(" { \"title\" : \"Buy\\n \\\"milk\\\"\", \"description\":\"caf\\u00e9 \\ud83d\\ude00\","
+                      " \"completed\": true, \"extra\": [1, -2.5e3, {\"a\": null}, false] } ",
+                      &input, storage, sizeof(storage)) == 0);
+    assert(strcmp(input.title, "Buy\n \"milk\"") == 0);
+    assert(strcmp(input.description, "caf\xc3\xa9 \xf0\x9f\x98\x80") == 0);
+    assert(input.has_completed && input.completed == 1);
+
+    // Wrong types are skipped rather than rejected, leaving the field unset
+    assert(parse_todo("{\"title\": 5, \"description\": \"d\", \"completed\": \"yes\"}",
+                      &input, storage, sizeof(storage)) == 0);
+    assert(input.title == NULL);
+    assert(strcmp(input.description, "d") == 0);
+    assert(!input.has_completed);
+
+    assert(parse_todo("{}", &input, storage, sizeof(storage)) == 0);
+
+    // Imports carry timestamps as 64-bit integers
+    assert(parse_todo("{\"title\": \"t\", \"created_at\": 4102444800, \"updated_at\": -1}",
+                      &input, storage, sizeof(storage)) == 0);
+    assert(input.has_created_at && input.created_at == 4102444800LL);
+    assert(input.has_updated_at && input.updated_at == -1);
+    assert(parse_todo("{\"created_at\": 9223372036854775808}", &input, storage, sizeof(storage)) != 0);
+
+    // Malformed documents
+    const char* invalid[] = {
+        "", "{", "[]", "{\"title\"}", "{\"title\": \"a\",}", "{\"title\": \"a\"} x",
+        "{\"title\": \"\\u0000\"}", "{\"title\": \"\\ud800\"}", "{\"title\": \"\\q\"}",
+        "{\"title\": \"bad \xff\"}", "{\"title\": 01}", "{\"title\": tru}",
+        "{\"a\": [[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]}",
+    };
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        assert(parse_todo(invalid[i], &input, storage, sizeof(storage)) != 0);
+    }
+}
+
+void test_json_read_batch(void) {
+    char storage[512];
+    const char* json = "[ {\"op\": \"create\", \"title\": \"a\", \"description\": \"b\"},"
+                       " {\"op\": \"delete\", \"id\": 42}, {\"ids\": [1, 2 ,3], \"completed\": false} ]";
+    size_t len = strlen(json);
+    memcpy(storage, json, len + 1);
+
+    json_reader_t reader;
+    todo_input_t input;
+    json_reader_init(&reader, storage, len);
+    assert(json_array_begin(&reader) == 0);
+
+    assert(json_array_next(&reader, 0) == 1);
+    assert(json_read_todo(&reader, &input) == 0);
+    assert(strcmp(input.op, "create") == 0 && strcmp(input.title, "a") == 0 && !input.has_id);
+
+    assert(json_array_next(&reader, 1) == 1);
+    assert(json_read_todo(&reader, &input) == 0);
+    assert(strcmp(input.op, "delete") == 0 && input.has_id && input.id == 42);
+
+    assert(json_array_next(&reader, 2) == 1);
+    assert(json_read_todo(&reader, &input) == 0);
+    assert(input.has_ids && input.has_completed && input.completed == 0);
+
+    // The ids array can be counted and then read
+    json_reader_t ids = input.ids;
+    assert(json_read_ids(&ids, NULL, 10) == 3);
+    int values[3];
+    ids = input.ids;
+    assert(json_read_ids(&ids, values, 3) == 3);
+    assert(values[0] == 1 && values[1] == 2 && values[2] == 3);
+    ids = input.ids;
+    assert(json_read_ids(&ids, NULL, 2) == -1);
+
+    assert(json_array_next(&reader, 3) == 0);
+    assert(json_reader_finish(&reader) == 0);
+
+    // Ids must be positive integers
+    const char* invalid[] = {"[1.5]", "[0]", "[-3]", "[\"1\"]", "[1,]", "[99999999999]", "[1 2]"};
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        len = strlen(invalid[i]);
+        memcpy(storage, invalid[i], len + 1);
+        json_reader_init(&reader, storage, len);
+        assert(json_read_ids(&reader, NULL, 10) == -1);
+    }
+}
+
+static atomic_int resumes;
+
+static void count_suspend(void* ctx) {
+    (void)ctx;
+}
+
+static void count_resume(void* ctx) {
+    (void)ctx;
+    atomic_fetch_add(&resumes, 1);
+}
+
+// Reads a parked stream until needle shows up, waiting for each resume
+static void read_stream_until(struct ResponseData* response, const char* needle, char* text, size_t size) {
+    size_t len = strlen(text);
+    while (!strstr(text, needle)) {
+        int before = atomic_load(&resumes);
+        ssize_t n = response->stream(response->stream_state, len, text + len, size - len - 1);
+        assert(n >= 0);
+        len += (size_t)n;
+        text[len] = '\0';
+        for (int i = 0; n == 0 && atomic_load(&resumes) == before; i++) {
+            assert(i < 5000);
+            usleep(1000);
+        }
+    }
+}
+
+void test_change_feed(void) {
+    char text[4096] = "";
+    assert(db_init(":memory:") == 0);
+    assert(change_feed_start() == 0);
+
+    // Without a waker a poll blocks in its reader until there is a change
+    struct ResponseData poll = {0};
+    handle_list_changes(&(struct RequestContext){.response = &poll}, 0, 10, 5, 0);
+    assert(poll.stream && !poll.data);
+    assert(todo_create("Watched", "") == 0);
+    ssize_t n = poll.stream(poll.stream_state, 0, text, sizeof(text) - 1);
+    assert(n > 0);
+    text[n] = '\0';
+    assert(strncmp(text, "{\"changes\":[{\"seq\":1,\"op\":\"create\",\"id\":1,", 42) == 0);
+    assert(strstr(text, "],\"last_seq\":1}"));
+    assert(poll.stream(poll.stream_state, (uint64_t)n, text, sizeof(text)) == RESPONSE_STREAM_END);
+    poll.stream_free(poll.stream_state);
+
+    // With changes already there the page comes back directly
+    struct ResponseData page = {0};
+    handle_list_changes(&(struct RequestContext){.response = &page}, 0, 10, 5, 0);
+    assert(!page.stream && page.borrowed);
+    assert(page.size == (size_t)n && memcmp(page.data, "{\"changes\":[{\"seq\":1,", 21) == 0);
+
+    // Event streams start at the given sequence and park between changes
+    struct ResponseData events = {0};
+    handle_list_changes(&(struct RequestContext){.response = &events}, 0, 10, 0, 1);
+    assert(events.stream && strcmp(events.content_type, "text/event-stream") == 0);
+    response_waker_t waker = {count_suspend, count_resume, NULL};
+    events.stream_set_waker(events.stream_state, &waker);
+
+    text[0] = '\0';
+    read_stream_until(&events, "id: 1\nevent: create\ndata: {\"seq\":1,", text, sizeof(text));
+    assert(strncmp(text, "retry: ", 7) == 0);
+    assert(todo_update(1, "Watched", "closely", 1) == 0);
+    read_stream_until(&events, "id: 2\nevent: update\n", text, sizeof(text));
+    assert(strstr(text, "\"description\":\"closely\",\"completed\":true,"));
+
+    // Stopping ends the stream and refuses new subscribers
+    change_feed_stop();
+    n = events.stream(events.stream_state, 0, text, sizeof(text));
+    assert(n == RESPONSE_STREAM_END);
+    events.stream_free(events.stream_state);
+
+    struct ResponseData refused = {0};
+    handle_list_changes(&(struct RequestContext){.response = &refused}, -1, 10, 0, 1);
+    assert(refused.status == 503);
+    free(refused.data);
+
+    // Once the log is pruned even since=0 is told to reload, and a poll
+    // without since starts from the latest change
+    db_param_t params[] = {DB_INT(2)};
+    assert(db_execute_query("DELETE FROM todo_changes WHERE seq < ?", params, 1, NULL) == 0);
+    struct ResponseData gone = {0};
+    handle_list_changes(&(struct RequestContext){.response = &gone}, 0, 10, 0, 0);
+    assert(gone.status == 410);
+    free(gone.data);
+
+    struct ResponseData current = {0};
+    handle_list_changes(&(struct RequestContext){.response = &current}, -1, 10, 0, 0);
+    assert(current.status == 0 && current.borrowed);
+    assert(current.size == 27 && memcmp(current.data, "{\"changes\":[],\"last_seq\":2}", 27) == 0);
+
+    db_cleanup();
+}
+
+void test_compress_negotiate(void) {
+    assert(compress_negotiate(NULL) == CONTENT_ENCODING_IDENTITY);
+    assert(compress_negotiate("") == CONTENT_ENCODING_IDENTITY);
+    assert(compress_negotiate("identity") == CONTENT_ENCODING_IDENTITY);
+    assert(compress_negotiate("gzip, deflate") == CONTENT_ENCODING_GZIP);
+    assert(compress_negotiate("deflate") == CONTENT_ENCODING_DEFLATE);
+    assert(compress_negotiate("x-gzip") == CONTENT_ENCODING_GZIP);
+    assert(compress_negotiate("GZIP;q=0.5, deflate;q=0.8") == CONTENT_ENCODING_DEFLATE);
+    assert(compress_negotiate("gzip;q=0, deflate;q=0") == CONTENT_ENCODING_IDENTITY);
+    assert(compress_negotiate("*;q=0.1, gzip;q=0") == CONTENT_ENCODING_DEFLATE ||
+           compress_negotiate("*;q=0.1, gzip;q=0") == CONTENT_ENCODING_ZSTD);
+    assert(compress_negotiate("br") == CONTENT_ENCODING_IDENTITY);
+    assert(strcmp(compress_encoding_name(CONTENT_ENCODING_GZIP), "gzip") == 0);
+    assert(compress_encoding_name(CONTENT_ENCODING_IDENTITY) == NULL);
+}
+
+// Inflates gzip or zlib data, telling the two apart by their headers
+static size_t inflate_all(const char* data, size_t len, char* out, size_t size) {
+    z_stream stream = {0};
+    assert(inflateInit2(&stream, 15 + 32) == Z_OK);
+    stream.next_in = (Bytef*)data;
+    stream.avail_in = (uInt)len;
+    stream.next_out = (Bytef*)out;
+    stream.avail_out = (uInt)size;
+    assert(inflate(&stream, Z_FINISH) == Z_STREAM_END);
+    size_t written = size - stream.avail_out;
+    inflateEnd(&stream);
+    return written;
+}
+
+// Hands the source out in pieces so that the wrapper has to refill
+static ssize_t read_source(void* state, uint64_t pos, char* buf, size_t max) {
+    const char* source = state;
+    size_t len = strlen(source);
+    if (pos >= len) {
+        return RESPONSE_STREAM_END;
+    }
+    size_t n = len - pos < 1000 ? len - pos : 1000;
+    if (n > max) n = max;
+    memcpy(buf, source + pos, n);
+    return (ssize_t)n;
+}
+
+void test_compress(void) {
+    static char body[100000];
+    static char inflated[sizeof(body)];
+    static const char row[] = "{\"id\":1,\"title\":\"Compressible\"},";
+    for (size_t i = 0; i < sizeof(body) - 1; i++) {
+        body[i] = row[i % (sizeof(row) - 1)];
+    }
+
+    char* data;
+    size_t size;
+    assert(compress_buffer(CONTENT_ENCODING_GZIP, body, strlen(body), &data, &size) == 0);
+    assert(size < strlen(body) / 10 && (unsigned char)data[0] == 0x1f);
+    assert(inflate_all(data, size, inflated, sizeof(inflated)) == strlen(body));
+    assert(memcmp(inflated, body, strlen(body)) == 0);
+    free(data);
+
+    // Streams are compressed as they are read, and captured for the cache
+    assert(compress_cache_init(256 * 1024) == 0);
+    struct ResponseData response = {0};
+    response.stream = read_source;
+    response.stream_state = body;
+    assert(compress_wrap_stream(&response, CONTENT_ENCODING_DEFLATE, "key") == 0);
+
+    static char compressed[sizeof(body)];
+    size_t len = 0;
+    ssize_t n;
+    while ((n = response.stream(response.stream_state, len, compressed + len, 100)) != RESPONSE_STREAM_END) {
+        assert(n > 0);
+        len += (size_t)n;
+    }
+    response.stream_free(response.stream_state);
+    assert(inflate_all(compressed, len, inflated, sizeof(inflated)) == strlen(body));
+    assert(memcmp(inflated, body, strlen(body)) == 0);
+
+    assert(compress_cache_get("key", CONTENT_ENCODING_GZIP, &data, &size) == -1);
+    assert(compress_cache_get("key", CONTENT_ENCODING_DEFLATE, &data, &size) == 0);
+    assert(size == len && memcmp(data, compressed, len) == 0);
+    free(data);
+
+    // Entries over a quarter of the budget are not kept
+    compress_cache_put("large", CONTENT_ENCODING_GZIP, body, sizeof(body));
+    assert(compress_cache_get("large", CONTENT_ENCODING_GZIP, &data, &size) == -1);
+    compress_cache_cleanup();
+    assert(compress_cache_get("key", CONTENT_ENCODING_DEFLATE, &data, &size) == -1);
+}
+
+void test_router(void) {
+    route_match_t match;
+    char allow[64];
+
+    assert(http_method_parse("GET") == HTTP_METHOD_GET);
+    assert(http_method_parse("PATCH") == HTTP_METHOD_PATCH);
+    assert(http_method_parse("get") == HTTP_METHOD_UNKNOWN);
+
+    assert(router_match(HTTP_METHOD_GET, "/todos", &match) == 0);
+    assert(match.route == METRICS_ROUTE_LIST_TODOS && match.param_count == 0);
+    assert(router_match(HTTP_METHOD_PATCH, "/todos", &match) == 0 && match.route == METRICS_ROUTE_PATCH_TODOS);
+    assert(router_match(HTTP_METHOD_POST, "/todos/batch", &match) == 0 && match.route == METRICS_ROUTE_BATCH_TODOS);
+    assert(router_match(HTTP_METHOD_GET, "/metrics", &match) == 0 && match.route == METRICS_ROUTE_METRICS);
+    assert(router_match(HTTP_METHOD_GET, "/todos/export", &match) == 0 && match.route == METRICS_ROUTE_EXPORT_TODOS);
+    assert(router_match(HTTP_METHOD_POST, "/todos/import", &match) == 0 && match.route == METRICS_ROUTE_IMPORT_TODOS);
+
+    // Literal segments win over the id parameter
+    assert(router_match(HTTP_METHOD_GET, "/todos/search", &match) == 0);
+    assert(match.route == METRICS_ROUTE_SEARCH_TODOS);
+    assert(router_match(HTTP_METHOD_PUT, "/todos/42", &match) == 0);
+    assert(match.route == METRICS_ROUTE_UPDATE_TODO && match.param_count == 1 && match.params[0] == 42);
+    assert(router_match(HTTP_METHOD_DELETE, "/todos/2147483647", &match) == 0 && match.params[0] == 2147483647);
+
+    // Ids must be positive decimal integers that fit an int
+    assert(router_match(HTTP_METHOD_GET, "/todos/abc", &match) != 0 && match.status == 400);
+    assert(router_match(HTTP_METHOD_GET, "/todos/0", &match) != 0 && match.status == 400);
+    assert(router_match(HTTP_METHOD_GET, "/todos/-1", &match) != 0 && match.status == 400);
+    assert(router_match(HTTP_METHOD_GET, "/todos/12x", &match) != 0 && match.status == 400);
+    assert(router_match(HTTP_METHOD_GET, "/todos/2147483648", &match) != 0 && match.status == 400);
+    assert(match.route == METRICS_ROUTE_OTHER);
+
+    assert(router_match(HTTP_METHOD_GET, "/", &match) != 0 && match.status == 404);
+    assert(router_match(HTTP_METHOD_GET, "/todo", &match) != 0 && match.status == 404);
+    assert(router_match(HTTP_METHOD_GET, "/todos/", &match) != 0 && match.status == 404);
+    assert(router_match(HTTP_METHOD_GET, "/todos/1/extra", &match) != 0 && match.status == 404);
+    assert(router_match(HTTP_METHOD_GET, "/stats/", &match) != 0 && match.status == 404);
+
+    assert(router_match(HTTP_METHOD_PATCH, "/todos/1", &match) != 0 && match.status == 405);
+    router_format_allow(match.allowed, allow, sizeof(allow));
+    assert(strcmp(allow, "GET, PUT, DELETE") == 0);
+    assert(router_match(HTTP_METHOD_UNKNOWN, "/todos", &match) != 0 && match.status == 405);
+    router_format_allow(match.allowed, allow, sizeof(allow));
+    assert(strcmp(allow, "GET, POST, DELETE, PATCH") == 0);
+    // Wrong method beats a bad id
+    assert(router_match(HTTP_METHOD_POST, "/todos/abc", &match) != 0 && match.status == 405);
+}
+
+void test_admission(void) {
+    const uint64_t second = 1000000000ull;
+    admission_config_t config;
+    unsigned int retry_after = 0;
+
+    admission_config_defaults(&config);
+    assert(admission_init(&config) == 0);
+    for (int i = 0; i < 1000; i++) {
+        assert(admission_check_rate(1, second, &retry_after) == 0);
+    }
+    admission_cleanup();
+
+    // A burst of 2 at 10/s: the third request waits for the next token
+    config.client_rate = 10;
+    config.client_burst = 2;
+    assert(admission_init(&config) == 0);
+    uint64_t now = 5 * second;
+    assert(admission_check_rate(1, now, &retry_after) == 0);
+    assert(admission_check_rate(1, now, &retry_after) == 0);
+    assert(admission_check_rate(1, now, &retry_after) == 429 && retry_after == 1);
+    assert(admission_check_rate(2, now, &retry_after) == 0);
+    assert(admission_check_rate(1, now + second / 10, &retry_after) == 0);
+    assert(admission_check_rate(1, now + second / 10, &retry_after) == 429);
+    admission_cleanup();
+
+    // The global bucket is shared by everyone and answers 503
+    admission_config_defaults(&config);
+    config.rate = 1;
+    config.burst = 3;
+    assert(admission_init(&config) == 0);
+    assert(admission_check_rate(1, now, &retry_after) == 0);
+    assert(admission_check_rate(2, now, &retry_after) == 0);
+    assert(admission_check_rate(3, now, &retry_after) == 0);
+    assert(admission_check_rate(4, now, &retry_after) == 503 && retry_after == 1);
+    assert(admission_check_rate(4, now + second, &retry_after) == 0);
+    admission_cleanup();
+
+    // Addresses hash without their port
+    struct sockaddr_in a = {.sin_family = AF_INET, .sin_port = htons(1000), .sin_addr.s_addr = htonl(0x7F000001)};
+    struct sockaddr_in b = a;
+    b.sin_port = htons(2000);
+    assert(admission_client_key((struct sockaddr*)&a) == admission_client_key((struct sockaddr*)&b));
+    b.sin_addr.s_addr = htonl(0x7F000002);
+    assert(admission_client_key((struct sockaddr*)&a) != admission_client_key((struct sockaddr*)&b));
+    assert(admission_client_key(NULL) != 0);
+
+    // In-flight caps are per class; the change feed never counts
+    admission_config_defaults(&config);
+    config.max_in_flight[ADMISSION_WRITE] = 1;
+    config.shed_delay_ms = 100;
+    assert(admission_init(&config) == 0);
+    assert(admission_acquire(ADMISSION_WRITE, now, &retry_after) == 0);
+    assert(admission_acquire(ADMISSION_WRITE, now, &retry_after) == 503);
+    assert(admission_acquire(ADMISSION_LIST, now, &retry_after) == 0);
+    admission_release(ADMISSION_LIST);
+    assert(admission_acquire(ADMISSION_UNLIMITED, now, &retry_after) == 0);
+    admission_release(ADMISSION_WRITE);
+    assert(admission_acquire(ADMISSION_WRITE, now, &retry_after) == 0);
+    admission_release(ADMISSION_WRITE);
+
+    // Queue delay above the target sheds lists and writes but not reads,
+    // until samples stop arriving for long enough to look again
+    for (int i = 0; i < 50; i++) {
+        admission_record_queue_delay(second / 2, now);
+    }
+    assert(admission_acquire(ADMISSION_LIST, now, &retry_after) == 503 && retry_after == 1);
+    assert(admission_acquire(ADMISSION_WRITE, now, &retry_after) == 503);
+    assert(admission_acquire(ADMISSION_READ, now, &retry_after) == 0);
+    admission_release(ADMISSION_READ);
+    assert(admission_acquire(ADMISSION_LIST, now + second, &retry_after) == 0);
+    admission_release(ADMISSION_LIST);
+    admission_cleanup();
+}
+
+// Reads a whole streamed response into buf, in small pieces
+static void drain_stream(struct ResponseData* response, json_buf_t* buf) {
+    char chunk[100];
+    ssize_t len;
+    while ((len = response->stream(response->stream_state, buf->len, chunk, sizeof(chunk))) >= 0) {
+        assert(json_buf_append(buf, chunk, (size_t)len) == 0);
+    }
+    assert(len == RESPONSE_STREAM_END);
+    response->stream_free(response->stream_state);
+}
+
+static void export_todos(int binary, json_buf_t* out) {
+    arena_t arena;
+    arena_init(&arena);
+    struct ResponseData response = {0};
+    struct RequestContext request = {.arena = &arena, .response = &response};
+    handle_export_todos(&request, binary);
+    assert(response.stream && strcmp(response.content_type, binary ? "application/octet-stream"
+                                                                     : "application/x-ndjson") == 0);
+    json_buf_reset(out);
+    drain_stream(&response, out);
+    arena_destroy(&arena);
+}
+
+// Runs while its page holds the only connection, so the stream is refused one
+static int refuse_stream_read(const todo_t* todo, void* ctx) {
+    (void)todo;
+    struct ResponseData* response = ctx;
+    char chunk[100];
+    todo_set_reads_nowait(1);
+    assert(response->stream(response->stream_state, 0, chunk, sizeof(chunk)) == RESPONSE_STREAM_ERROR);
+    todo_set_reads_nowait(0);
+    assert(todo_take_refused_read() == 1);
+    return 0;
+}
+
+// Uploads the body in small chunks, so lines and records arrive split
+static int import_todos(int binary, const json_buf_t* body, char* reply, size_t size) {
+    arena_t arena;
+    arena_init(&arena);
+    struct ImportUpload* upload = body->len ? import_upload_open(binary, 512) : NULL;
+    for (size_t pos = 0; pos < body->len; pos += 7) {
+        size_t chunk = body->len - pos < 7 ? body->len - pos : 7;
+        import_upload_write(upload, body->data + pos, chunk);
+    }
+    struct ResponseData response = {0};
+    struct RequestContext request = {.arena = &arena, .response = &response};
+    handle_import_todos(&request, upload);
+    snprintf(reply, size, "%.*s", (int)response.size, response.data);
+    if (!response.borrowed) free(response.data);
+    import_upload_free(upload);
+    arena_destroy(&arena);
+    return response.status ? response.status : 200;
+}
+
+void test_export_import(void) {
+    json_buf_t ndjson, binary, again;
+    json_buf_init(&ndjson);
+    json_buf_init(&binary);
+    json_buf_init(&again);
+    char reply[128];
+    arena_t arena;
+    arena_init(&arena);
+
+    assert(db_init(":memory:") == 0);
+    for (int i = 0; i < 300; i++) {
+        assert(todo_create(i % 2 ? "Odd \"quoted\"" : "Even", i % 3 ? "" : "Third\nline") == 0);
+    }
+    assert(todo_update(7, "Done", "Finished", 1) == 0);
+    export_todos(0, &ndjson);
+    export_todos(1, &binary);
+
+    // A refused read can be repeated and loses nothing, header included
+    struct ResponseData retried = {0};
+    handle_export_todos(&(struct RequestContext){.arena = &arena, .response = &retried}, 1);
+    todo_query_t first = {.limit = 1};
+    assert(todo_each(&first, refuse_stream_read, &retried) == 1);
+    drain_stream(&retried, &again);
+    assert(again.len == binary.len && memcmp(again.data, binary.data, binary.len) == 0);
+    db_cleanup();
+
+    // Either format restores the same table, ids and timestamps included
+    for (int format = 0; format < 2; format++) {
+        assert(db_init(":memory:") == 0);
+        assert(import_todos(format, format ? &binary : &ndjson, reply, sizeof(reply)) == 200);
+        assert(strcmp(reply, "{\"imported\": 300}") == 0);
+        todo_t todo;
+        assert(todo_get(7, &todo, &arena) == 0 && todo.completed == 1 && strcmp(todo.title, "Done") == 0);
+        assert(todo_get(298, &todo, &arena) == 0 && strcmp(todo.description, "Third\nline") == 0);
+        export_todos(0, &again);
+        assert(again.len == ndjson.len && memcmp(again.data, ndjson.data, ndjson.len) == 0);
+        db_cleanup();
+    }
+
+    // NDJSON lines need only a title; anything malformed loads nothing
+    assert(db_init(":memory:") == 0);
+    json_buf_reset(&again);
+    assert(json_buf_printf(&again, "{\"title\": \"Minimal\"}\n{\"id\": 9, \"title\": \"Kept\", \"created_at\": 5}\n") == 0);
+    assert(import_todos(0, &again, reply, sizeof(reply)) == 200);
+    todo_t todo;
+    assert(todo_get(9, &todo, &arena) == 0 && todo.created_at == 5 && todo.updated_at == 5);
+    assert(todo_get(1, &todo, &arena) == 0 && todo.description_len == 0);
+    json_buf_reset(&again);
+    assert(json_buf_printf(&again, "{\"id\": 20, \"title\": \"Fine\"}\n{\"description\": \"No title\"}\n") == 0);
+    assert(import_todos(0, &again, reply, sizeof(reply)) == 400);
+    assert(todo_get(20, &todo, &arena) != 0);
+    binary.len -= 1;
+    assert(import_todos(1, &binary, reply, sizeof(reply)) == 400);
+    // Each line or record must fit the upload's carry, the last line need
+    // not end in a newline, and a later line for an id wins
+    json_buf_reset(&again);
+    assert(json_buf_printf(&again, "{\"id\": 21, \"title\": \"%0600d\"}\n", 0) == 0);
+    assert(import_todos(0, &again, reply, sizeof(reply)) == 413);
+    assert(todo_get(21, &todo, &arena) != 0);
+    json_buf_reset(&again);
+    assert(json_buf_printf(&again, "{\"id\": 22, \"title\": \"First\"}\n{\"id\": 22, \"title\": \"Second\"}") == 0);
+    assert(import_todos(0, &again, reply, sizeof(reply)) == 200);
+    assert(strcmp(reply, "{\"imported\": 2}") == 0);
+    assert(todo_get(22, &todo, &arena) == 0 && strcmp(todo.title, "Second") == 0);
+    db_cleanup();
+
+    arena_destroy(&arena);
+    json_buf_free(&ndjson);
+    json_buf_free(&binary);
+    json_buf_free(&again);
+}
+
+int main(void) {
+    printf("Running HTTP tests...\n");
+
+    test_json_escape();
+    test_json_todo();
+    test_json_search_hit();
+    test_json_read_todo();
+    test_json_read_batch();
+    test_change_feed();
+    test_compress_negotiate();
+    test_compress();
+    test_router();
+    test_admission();
+    test_export_import();
+
+    printf("All HTTP tests passed!\n");
+    return EXIT_SUCCESS;
+}
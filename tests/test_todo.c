@@ -1,52 +1,82 @@
 #include "../src/core/todo.h"
 #include "../src/db/database.h"
+#include "../src/core/cache.h"
+#include "../src/core/metrics.h"
+#include "../src/core/executor.h"
+#include "../src/core/snapshot.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <sqlite3.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
 
 void test_create_todo(void) {
+    arena_t arena;
+    arena_init(&arena);
     assert(db_init(":memory:") == 0);
     
     assert(todo_create("Test Todo", "Test Description") == 0);
     
     todo_t todo;
-    assert(todo_get(1, &todo) == 0);
+    assert(todo_get(1, &todo, &arena) == 0);
     assert(strcmp(todo.title, "Test Todo") == 0);
     assert(strcmp(todo.description, "Test Description") == 0);
+    assert(todo.title_len == strlen("Test Todo"));
     assert(todo.completed == 0);
+
+    // Long values come back whole
+    char long_text[5000];
+    memset(long_text, 'x', sizeof(long_text) - 1);
+    long_text[sizeof(long_text) - 1] = '\0';
+    assert(todo_create(long_text, long_text) == 0);
+    assert(todo_get(2, &todo, &arena) == 0);
+    assert(todo.title_len == sizeof(long_text) - 1 && strcmp(todo.title, long_text) == 0);
+    assert(todo.description_len == sizeof(long_text) - 1);
     
+    arena_destroy(&arena);
     db_cleanup();
 }
 
 void test_update_todo(void) {
+    arena_t arena;
+    arena_init(&arena);
     assert(db_init(":memory:") == 0);
     
     assert(todo_create("Test Todo", "Test Description") == 0);
     assert(todo_update(1, "Updated Todo", "Updated Description", 1) == 0);
     
     todo_t todo;
-    assert(todo_get(1, &todo) == 0);
+    assert(todo_get(1, &todo, &arena) == 0);
     assert(strcmp(todo.title, "Updated Todo") == 0);
     assert(strcmp(todo.description, "Updated Description") == 0);
     assert(todo.completed == 1);
     
+    arena_destroy(&arena);
     db_cleanup();
 }
 
 void test_delete_todo(void) {
+    arena_t arena;
+    arena_init(&arena);
     assert(db_init(":memory:") == 0);
     
     assert(todo_create("Test Todo", "Test Description") == 0);
     assert(todo_delete(1) == 0);
     
     todo_t todo;
-    assert(todo_get(1, &todo) != 0);
+    assert(todo_get(1, &todo, &arena) != 0);
     
+    arena_destroy(&arena);
     db_cleanup();
 }
 
 void test_list_todos(void) {
+    arena_t arena;
+    arena_init(&arena);
     assert(db_init(":memory:") == 0);
     
     assert(todo_create("Todo 1", "Description 1") == 0);
@@ -54,13 +84,1108 @@ void test_list_todos(void) {
     
     todo_t* todos = NULL;
     int count = 0;
-    assert(todo_list(&todos, &count) == 0);
+    assert(todo_list(&todos, &count, &arena) == 0);
     assert(count == 2);
     assert(strcmp(todos[0].title, "Todo 1") == 0);
     assert(strcmp(todos[1].title, "Todo 2") == 0);
     
-    todo_free_list(todos);
+    arena_destroy(&arena);
+    db_cleanup();
+}
+
+static int collect_ids(const todo_t* todo, void* ctx) {
+    int* ids = ctx;
+    ids[++ids[0]] = todo->id;
+    return 0;
+}
+
+static int collect_three_ids(const todo_t* todo, void* ctx) {
+    collect_ids(todo, ctx);
+    return ((int*)ctx)[0] == 3;
+}
+
+void test_paginate_todos(void) {
+    assert(db_init(":memory:") == 0);
+
+    for (int i = 0; i < 5; i++) {
+        assert(todo_create("Paged", "Keyset") == 0);
+    }
+    assert(todo_delete(2) == 0);
+
+    // ids[0] holds the number of ids collected
+    int ids[8] = {0};
+    todo_query_t query = {.limit = 2};
+    assert(todo_each(&query, collect_ids, ids) == 2);
+    assert(ids[0] == 2 && ids[1] == 1 && ids[2] == 3);
+
+    query.after_id = ids[2];
+    assert(todo_each(&query, collect_ids, ids) == 2);
+    assert(ids[0] == 4 && ids[3] == 4 && ids[4] == 5);
+
+    query.after_id = 5;
+    assert(todo_each(&query, collect_ids, ids) == 0);
+
+    // A visitor can stop the walk early
+    memset(ids, 0, sizeof(ids));
+    query.after_id = 0;
+    query.limit = 0;
+    assert(todo_each(&query, collect_three_ids, ids) == 3);
+    assert(ids[0] == 3 && ids[3] == 4);
+
+    db_cleanup();
+}
+
+// Copies of the hits from one search, snippets NUL-terminated
+struct SearchResults {
+    int count;
+    todo_search_hit_t hits[8];
+    char snippets[8][2][128];
+};
+
+static int collect_hit(const todo_search_hit_t* hit, void* ctx) {
+    struct SearchResults* results = ctx;
+    int n = results->count++;
+    results->hits[n] = *hit;
+    snprintf(results->snippets[n][0], 128, "%.*s", (int)hit->title_snippet_len, hit->title_snippet);
+    snprintf(results->snippets[n][1], 128, "%.*s", (int)hit->description_snippet_len, hit->description_snippet);
+    return 0;
+}
+
+static int search(const char* text, int limit, int offset, struct SearchResults* results) {
+    todo_search_t query = {text, limit, offset};
+    memset(results, 0, sizeof(*results));
+    return todo_search(&query, collect_hit, results);
+}
+
+void test_search(void) {
+    assert(db_init(":memory:") == 0);
+
+    struct SearchResults results;
+    assert(todo_create("Buy milk", "From the caf\xc3\xa9 on the corner") == 0);
+    assert(todo_create("Write report", "Include the milk numbers for the quarter") == 0);
+    assert(todo_create("Walk the dog", "") == 0);
+
+    // Title matches outrank description matches
+    assert(search("milk", 8, 0, &results) == 2);
+    assert(results.hits[0].todo.id == 1 && results.hits[1].todo.id == 2);
+    assert(results.hits[0].rank < results.hits[1].rank);
+    assert(strcmp(results.snippets[0][0], "Buy <mark>milk</mark>") == 0);
+    assert(strstr(results.snippets[1][1], "the <mark>milk</mark> numbers"));
+
+    // Diacritics fold, prefixes match and every term is required
+    assert(search("cafe", 8, 0, &results) == 1 && results.hits[0].todo.id == 1);
+    assert(search("quart*", 8, 0, &results) == 1 && results.hits[0].todo.id == 2);
+    assert(search("milk corner", 8, 0, &results) == 1 && results.hits[0].todo.id == 1);
+
+    // Query syntax in the input is searched for, not interpreted
+    assert(search("milk OR dog", 8, 0, &results) == 0);
+    assert(search("\"unbalanced NEAR(", 8, 0, &results) == 0);
+    assert(search("*", 8, 0, &results) == 0);
+
+    // The index follows updates and deletes
+    assert(todo_update(3, "Milk the cow", "", 0) == 0);
+    assert(search("dog", 8, 0, &results) == 0);
+    assert(search("milk", 8, 0, &results) == 3);
+    assert(todo_delete(1) == 0);
+    assert(search("milk", 8, 0, &results) == 2);
+
+    assert(search("milk", 1, 1, &results) == 1);
+    assert(search("milk", 1, 2, &results) == 0);
+    assert(search("milk", 0, 0, &results) == -1);
+
+    db_cleanup();
+}
+
+struct ChangeLog {
+    int count;
+    long long seqs[8];
+    todo_change_op_t ops[8];
+    int ids[8];
+    int has_todo[8];
+};
+
+static int collect_change(const todo_change_t* change, void* ctx) {
+    struct ChangeLog* log = ctx;
+    log->seqs[log->count] = change->seq;
+    log->ops[log->count] = change->op;
+    log->ids[log->count] = change->id;
+    log->has_todo[log->count] = change->todo != NULL;
+    log->count++;
+    return 0;
+}
+
+static int changes_heard = 0;
+
+static void count_change(void) {
+    changes_heard++;
+}
+
+void test_changes(void) {
+    assert(db_init(":memory:") == 0);
+    todo_set_change_listener(count_change);
+
+    long long oldest, latest;
+    assert(todo_change_bounds(&oldest, &latest) == 0);
+    assert(oldest == 0 && latest == 0);
+
+    assert(todo_create("First", "") == 0);
+    assert(todo_create("Second", "") == 0);
+    assert(todo_update(1, "First", "edited", 1) == 0);
+    assert(todo_delete(2) == 0);
+
+    todo_op_t ops[] = {
+        {TODO_OP_CREATE, 0, "Third", "", 0},
+        {TODO_OP_PATCH, 1, NULL, NULL, 0},
+    };
+    todo_op_result_t results[2];
+    assert(todo_batch(ops, 2, results) == 0);
+    assert(changes_heard == 5);
+
+    struct ChangeLog log = {0};
+    assert(todo_changes(0, 8, collect_change, &log) == 6);
+    const todo_change_op_t expected[] = {
+        TODO_CHANGE_CREATE, TODO_CHANGE_CREATE, TODO_CHANGE_UPDATE,
+        TODO_CHANGE_DELETE, TODO_CHANGE_CREATE, TODO_CHANGE_UPDATE,
+    };
+    for (int i = 0; i < 6; i++) {
+        assert(log.seqs[i] == i + 1);
+        assert(log.ops[i] == expected[i]);
+    }
+    assert(log.ids[3] == 2 && !log.has_todo[3] && !log.has_todo[1]);
+    assert(log.ids[5] == 1 && log.has_todo[5]);
+
+    // Deltas only
+    memset(&log, 0, sizeof(log));
+    assert(todo_changes(4, 1, collect_change, &log) == 1);
+    assert(log.seqs[0] == 5 && log.ids[0] == 3);
+    assert(todo_changes(6, 8, collect_change, &log) == 0);
+
+    assert(todo_change_bounds(&oldest, &latest) == 0);
+    assert(oldest == 1 && latest == 6);
+    assert(todo_changes(-1, 8, collect_change, &log) == -1);
+
+    todo_set_change_listener(NULL);
+    db_cleanup();
+}
+
+void test_typed_params(void) {
+    arena_t arena;
+    arena_init(&arena);
+    assert(db_init(":memory:") == 0);
+
+    const char* insert =
+        "INSERT INTO todos (title, description, completed, created_at, updated_at) "
+        "VALUES (?, ?, ?, ?, ?)";
+
+    // Reuse the cached statement several times and check bindings do not leak
+    for (int i = 1; i <= 3; i++) {
+        db_param_t params[] = {
+            DB_TEXT_LEN("Typed title that is truncated", 11),
+            i == 2 ? DB_NULL() : DB_TEXT("With description"),
+            DB_INT(i % 2),
+            DB_INT(1000 + i),
+            DB_INT(2000 + i),
+        };
+        db_result_t result;
+        assert(db_execute_query(insert, params, 5, &result) == 0);
+        assert(result.last_insert_id == i);
+        assert(result.changes == 1);
+    }
+
+    todo_t todo;
+    assert(todo_get(2, &todo, &arena) == 0);
+    assert(strcmp(todo.title, "Typed title") == 0);
+    assert(todo.description[0] == '\0' && todo.description_len == 0);
+    assert(todo.completed == 0);
+    assert(todo.updated_at == 2002);
+
+    assert(todo_get(3, &todo, &arena) == 0);
+    assert(strcmp(todo.description, "With description") == 0);
+    assert(todo.completed == 1);
+
+    // Parameter count must match the statement
+    db_param_t too_few[] = { DB_INT(1) };
+    assert(db_execute_query(insert, too_few, 1, NULL) != 0);
+
+    arena_destroy(&arena);
+    db_cleanup();
+}
+
+#define POOL_TEST_DB "test_todo_pool.db"
+
+static void remove_pool_db(void) {
+    unlink(POOL_TEST_DB);
+    unlink(POOL_TEST_DB "-wal");
+    unlink(POOL_TEST_DB "-shm");
+}
+
+static int collect_page(const todo_t* todo, void* ctx) {
+    int* ids = ctx;
+    ids[++ids[0]] = todo->id;
+    return 0;
+}
+
+void test_filtered_queries(void) {
+    remove_pool_db();
+    assert(db_init(POOL_TEST_DB) == 0);
+
+    // id: completed, created_at, updated_at
+    const long long rows[][3] = {
+        {0, 100, 500}, {1, 200, 300}, {0, 300, 300}, {1, 400, 700}, {0, 500, 600}, {1, 600, 300},
+    };
+    for (int i = 0; i < 6; i++) {
+        db_param_t params[] = {
+            DB_TEXT("Filtered"), DB_TEXT("Query"), DB_INT(rows[i][0]), DB_INT(rows[i][1]), DB_INT(rows[i][2]),
+        };
+        assert(db_execute_query("INSERT INTO todos (title, description, completed, created_at, updated_at) "
+                                "VALUES (?, ?, ?, ?, ?)", params, 5, NULL) == 0);
+    }
+
+    int ids[8] = {0};
+    todo_query_t query = {0};
+    query.completed = TODO_COMPLETED_TRUE;
+    assert(todo_each(&query, collect_page, ids) == 3);
+    assert(ids[1] == 2 && ids[2] == 4 && ids[3] == 6);
+
+    memset(ids, 0, sizeof(ids));
+    memset(&query, 0, sizeof(query));
+    query.updated_since = 500;
+    query.created_before = 500;
+    assert(todo_each(&query, collect_page, ids) == 2);
+    assert(ids[1] == 1 && ids[2] == 4);
+
+    // Descending id order pages downwards
+    memset(ids, 0, sizeof(ids));
+    memset(&query, 0, sizeof(query));
+    query.descending = 1;
+    query.limit = 2;
+    query.after_id = 5;
+    assert(todo_each(&query, collect_page, ids) == 2);
+    assert(ids[1] == 4 && ids[2] == 3);
+
+    // Paging by updated_at breaks ties by id and never skips or repeats a row
+    memset(ids, 0, sizeof(ids));
+    memset(&query, 0, sizeof(query));
+    query.sort = TODO_SORT_UPDATED_AT;
+    query.limit = 2;
+    int expected[] = {2, 3, 6, 1, 5, 4};
+    for (int page = 0; page < 3; page++) {
+        int before = ids[0];
+        assert(todo_each(&query, collect_page, ids) == 2);
+        arena_t arena;
+        arena_init(&arena);
+        todo_t last;
+        assert(todo_get(ids[ids[0]], &last, &arena) == 0);
+        todo_query_advance(&query, &last);
+        arena_destroy(&arena);
+        assert(ids[0] == before + 2);
+    }
+    assert(todo_each(&query, collect_page, ids) == 0);
+    assert(memcmp(ids + 1, expected, sizeof(expected)) == 0);
+
+    // Newest first within the completed ones
+    memset(ids, 0, sizeof(ids));
+    memset(&query, 0, sizeof(query));
+    query.sort = TODO_SORT_CREATED_AT;
+    query.descending = 1;
+    query.completed = TODO_COMPLETED_FALSE;
+    assert(todo_each(&query, collect_page, ids) == 3);
+    assert(ids[1] == 5 && ids[2] == 3 && ids[3] == 1);
+
+    query.sort = (todo_sort_t)7;
+    assert(todo_each(&query, collect_page, ids) == -1);
+
+    // Reopening runs no migrations and keeps the data
+    db_cleanup();
+    assert(db_init(POOL_TEST_DB) == 0);
+    memset(ids, 0, sizeof(ids));
+    memset(&query, 0, sizeof(query));
+    assert(todo_each(&query, collect_page, ids) == 6);
+
+    db_cleanup();
+    remove_pool_db();
+}
+
+static void* read_todos_thread(void* arg) {
+    (void)arg;
+    arena_t arena;
+    arena_init(&arena);
+    for (int i = 0; i < 200; i++) {
+        todo_t todo;
+        assert(todo_get(1, &todo, &arena) == 0);
+        assert(strcmp(todo.title, "Pooled") == 0);
+
+        todo_t* todos = NULL;
+        int count = 0;
+        assert(todo_list(&todos, &count, &arena) == 0);
+        assert(count >= 1);
+        arena_reset(&arena);
+    }
+    arena_destroy(&arena);
+    return NULL;
+}
+
+static void* write_todos_thread(void* arg) {
+    (void)arg;
+    for (int i = 0; i < 50; i++) {
+        assert(todo_create("Writer", "Concurrent insert") == 0);
+    }
+    return NULL;
+}
+
+void test_concurrent_pool(void) {
+    arena_t arena;
+    arena_init(&arena);
+    remove_pool_db();
+
+    db_config_t config;
+    db_config_defaults(&config);
+    config.path = POOL_TEST_DB;
+    config.reader_count = 4;
+    assert(db_init_config(&config) == 0);
+
+    assert(todo_create("Pooled", "Shared by readers") == 0);
+
+    pthread_t threads[5];
+    for (int i = 0; i < 4; i++) {
+        assert(pthread_create(&threads[i], NULL, read_todos_thread, NULL) == 0);
+    }
+    assert(pthread_create(&threads[4], NULL, write_todos_thread, NULL) == 0);
+    for (int i = 0; i < 5; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    todo_t* todos = NULL;
+    int count = 0;
+    assert(todo_list(&todos, &count, &arena) == 0);
+    assert(count == 51);
+
+    arena_destroy(&arena);
+    db_cleanup();
+    remove_pool_db();
+}
+
+// Runs while its page holds the only reader
+static int read_without_waiting(const todo_t* todo, void* ctx) {
+    arena_t* arena = ctx;
+    todo_t other;
+    todo_set_reads_nowait(1);
+    assert(todo_get(todo->id, &other, arena) == -1);
+    assert(todo_get_version(todo->id, &other.updated_at) == -1);
+    todo_set_reads_nowait(0);
+    assert(todo_take_refused_read() == 1);
+    assert(todo_take_refused_read() == 0);
+    return 0;
+}
+
+void test_reads_nowait(void) {
+    arena_t arena;
+    arena_init(&arena);
+    remove_pool_db();
+
+    db_config_t config;
+    db_config_defaults(&config);
+    config.path = POOL_TEST_DB;
+    config.reader_count = 1;
+    assert(db_init_config(&config) == 0);
+    assert(todo_create("Held", "") == 0);
+
+    todo_query_t query = {0};
+    assert(todo_each(&query, read_without_waiting, &arena) == 1);
+
+    // With the reader free again nothing is refused
+    todo_t todo;
+    todo_set_reads_nowait(1);
+    assert(todo_get(1, &todo, &arena) == 0);
+    todo_set_reads_nowait(0);
+    assert(todo_take_refused_read() == 0);
+
+    arena_destroy(&arena);
+    db_cleanup();
+    remove_pool_db();
+}
+
+static void* memory_reader_thread(void* arg) {
+    atomic_int* stop = arg;
+    arena_t arena;
+    arena_init(&arena);
+    while (!atomic_load(stop)) {
+        todo_t todo;
+        assert(todo_get(1, &todo, &arena) == 0);
+        assert(strcmp(todo.title, "Pinned") == 0);
+
+        int ids[64] = {0};
+        todo_query_t query = {0};
+        query.limit = 60;
+        assert(todo_each(&query, collect_page, ids) >= 1);
+        for (int i = 2; i <= ids[0]; i++) {
+            assert(ids[i] > ids[i - 1]);
+        }
+        arena_reset(&arena);
+    }
+    arena_destroy(&arena);
+    return NULL;
+}
+
+static void* memory_writer_thread(void* arg) {
+    (void)arg;
+    for (int i = 0; i < 40; i++) {
+        assert(todo_create("Churn", "Created") == 0);
+        arena_t arena;
+        arena_init(&arena);
+        todo_t* todos = NULL;
+        int count = 0;
+        assert(todo_list(&todos, &count, &arena) == 0);
+        int last = todos[count - 1].id;
+        arena_destroy(&arena);
+        if (i % 2) {
+            assert(todo_update(last, "Churn", "Updated", 1) == 0);
+        } else {
+            assert(todo_delete(last) == 0);
+        }
+    }
+    return NULL;
+}
+
+static int cache_has(int id, const char* expected) {
+    char* data;
+    size_t len;
+    time_t version;
+    if (todo_cache_get(id, &data, &len, &version) != 0) {
+        return 0;
+    }
+    int match = len == strlen(expected) && memcmp(data, expected, len) == 0;
+    free(data);
+    return match;
+}
+
+void test_memory_primary(void) {
+    arena_t arena;
+    arena_init(&arena);
+    remove_pool_db();
+
+    // Rows written before the store is loaded come from the file
+    assert(db_init(POOL_TEST_DB) == 0);
+    assert(todo_create("Pinned", "Loaded from disk") == 0);
+    assert(todo_create("Second", "Also loaded") == 0);
+    db_cleanup();
+
+    db_config_t config;
+    db_config_defaults(&config);
+    config.path = POOL_TEST_DB;
+    config.memory_primary = 1;
+    config.batch_window_us = 500;
+    assert(db_init_config(&config) == 0);
+    assert(todo_cache_init(64 * 1024) == 0);
+    todo_follow_other_writers();
+
+    todo_t todo;
+    assert(todo_get(2, &todo, &arena) == 0);
+    assert(strcmp(todo.description, "Also loaded") == 0);
+    assert(todo_get(3, &todo, &arena) != 0);
+
+    // Writes are visible to the writer as soon as they return, and the
+    // sync does not mistake them for another process's
+    uint64_t table = todo_table_version();
+    assert(todo_create("Third", "") == 0);
+    assert(todo_table_version() == table + 1);
+    assert(todo_get(3, &todo, &arena) == 0 && todo.description_len == 0);
+    time_t version;
+    assert(todo_get_version(3, &version) == 0);
+    assert(todo_update_if(3, "Third", "Changed", 1, version) == TODO_OK);
+    assert(todo_update_if(3, "Third", "Stale", 1, version) == TODO_CONFLICT);
+    assert(todo_get(3, &todo, &arena) == 0 && todo.completed == 1 && strcmp(todo.description, "Changed") == 0);
+    assert(todo_delete(2) == 0);
+    assert(todo_get(2, &todo, &arena) != 0);
+    assert(todo_delete_if(2, version) == TODO_NOT_FOUND);
+
+    // Filters and keyset paging by id run in memory, other sorts in SQLite
+    int ids[8] = {0};
+    todo_query_t query = {0};
+    query.completed = TODO_COMPLETED_TRUE;
+    assert(todo_each(&query, collect_page, ids) == 1 && ids[1] == 3);
+    memset(ids, 0, sizeof(ids));
+    memset(&query, 0, sizeof(query));
+    query.descending = 1;
+    assert(todo_each(&query, collect_page, ids) == 2 && ids[1] == 3 && ids[2] == 1);
+    memset(ids, 0, sizeof(ids));
+    query.after_id = 3;
+    assert(todo_each(&query, collect_page, ids) == 1 && ids[1] == 1);
+    memset(ids, 0, sizeof(ids));
+    memset(&query, 0, sizeof(query));
+    query.sort = TODO_SORT_UPDATED_AT;
+    query.descending = 1;
+    assert(todo_each(&query, collect_page, ids) == 2 && ids[1] == 3);
+
+    // Batches and raw statements reach the store through the change log
+    todo_op_t ops[] = {
+        {TODO_OP_CREATE, 0, "Batched", "One", 0},
+        {TODO_OP_PATCH, 1, "Renamed", NULL, -1},
+        {TODO_OP_DELETE, 3, NULL, NULL, 0},
+    };
+    todo_op_result_t results[3];
+    assert(todo_batch(ops, 3, results) == 0);
+    assert(todo_get(1, &todo, &arena) == 0 && strcmp(todo.title, "Renamed") == 0);
+    assert(todo_get(3, &todo, &arena) != 0);
+    assert(todo_get(results[0].id, &todo, &arena) == 0);
+    db_param_t params[] = { DB_INT(results[0].id) };
+    assert(db_execute_query("UPDATE todos SET title = 'Raw' WHERE id = ?", params, 1, NULL) == 0);
+    assert(todo_get(results[0].id, &todo, &arena) == 0 && strcmp(todo.title, "Raw") == 0);
+    assert(todo_update(1, "Pinned", "Back", 0) == 0);
+
+    // Readers never see a freed record while a writer churns
+    atomic_int stop = 0;
+    pthread_t readers[3];
+    pthread_t writer_thread;
+    for (int i = 0; i < 3; i++) {
+        assert(pthread_create(&readers[i], NULL, memory_reader_thread, &stop) == 0);
+    }
+    assert(pthread_create(&writer_thread, NULL, memory_writer_thread, NULL) == 0);
+    pthread_join(writer_thread, NULL);
+    atomic_store(&stop, 1);
+    for (int i = 0; i < 3; i++) {
+        pthread_join(readers[i], NULL);
+    }
+
+    // Writes by another process reach the store on the idle writer's poll
+    // of the change log, which also drops their cached copies and moves the
+    // table version on
+    todo_t* todos = NULL;
+    int count = 0;
+    assert(todo_list(&todos, &count, &arena) == 0);
+    int last = todos[count - 1].id;
+    todo_cache_put(1, todo_cache_begin(1), 1, "cached", 6);
+    table = todo_table_version();
+    sqlite3* other;
+    assert(sqlite3_open(POOL_TEST_DB, &other) == SQLITE_OK);
+    assert(sqlite3_exec(other, "UPDATE todos SET title = 'Foreign' WHERE id = 1", NULL, NULL, NULL) == SQLITE_OK);
+    for (int i = 0; cache_has(1, "cached"); i++) {
+        assert(i < 3000);
+        usleep(1000);
+    }
+    assert(todo_table_version() > table);
+    assert(todo_get(1, &todo, &arena) == 0 && strcmp(todo.title, "Foreign") == 0);
+
+    // A change log pruned past the store reloads all of it and empties the cache
+    assert(sqlite3_exec(other, "BEGIN; DELETE FROM todos WHERE id = (SELECT MAX(id) FROM todos);"
+                               "DELETE FROM todo_changes; UPDATE todos SET title = 'Pinned' WHERE id = 1; COMMIT",
+                        NULL, NULL, NULL) == SQLITE_OK);
+    sqlite3_close(other);
+    todo_cache_put(3, todo_cache_begin(3), 1, "gone", 4);
+    table = todo_table_version();
+    db_sync_memstore();
+    assert(!cache_has(3, "gone") && todo_table_version() > table);
+    assert(todo_get(last, &todo, &arena) != 0);
+    assert(todo_get(1, &todo, &arena) == 0 && strcmp(todo.title, "Pinned") == 0);
+
+    // The store and the file agree
+    assert(todo_list(&todos, &count, &arena) == 0);
+    assert(count == 2 + 20 - 1);
+    db_cleanup();
+    assert(db_init(POOL_TEST_DB) == 0);
+    todo_t* stored = NULL;
+    int stored_count = 0;
+    assert(todo_list(&stored, &stored_count, &arena) == 0);
+    assert(stored_count == count);
+    for (int i = 0; i < count; i++) {
+        assert(stored[i].id == todos[i].id && stored[i].updated_at == todos[i].updated_at);
+        assert(strcmp(stored[i].title, todos[i].title) == 0);
+    }
+
+    todo_cache_cleanup();
+    arena_destroy(&arena);
+    db_cleanup();
+    remove_pool_db();
+}
+
+static void* batched_writer_thread(void* arg) {
+    int bad = *(int*)arg;
+    for (int i = 0; i < 25; i++) {
+        if (bad && i % 5 == 0) {
+            // NOT NULL violation must fail alone without poisoning its batch
+            db_param_t params[] = { DB_NULL(), DB_TEXT("no title"), DB_INT(0), DB_INT(0) };
+            assert(db_execute_query(
+                "INSERT INTO todos (title, description, created_at, updated_at) VALUES (?, ?, ?, ?)",
+                params, 4, NULL) != 0);
+        } else {
+            assert(todo_create("Batched", "Group commit") == 0);
+        }
+    }
+    return NULL;
+}
+
+void test_group_commit(void) {
+    arena_t arena;
+    arena_init(&arena);
+    remove_pool_db();
+
+    db_config_t config;
+    db_config_defaults(&config);
+    config.path = POOL_TEST_DB;
+    config.batch_max = 16;
+    config.batch_window_us = 20000;
+    assert(db_init_config(&config) == 0);
+
+    pthread_t threads[8];
+    int flags[8];
+    for (int i = 0; i < 8; i++) {
+        flags[i] = (i == 3);
+        assert(pthread_create(&threads[i], NULL, batched_writer_thread, &flags[i]) == 0);
+    }
+    for (int i = 0; i < 8; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    todo_t* todos = NULL;
+    int count = 0;
+    assert(todo_list(&todos, &count, &arena) == 0);
+    assert(count == 7 * 25 + 20);
+
+    // Multi-op submissions report a result per op
+    db_param_t first[] = { DB_INT(1) };
+    db_param_t missing[] = { DB_INT(100000) };
+    db_op_t ops[] = {
+        {"DELETE FROM todos WHERE id = ?", first, 1},
+        {"DELETE FROM todos WHERE id = ?", missing, 1},
+        {"DELETE FROM no_such_table WHERE id = ?", first, 1},
+    };
+    db_result_t results[3];
+    assert(db_execute_batch(ops, 3, results) != 0);
+    assert(results[0].status == 0 && results[0].changes == 1);
+    assert(results[1].status == 0 && results[1].changes == 0);
+    assert(results[2].status != 0);
+
+    arena_destroy(&arena);
     db_cleanup();
+    remove_pool_db();
+}
+
+void test_todo_batch(void) {
+    arena_t arena;
+    arena_init(&arena);
+    assert(db_init(":memory:") == 0);
+
+    assert(todo_create("Existing", "Before batch") == 0);
+
+    todo_op_t ops[] = {
+        {TODO_OP_CREATE, 0, "First", "Created in batch", 0},
+        {TODO_OP_CREATE, 0, "Second", "Created in batch", 0},
+        {TODO_OP_CREATE, 0, NULL, "Missing title", 0},
+        {TODO_OP_PATCH, 1, NULL, NULL, 1},
+        {TODO_OP_UPDATE, 2, "First v2", "Updated in batch", 0},
+        {TODO_OP_DELETE, 3, NULL, NULL, 0},
+        {TODO_OP_DELETE, 99, NULL, NULL, 0},
+        {TODO_OP_NONE, 1, NULL, NULL, 0},
+    };
+    todo_op_result_t results[8];
+    assert(todo_batch(ops, 8, results) == 0);
+
+    assert(results[0].status == TODO_OK && results[0].id == 2);
+    assert(results[1].status == TODO_OK && results[1].id == 3);
+    assert(results[2].status == TODO_INVALID);
+    assert(results[3].status == TODO_OK);
+    assert(results[4].status == TODO_OK);
+    assert(results[5].status == TODO_OK);
+    assert(results[6].status == TODO_NOT_FOUND && results[6].id == 99);
+    assert(results[7].status == TODO_INVALID);
+
+    // Patches leave unset fields alone
+    todo_t todo;
+    assert(todo_get(1, &todo, &arena) == 0);
+    assert(strcmp(todo.title, "Existing") == 0 && todo.completed == 1);
+    assert(todo_get(2, &todo, &arena) == 0);
+    assert(strcmp(todo.title, "First v2") == 0);
+    assert(todo_get(3, &todo, &arena) != 0);
+
+    assert(todo_batch(ops, 0, results) == 0);
+
+    arena_destroy(&arena);
+    db_cleanup();
+}
+
+#define SNAPSHOT_TEST_FILE "test_todo.snap"
+#define IMPORT_BULK_ROWS 12000
+
+static int bulk_row(void* ctx, long long index, todo_t* todo) {
+    (void)ctx;
+    todo->id = 1000 + (int)index;
+    todo->title = "Bulk row";
+    todo->title_len = strlen(todo->title);
+    todo->description = "Imported in bulk";
+    todo->description_len = strlen(todo->description);
+    todo->completed = (int)(index % 2);
+    todo->created_at = 5000 + index;
+    todo->updated_at = 6000 + index;
+    return 0;
+}
+
+void test_import_snapshot(void) {
+    arena_t arena;
+    arena_init(&arena);
+    assert(db_init(":memory:") == 0);
+    assert(todo_create("Existing", "Before the import") == 0);
+
+    // Records round trip, and a short or corrupt record is told apart
+    todo_t record = {7, "Title", 5, "", 0, 1, 100, 200};
+    char buf[128];
+    size_t size = todo_record_size(&record);
+    assert(size <= sizeof(buf));
+    todo_record_write(&record, buf);
+    todo_t decoded;
+    assert(todo_record_read(buf, size, &decoded) == (long long)size);
+    assert(decoded.id == 7 && decoded.completed == 1 && decoded.created_at == 100 && decoded.updated_at == 200);
+    assert(strcmp(decoded.title, "Title") == 0 && decoded.description_len == 0);
+    assert(todo_record_read(buf, size - 1, &decoded) == 0);
+    buf[4 + 25 + 5] = 'x';
+    assert(todo_record_read(buf, size, &decoded) == -1);
+
+    // Ids and timestamps are kept, existing ids are replaced and id 0 is new
+    todo_t todos[] = {
+        {1, "Replaced", 8, "By the import", 13, 1, 10, 20},
+        {50, "Kept id", 7, "", 0, 0, 30, 40},
+        {0, "New id", 6, "", 0, 0, 50, 60},
+    };
+    assert(todo_import(todos, 3) == 3);
+    todo_t todo;
+    assert(todo_get(1, &todo, &arena) == 0 && strcmp(todo.title, "Replaced") == 0 && todo.completed == 1);
+    assert(todo_get(50, &todo, &arena) == 0 && todo.created_at == 30 && todo.updated_at == 40);
+    assert(todo_get(51, &todo, &arena) == 0 && strcmp(todo.title, "New id") == 0);
+    struct SearchResults results;
+    assert(search("replaced", 8, 0, &results) == 1 && results.hits[0].todo.id == 1);
+    assert(search("existing", 8, 0, &results) == 0);
+
+    // An invalid row fails the whole import
+    todo_t invalid[] = {
+        {60, "Valid", 5, "", 0, 0, 1, 1},
+        {61, NULL, 0, "", 0, 0, 1, 1},
+    };
+    assert(todo_import(invalid, 2) == -1);
+    assert(todo_get(60, &todo, &arena) != 0);
+
+    // A large import rebuilds the indexes and triggers it drops
+    assert(todo_import_rows(bulk_row, NULL, IMPORT_BULK_ROWS) == IMPORT_BULK_ROWS);
+    assert(todo_get(1000 + IMPORT_BULK_ROWS - 1, &todo, &arena) == 0 && todo.updated_at == 6000 + IMPORT_BULK_ROWS - 1);
+    assert(search("bulk", 8, 0, &results) == 8);
+    assert(todo_update(1000, "Changed after import", "", 0) == 0);
+    assert(search("changed", 8, 0, &results) == 1 && results.hits[0].todo.id == 1000);
+    int ids[8] = {0};
+    todo_query_t query = {0};
+    query.completed = TODO_COMPLETED_TRUE;
+    query.sort = TODO_SORT_UPDATED_AT;
+    query.limit = 2;
+    assert(todo_each(&query, collect_page, ids) == 2 && ids[1] == 1 && ids[2] == 1001);
+
+    // A snapshot reloads into an empty database as the same rows
+    todo_t* saved = NULL;
+    int saved_count = 0;
+    assert(todo_list(&saved, &saved_count, &arena) == 0);
+    assert(saved_count == 3 + IMPORT_BULK_ROWS);
+    assert(todo_snapshot_save(SNAPSHOT_TEST_FILE) == saved_count);
+    db_cleanup();
+
+    assert(db_init(":memory:") == 0);
+    assert(todo_snapshot_load(SNAPSHOT_TEST_FILE) == saved_count);
+    todo_t* loaded = NULL;
+    int loaded_count = 0;
+    assert(todo_list(&loaded, &loaded_count, &arena) == 0);
+    assert(loaded_count == saved_count);
+    for (int i = 0; i < loaded_count; i++) {
+        assert(loaded[i].id == saved[i].id && loaded[i].completed == saved[i].completed);
+        assert(loaded[i].created_at == saved[i].created_at && loaded[i].updated_at == saved[i].updated_at);
+        assert(strcmp(loaded[i].title, saved[i].title) == 0);
+        assert(strcmp(loaded[i].description, saved[i].description) == 0);
+    }
+    assert(search("changed", 8, 0, &results) == 1);
+    db_cleanup();
+
+    // Staged in batches, the same rows load as one import that rebuilds the indexes
+    assert(db_init(":memory:") == 0);
+    todo_import_stage_t* stage = todo_import_open();
+    assert(stage);
+    for (int i = 0; i < saved_count; i += 1000) {
+        assert(todo_import_add(stage, saved + i, saved_count - i < 1000 ? saved_count - i : 1000) == 0);
+    }
+    assert(todo_import_finish(stage) == saved_count);
+    todo_import_close(stage);
+    assert(todo_list(&loaded, &loaded_count, &arena) == 0 && loaded_count == saved_count);
+    assert(loaded[saved_count - 1].updated_at == saved[saved_count - 1].updated_at);
+    assert(search("changed", 8, 0, &results) == 1);
+
+    // A damaged file is rejected without touching the table
+    assert(truncate(SNAPSHOT_TEST_FILE, 100) == 0);
+    assert(todo_snapshot_load(SNAPSHOT_TEST_FILE) == -1);
+    assert(todo_snapshot_load("no_such_snapshot.snap") == -1);
+    unlink(SNAPSHOT_TEST_FILE);
+
+    arena_destroy(&arena);
+    db_cleanup();
+}
+
+void test_todo_cache(void) {
+    assert(db_init(":memory:") == 0);
+
+    // Disabled until initialized
+    todo_cache_put(1, todo_cache_begin(1), 1, "x", 1);
+    assert(!cache_has(1, "x"));
+
+    assert(todo_cache_init(64 * 1024) == 0);
+
+    todo_cache_put(1, todo_cache_begin(1), 1, "one", 3);
+    assert(cache_has(1, "one"));
+    todo_cache_put(1, todo_cache_begin(1), 1, "uno", 3);
+    assert(cache_has(1, "uno"));
+
+    // A value read before an invalidation must not be stored
+    uint64_t token = todo_cache_begin(2);
+    todo_cache_invalidate(2);
+    todo_cache_put(2, token, 1, "stale", 5);
+    assert(!cache_has(2, "stale"));
+
+    // Updates and deletes through the todo API drop the cached copy
+    assert(todo_create("Cached", "Todo") == 0);
+    assert(todo_update(1, "Changed", "Todo", 1) == 0);
+    assert(!cache_has(1, "uno"));
+    todo_cache_put(1, todo_cache_begin(1), 1, "one", 3);
+    assert(todo_delete(1) == 0);
+    assert(!cache_has(1, "one"));
+
+    // Filling far past the budget evicts but keeps within it
+    char value[512];
+    memset(value, 'v', sizeof(value));
+    for (int id = 100; id < 1100; id++) {
+        todo_cache_put(id, todo_cache_begin(id), 1, value, sizeof(value));
+    }
+
+    todo_cache_stats_t stats;
+    todo_cache_stats(&stats);
+    assert(stats.bytes <= stats.capacity);
+    assert(stats.entries > 0 && stats.entries < 1000);
+    assert(stats.evictions == 1000 - stats.entries);
+    assert(stats.invalidations == 2);
+    assert(stats.hits == 2 && stats.misses == 3);
+
+    // Version checks leave the hit ratio alone
+    time_t version;
+    assert(todo_cache_version(100, &version) == -1);
+    assert(todo_cache_version(1099, &version) == 0 && version == 1);
+    todo_cache_stats(&stats);
+    assert(stats.hits == 2 && stats.misses == 3);
+
+    todo_cache_cleanup();
+    db_cleanup();
+}
+
+void test_catch_up(void) {
+    remove_pool_db();
+    assert(db_init(POOL_TEST_DB) == 0);
+    assert(todo_cache_init(1024 * 1024) == 0);
+    assert(todo_create("Shared", "Before") == 0);
+    assert(todo_create("Other", "Untouched") == 0);
+    todo_cache_put(1, todo_cache_begin(1), 1, "before", 6);
+    todo_cache_put(2, todo_cache_begin(2), 1, "other", 5);
+
+    long long oldest, since;
+    assert(todo_change_bounds(&oldest, &since) == 0 && since == 2);
+    assert(todo_catch_up(since) == since);
+    uint64_t version = todo_table_version();
+
+    // Another process writes to the same file; nothing here notices
+    sqlite3* other;
+    assert(sqlite3_open(POOL_TEST_DB, &other) == SQLITE_OK);
+    assert(sqlite3_exec(other, "UPDATE todos SET title = 'Elsewhere' WHERE id = 1", NULL, NULL, NULL) == SQLITE_OK);
+    assert(cache_has(1, "before") && todo_table_version() == version);
+
+    // Replaying the change log drops the stale copy and moves the version on
+    assert(todo_catch_up(since) == since + 1);
+    assert(!cache_has(1, "before") && cache_has(2, "other"));
+    assert(todo_table_version() > version);
+
+    // A log pruned past the starting point drops everything
+    assert(sqlite3_exec(other, "INSERT INTO todos (title, description, completed, created_at, updated_at) "
+                               "VALUES ('Third', '', 0, 1, 1), ('Fourth', '', 0, 1, 1);"
+                               "DELETE FROM todo_changes WHERE seq < (SELECT MAX(seq) FROM todo_changes)",
+                        NULL, NULL, NULL) == SQLITE_OK);
+    todo_cache_put(1, todo_cache_begin(1), 2, "again", 5);
+    long long latest;
+    assert(todo_change_bounds(&oldest, &latest) == 0 && oldest > since + 2);
+    assert(todo_catch_up(since + 1) == latest);
+    assert(!cache_has(1, "again") && !cache_has(2, "other"));
+    sqlite3_close(other);
+
+    todo_cache_cleanup();
+    db_cleanup();
+    remove_pool_db();
+}
+
+void test_conditional_writes(void) {
+    arena_t arena;
+    arena_init(&arena);
+    assert(db_init(":memory:") == 0);
+
+    assert(todo_create("Versioned", "Todo") == 0);
+    time_t v1, v2, v3;
+    assert(todo_get_version(1, &v1) == 0);
+    assert(todo_get_version(2, &v2) != 0);
+
+    // Versions advance on every write, even within one second
+    uint64_t table = todo_table_version();
+    assert(todo_update(1, "Versioned", "Again", 0) == 0);
+    assert(todo_get_version(1, &v2) == 0 && v2 > v1);
+    assert(todo_table_version() > table);
+
+    assert(todo_update_if(1, "Stale", "Write", 0, v1) == TODO_CONFLICT);
+    assert(todo_update_if(1, "Fresh", "Write", 1, v2) == TODO_OK);
+    assert(todo_get_version(1, &v3) == 0 && v3 > v2);
+
+    todo_t todo;
+    assert(todo_get(1, &todo, &arena) == 0);
+    assert(strcmp(todo.title, "Fresh") == 0 && todo.updated_at == v3);
+
+    assert(todo_delete_if(1, v2) == TODO_CONFLICT);
+    assert(todo_delete_if(1, v3) == TODO_OK);
+    assert(todo_delete_if(1, v3) == TODO_NOT_FOUND);
+
+    arena_destroy(&arena);
+    db_cleanup();
+}
+
+static void* record_requests(void* arg) {
+    (void)arg;
+    uint64_t phases[METRICS_PHASE_COUNT] = {
+        [METRICS_PHASE_PARSE] = 1000,
+        [METRICS_PHASE_DB] = 2500,
+        [METRICS_PHASE_SEND] = 20000000000ull,
+    };
+    for (int i = 0; i < 3; i++) {
+        metrics_record_request(METRICS_ROUTE_GET_TODO, 200, phases);
+    }
+    metrics_record_request(METRICS_ROUTE_GET_TODO, 418, phases);
+    return NULL;
+}
+
+void test_metrics(void) {
+    assert(db_init(":memory:") == 0);
+
+    // Counters from other threads, including exited ones, are summed on render
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, record_requests, NULL) == 0);
+    pthread_join(thread, NULL);
+    record_requests(NULL);
+
+    uint64_t before = metrics_thread_db_time();
+    assert(todo_create("Timed", "Todo") == 0);
+    assert(metrics_thread_db_time() > before);
+    metrics_connection_opened();
+
+    char* text;
+    size_t size;
+    assert(metrics_render(&text, &size) == 0);
+    assert(size == strlen(text));
+    assert(strstr(text, "todo_http_requests_total{method=\"GET\",route=\"/todos/:id\",code=\"200\"} 6\n"));
+    assert(strstr(text, "todo_http_requests_total{method=\"GET\",route=\"/todos/:id\",code=\"other\"} 2\n"));
+
+    // Bucket bounds are inclusive, and samples past the last bound only count in +Inf
+    const char* labels = "{method=\"GET\",route=\"/todos/:id\",phase=";
+    char line[256];
+    snprintf(line, sizeof(line), "_bucket%s\"parse\",le=\"1e-06\"} 8\n", labels);
+    assert(strstr(text, line));
+    snprintf(line, sizeof(line), "_bucket%s\"db\",le=\"2e-06\"} 0\n", labels);
+    assert(strstr(text, line));
+    snprintf(line, sizeof(line), "_bucket%s\"db\",le=\"3e-06\"} 8\n", labels);
+    assert(strstr(text, line));
+    snprintf(line, sizeof(line), "_bucket%s\"send\",le=\"12.58291\"} 0\n", labels);
+    assert(strstr(text, line));
+    snprintf(line, sizeof(line), "_bucket%s\"send\",le=\"+Inf\"} 8\n", labels);
+    assert(strstr(text, line));
+    snprintf(line, sizeof(line), "_count%s\"send\"} 8\n", labels);
+    assert(strstr(text, line));
+
+    assert(strstr(text, "todo_db_operation_seconds_count{op=\"write\"}"));
+    assert(strstr(text, "todo_db_operation_seconds_count{op=\"commit\"}"));
+    assert(strstr(text, "todo_http_connections_active 1\n"));
+    assert(strstr(text, "# TYPE todo_cache_hits_total counter\n"));
+    free(text);
+
+    metrics_connection_closed();
+
+    // In-flight requests are summed across threads, like the gauges above
+    uint64_t in_flight = metrics_requests_in_flight();
+    metrics_request_started();
+    metrics_request_started();
+    assert(metrics_requests_in_flight() == in_flight + 2);
+    metrics_request_finished();
+    metrics_request_finished();
+    assert(metrics_requests_in_flight() == in_flight);
+    db_cleanup();
+}
+
+static atomic_int executed;
+static atomic_int blocked;
+static atomic_int release_blocked;
+
+static void count_task(void* arg) {
+    (void)arg;
+    atomic_fetch_add(&executed, 1);
+}
+
+static void claim_task(void* arg) {
+    int* claims = arg;
+    (*claims)++;
+}
+
+static void blocking_task(void* arg) {
+    (void)arg;
+    atomic_fetch_add(&blocked, 1);
+    while (!atomic_load(&release_blocked)) {
+        usleep(100);
+    }
+    atomic_fetch_add(&executed, 1);
+}
+
+void test_executor(void) {
+    atomic_store(&executed, 0);
+    assert(executor_submit(count_task, NULL) == -1);
+    assert(executor_start(4, 2) == -1);
+    assert(executor_start(4, 16) == 0);
+
+    // The claim callback runs before the task can
+    int claimed = 0;
+    assert(executor_submit_claimed(claim_task, &claimed, claim_task) == 0);
+
+    // Tasks queued behind busy workers are still run, by whichever is free
+    int submitted = 0;
+    while (submitted < 10000) {
+        if (executor_submit(count_task, NULL) == 0) {
+            submitted++;
+        } else {
+            sched_yield();
+        }
+    }
+
+    // With every worker stuck, the queues fill up and submissions are refused
+    atomic_store(&blocked, 0);
+    atomic_store(&release_blocked, 0);
+    for (int i = 0; i < 4; i++) {
+        while (executor_submit(blocking_task, NULL) != 0) {
+            sched_yield();
+        }
+    }
+    while (atomic_load(&blocked) < 4) {
+        usleep(100);
+    }
+    for (int i = 0; i < 16; i++) {
+        assert(executor_submit(count_task, NULL) == 0);
+    }
+    assert(executor_submit(count_task, NULL) == -1);
+    int claims = 0;
+    assert(executor_submit_claimed(count_task, &claims, claim_task) == -1 && claims == 0);
+
+    // Stopping runs what is queued and refuses the rest
+    atomic_store(&release_blocked, 1);
+    executor_stop();
+    assert(atomic_load(&executed) == 10000 + 4 + 16);
+    assert(claimed == 2);
+    assert(executor_submit(count_task, NULL) == -1);
 }
 
 int main(void) {
@@ -70,6 +1195,22 @@ int main(void) {
     test_update_todo();
     test_delete_todo();
     test_list_todos();
+    test_paginate_todos();
+    test_filtered_queries();
+    test_search();
+    test_changes();
+    test_typed_params();
+    test_concurrent_pool();
+    test_reads_nowait();
+    test_memory_primary();
+    test_group_commit();
+    test_todo_batch();
+    test_import_snapshot();
+    test_todo_cache();
+    test_catch_up();
+    test_conditional_writes();
+    test_metrics();
+    test_executor();
     
     printf("All tests passed!\n");
     return EXIT_SUCCESS;